@@ -0,0 +1,164 @@
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "fdpool.h"
+#include "log.h"
+#include "log_sections.h"
+
+struct fdpool_entry {
+    char *filename;
+    int fd;
+    unsigned users;
+    bool dead; // Invalidated while in use; the last fdpool_release closes it
+    unsigned long last_used;
+};
+
+// pool_mutex protects everything below
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Live entries by filename; dead ones are only in by_fd
+static GHashTable *by_name = NULL;
+static GHashTable *by_fd = NULL;
+static unsigned capacity = 0;
+static unsigned long clock_tick = 0;
+
+static void entry_close(struct fdpool_entry *entry) {
+    g_hash_table_remove(by_fd, GINT_TO_POINTER(entry->fd));
+    close(entry->fd);
+    free(entry->filename);
+    free(entry);
+}
+
+void fdpool_init(unsigned size) {
+    capacity = size;
+    by_name = g_hash_table_new(g_str_hash, g_str_equal);
+    by_fd = g_hash_table_new(g_direct_hash, g_direct_equal);
+    log_print(LOG_INFO, SECTION_FILECACHE_OPEN, "fdpool_init: keeping up to %u cache fds open", size);
+}
+
+// Returns a pooled fd on filename, or -1. Give it back with fdpool_release.
+int fdpool_get(const char *filename) {
+    struct fdpool_entry *entry;
+    int fd = -1;
+
+    if (capacity == 0) return -1;
+
+    pthread_mutex_lock(&pool_mutex);
+    entry = g_hash_table_lookup(by_name, filename);
+    if (entry) {
+        ++entry->users;
+        entry->last_used = ++clock_tick;
+        fd = entry->fd;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    return fd;
+}
+
+// Hands fd, just opened read-only on filename, to the pool, with the caller as its
+// one user. Returns false if the pool won't take it; the caller then closes it itself.
+bool fdpool_add(const char *filename, int fd) {
+    struct fdpool_entry *entry;
+    bool added = false;
+
+    if (capacity == 0) return false;
+
+    pthread_mutex_lock(&pool_mutex);
+
+    // Someone else got here first
+    if (g_hash_table_lookup(by_name, filename)) goto finish;
+
+    // Make room by closing the least recently used idle fd
+    if (g_hash_table_size(by_name) >= capacity) {
+        struct fdpool_entry *victim = NULL;
+        GHashTableIter iter;
+        gpointer value;
+
+        g_hash_table_iter_init(&iter, by_name);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            entry = value;
+            if (entry->users == 0 && (victim == NULL || entry->last_used < victim->last_used)) {
+                victim = entry;
+            }
+        }
+        if (victim == NULL) goto finish;
+        g_hash_table_remove(by_name, victim->filename);
+        entry_close(victim);
+    }
+
+    entry = calloc(1, sizeof(struct fdpool_entry));
+    if (entry == NULL) goto finish;
+    entry->filename = strdup(filename);
+    if (entry->filename == NULL) {
+        free(entry);
+        goto finish;
+    }
+    entry->fd = fd;
+    entry->users = 1;
+    entry->last_used = ++clock_tick;
+    g_hash_table_insert(by_name, entry->filename, entry);
+    g_hash_table_insert(by_fd, GINT_TO_POINTER(fd), entry);
+    added = true;
+
+finish:
+    pthread_mutex_unlock(&pool_mutex);
+    return added;
+}
+
+void fdpool_release(int fd) {
+    struct fdpool_entry *entry;
+
+    pthread_mutex_lock(&pool_mutex);
+    entry = g_hash_table_lookup(by_fd, GINT_TO_POINTER(fd));
+    if (entry == NULL) {
+        log_print(LOG_WARNING, SECTION_FILECACHE_FILE, "fdpool_release: fd %d isn't pooled", fd);
+    }
+    else if (--entry->users == 0 && entry->dead) {
+        entry_close(entry);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+// Called when filename is replaced or removed; later opens will open it afresh
+void fdpool_invalidate(const char *filename) {
+    struct fdpool_entry *entry;
+
+    if (capacity == 0) return;
+
+    pthread_mutex_lock(&pool_mutex);
+    entry = g_hash_table_lookup(by_name, filename);
+    if (entry) {
+        g_hash_table_remove(by_name, filename);
+        if (entry->users == 0) {
+            entry_close(entry);
+        }
+        else {
+            entry->dead = true;
+        }
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
@@ -0,0 +1,37 @@
+#ifndef foofdpoolhfoo
+#define foofdpoolhfoo
+
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#include <stdbool.h>
+
+/* A bounded pool of read-only fds on cache files, keyed by cache filename.
+ * Read-only opens borrow a pooled fd instead of opening the file again, and
+ * give it back on close; reads use pread, so sharing one fd is safe. When the
+ * cache file is replaced or removed, its entry is invalidated, and the fd is
+ * closed as soon as nobody is using it.
+ */
+
+void fdpool_init(unsigned size);
+int fdpool_get(const char *filename);
+bool fdpool_add(const char *filename, int fd);
+void fdpool_release(int fd);
+void fdpool_invalidate(const char *filename);
+
+#endif
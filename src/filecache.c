@@ -26,6 +26,7 @@
 #include <errno.h>
 #include <libgen.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/file.h>
 #include <stdlib.h>
 #include <ctype.h>
@@ -40,9 +41,16 @@
 #include "session.h"
 #include "fusedav_config.h"
 #include "fusedav-statsd.h"
+#include "slabstore.h"
+#include "ioengine.h"
+#include "writequeue.h"
+#include "fdpool.h"
 
 #define REFRESH_INTERVAL 3
 #define CACHE_FILE_ENTROPY 20
+// Cache files are spread over this many subdirectories of cache_path/files, named 00 to ff,
+// to keep each directory small enough that creates, unlinks and readdir stay cheap
+#define CACHE_FILE_FANOUT 256
 
 // Remove filecache files older than 8 days
 #define AGE_OUT_THRESHOLD 691200
@@ -60,8 +68,69 @@ static const char * filecache_prefix = "fc:";
 // Name of forensic haven directory
 static const char * forensic_haven_dir = "forensic-haven";
 
+// Files no bigger than this are kept inline in their ldb entry rather than in a cache file.
+// Set from the inline_file_size config; 0 turns inlining off.
+static size_t inline_file_size = 0;
+#define INLINE_FILE_SIZE_MAX (64 * 1024)
+
+// Set from the slab_store config: keep the bodies of small read-only files in slabs
+static bool use_slab_store = false;
+
+// Cache filenames in pdata are relative to this
+static char cache_root[PATH_MAX];
+
+// Read-only opens of uncached files at least this big are passed through to the
+// server rather than copied into the cache. Set from passthrough_file_size; 0 is off.
+static off_t passthrough_file_size = 0;
+// Set, with __sync, once the server has shown it ignores Range; passthrough is off from then on
+static int passthrough_off = 0;
+// Read-ahead window for sequential passthrough reads; it doubles up to the max
+#define PASSTHROUGH_WINDOW_MIN (256 * 1024)
+#define PASSTHROUGH_WINDOW_MAX (4 * 1024 * 1024)
+
+// Set from append_uploads: send only the new tail of files which have just grown; see put_append.
+// Cleared if the server turns out not to support it.
+static bool append_uploads = false;
+
+// Files at least this big are uploaded in resumable chunks; see put_chunked.
+// Set from chunked_upload_size; 0 is off. Cleared if the server turns out not to support it.
+static off_t chunked_upload_size = 0;
+
+// Read-only opens may use a cached copy up to this many seconds old, which is then
+// revalidated in the background; see schedule_revalidate. Set from max_staleness; 0 is off.
+static time_t max_staleness = 0;
+
+// Writes up to this size are combined in a per-handle buffer of write_buffer_size bytes
+// before they go to the cache file. Set from write_buffer_size; 0 is off.
+static size_t write_buffer_size = 0;
+#define WRITE_COMBINE_MAX (16 * 1024)
+
+// Set from saint_write_queue: uploads which fail in saint mode wait in the write
+// queue instead of failing the close; see filecache_replay_writes.
+static bool saint_write_queue = false;
+
+// Handles whose writes the stat cache hasn't caught up with, by path. Only the
+// handle which wrote last is kept for a path; see filecache_defer_stat.
+static pthread_mutex_t deferred_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *deferred_stats = NULL;
+
+// Files open for writing, by path, which later opens of the path share
+static pthread_mutex_t open_files_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Held for every write of an entry, put or delete, so that jobs which rewrite an entry they
+ * read a while ago (compaction, cache file migration) can check it hasn't changed since and
+ * write it in one step; see filecache_pdata_replace. Recursive, since that calls the writers.
+ */
+static pthread_mutex_t pdata_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static GHashTable *open_files = NULL;
+// Background revalidation; pending paths beyond the queue limit are revalidated in the foreground
+#define REVALIDATE_THREADS 2
+#define REVALIDATE_QUEUE_MAX 1024
+
 typedef int fd_t;
 
+// @TODO Where to find ETAG_MAX?
+#define ETAG_MAX 256
+
 // Session data
 struct filecache_sdata {
     fd_t fd; // LOCK_SH for write/truncation; LOCK_EX during PUT
@@ -69,10 +138,67 @@ struct filecache_sdata {
     bool writable;
     bool modified;
     int error_code;
+    // Read-only opens of inline and slab entries read packed_size bytes of body from
+    // either inline_data (fd is -1) or fd at packed_offset (fd is the slab)
+    bool packed;
+    char *inline_data;
+    off_t packed_offset;
+    size_t packed_size;
+    // Passthrough opens have no fd (-1) and read from the server through this
+    struct passthrough *stream;
+    bool pooled; // fd is borrowed from the fd pool
+    // base_etag is the server's ETag for the version these writes started from, if known.
+    // The file was append_base bytes long when it last matched base_etag on the server,
+    // and has only been appended to since; -1 if that's not known to be so
+    off_t append_base;
+    char base_etag[ETAG_MAX + 1];
+    bool marked_modified; // pdata already says the local copy is newer than the server's
+    char *deferred_path; // The stat cache entry for this path is behind our writes; see filecache_defer_stat
+    // Small writes not yet in the cache file: wbuf_len bytes at wbuf_offset; see flush_write_buffer.
+    // wbuf is only allocated for writable handles when write_buffer_size is set.
+    pthread_mutex_t wbuf_lock;
+    char *wbuf;
+    off_t wbuf_offset;
+    size_t wbuf_len;
+    // Handles which opened the same path while this was open for writing share it; see join_open_file.
+    // Writes and truncation hold io_lock shared, and a sync exclusively while it sets up a PUT and
+    // settles up after it, since flock can't tell the handles apart. handles counts those not yet released, refs those not yet closed; both are
+    // protected by open_files_mutex.
+    pthread_rwlock_t io_lock;
+    char *open_path; // Where it's registered in open_files, if it is
+    bool append_mode; // fd has O_APPEND, so only O_APPEND writers can share it
+    unsigned handles;
+    unsigned refs;
+    uint64_t version; // Set on every change, so each version of the contents uploads under its own id
 };
 
-// @TODO Where to find ETAG_MAX?
-#define ETAG_MAX 256
+// Versions for mark_modified; seeded from the clock in filecache_init, so they don't repeat across restarts
+static uint64_t write_version = 0;
+
+static void mark_modified(struct filecache_sdata *sdata) {
+    sdata->modified = true;
+    sdata->version = __sync_add_and_fetch(&write_version, 1);
+}
+
+// What info->fh points to; one per open handle, where sdata may be shared
+struct filecache_handle {
+    struct filecache_sdata *sdata;
+    bool released; // See filecache_release
+};
+
+// Passthrough read state; see open_passthrough
+struct passthrough {
+    pthread_mutex_t lock; // Held across fetches; reads on one handle are serialized
+    char *path;
+    char etag[ETAG_MAX + 1]; // From the first response; later ranges must match it
+    off_t size; // From the first response's Content-Range; so must theirs
+    // buf holds buf_len bytes of the file starting at buf_offset
+    char *buf;
+    off_t buf_offset;
+    size_t buf_len;
+    off_t next_offset; // Where a sequential read would start
+    size_t window;
+};
 
 // Persistent data stored in leveldb
 struct filecache_pdata {
@@ -81,17 +207,119 @@ struct filecache_pdata {
     time_t last_server_update;
 };
 
+/* Small files can be stored inline. The body then follows the pdata in the
+ * same ldb value, and filename is empty, which never happens for an entry
+ * backed by a cache file. The body length is whatever is left of the value
+ * after the pdata.
+ */
+#define pdata_is_inline(pdata) ((pdata)->filename[0] == '\0')
+#define pdata_inline_body(pdata) ((char *)(pdata) + sizeof(struct filecache_pdata))
+
+/* Entries whose body is in a slab (see slabstore.h) have a filename of
+ * "slab:<id>:<offset>:<length>". Real cache filenames never start with that:
+ * they're absolute, or relative to cache_path/files (see cache_file_abs).
+ */
+static const char *slab_prefix = "slab:";
+#define pdata_is_slab(pdata) (strncmp((pdata)->filename, slab_prefix, strlen(slab_prefix)) == 0)
+#define pdata_is_packed(pdata) (pdata_is_inline(pdata) || pdata_is_slab(pdata))
+
+static bool pdata_slab_ref(const struct filecache_pdata *pdata, struct slab_ref *ref) {
+    long long offset, length;
+
+    if (sscanf(pdata->filename + strlen(slab_prefix), "%u:%lld:%lld", &ref->id, &offset, &length) != 3) {
+        return false;
+    }
+    ref->offset = offset;
+    ref->length = length;
+    return true;
+}
+
+static void pdata_set_slab_ref(struct filecache_pdata *pdata, const struct slab_ref *ref) {
+    snprintf(pdata->filename, PATH_MAX, "%s%u:%lld:%lld", slab_prefix, ref->id,
+        (long long) ref->offset, (long long) ref->length);
+}
+
 // GError mechanisms
 static G_DEFINE_QUARK(FC, filecache)
 static G_DEFINE_QUARK(SYS, system)
 static G_DEFINE_QUARK(LDB, leveldb)
 static G_DEFINE_QUARK(CURL, curl)
 
-void filecache_init(char *cache_path, GError **gerr) {
+/* Paths waiting for, or undergoing, background revalidation. A path is only ever
+ * queued once, however many opens serve its stale copy in the meantime.
+ */
+enum revalidate_state {REVALIDATE_QUEUED = 1, REVALIDATE_RUNNING};
+// revalidate_mutex protects the table and the cache handle
+static pthread_mutex_t revalidate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t revalidate_cond = PTHREAD_COND_INITIALIZER;
+static GHashTable *revalidate_paths = NULL;
+static filecache_t *revalidate_cache = NULL;
+
+// forward reference; the workers call back into get_fresh_fd
+static void *revalidate_worker(void *ptr);
+
+static void revalidate_init(int staleness) {
+    revalidate_paths = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+    for (int idx = 0; idx < REVALIDATE_THREADS; idx++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, revalidate_worker, NULL)) {
+            log_print(LOG_ERR, SECTION_FILECACHE_OPEN, "revalidate_init: failed to start worker: %d %s", errno, strerror(errno));
+            // Without any workers, there's nobody to revalidate stale copies; don't serve them
+            if (idx == 0) return;
+            break;
+        }
+        pthread_detach(thread);
+    }
+    max_staleness = staleness;
+    log_print(LOG_INFO, SECTION_FILECACHE_OPEN, "revalidate_init: serving copies up to %lus stale", max_staleness);
+}
+
+// Queues path for background revalidation. Returns false if the queue is full, in which case the caller should revalidate it now.
+static bool schedule_revalidate(filecache_t *cache, const char *path) {
+    bool scheduled = true;
+
+    pthread_mutex_lock(&revalidate_mutex);
+    revalidate_cache = cache;
+    if (g_hash_table_lookup(revalidate_paths, path) == NULL) {
+        char *key = strdup(path);
+        if (key == NULL || g_hash_table_size(revalidate_paths) >= REVALIDATE_QUEUE_MAX) {
+            free(key);
+            scheduled = false;
+        }
+        else {
+            g_hash_table_insert(revalidate_paths, key, GINT_TO_POINTER(REVALIDATE_QUEUED));
+            pthread_cond_signal(&revalidate_cond);
+        }
+    }
+    pthread_mutex_unlock(&revalidate_mutex);
+
+    return scheduled;
+}
+
+void filecache_init(struct fusedav_config *config, GError **gerr) {
+    const char *cache_path = config->cache_path;
     char path[PATH_MAX];
+    struct timespec now;
 
     BUMP(filecache_init);
 
+    strncpy(cache_root, cache_path, PATH_MAX - 1);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    write_version = (uint64_t) now.tv_sec * 1000 * 1000 * 1000 + now.tv_nsec;
+
+    deferred_stats = g_hash_table_new(g_str_hash, g_str_equal);
+    open_files = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+
+    if (config->inline_file_size > 0) {
+        inline_file_size = config->inline_file_size;
+        if (inline_file_size > INLINE_FILE_SIZE_MAX) {
+            log_print(LOG_NOTICE, SECTION_FILECACHE_OPEN, "filecache_init: inline_file_size %d reduced to %d",
+                config->inline_file_size, INLINE_FILE_SIZE_MAX);
+            inline_file_size = INLINE_FILE_SIZE_MAX;
+        }
+    }
+
     if (mkdir(cache_path, 0770) == -1) {
         if (errno != EEXIST || inject_error(filecache_error_init1)) {
             g_set_error (gerr, system_quark(), errno, "filecache_init: Cache Path %s could not be created.", cache_path);
@@ -99,6 +327,61 @@ void filecache_init(char *cache_path, GError **gerr) {
         }
     }
 
+    append_uploads = config->append_uploads;
+
+    if (config->chunked_upload_size > 0) {
+        chunked_upload_size = (off_t) config->chunked_upload_size * 1024 * 1024;
+    }
+
+    if (config->fd_pool_size > 0) {
+        fdpool_init(config->fd_pool_size);
+    }
+
+    if (config->passthrough_file_size > 0) {
+        passthrough_file_size = (off_t) config->passthrough_file_size * 1024 * 1024;
+    }
+
+    if (config->write_buffer_size > 0) {
+        write_buffer_size = (size_t) config->write_buffer_size * 1024;
+    }
+
+    if (config->io_uring) {
+        int ret = ioengine_init(true);
+        if (ret < 0) {
+            log_print(LOG_WARNING, SECTION_FILECACHE_OPEN, "filecache_init: io_uring unavailable, using pread/pwrite: %d %s",
+                -ret, strerror(-ret));
+        }
+        else {
+            log_print(LOG_NOTICE, SECTION_FILECACHE_OPEN, "filecache_init: cache file I/O on io_uring");
+        }
+    }
+
+    if (config->saint_write_queue) {
+        GError *tmpgerr = NULL;
+
+        writequeue_init(cache_path, &tmpgerr);
+        if (tmpgerr) {
+            g_propagate_prefixed_error(gerr, tmpgerr, "filecache_init: ");
+            return;
+        }
+        saint_write_queue = true;
+    }
+
+    if (config->max_staleness > 0) {
+        revalidate_init(config->max_staleness);
+    }
+
+    if (config->slab_store) {
+        GError *tmpgerr = NULL;
+
+        slabstore_init(cache_path, &tmpgerr);
+        if (tmpgerr) {
+            g_propagate_prefixed_error(gerr, tmpgerr, "filecache_init: ");
+            return;
+        }
+        use_slab_store = true;
+    }
+
     snprintf(path, PATH_MAX, "%s/files", cache_path);
     if (mkdir(path, 0770) == -1) {
         if (errno != EEXIST || inject_error(filecache_error_init2)) {
@@ -107,6 +390,14 @@ void filecache_init(char *cache_path, GError **gerr) {
         }
     }
 
+    for (unsigned bucket = 0; bucket < CACHE_FILE_FANOUT; bucket++) {
+        snprintf(path, PATH_MAX, "%s/files/%02x", cache_path, bucket);
+        if (mkdir(path, 0770) == -1 && errno != EEXIST) {
+            g_set_error (gerr, system_quark(), errno, "filecache_init: Path %s could not be created.", path);
+            return;
+        }
+    }
+
     snprintf(path, PATH_MAX, "%s/%s", cache_path, forensic_haven_dir);
     if (mkdir(path, 0770) == -1) {
         if (errno != EEXIST || inject_error(filecache_error_init3)) {
@@ -165,9 +456,18 @@ struct curl_slist* enhanced_logging(struct curl_slist *slist, int log_level, int
     return slist;
 }
 
-// creates a new cache file
+// Cache filenames in pdata are relative to the cache path. Entries from before the
+// hashed layout hold absolute paths, which are used as they are.
+static const char *cache_file_abs(const char *filename, char *buf) {
+    if (filename[0] == '/') return filename;
+    snprintf(buf, PATH_MAX, "%s/%s", cache_root, filename);
+    return buf;
+}
+
+// Creates a cache file in a random subdirectory; cache_file_path gets its name relative to cache_path
 static void new_cache_file(const char *cache_path, char *cache_file_path, fd_t *fd, GError **gerr) {
     char entropy[CACHE_FILE_ENTROPY + 1];
+    char abs_path[PATH_MAX];
 
     BUMP(filecache_cache_file);
 
@@ -176,20 +476,21 @@ static void new_cache_file(const char *cache_path, char *cache_file_path, fd_t *
     }
     entropy[CACHE_FILE_ENTROPY] = '\0';
 
-    snprintf(cache_file_path, PATH_MAX, "%s/files/fusedav-cache-%s-XXXXXX", cache_path, entropy);
-    log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "new_cache_file: Using pattern %s", cache_file_path);
-    if ((*fd = mkstemp(cache_file_path)) < 0 || inject_error(filecache_error_newcachefile)) {
+    snprintf(abs_path, PATH_MAX, "%s/files/%02x/fusedav-cache-%s-XXXXXX", cache_path, rand() % CACHE_FILE_FANOUT, entropy);
+    log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "new_cache_file: Using pattern %s", abs_path);
+    if ((*fd = mkstemp(abs_path)) < 0 || inject_error(filecache_error_newcachefile)) {
         g_set_error (gerr, system_quark(), errno, "new_cache_file: Failed mkstemp");
         return;
     }
+    strncpy(cache_file_path, abs_path + strlen(cache_path) + 1, PATH_MAX);
 
     log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "new_cache_file: mkstemp fd=%d :: %s", *fd, cache_file_path);
     return;
 }
 
-// adds an entry to the ldb cache
-static void filecache_pdata_set(filecache_t *cache, const char *path,
-        const struct filecache_pdata *pdata, GError **gerr) {
+// adds an entry to the ldb cache; pdata_len is more than the size of the pdata for inline entries
+static void filecache_pdata_put(filecache_t *cache, const char *path,
+        const struct filecache_pdata *pdata, size_t pdata_len, GError **gerr) {
     leveldb_writeoptions_t *options;
     char *ldberr = NULL;
     char *key;
@@ -202,11 +503,14 @@ static void filecache_pdata_set(filecache_t *cache, const char *path,
         return;
     }
 
-    log_print(LOG_DEBUG, SECTION_FILECACHE_CACHE, "filecache_pdata_set: path=%s ; cachefile=%s", path, pdata->filename);
+    log_print(LOG_DEBUG, SECTION_FILECACHE_CACHE, "filecache_pdata_set: path=%s ; cachefile=%s ; len=%lu",
+        path, pdata_is_inline(pdata) ? "(inline)" : pdata->filename, pdata_len);
 
     key = path2key(path);
     options = leveldb_writeoptions_create();
-    leveldb_put(cache, options, key, strlen(key) + 1, (const char *) pdata, sizeof(struct filecache_pdata), &ldberr);
+    pthread_mutex_lock(&pdata_mutex);
+    leveldb_put(cache, options, key, strlen(key) + 1, (const char *) pdata, pdata_len, &ldberr);
+    pthread_mutex_unlock(&pdata_mutex);
     leveldb_writeoptions_destroy(options);
 
     free(key);
@@ -221,6 +525,16 @@ static void filecache_pdata_set(filecache_t *cache, const char *path,
     return;
 }
 
+static void filecache_pdata_set(filecache_t *cache, const char *path,
+        const struct filecache_pdata *pdata, GError **gerr) {
+    // Writing just the pdata for an inline entry would silently turn it into an empty file
+    if (pdata && pdata_is_inline(pdata)) {
+        g_set_error(gerr, filecache_quark(), E_FC_PDATANULL, "filecache_pdata_set: inline entry without its body for %s", path);
+        return;
+    }
+    filecache_pdata_put(cache, path, pdata, sizeof(struct filecache_pdata), gerr);
+}
+
 // Create a new file to write into and set values
 static void create_file(struct filecache_sdata *sdata, const char *cache_path,
         filecache_t *cache, const char *path, GError **gerr) {
@@ -239,7 +553,7 @@ static void create_file(struct filecache_sdata *sdata, const char *cache_path,
         return;
     }
 
-    sdata->modified = true;
+    mark_modified(sdata);
     sdata->writable = true;
     new_cache_file(cache_path, pdata->filename, &sdata->fd, &tmpgerr);
     if (tmpgerr) {
@@ -264,8 +578,9 @@ finish:
     return;
 }
 
-// get an entry from the ldb cache
-static struct filecache_pdata *filecache_pdata_get(filecache_t *cache, const char *path, GError **gerr) {
+// get an entry from the ldb cache; for inline entries the body follows the pdata,
+// and *pdata_len (if not NULL) says how long the whole thing is
+static struct filecache_pdata *filecache_pdata_get_len(filecache_t *cache, const char *path, size_t *pdata_len, GError **gerr) {
     struct filecache_pdata *pdata = NULL;
     char *key;
     leveldb_readoptions_t *options;
@@ -296,17 +611,189 @@ static struct filecache_pdata *filecache_pdata_get(filecache_t *cache, const cha
         return NULL;
     }
 
-    if (vallen != sizeof(struct filecache_pdata) || inject_error(filecache_error_getvallen)) {
+    if (vallen < sizeof(struct filecache_pdata) ||
+            (vallen != sizeof(struct filecache_pdata) && !pdata_is_inline(pdata)) ||
+            inject_error(filecache_error_getvallen)) {
         g_set_error(gerr, leveldb_quark(), E_FC_LDBERR, "Length %lu is not expected length %lu.", vallen, sizeof(struct filecache_pdata));
         free(pdata);
         return NULL;
     }
 
-    log_print(LOG_DEBUG, SECTION_FILECACHE_CACHE, "Returning from filecache_pdata_get: path=%s :: cachefile=%s", path, pdata->filename);
+    if (pdata_len) *pdata_len = vallen;
+
+    log_print(LOG_DEBUG, SECTION_FILECACHE_CACHE, "Returning from filecache_pdata_get: path=%s :: cachefile=%s",
+        path, pdata_is_inline(pdata) ? "(inline)" : pdata->filename);
 
     return pdata;
 }
 
+static struct filecache_pdata *filecache_pdata_get(filecache_t *cache, const char *path, GError **gerr) {
+    return filecache_pdata_get_len(cache, path, NULL, gerr);
+}
+
+/* Writes pdata as path's entry, but only if the entry is still what the caller read as old:
+ * same body, etag and last update. Returns false, writing nothing, if it has changed or gone.
+ */
+static bool filecache_pdata_replace(filecache_t *cache, const char *path, const struct filecache_pdata *old,
+        const struct filecache_pdata *pdata, GError **gerr) {
+    struct filecache_pdata *current;
+    GError *tmpgerr = NULL;
+    bool unchanged;
+
+    pthread_mutex_lock(&pdata_mutex);
+    current = filecache_pdata_get(cache, path, &tmpgerr);
+    unchanged = (!tmpgerr && current && strcmp(current->filename, old->filename) == 0 &&
+        strcmp(current->etag, old->etag) == 0 && current->last_server_update == old->last_server_update);
+    if (unchanged) {
+        filecache_pdata_set(cache, path, pdata, &tmpgerr);
+    }
+    pthread_mutex_unlock(&pdata_mutex);
+
+    free(current);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "filecache_pdata_replace: ");
+        return false;
+    }
+    return unchanged;
+}
+
+// Copy len bytes at src_offset in src_fd to the start of dst_fd
+static bool copy_range(fd_t src_fd, off_t src_offset, fd_t dst_fd, size_t len) {
+    char buf[4096];
+    size_t done = 0;
+
+    while (done < len) {
+        size_t chunk = (len - done) < sizeof(buf) ? len - done : sizeof(buf);
+        ssize_t bytes = pread(src_fd, buf, chunk, src_offset + done);
+
+        if (bytes <= 0) {
+            if (bytes == 0) errno = EIO;
+            return false;
+        }
+        if (pwrite(dst_fd, buf, bytes, done) != bytes) return false;
+        done += bytes;
+    }
+    return true;
+}
+
+/* Serve an inline or slab entry. Read-only opens read the body where it is; anything which
+ * might write spills the body out to a normal cache file, which the entry then points to.
+ * Returns false, having set nothing up, if the body isn't where the entry says, even after
+ * reading the entry again in case compaction moved it; the caller fetches the file afresh.
+ */
+static bool open_packed(filecache_t *cache, const char *cache_path, const char *path,
+        struct filecache_sdata *sdata, struct filecache_pdata *pdata, size_t pdata_len, int flags, GError **gerr) {
+    static const char *funcname = "open_packed";
+    GError *tmpgerr = NULL;
+    char packed_name[PATH_MAX];
+    char abs_path[PATH_MAX];
+    struct slab_ref ref = {0};
+    fd_t slab_fd = -1;
+    size_t body_len;
+    bool inlined = pdata_is_inline(pdata);
+
+    if (inlined) {
+        body_len = pdata_len - sizeof(struct filecache_pdata);
+    }
+    else {
+        if (!pdata_slab_ref(pdata, &ref)) {
+            g_set_error(gerr, filecache_quark(), E_FC_LDBERR, "%s: bad slab reference %s for %s", funcname, pdata->filename, path);
+            return true;
+        }
+        body_len = ref.length;
+    }
+
+    // A truncating open doesn't need the old body
+    if (!inlined && !(flags & O_TRUNC)) {
+        slab_fd = slabstore_open(&ref, &tmpgerr);
+        if (tmpgerr) {
+            struct filecache_pdata *latest;
+
+            // Compaction may have moved the body, and retired its slab, since we read the entry
+            log_print(LOG_INFO, SECTION_FILECACHE_OPEN, "%s: %s; rereading the entry for %s", funcname, tmpgerr->message, path);
+            g_clear_error(&tmpgerr);
+            latest = filecache_pdata_get(cache, path, &tmpgerr);
+            if (tmpgerr) g_clear_error(&tmpgerr);
+            if (latest && pdata_is_slab(latest) && strcmp(latest->filename, pdata->filename) != 0 && pdata_slab_ref(latest, &ref)) {
+                // Entries in slabs are all the same size
+                memcpy(pdata, latest, sizeof(struct filecache_pdata));
+                slab_fd = slabstore_open(&ref, &tmpgerr);
+            }
+            else {
+                g_set_error(&tmpgerr, filecache_quark(), E_FC_PDATANULL, "%s: the entry points nowhere else", funcname);
+            }
+            free(latest);
+        }
+        if (tmpgerr) {
+            log_print(LOG_NOTICE, SECTION_FILECACHE_OPEN, "%s: body of %s not in its slab: %s; refetching", funcname, path, tmpgerr->message);
+            g_clear_error(&tmpgerr);
+            BUMP(filecache_slab_miss);
+            return false;
+        }
+        body_len = ref.length;
+    }
+
+    if ((flags & O_ACCMODE) == O_RDONLY && !(flags & O_TRUNC)) {
+        sdata->packed = true;
+        sdata->packed_size = body_len;
+        if (inlined) {
+            sdata->fd = -1;
+            sdata->inline_data = malloc(body_len ? body_len : 1);
+            if (sdata->inline_data == NULL) {
+                g_set_error(gerr, system_quark(), ENOMEM, "%s: malloc failed for %s", funcname, path);
+                return true;
+            }
+            memcpy(sdata->inline_data, pdata_inline_body(pdata), body_len);
+            BUMP(filecache_inline_open);
+        }
+        else {
+            sdata->fd = slab_fd;
+            sdata->packed_offset = ref.offset;
+            BUMP(filecache_slab_open);
+        }
+        log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "%s: serving %lu bytes from %s for %s", funcname, body_len,
+            inlined ? "(inline)" : pdata->filename, path);
+        return true;
+    }
+
+    strncpy(packed_name, pdata->filename, PATH_MAX);
+    new_cache_file(cache_path, pdata->filename, &sdata->fd, &tmpgerr);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "%s: ", funcname);
+        goto finish;
+    }
+
+    if (flags & O_TRUNC) {
+        mark_modified(sdata);
+    }
+    else if (inlined ? pwrite(sdata->fd, pdata_inline_body(pdata), body_len, 0) != (ssize_t) body_len :
+            !copy_range(slab_fd, ref.offset, sdata->fd, body_len)) {
+        g_set_error(gerr, system_quark(), errno, "%s: failed to spill body for %s", funcname, path);
+        goto fail;
+    }
+
+    filecache_pdata_set(cache, path, pdata, &tmpgerr);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "%s: ", funcname);
+        goto fail;
+    }
+
+    if (inlined) BUMP(filecache_inline_spill);
+    else BUMP(filecache_slab_spill);
+    log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "%s: spilled %lu bytes for %s to %s", funcname, body_len, path, pdata->filename);
+    goto finish;
+
+fail:
+    close(sdata->fd);
+    sdata->fd = -1;
+    unlink(cache_file_abs(pdata->filename, abs_path));
+    strncpy(pdata->filename, packed_name, PATH_MAX);
+
+finish:
+    if (slab_fd >= 0) close(slab_fd);
+    return true;
+}
+
 // Stores the header value into into *userdata if it's "ETag."
 static size_t capture_etag(void *ptr, size_t size, size_t nmemb, void *userdata) {
     size_t real_size = size * nmemb;
@@ -351,20 +838,403 @@ static size_t write_response_to_fd(void *ptr, size_t size, size_t nmemb, void *u
     return real_size;
 }
 
+// What passthrough GETs keep from the response headers
+struct range_headers {
+    char etag[ETAG_MAX + 1];
+    off_t total; // The size of the whole file, from Content-Range; -1 if not given
+};
+
+// Content-Range: bytes <first>-<last>/<total>
+static size_t capture_range_headers(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    struct range_headers *headers = (struct range_headers *) userdata;
+    const char *header = (const char *) ptr;
+    size_t real_size = size * nmemb;
+
+    if (real_size > 14 && strncasecmp(header, "Content-Range:", 14) == 0) {
+        const char *slash = memchr(header, '/', real_size);
+        if (slash && isdigit((unsigned char) slash[1])) headers->total = strtoll(slash + 1, NULL, 10);
+        return real_size;
+    }
+    return capture_etag(ptr, size, nmemb, headers->etag);
+}
+
+// Response body sink for passthrough GETs
+struct range_sink {
+    char *buf;
+    size_t len;
+    size_t cap;
+    bool overflow;
+};
+
+static size_t write_response_to_buf(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    struct range_sink *sink = (struct range_sink *) userdata;
+    size_t real_size = size * nmemb;
+
+    if (sink->len + real_size > sink->cap) {
+        sink->overflow = true;
+        return 0;
+    }
+    memcpy(sink->buf + sink->len, ptr, real_size);
+    sink->len += real_size;
+    return real_size;
+}
+
+// Upload source for a PUT. We pread straight from the cache file rather than
+// going through a dup'd, fdopen'd stdio stream, so there is no extra buffer
+// and copy per upload, and the fd offset is left alone.
+// The body is the range [start, end) of the file.
+struct put_source {
+    fd_t fd;
+    off_t start;
+    off_t offset;
+    off_t end;
+};
+
+static size_t read_request_from_fd(char *buf, size_t size, size_t nmemb, void *userdata) {
+    struct put_source *source = (struct put_source *) userdata;
+    size_t want = size * nmemb;
+    ssize_t res;
+
+    if ((off_t) want > source->end - source->offset) want = source->end - source->offset;
+    if (want == 0) return 0;
+
+    do {
+        res = pread(source->fd, buf, want, source->offset);
+    } while (res < 0 && errno == EINTR);
+
+    if (res < 0) {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "read_request_from_fd: pread failed on fd %d at offset %lu: %d %s",
+            source->fd, source->offset, errno, strerror(errno));
+        return CURL_READFUNC_ABORT;
+    }
+    if (res == 0) {
+        // Truncated since the upload started; the write that did it gets uploaded after this one
+        memset(buf, 0, want);
+        res = want;
+    }
+
+    source->offset += res;
+    return res;
+}
+
+// curl calls this if it needs to rewind the upload, e.g. on a redirect
+static int seek_request_fd(void *userdata, curl_off_t offset, int origin) {
+    struct put_source *source = (struct put_source *) userdata;
+
+    if (origin != SEEK_SET || offset < 0)
+        return CURL_SEEKFUNC_CANTSEEK;
+
+    source->offset = source->start + offset;
+    return CURL_SEEKFUNC_OK;
+}
+
+// Replace the entry for a freshly downloaded file with an inline one if it's small enough.
+// Leaves *pdatap pointing to a cache file entry if not.
+static void store_inline(filecache_t *cache, const char *path, struct filecache_pdata **pdatap,
+        size_t *pdata_lenp, fd_t fd, GError **gerr) {
+    struct filecache_pdata *pdata;
+    struct stat st;
+    size_t pdata_len;
+
+    if (fstat(fd, &st) || (size_t) st.st_size > inline_file_size) return;
+
+    pdata_len = sizeof(struct filecache_pdata) + st.st_size;
+    pdata = realloc(*pdatap, pdata_len);
+    // Not fatal; we just keep using the cache file
+    if (pdata == NULL) return;
+    *pdatap = pdata;
+
+    if (pread(fd, pdata_inline_body(pdata), st.st_size, 0) != st.st_size) {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_OPEN, "store_inline: short read on %s; not inlining", path);
+        return;
+    }
+
+    pdata->filename[0] = '\0';
+    filecache_pdata_put(cache, path, pdata, pdata_len, gerr);
+    *pdata_lenp = pdata_len;
+
+    BUMP(filecache_inline_store);
+    log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "store_inline: stored %lu bytes inline for %s", st.st_size, path);
+}
+
+// Point the entry for a freshly downloaded file at a copy of its body in a slab, if it fits.
+// On failure the entry keeps pointing at the response file. Returns true if the body went
+// into a slab; the caller then calls slabstore_append_done on ref once the entry is written.
+static bool store_slab(const char *path, struct filecache_pdata *pdata, fd_t fd, struct slab_ref *ref) {
+    GError *tmpgerr = NULL;
+    struct stat st;
+
+    if (fstat(fd, &st) || st.st_size > SLAB_BODY_MAX) return false;
+
+    slabstore_append(fd, 0, st.st_size, ref, &tmpgerr);
+    if (tmpgerr) {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_OPEN, "store_slab: not using slab for %s: %s", path, tmpgerr->message);
+        g_clear_error(&tmpgerr);
+        return false;
+    }
+
+    pdata_set_slab_ref(pdata, ref);
+    BUMP(filecache_slab_store);
+    log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "store_slab: stored %lu bytes for %s at %s", st.st_size, path, pdata->filename);
+    return true;
+}
+
+/* Fill the passthrough buffer with len bytes at offset, using a ranged GET. The first
+ * response gives the size of the file, and the ETag; if either changes later, the file
+ * changed on the server, and the error is ESTALE.
+ */
+static void passthrough_fetch(struct passthrough *stream, off_t offset, size_t len, GError **gerr) {
+    static const char *funcname = "passthrough_fetch";
+    struct range_sink sink = {stream->buf, 0, len, false};
+    struct range_headers headers;
+    size_t expected;
+    char range[64];
+    long response_code = 500; // seed it as bad so we can enter the loop
+    CURLcode res = CURLE_OK;
+
+    BUMP(filecache_passthrough_get);
+
+    snprintf(range, sizeof(range), "%lld-%lld", (long long) offset, (long long) (offset + len - 1));
+
+    for (int idx = 0; idx < num_filesystem_server_nodes && (res != CURLE_OK || response_code >= 500) && !sink.overflow; idx++) {
+        long elapsed_time = 0;
+        CURL *session;
+        struct curl_slist *slist = NULL;
+
+        session = session_request_init(stream->path, NULL, false);
+        if (!session || inject_error(filecache_error_freshsession)) {
+            g_set_error(gerr, curl_quark(), E_FC_CURLERR, "%s: Failed session_request_init on GET", funcname);
+            try_release_request_outstanding();
+            return;
+        }
+
+        // Don't stitch together ranges from different versions of the file
+        if (stream->etag[0] != '\0') {
+            char *header = NULL;
+            asprintf(&header, "If-Match: %s", stream->etag);
+            slist = curl_slist_append(slist, header);
+            free(header);
+        }
+        slist = enhanced_logging(slist, LOG_INFO, SECTION_FILECACHE_IO, "%s: %s %s", funcname, stream->path, range);
+        if (slist) curl_easy_setopt(session, CURLOPT_HTTPHEADER, slist);
+
+        curl_easy_setopt(session, CURLOPT_RANGE, range);
+
+        headers.etag[0] = '\0';
+        headers.total = -1;
+        sink.len = 0;
+        session_request_type(session, REQUEST_GET, len);
+        session_hedgeable(session, write_response_to_buf, &sink, capture_range_headers, &headers);
+
+        timed_curl_easy_perform(session, &res, &response_code, &elapsed_time);
+
+        if (slist) curl_slist_free_all(slist);
+
+        process_status(funcname, session, res, response_code, elapsed_time, idx, stream->path, false);
+    }
+
+    // The server sent more than we asked for, most likely the whole file. A server which
+    // ignores ranges will do that every time, so stop opening files this way.
+    if (sink.overflow) {
+        if (__sync_bool_compare_and_swap(&passthrough_off, 0, 1)) {
+            log_print(LOG_NOTICE, SECTION_FILECACHE_OPEN, "%s: server ignored range %s (%ld); caching big files instead",
+                funcname, range, response_code);
+        }
+        g_set_error(gerr, filecache_quark(), EIO, "%s: server ignored range %s on %s", funcname, range, stream->path);
+        return;
+    }
+
+    if (res != CURLE_OK || response_code >= 500) {
+        trigger_saint_event(CLUSTER_FAILURE);
+        set_dynamic_logging();
+        g_set_error(gerr, curl_quark(), E_FC_CURLERR, "%s: curl_easy_perform is not CURLE_OK or 500: %s",
+            funcname, curl_easy_strerror(res));
+        return;
+    }
+    trigger_saint_event(CLUSTER_SUCCESS);
+
+    if (response_code == 412) {
+        g_set_error(gerr, filecache_quark(), ESTALE, "%s: %s changed on the server while being read", funcname, stream->path);
+        return;
+    }
+    if (response_code != 206 && !(response_code == 200 && offset == 0)) {
+        g_set_error(gerr, filecache_quark(), EIO, "%s: unexpected response %ld for %s on %s", funcname, response_code, range, stream->path);
+        return;
+    }
+
+    // A 200 is the whole file
+    if (response_code == 200) headers.total = sink.len;
+    if (headers.total < 0) {
+        g_set_error(gerr, filecache_quark(), EIO, "%s: no size in Content-Range for %s on %s", funcname, range, stream->path);
+        return;
+    }
+    if (stream->size < 0) {
+        stream->size = headers.total;
+        strncpy(stream->etag, headers.etag, ETAG_MAX);
+    }
+    else if (headers.total != stream->size) {
+        g_set_error(gerr, filecache_quark(), ESTALE, "%s: %s changed size on the server from %lld to %lld while being read",
+            funcname, stream->path, (long long) stream->size, (long long) headers.total);
+        return;
+    }
+
+    // Anything short of the range, or of the end of the file, is a broken response
+    expected = (offset >= stream->size) ? 0 : len;
+    if ((off_t) expected > stream->size - offset) expected = stream->size - offset;
+    if (sink.len != expected) {
+        g_set_error(gerr, filecache_quark(), EIO, "%s: got %lu bytes for %s of %lld on %s", funcname, sink.len, range,
+            (long long) stream->size, stream->path);
+        return;
+    }
+
+    stream->buf_offset = offset;
+    stream->buf_len = sink.len;
+    log_print(LOG_DEBUG, SECTION_FILECACHE_IO, "%s: got %lu bytes at %lu for %s", funcname, sink.len, offset, stream->path);
+}
+
+static ssize_t passthrough_read(struct passthrough *stream, char *buf, size_t size, off_t offset, GError **gerr) {
+    GError *tmpgerr = NULL;
+    ssize_t bytes_read = 0;
+
+    pthread_mutex_lock(&stream->lock);
+
+    if (offset < 0 || offset >= stream->size) goto finish;
+    if ((off_t) size > stream->size - offset) size = stream->size - offset;
+    if (size > PASSTHROUGH_WINDOW_MAX) size = PASSTHROUGH_WINDOW_MAX;
+
+    if (offset < stream->buf_offset || offset + (off_t) size > stream->buf_offset + (off_t) stream->buf_len) {
+        size_t want = size;
+
+        // Sequential readers get a growing read-ahead; anything else just gets what it asked for
+        if (offset == stream->next_offset) {
+            if (want < stream->window) want = stream->window;
+            if (stream->window < PASSTHROUGH_WINDOW_MAX) stream->window *= 2;
+        }
+        else {
+            stream->window = PASSTHROUGH_WINDOW_MIN;
+        }
+        if ((off_t) want > stream->size - offset) want = stream->size - offset;
+
+        passthrough_fetch(stream, offset, want, &tmpgerr);
+        if (tmpgerr) {
+            stream->buf_len = 0;
+            g_propagate_prefixed_error(gerr, tmpgerr, "passthrough_read: ");
+            bytes_read = -1;
+            goto finish;
+        }
+    }
+
+    memcpy(buf, stream->buf + (offset - stream->buf_offset), size);
+    stream->next_offset = offset + size;
+    bytes_read = size;
+
+finish:
+    pthread_mutex_unlock(&stream->lock);
+    return bytes_read;
+}
+
+static void passthrough_free(struct passthrough *stream) {
+    if (stream == NULL) return;
+    pthread_mutex_destroy(&stream->lock);
+    free(stream->path);
+    free(stream->buf);
+    free(stream);
+}
+
+// The size of the file going by the stat cache, or -1 if it isn't there
+static curl_off_t stat_cache_size(filecache_t *cache, const char *path) {
+    struct stat_cache_value *value;
+    curl_off_t size;
+
+    value = stat_cache_value_get(cache, path, true, NULL);
+    if (value == NULL) return -1;
+    size = value->st.st_size;
+    stat_cache_value_free(value);
+    return size;
+}
+
+/* Set up a passthrough handle if the file is big enough, going by the stat cache.
+ * The first window is fetched here, so that if the server won't send it (most likely
+ * because it ignores Range and answers 200 with the whole file), the open can go the
+ * usual way through the cache instead of failing every read. Its Content-Range gives
+ * the size reads go by, since the stat cache's may be out of date.
+ */
+static bool open_passthrough(filecache_t *cache, const char *path, struct filecache_sdata *sdata) {
+    struct passthrough *stream;
+    GError *tmpgerr = NULL;
+    curl_off_t size;
+
+    size = stat_cache_size(cache, path);
+    if (size < 0 || size < passthrough_file_size || __sync_fetch_and_add(&passthrough_off, 0)) return false;
+
+    stream = calloc(1, sizeof(struct passthrough));
+    if (stream == NULL) return false;
+    stream->path = strdup(path);
+    stream->buf = malloc(PASSTHROUGH_WINDOW_MAX);
+    if (stream->path == NULL || stream->buf == NULL) {
+        passthrough_free(stream);
+        return false;
+    }
+    pthread_mutex_init(&stream->lock, NULL);
+    stream->size = -1; // Until the server tells us
+    stream->window = PASSTHROUGH_WINDOW_MIN;
+
+    passthrough_fetch(stream, 0, stream->window, &tmpgerr);
+    if (tmpgerr) {
+        BUMP(filecache_passthrough_fallback);
+        log_print(LOG_NOTICE, SECTION_FILECACHE_OPEN, "open_passthrough: %s; caching %s instead", tmpgerr->message, path);
+        g_clear_error(&tmpgerr);
+        passthrough_free(stream);
+        return false;
+    }
+
+    sdata->fd = -1;
+    sdata->stream = stream;
+    BUMP(filecache_passthrough_open);
+    log_print(LOG_INFO, SECTION_FILECACHE_OPEN, "open_passthrough: passing %s (%lld bytes) through", path,
+        (long long) stream->size);
+    return true;
+}
+
+// Open an existing cache file. Plain read-only opens borrow an fd from the pool if they can.
+static fd_t open_cache_file(struct filecache_sdata *sdata, const char *filename, int flags) {
+    char abs_path[PATH_MAX];
+    bool poolable = (flags & O_ACCMODE) == O_RDONLY && !(flags & O_TRUNC);
+    fd_t fd;
+
+    if (poolable) {
+        fd = fdpool_get(filename);
+        if (fd >= 0) {
+            sdata->pooled = true;
+            BUMP(filecache_fdpool_hit);
+            return fd;
+        }
+    }
+
+    fd = open(cache_file_abs(filename, abs_path), flags);
+    if (fd >= 0 && poolable) {
+        sdata->pooled = fdpool_add(filename, fd);
+    }
+    return fd;
+}
+
 // Get a file descriptor pointing to the latest full copy of the file.
+// If allow_stale, a copy younger than max_staleness will do, and is revalidated later.
 static void get_fresh_fd(filecache_t *cache,
         const char *cache_path, const char *path, struct filecache_sdata *sdata,
-        struct filecache_pdata **pdatap, int flags, bool use_local_copy, GError **gerr) {
+        struct filecache_pdata **pdatap, size_t *pdata_lenp, int flags, bool use_local_copy, bool allow_stale, GError **gerr) {
     static const char *funcname = "get_fresh_fd";
     GError *tmpgerr = NULL;
     struct filecache_pdata *pdata;
     char etag[ETAG_MAX];
     char response_filename[PATH_MAX] = "\0";
+    char abs_path[PATH_MAX];
     int response_fd = -1;
     bool close_response_fd = true;
     struct timespec start_time;
     long response_code = 500; // seed it as bad so we can enter the loop
     CURLcode res = CURLE_OK;
+    curl_off_t expected_bytes;
     // Not to exceed time for operation, else it's an error. Allow large files a longer time
     // Somewhat arbitrary
     static const unsigned small_time_allotment = 2000; // 2 seconds
@@ -381,6 +1251,18 @@ static void get_fresh_fd(filecache_t *cache,
         log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "%s: file found in cache: %s::%s", funcname, path, pdata->filename);
     }
 
+    // Read-mostly files almost always get a 304, so don't make the caller wait for it
+    if (allow_stale && max_staleness > 0 && pdata != NULL && !use_local_copy &&
+            (flags & O_ACCMODE) == O_RDONLY && !(flags & O_TRUNC) && pdata->last_server_update != 0 &&
+            (time(NULL) - pdata->last_server_update) > REFRESH_INTERVAL &&
+            (time(NULL) - pdata->last_server_update) <= max_staleness &&
+            schedule_revalidate(cache, path)) {
+        log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "%s: serving stale copy while revalidating: %s::%s (%lus old)",
+                funcname, path, pdata->filename, time(NULL) - pdata->last_server_update);
+        BUMP(filecache_stale_open);
+        use_local_copy = true;
+    }
+
     // Do we need to go out to the server, or just serve from the file cache
     // We should have guaranteed that if O_TRUNC is specified and pdata is NULL we don't get here.
     // For O_TRUNC, we just want to open a truncated cache file and not bother getting a copy from
@@ -394,8 +1276,21 @@ static void get_fresh_fd(filecache_t *cache,
         log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "%s: file is fresh or being truncated: %s::%s", 
                 funcname, path, pdata->filename);
 
+        if (pdata_is_packed(pdata)) {
+            if (open_packed(cache, cache_path, path, sdata, pdata, *pdata_lenp, flags, &tmpgerr)) {
+                if (tmpgerr) {
+                    g_propagate_prefixed_error(gerr, tmpgerr, "%s: ", funcname);
+                }
+                goto finish;
+            }
+            // Nothing local to serve; fetch it as if it had never been cached
+            free(pdata);
+            *pdatap = pdata = NULL;
+            goto fetch;
+        }
+
         // Open first with O_TRUNC off to avoid modifying the file without holding the right lock.
-        sdata->fd = open(pdata->filename, flags & ~O_TRUNC);
+        sdata->fd = open_cache_file(sdata, pdata->filename, flags & ~O_TRUNC);
         if (sdata->fd < 0 || inject_error(filecache_error_freshopen1)) {
             log_print(LOG_DYNAMIC, SECTION_FILECACHE_OPEN, "%s: < 0, %s with flags %x returns < 0: errno: %d, %s : ENOENT=%d", 
                     funcname, path, flags, errno, strerror(errno), ENOENT);
@@ -445,7 +1340,7 @@ static void get_fresh_fd(filecache_t *cache,
 
             log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "%s: released shared file lock on fd %d", funcname, sdata->fd);
 
-            sdata->modified = true;
+            mark_modified(sdata);
         }
         else {
             log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "%s: O_TRUNC not specified on fd %d:%s::%s",
@@ -456,6 +1351,12 @@ static void get_fresh_fd(filecache_t *cache,
         goto finish;
     }
 
+fetch:
+    res = CURLE_OK;
+    response_code = 500;
+    // For the request's timeout
+    expected_bytes = stat_cache_size(cache, path);
+
     for (int idx = 0; idx < num_filesystem_server_nodes && (res != CURLE_OK || response_code >= 500); idx++) {
         long elapsed_time = 0;
         CURL *session;
@@ -463,7 +1364,7 @@ static void get_fresh_fd(filecache_t *cache,
 
         // These will be -1 and [0] = '\0' on idx 0; but subsequent iterations we need to clean up from previous time
         if (response_fd >= 0) close(response_fd);
-        if (response_filename[0] != '\0') unlink(response_filename);
+        if (response_filename[0] != '\0') unlink(cache_file_abs(response_filename, abs_path));
 
         session = session_request_init(path, NULL, false);
         if (!session || inject_error(filecache_error_freshsession)) {
@@ -486,8 +1387,6 @@ static void get_fresh_fd(filecache_t *cache,
 
         // Set an ETag header capture path.
         etag[0] = '\0';
-        curl_easy_setopt(session, CURLOPT_HEADERFUNCTION, capture_etag);
-        curl_easy_setopt(session, CURLOPT_WRITEHEADER, etag);
 
         // Create a new temp file in case cURL needs to write to one.
         new_cache_file(cache_path, response_filename, &response_fd, &tmpgerr);
@@ -499,9 +1398,9 @@ static void get_fresh_fd(filecache_t *cache,
             goto finish;
         }
 
-        // Give cURL the fd and callback for handling the response body.
-        curl_easy_setopt(session, CURLOPT_WRITEDATA, &response_fd);
-        curl_easy_setopt(session, CURLOPT_WRITEFUNCTION, write_response_to_fd);
+        // Give cURL the fd and callback for handling the response body, and capture the ETag.
+        session_request_type(session, REQUEST_GET, expected_bytes);
+        session_hedgeable(session, write_response_to_fd, &response_fd, capture_etag, etag);
 
         timed_curl_easy_perform(session, &res, &response_code, &elapsed_time);
 
@@ -546,13 +1445,28 @@ static void get_fresh_fd(filecache_t *cache,
         log_print(LOG_INFO, SECTION_FILECACHE_OPEN, 
                 "%s: Updating file cache on 304 for %s : %s : timestamp: %lu : etag %s.", 
                 funcname, path, pdata->filename, pdata->last_server_update, pdata->etag);
-        filecache_pdata_set(cache, path, pdata, &tmpgerr);
+        filecache_pdata_put(cache, path, pdata, *pdata_lenp, &tmpgerr);
         if (tmpgerr) {
             g_propagate_prefixed_error(gerr, tmpgerr, "%s on 304: ", funcname);
             goto finish;
         }
 
-        sdata->fd = open(pdata->filename, flags);
+        if (pdata_is_packed(pdata)) {
+            if (!open_packed(cache, cache_path, path, sdata, pdata, *pdata_lenp, flags, &tmpgerr)) {
+                // The server's copy is the one we had, but ours has gone; get the whole thing
+                free(pdata);
+                *pdatap = pdata = NULL;
+                goto fetch;
+            }
+            if (tmpgerr) {
+                g_propagate_prefixed_error(gerr, tmpgerr, "%s on 304: ", funcname);
+                goto finish;
+            }
+            BUMP(filecache_get_304_count);
+            goto finish;
+        }
+
+        sdata->fd = open_cache_file(sdata, pdata->filename, flags);
 
         if (sdata->fd < 0 || inject_error(filecache_error_freshopen2)) {
             // If the cachefile named in pdata->filename does not exist ...
@@ -581,8 +1495,10 @@ static void get_fresh_fd(filecache_t *cache,
         unsigned long count;
         // Archive the old temp file path for unlinking after replacement.
         char old_filename[PATH_MAX];
+        struct slab_ref slab;
         const char *sz;
         bool unlink_old = false;
+        bool slab_stored = false;
 
         if (pdata == NULL) {
             *pdatap = calloc(1, sizeof(struct filecache_pdata));
@@ -592,7 +1508,7 @@ static void get_fresh_fd(filecache_t *cache,
                 goto finish;
             }
         }
-        else {
+        else if (!pdata_is_packed(pdata)) {
             strncpy(old_filename, pdata->filename, PATH_MAX);
             unlink_old = true;
         }
@@ -605,12 +1521,25 @@ static void get_fresh_fd(filecache_t *cache,
         // Point the persistent cache to the new file content.
         pdata->last_server_update = time(NULL);
         strncpy(pdata->filename, response_filename, PATH_MAX);
+        *pdata_lenp = sizeof(struct filecache_pdata);
 
         sdata->fd = response_fd;
 
-        log_print(LOG_INFO, SECTION_FILECACHE_OPEN, "%s: Updating file cache on 200 for %s : %s : timestamp: %lu.", 
-                funcname, path, pdata->filename, pdata->last_server_update);
-        filecache_pdata_set(cache, path, pdata, &tmpgerr);
+        // Small files opened read-only go inline. This handle still reads from the response file.
+        if (inline_file_size > 0 && (flags & O_ACCMODE) == O_RDONLY) {
+            store_inline(cache, path, pdatap, pdata_lenp, response_fd, &tmpgerr);
+            pdata = *pdatap;
+        }
+        if (!tmpgerr && use_slab_store && !pdata_is_inline(pdata) && (flags & O_ACCMODE) == O_RDONLY) {
+            slab_stored = store_slab(path, pdata, response_fd, &slab);
+        }
+
+        if (!tmpgerr && !pdata_is_inline(pdata)) {
+            log_print(LOG_INFO, SECTION_FILECACHE_OPEN, "%s: Updating file cache on 200 for %s : %s : timestamp: %lu.", 
+                    funcname, path, pdata->filename, pdata->last_server_update);
+            filecache_pdata_set(cache, path, pdata, &tmpgerr);
+        }
+        if (slab_stored) slabstore_append_done(&slab);
         if (tmpgerr) {
             memset(sdata, 0, sizeof(struct filecache_sdata));
             g_propagate_prefixed_error(gerr, tmpgerr, "%s on 200: ", funcname);
@@ -619,11 +1548,17 @@ static void get_fresh_fd(filecache_t *cache,
 
         close_response_fd = false;
 
+        // Nothing references the response file once it's packed; it goes away when this handle closes
+        if (pdata_is_packed(pdata)) {
+            unlink(cache_file_abs(response_filename, abs_path));
+        }
+
         // Unlink the old cache file, which the persistent cache
         // no longer references. This will cause the file to be
         // deleted once no more file descriptors reference it.
         if (unlink_old) {
-            unlink(old_filename);
+            fdpool_invalidate(old_filename);
+            unlink(cache_file_abs(old_filename, abs_path));
             log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "%s: 200: unlink old filename %s", funcname, old_filename);
         }
 
@@ -753,14 +1688,68 @@ static void get_fresh_fd(filecache_t *cache,
 finish:
     if (close_response_fd) {
         if (response_fd >= 0) close(response_fd);
-        if (response_filename[0] != '\0') unlink(response_filename);
+        if (response_filename[0] != '\0') unlink(cache_file_abs(response_filename, abs_path));
+    }
+}
+
+static struct filecache_sdata *handle_sdata(struct fuse_file_info *info) {
+    struct filecache_handle *handle = (struct filecache_handle *)info->fh;
+    return handle ? handle->sdata : NULL;
+}
+
+/* While a path is open for writing, later opens of it share that handle's state:
+ * the cache fd, write buffer, modified flag and upload. Readers then see writes
+ * which haven't been uploaded yet, and however many handles there are, the file
+ * is uploaded once, when the last one is released (or on fsync).
+ * Returns the shared state with a reference taken, or NULL if there's nothing to share.
+ */
+static struct filecache_sdata *join_open_file(const char *path, int flags) {
+    struct filecache_sdata *sdata;
+    bool writer = (flags & O_ACCMODE) != O_RDONLY;
+
+    pthread_mutex_lock(&open_files_mutex);
+    sdata = g_hash_table_lookup(open_files, path);
+    // A handle which failed a write won't be uploaded; new opens get a fresh start
+    if (sdata && (sdata->error_code || (writer && sdata->append_mode != ((flags & O_APPEND) != 0)))) {
+        sdata = NULL;
+    }
+    if (sdata) {
+        ++sdata->handles;
+        ++sdata->refs;
+    }
+    pthread_mutex_unlock(&open_files_mutex);
+
+    return sdata;
+}
+
+// Makes a newly opened writable sdata the one later opens of path share
+static void register_open_file(const char *path, struct filecache_sdata *sdata, int flags) {
+    char *key = strdup(path);
+
+    sdata->open_path = strdup(path);
+    sdata->append_mode = (flags & O_APPEND) != 0;
+    if (key == NULL || sdata->open_path == NULL) {
+        free(key);
+        return;
     }
+
+    pthread_mutex_lock(&open_files_mutex);
+    // Two writers opening at once may both find nothing to share; the first one stays registered.
+    // A create replaces whatever was there, since the old file is gone.
+    if ((flags & O_CREAT) || g_hash_table_lookup(open_files, path) == NULL) {
+        g_hash_table_replace(open_files, key, sdata);
+        key = NULL;
+    }
+    pthread_mutex_unlock(&open_files_mutex);
+    free(key);
 }
 
 // top-level open call
 void filecache_open(char *cache_path, filecache_t *cache, const char *path, struct fuse_file_info *info, bool grace, GError **gerr) {
     struct filecache_pdata *pdata = NULL;
+    size_t pdata_len = 0;
     struct filecache_sdata *sdata = NULL;
+    struct filecache_handle *handle = NULL;
     GError *tmpgerr = NULL;
     int max_retries = 2;
     int flags = info->flags;
@@ -770,6 +1759,37 @@ void filecache_open(char *cache_path, filecache_t *cache, const char *path, stru
 
     log_print(LOG_INFO, SECTION_FILECACHE_OPEN, "filecache_open: %s", path);
 
+    handle = calloc(1, sizeof(struct filecache_handle));
+    if (handle == NULL) {
+        g_set_error(gerr, system_quark(), errno, "filecache_open: Failed to calloc handle");
+        return;
+    }
+
+    // O_CREAT means a new file, which has nothing to share
+    if (!(flags & O_CREAT)) {
+        handle->sdata = join_open_file(path, flags);
+    }
+    if (handle->sdata) {
+        BUMP(filecache_open_shared);
+        info->fh = (uint64_t) handle;
+        log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "filecache_open: sharing fd %d for %s", handle->sdata->fd, path);
+        if (flags & O_TRUNC) {
+            filecache_truncate(info, 0, &tmpgerr);
+            if (tmpgerr) {
+                g_propagate_prefixed_error(gerr, tmpgerr, "filecache_open: ");
+                filecache_close(info, NULL);
+                info->fh = (uint64_t) NULL;
+                return;
+            }
+            // The other handles see the truncation too; it has to go up even if nobody writes after it
+            pthread_rwlock_rdlock(&handle->sdata->io_lock);
+            mark_modified(handle->sdata);
+            handle->sdata->append_base = -1;
+            pthread_rwlock_unlock(&handle->sdata->io_lock);
+        }
+        return;
+    }
+
     // Don't bother going to server if already in cluster saint mode
     if (use_saint_mode()) {
         use_local_copy = true;
@@ -784,6 +1804,22 @@ void filecache_open(char *cache_path, filecache_t *cache, const char *path, stru
         g_set_error(gerr, system_quark(), errno, "filecache_open: Failed to calloc sdata");
         goto fail;
     }
+    pthread_mutex_init(&sdata->wbuf_lock, NULL);
+    pthread_rwlock_init(&sdata->io_lock, NULL);
+    sdata->handles = 1;
+    sdata->refs = 1;
+    handle->sdata = sdata;
+
+    // Big files which aren't cached already are read straight from the server, so a
+    // one-off download doesn't push the working set out of the cache. There's nothing
+    // left for the loop below to do then.
+    if (passthrough_file_size > 0 && !use_local_copy &&
+            (flags & O_ACCMODE) == O_RDONLY && !(flags & (O_CREAT | O_TRUNC))) {
+        pdata = filecache_pdata_get_len(cache, path, &pdata_len, NULL);
+        if (pdata == NULL && open_passthrough(cache, path, sdata)) {
+            max_retries = 0;
+        }
+    }
 
     // NB. We call get_fresh_fd; it tries each of the servers. If they all fail
     // we try again but force it to use the local copy. This should make saint mode
@@ -798,7 +1834,7 @@ void filecache_open(char *cache_path, filecache_t *cache, const char *path, stru
         // If it is in the cache, we let get_fresh_fd handle it.
 
         if (pdata == NULL) {
-            pdata = filecache_pdata_get(cache, path, NULL);
+            pdata = filecache_pdata_get_len(cache, path, &pdata_len, NULL);
         }
 
         if ((flags & O_CREAT) || ((flags & O_TRUNC) && (pdata == NULL))) {
@@ -818,7 +1854,7 @@ void filecache_open(char *cache_path, filecache_t *cache, const char *path, stru
 
         // Get a file descriptor pointing to a guaranteed-fresh file.
         log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "filecache_open: calling get_fresh_fd on %s", path);
-        get_fresh_fd(cache, cache_path, path, sdata, &pdata, flags, use_local_copy, &tmpgerr);
+        get_fresh_fd(cache, cache_path, path, sdata, &pdata, &pdata_len, flags, use_local_copy, true, &tmpgerr);
         if (tmpgerr) {
             // If we got a network error (curl_quark is a marker) and we 
             // are using grace, try again but use the local copy
@@ -844,7 +1880,24 @@ void filecache_open(char *cache_path, filecache_t *cache, const char *path, stru
     if (flags & O_RDONLY || flags & O_RDWR) sdata->readable = 1;
     if (flags & O_WRONLY || flags & O_RDWR) sdata->writable = 1;
 
-    if (sdata->fd >= 0) {
+    // Without a buffer, writes go straight to the cache file
+    if (write_buffer_size > 0 && sdata->writable) {
+        sdata->wbuf = malloc(write_buffer_size);
+    }
+
+    // A writer starting from what the server has can later send just what it appends,
+    // and a write queued in saint mode only replaces that version
+    sdata->append_base = -1;
+    if (sdata->writable && sdata->fd >= 0 && pdata && pdata->etag[0] != '\0' && pdata->last_server_update != 0) {
+        struct stat st;
+        strncpy(sdata->base_etag, pdata->etag, ETAG_MAX);
+        sdata->base_etag[ETAG_MAX] = '\0';
+        if (append_uploads && !(flags & (O_TRUNC | O_CREAT)) && fstat(sdata->fd, &st) == 0) {
+            sdata->append_base = st.st_size;
+        }
+    }
+
+    if (sdata->fd >= 0 || sdata->packed || sdata->stream) {
         if (pdata) {
             log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN,
             "filecache_open: Setting fd to session data structure with fd %d for %s :: %s:%lu.",
@@ -854,7 +1907,11 @@ void filecache_open(char *cache_path, filecache_t *cache, const char *path, stru
             log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN,
             "filecache_open: Setting fd to session data structure with fd %d for %s :: (no pdata).", sdata->fd, path);
         }
-        info->fh = (uint64_t) sdata;
+        // Packed and passthrough opens are read-only, and have no cache fd to share
+        if (sdata->writable && sdata->fd >= 0) {
+            register_open_file(path, sdata, flags);
+        }
+        info->fh = (uint64_t) handle;
         goto finish;
     }
 
@@ -862,15 +1919,83 @@ fail:
     log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "filecache_open: No valid fd set for path %s. Setting fh structure to NULL.", path);
     info->fh = (uint64_t) NULL;
 
+    if (sdata) {
+        free(sdata->inline_data);
+        free(sdata->wbuf);
+        if (sdata->pooled) fdpool_release(sdata->fd);
+        pthread_rwlock_destroy(&sdata->io_lock);
+        pthread_mutex_destroy(&sdata->wbuf_lock);
+    }
     free(sdata);
+    free(handle);
 
 finish:
     free(pdata);
 }
 
+static void set_error(struct filecache_sdata *sdata, int error_code) {
+    if (sdata->error_code == 0) {
+        sdata->error_code = error_code;
+        log_print(LOG_DEBUG, SECTION_FILECACHE_IO, "set_error: %d.", error_code);
+    }
+    else {
+        log_print(LOG_DEBUG, SECTION_FILECACHE_IO, "set_error: not changing %d to %d.", sdata->error_code, error_code);
+    }
+}
+
+/* Write-combining: runs of small adjacent writes are gathered in wbuf and written to the
+ * cache file in one pwrite, under one shared lock. Anything which needs the cache file to
+ * be current (overlapping reads, truncation, sync and close, anyone asking for the fd)
+ * flushes it first. A failed flush sets the handle's error, like a failed write would.
+ * Called with wbuf_lock held, and io_lock held either way.
+ */
+static void flush_write_buffer(struct filecache_sdata *sdata, GError **gerr) {
+    ssize_t bytes_written;
+
+    if (sdata->wbuf_len == 0) return;
+
+    if (flock(sdata->fd, LOCK_SH)) {
+        set_error(sdata, errno);
+        g_set_error(gerr, system_quark(), errno, "flush_write_buffer: error acquiring shared file lock");
+        return;
+    }
+
+    bytes_written = ioengine_pwrite(sdata->fd, sdata->wbuf, sdata->wbuf_len, sdata->wbuf_offset);
+    if (ioengine_uring()) BUMP(filecache_uring_io);
+    if (bytes_written != (ssize_t) sdata->wbuf_len) {
+        int error_code = (bytes_written < 0) ? errno : EIO;
+        set_error(sdata, error_code);
+        g_set_error(gerr, system_quark(), error_code, "flush_write_buffer: pwrite failed");
+        log_print(LOG_INFO, SECTION_FILECACHE_IO, "flush_write_buffer: %ld::%d %lu %ld :: %s",
+            bytes_written, sdata->fd, sdata->wbuf_len, sdata->wbuf_offset, strerror(error_code));
+    }
+    else {
+        log_print(LOG_DEBUG, SECTION_FILECACHE_IO, "flush_write_buffer: wrote %lu bytes at %ld on fd %d",
+            sdata->wbuf_len, sdata->wbuf_offset, sdata->fd);
+    }
+    BUMP(filecache_wbuf_flush);
+
+    if (flock(sdata->fd, LOCK_UN)) {
+        log_print(LOG_CRIT, SECTION_FILECACHE_FLOCK, "flush_write_buffer: error releasing shared file lock :: %s", strerror(errno));
+    }
+
+    // Whatever happened, the data is gone; the error goes along with the handle
+    sdata->wbuf_len = 0;
+}
+
+static void flush_writes(struct filecache_sdata *sdata, GError **gerr) {
+    if (sdata->wbuf == NULL) return;
+
+    pthread_rwlock_rdlock(&sdata->io_lock);
+    pthread_mutex_lock(&sdata->wbuf_lock);
+    flush_write_buffer(sdata, gerr);
+    pthread_mutex_unlock(&sdata->wbuf_lock);
+    pthread_rwlock_unlock(&sdata->io_lock);
+}
+
 // top-level read call
 ssize_t filecache_read(struct fuse_file_info *info, char *buf, size_t size, off_t offset, GError **gerr) {
-    struct filecache_sdata *sdata = (struct filecache_sdata *)info->fh;
+    struct filecache_sdata *sdata = handle_sdata(info);
     ssize_t bytes_read;
 
     BUMP(filecache_read);
@@ -882,7 +2007,41 @@ ssize_t filecache_read(struct fuse_file_info *info, char *buf, size_t size, off_
 
     log_print(LOG_INFO, SECTION_FILECACHE_IO, "filecache_read: fd=%d", sdata->fd);
 
-    bytes_read = pread(sdata->fd, buf, size, offset);
+    if (sdata->stream) {
+        return passthrough_read(sdata->stream, buf, size, offset, gerr);
+    }
+
+    // Buffered writes this read would see have to reach the cache file first
+    if (sdata->wbuf) {
+        GError *tmpgerr = NULL;
+
+        pthread_mutex_lock(&sdata->wbuf_lock);
+        if (sdata->wbuf_len > 0 && offset < (off_t) (sdata->wbuf_offset + sdata->wbuf_len) &&
+                (off_t) (offset + size) > sdata->wbuf_offset) {
+            flush_write_buffer(sdata, &tmpgerr);
+        }
+        pthread_mutex_unlock(&sdata->wbuf_lock);
+        if (tmpgerr) {
+            g_propagate_prefixed_error(gerr, tmpgerr, "filecache_read: ");
+            return -1;
+        }
+    }
+
+    if (sdata->packed) {
+        if (offset < 0 || (size_t) offset >= sdata->packed_size) return 0;
+        bytes_read = sdata->packed_size - offset;
+        if ((size_t) bytes_read > size) bytes_read = size;
+        if (sdata->inline_data) {
+            memcpy(buf, sdata->inline_data + offset, bytes_read);
+            return bytes_read;
+        }
+        // Slab entries: read our slice of the slab
+        size = bytes_read;
+        offset += sdata->packed_offset;
+    }
+
+    bytes_read = ioengine_pread(sdata->fd, buf, size, offset);
+    if (ioengine_uring()) BUMP(filecache_uring_io);
     if (bytes_read < 0 || inject_error(filecache_error_readread)) {
         g_set_error(gerr, system_quark(), errno, "filecache_read: pread failed: ");
         log_print(LOG_INFO, SECTION_FILECACHE_IO, "filecache_read: %ld %d %s %lu %ld::%s", bytes_read, sdata->fd, buf, size, offset, g_strerror(errno));
@@ -894,19 +2053,9 @@ ssize_t filecache_read(struct fuse_file_info *info, char *buf, size_t size, off_
     return bytes_read;
 }
 
-static void set_error(struct filecache_sdata *sdata, int error_code) {
-    if (sdata->error_code == 0) {
-        sdata->error_code = error_code;
-        log_print(LOG_DEBUG, SECTION_FILECACHE_IO, "set_error: %d.", error_code);
-    }
-    else {
-        log_print(LOG_DEBUG, SECTION_FILECACHE_IO, "set_error: not changing %d to %d.", sdata->error_code, error_code);
-    }
-}
-
 // top-level write call
 ssize_t filecache_write(struct fuse_file_info *info, const char *buf, size_t size, off_t offset, GError **gerr) {
-    struct filecache_sdata *sdata = (struct filecache_sdata *)info->fh;
+    struct filecache_sdata *sdata = handle_sdata(info);
     ssize_t bytes_written;
 
     BUMP(filecache_write);
@@ -923,72 +2072,541 @@ ssize_t filecache_write(struct fuse_file_info *info, const char *buf, size_t siz
         return -1;
     }
 
+    if (sdata->wbuf && size <= WRITE_COMBINE_MAX && size < write_buffer_size) {
+        GError *tmpgerr = NULL;
+
+        pthread_rwlock_rdlock(&sdata->io_lock);
+        pthread_mutex_lock(&sdata->wbuf_lock);
+        // Unless this write carries on from the buffered ones, and fits, start a new run
+        if (sdata->wbuf_len > 0 && (offset != (off_t) (sdata->wbuf_offset + sdata->wbuf_len) ||
+                sdata->wbuf_len + size > write_buffer_size)) {
+            flush_write_buffer(sdata, &tmpgerr);
+        }
+        if (!tmpgerr) {
+            if (sdata->wbuf_len == 0) sdata->wbuf_offset = offset;
+            memcpy(sdata->wbuf + sdata->wbuf_len, buf, size);
+            sdata->wbuf_len += size;
+            mark_modified(sdata);
+            if (offset < sdata->append_base) sdata->append_base = -1;
+            BUMP(filecache_wbuf_combine);
+            if (sdata->wbuf_len == write_buffer_size) {
+                flush_write_buffer(sdata, &tmpgerr);
+            }
+        }
+        pthread_mutex_unlock(&sdata->wbuf_lock);
+        pthread_rwlock_unlock(&sdata->io_lock);
+
+        if (tmpgerr) {
+            g_propagate_prefixed_error(gerr, tmpgerr, "filecache_write: ");
+            return -1;
+        }
+        log_print(LOG_INFO, SECTION_FILECACHE_IO, "filecache_write: buffered %lu bytes on fd %d", size, sdata->fd);
+        return size;
+    }
+
+    // Bigger writes go straight to the cache file, after any buffered ones so they land in order
+    if (sdata->wbuf) {
+        GError *tmpgerr = NULL;
+        flush_writes(sdata, &tmpgerr);
+        if (tmpgerr) {
+            g_propagate_prefixed_error(gerr, tmpgerr, "filecache_write: ");
+            return -1;
+        }
+    }
+
     // Don't write to a file while it is being PUT
+    pthread_rwlock_rdlock(&sdata->io_lock);
     log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_write: acquiring shared file lock on fd %d", sdata->fd);
     if (flock(sdata->fd, LOCK_SH) || inject_error(filecache_error_writeflock1)) {
         g_set_error(gerr, system_quark(), errno, "filecache_write: error acquiring shared file lock");
+        pthread_rwlock_unlock(&sdata->io_lock);
         return -1;
     }
     log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_write: acquired shared file lock on fd %d", sdata->fd);
 
-    bytes_written = pwrite(sdata->fd, buf, size, offset);
+    bytes_written = ioengine_pwrite(sdata->fd, buf, size, offset);
+    if (ioengine_uring()) BUMP(filecache_uring_io);
+
+    // If pwrite fails, file goes to forensic haven
+    if (bytes_written < 0 || inject_error(filecache_error_writewrite)) {
+        set_error(sdata, errno);
+        g_set_error(gerr, system_quark(), errno, "filecache_write: pwrite failed");
+        log_print(LOG_INFO, SECTION_FILECACHE_IO, "filecache_write: %ld::%d %lu %ld :: %s", bytes_written, sdata->fd, size, offset, strerror(errno));
+    } else {
+        mark_modified(sdata);
+        // Anything but an append means the next upload has to be the whole file
+        if (offset < sdata->append_base) sdata->append_base = -1;
+        log_print(LOG_INFO, SECTION_FILECACHE_IO, "filecache_write: wrote %d bytes on fd %d", bytes_written, sdata->fd);
+    }
+
+    log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_write: releasing shared file lock on fd %d", sdata->fd);
+    if (flock(sdata->fd, LOCK_UN) || inject_error(filecache_error_writeflock2)) {
+        g_set_error(gerr, system_quark(), errno, "filecache_write: error releasing shared file lock");
+        // Since we've already written (or not), just fall through and return bytes_written
+    }
+    pthread_rwlock_unlock(&sdata->io_lock);
+    log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_write: released shared file lock on fd %d", sdata->fd);
+
+    return bytes_written;
+}
+
+static void stat_published(struct filecache_sdata *sdata);
+
+/* Stops later opens from joining this handle's sdata. Returns true if it was the last
+ * handle on it, which is the one whose release should upload the file.
+ * Safe to call more than once; filecache_close calls it too.
+ */
+bool filecache_release(struct fuse_file_info *info) {
+    struct filecache_handle *handle = (struct filecache_handle *)info->fh;
+    struct filecache_sdata *sdata;
+    bool last;
+
+    if (handle == NULL) return true;
+    sdata = handle->sdata;
+
+    pthread_mutex_lock(&open_files_mutex);
+    if (!handle->released) {
+        handle->released = true;
+        --sdata->handles;
+    }
+    last = (sdata->handles == 0);
+    if (last && sdata->open_path && g_hash_table_lookup(open_files, sdata->open_path) == sdata) {
+        g_hash_table_remove(open_files, sdata->open_path);
+    }
+    pthread_mutex_unlock(&open_files_mutex);
+
+    return last;
+}
+
+// True if other open handles share this one's state
+bool filecache_shared(struct fuse_file_info *info) {
+    struct filecache_sdata *sdata = handle_sdata(info);
+    bool shared;
+
+    if (sdata == NULL) return false;
+
+    pthread_mutex_lock(&open_files_mutex);
+    shared = (sdata->handles > 1);
+    pthread_mutex_unlock(&open_files_mutex);
+
+    return shared;
+}
+
+static void close_sdata(struct filecache_sdata *sdata, GError **gerr) {
+    log_print(LOG_INFO, SECTION_FILECACHE_FILE, "filecache_close: fd (%d).", sdata->fd);
+
+    // If the buffered writes can't be written now, it's too late to tell anyone but the log
+    if (sdata->wbuf) {
+        GError *tmpgerr = NULL;
+        flush_writes(sdata, &tmpgerr);
+        if (tmpgerr) {
+            log_print(LOG_ERR, SECTION_FILECACHE_FILE, "filecache_close: %s", tmpgerr->message);
+            g_clear_error(&tmpgerr);
+        }
+    }
+
+    if (sdata->packed && sdata->inline_data) {
+        log_print(LOG_DEBUG, SECTION_FILECACHE_FILE, "filecache_close: inline, no fd");
+    }
+    else if (sdata->stream) {
+        log_print(LOG_DEBUG, SECTION_FILECACHE_FILE, "filecache_close: passthrough, no fd");
+    }
+    else if (sdata->pooled) {
+        fdpool_release(sdata->fd);
+        log_print(LOG_DEBUG, SECTION_FILECACHE_FILE, "filecache_close: returned fd (%d) to the pool.", sdata->fd);
+    }
+    else if (sdata->fd <= 0 || inject_error(filecache_error_closefd))  {
+        g_set_error(gerr, system_quark(), EBADF, "filecache_close doesn't have legitimate file descriptor");
+    }
+    else {
+        if (close(sdata->fd) < 0 || inject_error(filecache_error_closeclose)) {
+            g_set_error(gerr, system_quark(), errno, "filecache_close: close failed on fd (%d)", sdata->fd);
+        }
+        else {
+            log_print(LOG_DEBUG, SECTION_FILECACHE_FILE, "filecache_close: closed fd (%d).", sdata->fd);
+        }
+    }
+
+    stat_published(sdata);
+
+    free(sdata->inline_data);
+    free(sdata->wbuf);
+    free(sdata->open_path);
+    pthread_mutex_destroy(&sdata->wbuf_lock);
+    pthread_rwlock_destroy(&sdata->io_lock);
+    passthrough_free(sdata->stream);
+    free(sdata);
+}
+
+// close the file; the shared state goes with the last handle on it
+void filecache_close(struct fuse_file_info *info, GError **gerr) {
+    struct filecache_handle *handle = (struct filecache_handle *)info->fh;
+    struct filecache_sdata *sdata = handle_sdata(info);
+    unsigned refs;
+
+    BUMP(filecache_close);
+
+    if (sdata == NULL || inject_error(filecache_error_closesdata)) {
+        g_set_error(gerr, filecache_quark(), E_FC_SDATANULL, "filecache_close: sdata is NULL");
+        return;
+    }
+
+    filecache_release(info);
+    pthread_mutex_lock(&open_files_mutex);
+    refs = --sdata->refs;
+    pthread_mutex_unlock(&open_files_mutex);
+    free(handle);
+    info->fh = (uint64_t) NULL;
+
+    if (refs > 0) {
+        log_print(LOG_DEBUG, SECTION_FILECACHE_FILE, "filecache_close: fd (%d) still has %u handles", sdata->fd, refs);
+        return;
+    }
+
+    close_sdata(sdata, gerr);
+}
+
+// Does the conditional GET that a stale open skipped. On a 200 the cache entry is
+// replaced as for any other open, so the next open gets the new copy.
+static void revalidate(filecache_t *cache, const char *path) {
+    struct filecache_sdata *sdata;
+    struct filecache_pdata *pdata;
+    size_t pdata_len = 0;
+    char old_etag[ETAG_MAX + 1];
+    GError *tmpgerr = NULL;
+
+    // Leave the stale copy be until the cluster is back
+    if (use_saint_mode()) return;
+
+    pdata = filecache_pdata_get_len(cache, path, &pdata_len, NULL);
+    // The file was deleted in the meantime
+    if (pdata == NULL) return;
+    strncpy(old_etag, pdata->etag, ETAG_MAX + 1);
+
+    sdata = calloc(1, sizeof(struct filecache_sdata));
+    if (sdata == NULL) {
+        free(pdata);
+        return;
+    }
+    pthread_mutex_init(&sdata->wbuf_lock, NULL);
+    pthread_rwlock_init(&sdata->io_lock, NULL);
+    sdata->fd = -1;
+
+    get_fresh_fd(cache, cache_root, path, sdata, &pdata, &pdata_len, O_RDONLY, false, false, &tmpgerr);
+    if (tmpgerr) {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_OPEN, "revalidate: %s: %s", path, tmpgerr->message);
+        g_clear_error(&tmpgerr);
+        free(sdata->inline_data);
+        if (sdata->pooled) fdpool_release(sdata->fd);
+        pthread_mutex_destroy(&sdata->wbuf_lock);
+        pthread_rwlock_destroy(&sdata->io_lock);
+        free(sdata);
+    }
+    else {
+        BUMP(filecache_revalidate);
+        if (pdata && strcmp(old_etag, pdata->etag) != 0) {
+            log_print(LOG_INFO, SECTION_FILECACHE_OPEN, "revalidate: %s changed on the server; etag %s -> %s", path, old_etag, pdata->etag);
+        }
+        // Hand back what get_fresh_fd opened
+        close_sdata(sdata, &tmpgerr);
+        if (tmpgerr) g_clear_error(&tmpgerr);
+    }
+    free(pdata);
+}
+
+static void *revalidate_worker(__unused void *ptr) {
+    while (true) {
+        filecache_t *cache;
+        char *path = NULL;
+
+        pthread_mutex_lock(&revalidate_mutex);
+        while (path == NULL) {
+            GHashTableIter iter;
+            gpointer key;
+            gpointer value;
+
+            g_hash_table_iter_init(&iter, revalidate_paths);
+            while (g_hash_table_iter_next(&iter, &key, &value)) {
+                if (GPOINTER_TO_INT(value) == REVALIDATE_QUEUED) {
+                    path = key;
+                    break;
+                }
+            }
+            if (path == NULL) {
+                pthread_cond_wait(&revalidate_cond, &revalidate_mutex);
+            }
+        }
+        // Keep the path in the table while we work, so it isn't queued again
+        g_hash_table_steal(revalidate_paths, path);
+        g_hash_table_insert(revalidate_paths, path, GINT_TO_POINTER(REVALIDATE_RUNNING));
+        cache = revalidate_cache;
+        pthread_mutex_unlock(&revalidate_mutex);
+
+        log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "revalidate_worker: %s", path);
+        revalidate(cache, path);
+
+        pthread_mutex_lock(&revalidate_mutex);
+        g_hash_table_remove(revalidate_paths, path);
+        pthread_mutex_unlock(&revalidate_mutex);
+    }
+    return NULL;
+}
+
+// Drop the exclusive file lock taken for a PUT, and record how much CPU the upload cost this thread.
+// Handles sharing the fd aren't kept out by it; see filecache_sync for what they wait on.
+static void release_put_lock(const char *funcname, const char *path, int fd,
+        const struct timespec *lock_time, const struct timespec *cpu_start_time, off_t size, GError **gerr) {
+    struct timespec now;
+    struct timespec cpu_now;
+    long lock_held;
+    long cpu_used;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_now);
+
+    log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "%s: releasing exclusive file lock on fd %d", funcname, fd);
+    if (flock(fd, LOCK_UN) || inject_error(filecache_error_etagflock2)) {
+        g_set_error(gerr, system_quark(), errno, "%s: error releasing exclusive file lock", funcname);
+    }
+    else {
+        log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "%s: released exclusive file lock on fd %d", funcname, fd);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    // Lock hold time in ms, like the other latencies; CPU time in us, since small PUTs take well under a ms
+    lock_held = ((now.tv_sec - lock_time->tv_sec) * 1000) + ((now.tv_nsec - lock_time->tv_nsec) / (1000 * 1000));
+    cpu_used = ((cpu_now.tv_sec - cpu_start_time->tv_sec) * 1000 * 1000) + ((cpu_now.tv_nsec - cpu_start_time->tv_nsec) / 1000);
+
+    TIMING(filecache_put_cpu_timing, cpu_used);
+    stats_timer("put-cpu-usec", cpu_used);
+
+    log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "%s: held exclusive lock %ld ms, used %ld us cpu, for %s (%lu bytes)",
+        funcname, lock_held, cpu_used, path, size);
+}
+
+// Drop io_lock after filecache_sync held it exclusively, adding how long it was held to *held_ms
+static void unlock_io(struct filecache_sdata *sdata, const struct timespec *lock_time, long *held_ms) {
+    struct timespec now;
+
+    pthread_rwlock_unlock(&sdata->io_lock);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    *held_ms += ((now.tv_sec - lock_time->tv_sec) * 1000) + ((now.tv_nsec - lock_time->tv_nsec) / (1000 * 1000));
+}
+
+/* Chunked uploads. Large files go up in CHUNKED_UPLOAD_CHUNK pieces to a server-side
+ * staging area named by an upload id, so an upload cut off by a dropped connection,
+ * a timeout or a node switch picks up where it left off instead of starting over.
+ * All requests are on the file's own URL:
+ *   HEAD <path>?chunked-upload=<id>               Upload-Offset: bytes received so far (404: none)
+ *   PUT  <path>?chunked-upload=<id>&offset=<n>    the chunk at n; must start at the Upload-Offset
+ *   POST <path>?chunked-upload=<id>&commit=<size> replace <path> with the staged bytes; returns the ETag
+ * A server without support answers the first request with 405 or 501, and we go back to plain PUTs.
+ * The id is derived from the cache file, its size and mtime, and a version token for the
+ * contents: the handle's version (see mark_modified) when a handle syncs, the write queue's
+ * sequence number on replay. A retry of the same version resumes; a file rewritten in place,
+ * even to the same size within the same mtime tick, starts a new upload instead of landing
+ * on top of the chunks staged for the old one. tests/chunked-upload-server.py emulates this.
+ */
+#define CHUNKED_UPLOAD_CHUNK (8 * 1024 * 1024)
+
+static size_t capture_upload_offset(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    size_t real_size = size * nmemb;
+    off_t *offset = (off_t *) userdata;
+    long long value;
+
+    if (strncasecmp((char *) ptr, "Upload-Offset:", 14) == 0 && sscanf((char *) ptr + 14, "%lld", &value) == 1) {
+        *offset = value;
+    }
+    return real_size;
+}
+
+// One request of a chunked or append upload; if fd is set, the body is [start, end) of it.
+// Takes over slist, any extra request headers.
+static void upload_request(const char *path, const char *query, const char *method, struct curl_slist *slist,
+        fd_t fd, off_t start, off_t end, size_t (*header_function)(void *, size_t, size_t, void *), void *header_data,
+        int idx, CURLcode *res, long *response_code) {
+    static const char *funcname = "upload_request";
+    struct put_source source = {fd, start, start, end};
+    long elapsed_time = 0;
+    CURL *session;
+
+    session = session_request_init(path, query, false);
+    if (!session || inject_error(filecache_error_freshsession)) {
+        log_print(LOG_WARNING, SECTION_FILECACHE_COMM, "%s: Failed session_request_init on %s %s", funcname, method, path);
+        try_release_request_outstanding();
+        if (slist) curl_slist_free_all(slist);
+        *res = CURLE_FAILED_INIT;
+        return;
+    }
+
+    if (strcmp(method, "HEAD") == 0) {
+        curl_easy_setopt(session, CURLOPT_NOBODY, 1L);
+    }
+    else {
+        curl_easy_setopt(session, CURLOPT_CUSTOMREQUEST, method);
+    }
+    if (fd >= 0) {
+        session_request_type(session, REQUEST_PUT, end - start);
+        curl_easy_setopt(session, CURLOPT_UPLOAD, 1L);
+        curl_easy_setopt(session, CURLOPT_INFILESIZE_LARGE, (curl_off_t) (end - start));
+        curl_easy_setopt(session, CURLOPT_READFUNCTION, read_request_from_fd);
+        curl_easy_setopt(session, CURLOPT_READDATA, (void *) &source);
+        curl_easy_setopt(session, CURLOPT_SEEKFUNCTION, seek_request_fd);
+        curl_easy_setopt(session, CURLOPT_SEEKDATA, (void *) &source);
+    }
+    else if (strcmp(method, "POST") == 0) {
+        curl_easy_setopt(session, CURLOPT_POSTFIELDSIZE, 0L);
+        curl_easy_setopt(session, CURLOPT_POSTFIELDS, "");
+    }
+
+    slist = enhanced_logging(slist, LOG_DYNAMIC, SECTION_FILECACHE_COMM, "%s: %s %s?%s", funcname, method, path, query ? query : "");
+    if (slist) curl_easy_setopt(session, CURLOPT_HTTPHEADER, slist);
+
+    curl_easy_setopt(session, CURLOPT_HEADERFUNCTION, header_function);
+    curl_easy_setopt(session, CURLOPT_WRITEHEADER, header_data);
+
+    timed_curl_easy_perform(session, res, response_code, &elapsed_time);
+
+    if (slist) curl_slist_free_all(slist);
+
+    process_status(funcname, session, *res, *response_code, elapsed_time, idx, path, false);
+}
+
+/* Upload st->st_size bytes of fd to path in chunks, then commit, leaving the commit's
+ * outcome in res, response_code and etag for put_return_etag to handle like a PUT's.
+ * If if_match is not NULL, only the commit carries it.
+ * Returns false if the server doesn't do chunked uploads, in which case nothing was sent.
+ */
+static bool put_chunked(const char *path, fd_t fd, const struct stat *st, const char *version, const char *if_match,
+        char *etag, CURLcode *res, long *response_code) {
+    static const char *funcname = "put_chunked";
+    char upload_id[128];
+    char query[256];
+
+    snprintf(upload_id, sizeof(upload_id), "%08x%lx%lx%lx%09lx-%s", g_str_hash(path), (unsigned long) st->st_ino,
+        (unsigned long) st->st_size, (unsigned long) st->st_mtim.tv_sec, (unsigned long) st->st_mtim.tv_nsec, version);
+
+    *res = CURLE_OK;
+    *response_code = 500; // seed it as bad so we can enter the loop
+
+    // Each pass resumes from whatever the server already has
+    for (int idx = 0; idx < num_filesystem_server_nodes && (*res != CURLE_OK || *response_code >= 500); idx++) {
+        struct curl_slist *slist;
+        off_t offset = 0;
+
+        snprintf(query, sizeof(query), "chunked-upload=%s", upload_id);
+        upload_request(path, query, "HEAD", NULL, -1, 0, 0, capture_upload_offset, &offset, idx, res, response_code);
+        if (*res != CURLE_OK || *response_code >= 500) continue;
+        if (*response_code == 405 || *response_code == 501) {
+            log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "%s: server doesn't do chunked uploads (%ld); using PUT", funcname, *response_code);
+            chunked_upload_size = 0;
+            return false;
+        }
+        if (*response_code == 404 || offset < 0 || offset > st->st_size) offset = 0;
+        if (offset > 0) {
+            BUMP(filecache_chunked_resume);
+            log_print(LOG_INFO, SECTION_FILECACHE_COMM, "%s: resuming %s at %lu of %lu", funcname, path, offset, st->st_size);
+        }
 
-    // If pwrite fails, file goes to forensic haven
-    if (bytes_written < 0 || inject_error(filecache_error_writewrite)) {
-        set_error(sdata, errno);
-        g_set_error(gerr, system_quark(), errno, "filecache_write: pwrite failed");
-        log_print(LOG_INFO, SECTION_FILECACHE_IO, "filecache_write: %ld::%d %lu %ld :: %s", bytes_written, sdata->fd, size, offset, strerror(errno));
-    } else {
-        sdata->modified = true;
-        log_print(LOG_INFO, SECTION_FILECACHE_IO, "filecache_write: wrote %d bytes on fd %d", bytes_written, sdata->fd);
-    }
+        while (offset < st->st_size) {
+            off_t end = offset + CHUNKED_UPLOAD_CHUNK;
+            if (end > st->st_size) end = st->st_size;
 
-    log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_write: releasing shared file lock on fd %d", sdata->fd);
-    if (flock(sdata->fd, LOCK_UN) || inject_error(filecache_error_writeflock2)) {
-        g_set_error(gerr, system_quark(), errno, "filecache_write: error releasing shared file lock");
-        // Since we've already written (or not), just fall through and return bytes_written
+            snprintf(query, sizeof(query), "chunked-upload=%s&offset=%lld", upload_id, (long long) offset);
+            upload_request(path, query, "PUT", NULL, fd, offset, end, capture_etag, etag, idx, res, response_code);
+            if (*res != CURLE_OK || *response_code >= 300) break;
+            BUMP(filecache_chunked_chunk);
+            offset = end;
+        }
+        // 5xx and network errors go round again; anything else is the answer
+        if (*res != CURLE_OK || *response_code >= 300) continue;
+
+        snprintf(query, sizeof(query), "chunked-upload=%s&commit=%lld", upload_id, (long long) st->st_size);
+        slist = NULL;
+        if (if_match) {
+            char *header = NULL;
+            asprintf(&header, "If-Match: %s", if_match);
+            slist = curl_slist_append(slist, header);
+            free(header);
+        }
+        etag[0] = '\0';
+        upload_request(path, query, "POST", slist, -1, 0, 0, capture_etag, etag, idx, res, response_code);
     }
-    log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_write: released shared file lock on fd %d", sdata->fd);
 
-    return bytes_written;
+    return true;
 }
 
-// close the file
-void filecache_close(struct fuse_file_info *info, GError **gerr) {
-    struct filecache_sdata *sdata = (struct filecache_sdata *)info->fh;
+/* Append uploads. If a file has only grown since it last matched the server, we send
+ * just the new tail:
+ *   PATCH <path>   Content-Range: bytes <base>-<size - 1>/<size>   If-Match: <etag at base>
+ * The server appends the body and returns the new ETag. Any 4xx (the file changed under
+ * us, or the server doesn't like the range) means a full PUT instead; 405 and 501 mean
+ * the server can't do this at all, and we stop trying.
+ * Returns false if nothing was appended, and res/response_code are then meaningless.
+ */
+static bool put_append(const char *path, fd_t fd, const struct stat *st, off_t base, const char *base_etag,
+        char *etag, CURLcode *res, long *response_code) {
+    static const char *funcname = "put_append";
 
-    BUMP(filecache_close);
+    *res = CURLE_OK;
+    *response_code = 500; // seed it as bad so we can enter the loop
 
-    if (sdata == NULL || inject_error(filecache_error_closesdata)) {
-        g_set_error(gerr, filecache_quark(), E_FC_SDATANULL, "filecache_close: sdata is NULL");
-        return;
-    }
+    for (int idx = 0; idx < num_filesystem_server_nodes && (*res != CURLE_OK || *response_code >= 500); idx++) {
+        struct curl_slist *slist = NULL;
+        char *header = NULL;
 
-    log_print(LOG_INFO, SECTION_FILECACHE_FILE, "filecache_close: fd (%d).", sdata->fd);
+        asprintf(&header, "Content-Range: bytes %lld-%lld/%lld", (long long) base, (long long) st->st_size - 1,
+            (long long) st->st_size);
+        slist = curl_slist_append(slist, header);
+        free(header);
+        asprintf(&header, "If-Match: %s", base_etag);
+        slist = curl_slist_append(slist, header);
+        free(header);
 
-    if (sdata->fd <= 0 || inject_error(filecache_error_closefd))  {
-        g_set_error(gerr, system_quark(), EBADF, "filecache_close doesn't have legitimate file descriptor");
+        etag[0] = '\0';
+        upload_request(path, NULL, "PATCH", slist, fd, base, st->st_size, capture_etag, etag, idx, res, response_code);
     }
-    else {
-        if (close(sdata->fd) < 0 || inject_error(filecache_error_closeclose)) {
-            g_set_error(gerr, system_quark(), errno, "filecache_close: close failed on fd (%d)", sdata->fd);
-        }
-        else {
-            log_print(LOG_DEBUG, SECTION_FILECACHE_FILE, "filecache_close: closed fd (%d).", sdata->fd);
+
+    // Network trouble and 5xx are for put_return_etag to deal with as usual
+    if (*res != CURLE_OK || *response_code >= 500 || (*response_code >= 200 && *response_code < 300)) {
+        if (*res == CURLE_OK && *response_code < 300) {
+            BUMP(filecache_append_put);
+            log_print(LOG_INFO, SECTION_FILECACHE_COMM, "%s: appended %lu bytes to %s", funcname, st->st_size - base, path);
         }
+        return true;
     }
 
-    free(sdata);
-
-    return;
+    if (*response_code == 405 || *response_code == 501) {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "%s: server doesn't do append uploads (%ld); using PUT", funcname, *response_code);
+        append_uploads = false;
+    }
+    else {
+        log_print(LOG_INFO, SECTION_FILECACHE_COMM, "%s: append refused (%ld) on %s; using PUT", funcname, *response_code, path);
+    }
+    BUMP(filecache_append_fallback);
+    return false;
 }
 
 /* PUT's from fd to URI */
 /* Our modification to include etag support on put */
-static void put_return_etag(const char *path, int fd, char *etag, GError **gerr) {
+/* If append_base is not NULL and *append_base is not -1, the file matched base_etag on the
+ * server when it was *append_base bytes long, and has only been appended to since.
+ * On success *append_base is set to the size uploaded.
+ * version names these contents for chunked uploads; see put_chunked.
+ * If if_match is not NULL, the server only takes the upload if it still has that ETag;
+ * if it has something else, the error is E_FC_CONFLICT.
+ */
+static void put_return_etag(const char *path, int fd, char *etag, off_t *append_base, const char *base_etag,
+        const char *version, const char *if_match, GError **gerr) {
     static const char *funcname = "put_return_etag";
-    struct stat st;
+    GError *tmpgerr = NULL;
+    struct stat st = {0};
     struct timespec start_time;
+    struct timespec lock_time;
+    struct timespec cpu_start_time;
+    struct put_source source;
+    bool locked = false;
+    bool chunked = false;
+    bool appended = false;
     long response_code = 500; // seed it as bad so we can enter the loop
     CURLcode res = CURLE_OK;
     // Not to exceed time for operation, else it's an error. Allow large files a longer time
@@ -1008,6 +2626,9 @@ static void put_return_etag(const char *path, int fd, char *etag, GError **gerr)
         return;
     }
     log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "%s: acquired exclusive file lock on fd %d", funcname, fd);
+    locked = true;
+    clock_gettime(CLOCK_MONOTONIC, &lock_time);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start_time);
 
     assert(etag);
 
@@ -1018,24 +2639,35 @@ static void put_return_etag(const char *path, int fd, char *etag, GError **gerr)
 
     log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "%s: file size %d", funcname, st.st_size);
 
+    if (append_uploads && append_base && *append_base >= 0 && st.st_size > *append_base && base_etag[0] != '\0') {
+        appended = put_append(path, fd, &st, *append_base, base_etag, etag, &res, &response_code);
+        if (!appended) {
+            res = CURLE_OK;
+            response_code = 500;
+        }
+    }
+
+    if (!appended && chunked_upload_size > 0 && st.st_size >= chunked_upload_size) {
+        chunked = put_chunked(path, fd, &st, version, if_match, etag, &res, &response_code);
+        if (!chunked) {
+            res = CURLE_OK;
+            response_code = 500;
+        }
+    }
+
     // If we're in saint mode, skip the PUT altogether
     for (int idx = 0;
-         idx < num_filesystem_server_nodes && (res != CURLE_OK || response_code >= 500);
+         !chunked && !appended && idx < num_filesystem_server_nodes && (res != CURLE_OK || response_code >= 500);
          idx++) {
         long elapsed_time = 0;
         CURL *session;
         struct curl_slist *slist = NULL;
-        FILE *fp;
 
-        fp = fdopen(dup(fd), "r");
-        if (!fp) {
-            g_set_error(gerr, system_quark(), errno, "%s: NULL fp from fdopen on fd %d for path %s", funcname, fd, path);
-            goto finish;
-        }
-        if (fseek(fp, 0L, SEEK_SET) == (off_t)-1) {
-            g_set_error(gerr, system_quark(), errno, "%s: fseek error on path %s", funcname, path);
-            goto finish;
-        }
+        // Each attempt uploads from the start of the file
+        source.fd = fd;
+        source.start = 0;
+        source.offset = 0;
+        source.end = st.st_size;
 
         // REVIEW: We didn't use to check for sesssion == NULL, so now we 
         // also call try_release_request_outstanding. Is this OK?
@@ -1048,10 +2680,20 @@ static void put_return_etag(const char *path, int fd, char *etag, GError **gerr)
         }
 
         curl_easy_setopt(session, CURLOPT_CUSTOMREQUEST, "PUT");
+        session_request_type(session, REQUEST_PUT, st.st_size);
         curl_easy_setopt(session, CURLOPT_UPLOAD, 1L);
-        curl_easy_setopt(session, CURLOPT_INFILESIZE, st.st_size);
-        curl_easy_setopt(session, CURLOPT_READDATA, (void *) fp);
+        curl_easy_setopt(session, CURLOPT_INFILESIZE_LARGE, (curl_off_t) st.st_size);
+        curl_easy_setopt(session, CURLOPT_READFUNCTION, read_request_from_fd);
+        curl_easy_setopt(session, CURLOPT_READDATA, (void *) &source);
+        curl_easy_setopt(session, CURLOPT_SEEKFUNCTION, seek_request_fd);
+        curl_easy_setopt(session, CURLOPT_SEEKDATA, (void *) &source);
 
+        if (if_match) {
+            char *header = NULL;
+            asprintf(&header, "If-Match: %s", if_match);
+            slist = curl_slist_append(slist, header);
+            free(header);
+        }
         slist = enhanced_logging(slist, LOG_DYNAMIC, SECTION_FILECACHE_COMM, "put_return_tag: %s", path);
         if (slist) curl_easy_setopt(session, CURLOPT_HTTPHEADER, slist);
 
@@ -1062,13 +2704,20 @@ static void put_return_etag(const char *path, int fd, char *etag, GError **gerr)
 
         timed_curl_easy_perform(session, &res, &response_code, &elapsed_time);
 
-        fclose(fp);
-
         if (slist) curl_slist_free_all(slist);
 
         process_status(funcname, session, res, response_code, elapsed_time, idx, path, false);
     }
 
+    // The body has been sent (or we've given up), so writers can proceed.
+    // Everything after this point only looks at the response.
+    release_put_lock(funcname, path, fd, &lock_time, &cpu_start_time, st.st_size, &tmpgerr);
+    locked = false;
+    if (tmpgerr) {
+        g_propagate_error(gerr, tmpgerr);
+        goto finish;
+    }
+
     if ((res != CURLE_OK || response_code >= 500) || inject_error(filecache_error_etagcurl1)) {
         trigger_saint_event(CLUSTER_FAILURE);
         set_dynamic_logging();
@@ -1093,6 +2742,7 @@ static void put_return_etag(const char *path, int fd, char *etag, GError **gerr)
             // Opening up into the abyss...adding a separate code for a specific error return. Where will it end?
             int curlerr = E_FC_CURLERR;
             if (response_code == 413) curlerr = E_FC_FILETOOLARGE;
+            else if (response_code == 412 && if_match) curlerr = E_FC_CONFLICT;
             g_set_error(gerr, curl_quark(), curlerr, "%s: retry_curl_easy_perform error response %ld: ",
                 funcname, response_code);
             goto finish;
@@ -1180,16 +2830,16 @@ static void put_return_etag(const char *path, int fd, char *etag, GError **gerr)
         }
     }
 
+    // Without an ETag we can't vouch for the next append
+    if (append_base) *append_base = (etag[0] != '\0') ? st.st_size : -1;
+
     log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "PUT returns etag: %s", etag);
 
 finish:
 
-    log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "%s: releasing exclusive file lock on fd %d", funcname, fd);
-    if (flock(fd, LOCK_UN) || inject_error(filecache_error_etagflock2)) {
-        g_set_error(gerr, system_quark(), errno, "%s: error releasing exclusive file lock", funcname);
-    }
-    else {
-        log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "%s: released exclusive file lock on fd %d", funcname, fd);
+    // Error paths which bail before the upload completes still hold the lock
+    if (locked) {
+        release_put_lock(funcname, path, fd, &lock_time, &cpu_start_time, st.st_size, gerr);
     }
 
     log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "exit: %s", funcname);
@@ -1199,10 +2849,18 @@ finish:
 
 // top-level sync call
 bool filecache_sync(filecache_t *cache, const char *path, struct fuse_file_info *info, bool do_put, GError **gerr) {
-    struct filecache_sdata *sdata = (struct filecache_sdata *)info->fh;
+    struct filecache_sdata *sdata = handle_sdata(info);
     struct filecache_pdata *pdata = NULL;
     GError *tmpgerr = NULL;
+    struct timespec lock_time;
+    char base_etag[ETAG_MAX + 1] = "";
+    off_t append_base = -1;
+    uint64_t put_version = 0;
+    long lock_held = 0;
+    bool modified;
     bool wrote_data = false;
+    bool queued = false;
+    bool put_locked = false;
 
     BUMP(filecache_sync);
 
@@ -1229,6 +2887,33 @@ bool filecache_sync(filecache_t *cache, const char *path, struct fuse_file_info
     // So no need to go ahead and try to process this.
     // However, if we aren't yet doing the PUT, let the sync continue. Eventually, the file
     // will make it to forensic haven
+    // Buffered writes have to be in the cache file before it goes up. If that fails,
+    // the handle has the error and we stop just below.
+    // Handles sharing this sdata write through the same fd, so flock can't keep them out
+    // of the upload. Instead io_lock is held just long enough to flush and note which
+    // version we're uploading; writes during the upload bump the version, which leaves
+    // the file modified afterwards, so they go up next time rather than being lost.
+    modified = sdata->modified;
+    if (do_put) {
+        pthread_rwlock_wrlock(&sdata->io_lock);
+        clock_gettime(CLOCK_MONOTONIC, &lock_time);
+        put_locked = true;
+        if (sdata->wbuf) {
+            pthread_mutex_lock(&sdata->wbuf_lock);
+            flush_write_buffer(sdata, &tmpgerr);
+            pthread_mutex_unlock(&sdata->wbuf_lock);
+            if (tmpgerr) {
+                log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "filecache_sync: %s on %s", tmpgerr->message, path);
+                g_clear_error(&tmpgerr);
+            }
+        }
+        modified = sdata->modified;
+        put_version = sdata->version;
+        append_base = sdata->append_base;
+        strncpy(base_etag, sdata->base_etag, ETAG_MAX);
+        unlock_io(sdata, &lock_time, &lock_held);
+    }
+
     if (sdata->error_code && do_put) {
         log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "filecache_sync: already have previous error on %s", path);
         g_set_error(gerr, filecache_quark(), sdata->error_code, "filecache_sync: sdata indicates previous error");
@@ -1241,6 +2926,13 @@ bool filecache_sync(filecache_t *cache, const char *path, struct fuse_file_info
         goto finish;
     }
 
+    // Every write calls us, but marking the entry as locally modified only needs doing once until the next PUT
+    if (!do_put && sdata->modified && sdata->marked_modified) {
+        log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "filecache_sync: already marked modified on %s", path);
+        wrote_data = true;
+        goto finish;
+    }
+
     // Write this data to the persistent cache
     // Update the file cache
     pdata = filecache_pdata_get(cache, path, &tmpgerr);
@@ -1256,20 +2948,33 @@ bool filecache_sync(filecache_t *cache, const char *path, struct fuse_file_info
     }
     log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "filecache_sync(%s, fd=%d): cachefile=%s", path, sdata->fd, pdata->filename);
 
-    if (sdata->modified) {
+    if (modified) {
         if (do_put) {
-            log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "filecache_sync: Seeking fd=%d", sdata->fd);
-            // If this lseek fails, file eventually goes to forensic haven.
-            if ((lseek(sdata->fd, 0, SEEK_SET) == (off_t)-1) || inject_error(filecache_error_synclseek)) {
-                set_error(sdata, errno);
-                log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "filecache_sync: error on lseek on %s", path);
-                g_set_error(gerr, system_quark(), errno, "filecache_sync: failed lseek");
-                goto finish;
-            }
+            char version[32];
+            bool current;
 
+            // put_return_etag preads from offset 0, so there's no need to seek the fd first
             log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "About to PUT file (%s, fd=%d).", path, sdata->fd);
 
-            put_return_etag(path, sdata->fd, pdata->etag, &tmpgerr);
+            snprintf(version, sizeof(version), "h%llx", (unsigned long long) put_version);
+            put_return_etag(path, sdata->fd, pdata->etag, &append_base, base_etag, version, NULL, &tmpgerr);
+
+            // In saint mode, the upload can wait in the write queue; until it goes, the local copy is the file
+            if (tmpgerr && tmpgerr->code == E_FC_CURLERR && saint_write_queue && use_saint_mode()) {
+                GError *queuegerr = NULL;
+
+                writequeue_add(path, base_etag, &queuegerr);
+                if (queuegerr) {
+                    log_print(LOG_WARNING, SECTION_FILECACHE_COMM, "filecache_sync: can't queue %s: %s", path, queuegerr->message);
+                    g_clear_error(&queuegerr);
+                }
+                else {
+                    log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "filecache_sync: queued %s for upload after saint mode: %s",
+                        path, tmpgerr->message);
+                    g_clear_error(&tmpgerr);
+                    queued = true;
+                }
+            }
 
             // if we fail PUT for any reason, file will eventually go to forensic haven.
             // We err in put_return_etag on:
@@ -1298,11 +3003,43 @@ bool filecache_sync(filecache_t *cache, const char *path, struct fuse_file_info
                 goto finish;
             }
 
-            log_print(LOG_INFO, SECTION_FILECACHE_COMM, "filecache_sync: PUT successful: %s : %s : old-timestamp: %lu: etag = %s", path, pdata->filename, pdata->last_server_update, pdata->etag);
+            // Unless it was written to while we uploaded, it's no longer locally modified
+            pthread_rwlock_wrlock(&sdata->io_lock);
+            clock_gettime(CLOCK_MONOTONIC, &lock_time);
+            current = (sdata->version == put_version);
+            if (current) sdata->modified = false;
+            if (queued) {
+                // What the server has can't be appended to, since we don't know what that is
+                sdata->append_base = -1;
+            }
+            else {
+                strncpy(sdata->base_etag, pdata->etag, ETAG_MAX);
+                // A write during the upload may not be an append
+                sdata->append_base = current ? append_base : -1;
+            }
+            unlock_io(sdata, &lock_time, &lock_held);
+
+            if (queued) {
+                BUMP(filecache_wqueue_add);
+                // The queue owns the upload now, so the handle has nothing to PUT until it's written to again
+                strncpy(pdata->etag, "", 1);
+                pdata->last_server_update = 0;
+            }
+            else {
+                log_print(LOG_INFO, SECTION_FILECACHE_COMM, "filecache_sync: PUT successful: %s : %s : old-timestamp: %lu: etag = %s", path, pdata->filename, pdata->last_server_update, pdata->etag);
 
-            // If the PUT succeeded, the file isn't locally modified.
-            sdata->modified = false;
-            pdata->last_server_update = time(NULL);
+                // Anything queued for the path in saint mode went up with it
+                writequeue_remove(path, 0);
+                if (current) {
+                    pdata->last_server_update = time(NULL);
+                }
+                else {
+                    // The server's copy may be missing the later writes; the local one still trumps it
+                    log_print(LOG_INFO, SECTION_FILECACHE_COMM, "filecache_sync: %s was written to during the PUT", path);
+                    strncpy(pdata->etag, "", 1);
+                    pdata->last_server_update = 0;
+                }
+            }
         }
         else {
             // If we don't PUT the file, we don't have an etag, so zero it out
@@ -1324,11 +3061,18 @@ bool filecache_sync(filecache_t *cache, const char *path, struct fuse_file_info
             g_propagate_prefixed_error(gerr, tmpgerr, "filecache_sync: ");
             goto finish;
         }
+        sdata->marked_modified = sdata->modified;
     }
     log_print(LOG_INFO, SECTION_FILECACHE_COMM, "filecache_sync: Updated stat cache %d:%s:%s:%lu", sdata->fd, path, pdata->filename, pdata->last_server_update);
 
 finish:
 
+    // Writers sharing the handle wait for as long as we hold io_lock
+    if (put_locked) {
+        TIMING(filecache_put_lock_timing, lock_held);
+        BUMP(filecache_put_lock_count);
+        stats_timer("put-lock-latency", lock_held);
+    }
     free(pdata);
 
     log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "filecache_sync: Done syncing file (%s, fd=%d).", path, sdata ? sdata->fd : -1);
@@ -1336,9 +3080,122 @@ finish:
     return wrote_data;
 }
 
+/* Uploads the writes which were queued in saint mode, oldest first, for as long as the
+ * cluster stays healthy. Entries whose local copy has since been uploaded, replaced or
+ * deleted are dropped. Files still open for writing are skipped: their handles upload
+ * on close and drop the entry once that succeeds, and if it doesn't, a later replay
+ * picks the entry up. Returns how many were uploaded.
+ */
+int filecache_replay_writes(filecache_t *cache) {
+    char path[PATH_MAX];
+    char base_etag[ETAG_MAX + 1];
+    unsigned long after = 0;
+    unsigned long seq;
+    int uploaded = 0;
+
+    for (; writequeue_peek(after, path, base_etag, sizeof(base_etag), &seq); after = seq) {
+        struct filecache_pdata *pdata = NULL;
+        struct filecache_pdata *latest = NULL;
+        char abs_path[PATH_MAX];
+        char etag[ETAG_MAX + 1];
+        char version[32];
+        GError *tmpgerr = NULL;
+        struct stat st;
+        bool in_flight;
+        int fd;
+
+        if (use_saint_mode()) break;
+
+        pthread_mutex_lock(&open_files_mutex);
+        in_flight = (g_hash_table_lookup(open_files, path) != NULL);
+        pthread_mutex_unlock(&open_files_mutex);
+        if (in_flight) {
+            log_print(LOG_INFO, SECTION_FILECACHE_COMM, "filecache_replay_writes: %s is open for writing; leaving it queued", path);
+            continue;
+        }
+
+        pdata = filecache_pdata_get(cache, path, &tmpgerr);
+        if (tmpgerr) {
+            log_print(LOG_WARNING, SECTION_FILECACHE_COMM, "filecache_replay_writes: %s: %s", path, tmpgerr->message);
+            g_clear_error(&tmpgerr);
+            break;
+        }
+
+        if (pdata == NULL || pdata->last_server_update != 0 || pdata_is_packed(pdata)) {
+            log_print(LOG_INFO, SECTION_FILECACHE_COMM, "filecache_replay_writes: %s no longer needs uploading", path);
+            writequeue_remove(path, seq);
+            free(pdata);
+            continue;
+        }
+
+        fd = open(cache_file_abs(pdata->filename, abs_path), O_RDONLY);
+        if (fd < 0 || fstat(fd, &st)) {
+            log_print(LOG_WARNING, SECTION_FILECACHE_COMM, "filecache_replay_writes: can't open %s for %s: %d %s; dropping it",
+                pdata->filename, path, errno, strerror(errno));
+            if (fd >= 0) close(fd);
+            writequeue_remove(path, seq);
+            free(pdata);
+            continue;
+        }
+
+        etag[0] = '\0';
+        snprintf(version, sizeof(version), "q%lx", seq);
+        // Don't overwrite a change someone else made while we couldn't reach the server
+        put_return_etag(path, fd, etag, NULL, NULL, version, base_etag[0] != '\0' ? base_etag : NULL, &tmpgerr);
+        close(fd);
+
+        if (tmpgerr && tmpgerr->code == E_FC_CURLERR) {
+            // Still unhealthy; this and everything after it waits for the next try
+            log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "filecache_replay_writes: %s: %s", path, tmpgerr->message);
+            g_clear_error(&tmpgerr);
+            free(pdata);
+            break;
+        }
+        else if (tmpgerr) {
+            // The server won't take it, or has a newer version than the one it was written from; either
+            // would have failed the close, so handle it the way dav_release does
+            log_print(LOG_WARNING, SECTION_FILECACHE_COMM, "filecache_replay_writes: %s refused: %s; invoking forensic_haven",
+                path, tmpgerr->message);
+            g_clear_error(&tmpgerr);
+            filecache_forensic_haven(cache_root, cache, path, st.st_size, &tmpgerr);
+            if (tmpgerr) g_clear_error(&tmpgerr);
+            filecache_delete(cache, path, false, &tmpgerr);
+            if (tmpgerr) g_clear_error(&tmpgerr);
+            stat_cache_delete(cache, path, NULL);
+            writequeue_remove(path, seq);
+            free(pdata);
+            continue;
+        }
+
+        BUMP(filecache_wqueue_replay);
+        log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "filecache_replay_writes: uploaded %s (%lu bytes) queued in saint mode",
+            path, st.st_size);
+
+        // The local copy now matches the server, unless it was replaced while we uploaded
+        latest = filecache_pdata_get(cache, path, &tmpgerr);
+        if (tmpgerr) g_clear_error(&tmpgerr);
+        if (latest && latest->last_server_update == 0 && strcmp(latest->filename, pdata->filename) == 0) {
+            strncpy(latest->etag, etag, ETAG_MAX);
+            latest->etag[ETAG_MAX] = '\0';
+            latest->last_server_update = time(NULL);
+            filecache_pdata_set(cache, path, latest, &tmpgerr);
+            if (tmpgerr) {
+                log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "filecache_replay_writes: %s: %s", path, tmpgerr->message);
+                g_clear_error(&tmpgerr);
+            }
+        }
+        writequeue_remove(path, seq);
+        ++uploaded;
+        free(latest);
+        free(pdata);
+    }
+
+    return uploaded;
+}
+
 // top-level truncate call
 void filecache_truncate(struct fuse_file_info *info, off_t s, GError **gerr) {
-    struct filecache_sdata *sdata = (struct filecache_sdata *)info->fh;
+    struct filecache_sdata *sdata = handle_sdata(info);
 
     BUMP(filecache_truncate);
 
@@ -1349,9 +3206,20 @@ void filecache_truncate(struct fuse_file_info *info, off_t s, GError **gerr) {
 
     log_print(LOG_INFO, SECTION_FILECACHE_FILE, "filecache_truncate(%d)", sdata->fd);
 
+    if (sdata->wbuf) {
+        GError *tmpgerr = NULL;
+        flush_writes(sdata, &tmpgerr);
+        if (tmpgerr) {
+            g_propagate_prefixed_error(gerr, tmpgerr, "filecache_truncate: ");
+            return;
+        }
+    }
+
+    pthread_rwlock_rdlock(&sdata->io_lock);
     log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_truncate: acquiring shared file lock on fd %d", sdata->fd);
     if (flock(sdata->fd, LOCK_SH) || inject_error(filecache_error_truncflock1)) {
         g_set_error(gerr, system_quark(), errno, "filecache_truncate: error acquiring shared file lock");
+        pthread_rwlock_unlock(&sdata->io_lock);
         return;
     }
     log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_truncate: acquired shared file lock on fd %d", sdata->fd);
@@ -1369,31 +3237,125 @@ void filecache_truncate(struct fuse_file_info *info, off_t s, GError **gerr) {
         else {
             log_print(LOG_CRIT, SECTION_FILECACHE_FILE, "filecache_truncate: error releasing shared file lock :: %s", g_strerror(errno));
         }
+        pthread_rwlock_unlock(&sdata->io_lock);
         return;
     }
 
     // If we got an error on ftruncate, we fell through to flock. If we didn't get an error there, we need
     // to return before setting sdata modified.
-    if (gerr) return;
+    if (gerr) {
+        pthread_rwlock_unlock(&sdata->io_lock);
+        return;
+    }
 
     log_print(LOG_DEBUG, SECTION_FILECACHE_FILE, "filecache_truncate: released shared file lock on fd %d", sdata->fd);
 
-    sdata->modified = true;
+    mark_modified(sdata);
+    // Cutting into what the server already has can't be sent as an append
+    if (s < sdata->append_base) sdata->append_base = -1;
+    pthread_rwlock_unlock(&sdata->io_lock);
 
     return;
 }
 
+off_t filecache_packed_size(struct fuse_file_info *info) {
+    struct filecache_sdata *sdata = handle_sdata(info);
+
+    if (sdata == NULL) return -1;
+    if (sdata->stream) return sdata->stream->size;
+    if (!sdata->packed) return -1;
+    return sdata->packed_size;
+}
+
+/* Writes don't update the stat cache; that's done once, at flush or release.
+ * Meanwhile getattr on the path gets the size and mtime from the handle's cache file.
+ */
+void filecache_defer_stat(const char *path, struct fuse_file_info *info) {
+    struct filecache_sdata *sdata = handle_sdata(info);
+
+    if (sdata == NULL || path == NULL) return;
+
+    pthread_mutex_lock(&deferred_mutex);
+    if (sdata->deferred_path == NULL) {
+        sdata->deferred_path = strdup(path);
+        if (sdata->deferred_path) {
+            g_hash_table_replace(deferred_stats, sdata->deferred_path, sdata);
+        }
+    }
+    pthread_mutex_unlock(&deferred_mutex);
+}
+
+// Fills in st's size and times if path has writes the stat cache hasn't seen; returns true if it did
+bool filecache_deferred_stat(const char *path, struct stat *st) {
+    struct filecache_sdata *sdata;
+    struct stat fst;
+    bool found = false;
+
+    pthread_mutex_lock(&deferred_mutex);
+    sdata = g_hash_table_lookup(deferred_stats, path);
+    if (sdata && fstat(sdata->fd, &fst) == 0) {
+        if (sdata->wbuf) {
+            pthread_mutex_lock(&sdata->wbuf_lock);
+            if (sdata->wbuf_len > 0 && (off_t) (sdata->wbuf_offset + sdata->wbuf_len) > fst.st_size) {
+                fst.st_size = sdata->wbuf_offset + sdata->wbuf_len;
+                fst.st_mtime = time(NULL);
+            }
+            pthread_mutex_unlock(&sdata->wbuf_lock);
+        }
+        st->st_size = fst.st_size;
+        st->st_blocks = (fst.st_size + 511) / 512;
+        st->st_mtime = fst.st_mtime;
+        st->st_ctime = fst.st_ctime;
+        found = true;
+    }
+    pthread_mutex_unlock(&deferred_mutex);
+
+    return found;
+}
+
+static void stat_published(struct filecache_sdata *sdata) {
+    pthread_mutex_lock(&deferred_mutex);
+    if (sdata->deferred_path) {
+        // Another handle may have written to the path since, and taken it over
+        if (g_hash_table_lookup(deferred_stats, sdata->deferred_path) == sdata) {
+            g_hash_table_remove(deferred_stats, sdata->deferred_path);
+        }
+        free(sdata->deferred_path);
+        sdata->deferred_path = NULL;
+    }
+    pthread_mutex_unlock(&deferred_mutex);
+}
+
+// Called once the stat cache has this handle's writes, and on close
+void filecache_stat_published(struct fuse_file_info *info) {
+    struct filecache_sdata *sdata = handle_sdata(info);
+
+    if (sdata == NULL) return;
+    stat_published(sdata);
+}
+
 int filecache_fd(struct fuse_file_info *info) {
-    struct filecache_sdata *sdata = (struct filecache_sdata *)info->fh;
+    struct filecache_sdata *sdata = handle_sdata(info);
 
     BUMP(filecache_get_fd);
 
     log_print(LOG_DEBUG, SECTION_FILECACHE_FILE, "filecache_fd: %d", sdata->fd);
+
+    // Callers use the fd to size the file, so it had better have all our writes.
+    // A failure is on the handle now, and comes out at the next sync.
+    if (sdata->wbuf) {
+        GError *tmpgerr = NULL;
+        flush_writes(sdata, &tmpgerr);
+        if (tmpgerr) {
+            log_print(LOG_NOTICE, SECTION_FILECACHE_FILE, "filecache_fd: %s", tmpgerr->message);
+            g_clear_error(&tmpgerr);
+        }
+    }
     return sdata->fd;
 }
 
 void filecache_set_error(struct fuse_file_info *info, int error_code) {
-    struct filecache_sdata *sdata = (struct filecache_sdata *)info->fh;
+    struct filecache_sdata *sdata = handle_sdata(info);
 
     BUMP(filecache_set_error);
     set_error(sdata, error_code);
@@ -1406,6 +3368,7 @@ void filecache_delete(filecache_t *cache, const char *path, bool unlink_cachefil
     GError *tmpgerr = NULL;
     char *key;
     char *ldberr = NULL;
+    char abs_path[PATH_MAX];
 
     BUMP(filecache_delete);
 
@@ -1419,16 +3382,27 @@ void filecache_delete(filecache_t *cache, const char *path, bool unlink_cachefil
 
     if (!pdata) return;
 
+    // Handles still open on the old file keep it, but new opens of the path get a new one
+    pthread_mutex_lock(&open_files_mutex);
+    g_hash_table_remove(open_files, path);
+    pthread_mutex_unlock(&open_files_mutex);
+
     key = path2key(path);
 
     options = leveldb_writeoptions_create();
+    pthread_mutex_lock(&pdata_mutex);
     leveldb_delete(cache, options, key, strlen(key) + 1, &ldberr);
+    pthread_mutex_unlock(&pdata_mutex);
     leveldb_writeoptions_destroy(options);
     free(key);
 
-    if (unlink_cachefile && pdata) {
+    if (pdata && !pdata_is_packed(pdata)) {
+        fdpool_invalidate(pdata->filename);
+    }
+
+    if (unlink_cachefile && pdata && !pdata_is_packed(pdata)) {
         log_print(LOG_DEBUG, SECTION_FILECACHE_CACHE, "filecache_delete: unlinking %s", pdata->filename);
-        if (unlink(pdata->filename)) {
+        if (unlink(cache_file_abs(pdata->filename, abs_path))) {
             log_print(LOG_WARNING, SECTION_FILECACHE_CACHE, "filecache_delete: error unlinking %s", pdata->filename);
         }
     }
@@ -1443,7 +3417,9 @@ void filecache_delete(filecache_t *cache, const char *path, bool unlink_cachefil
     return;
 }
 
-static int clear_files(const char *filecache_path, time_t stamped_time, GError **gerr) {
+// Cache files live in the hashed subdirectories of filecache_path (buckets is true
+// there); files from before that layout may still sit at the top.
+static int clear_files(const char *filecache_path, time_t stamped_time, bool buckets, GError **gerr) {
     const char *fname = "clear_files";
     struct dirent *diriter;
     DIR *dir;
@@ -1474,10 +3450,24 @@ static int clear_files(const char *filecache_path, time_t stamped_time, GError *
         }
 
         if ((stbuf.st_mode & S_IFMT ) == S_IFDIR) {
-            // We don't expect directories, but skip them
+            unsigned bucket;
+            // We don't expect directories other than the buckets, but skip them
             if ((strcmp(diriter->d_name, ".") == 0) || (strcmp(diriter->d_name, "..") == 0)) {
                 log_print(LOG_DEBUG, SECTION_FILECACHE_CLEAN, "%s: found . or .. directory: %s", fname, cachefile_path);
             }
+            else if (buckets && strlen(diriter->d_name) == 2 && sscanf(diriter->d_name, "%02x", &bucket) == 1) {
+                GError *tmpgerr = NULL;
+                int left = clear_files(cachefile_path, stamped_time, false, &tmpgerr);
+                if (tmpgerr) {
+                    log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "%s: %s", fname, tmpgerr->message);
+                    g_clear_error(&tmpgerr);
+                    --ret;
+                }
+                else {
+                    // Count what's left in the bucket as visited
+                    visited += left;
+                }
+            }
             else {
                 log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "%s: unexpected directory in filecache: %s", fname, cachefile_path);
                 --ret;
@@ -1526,6 +3516,7 @@ void filecache_forensic_haven(const char *cache_path, filecache_t *cache, const
     char *buf = NULL;
     ssize_t bytes_written;
     bool failed_rename = false;
+    char abs_path[PATH_MAX];
 
     BUMP(filecache_forensic_haven);
     log_print(LOG_DYNAMIC, SECTION_FILECACHE_FILE, "%s: cp %s p %s", fname, cache_path, path);
@@ -1552,7 +3543,8 @@ void filecache_forensic_haven(const char *cache_path, filecache_t *cache, const
     asprintf(&newpath, "%s/%s/%s", cache_path, forensic_haven_dir, bname);
     // Move the file to forensic-haven
     log_print(LOG_DEBUG, SECTION_FILECACHE_CACHE, "%s: doing rename(%s, %s)", fname, pdata->filename, newpath);
-    if (rename(pdata->filename, newpath) == -1) {
+    fdpool_invalidate(pdata->filename);
+    if (rename(cache_file_abs(pdata->filename, abs_path), newpath) == -1) {
         log_print(LOG_WARNING, SECTION_FILECACHE_CACHE, "%s: error on rename(%s, %s)", fname, pdata->filename, newpath);
         // If rename fails, put this in the .txt file
         failed_rename = true;
@@ -1595,7 +3587,7 @@ finish:
     asprintf(&newpath, "%s/%s/", cache_path, forensic_haven_dir);
     // Clear out all files older than a day
     while (files_left >= files_kept && hours > 0) {
-        files_left = clear_files(newpath, time(NULL) - (hours * 60 * 60), &subgerr);
+        files_left = clear_files(newpath, time(NULL) - (hours * 60 * 60), false, &subgerr);
         if (subgerr) {
             log_print(LOG_ERR, SECTION_FILECACHE_FILE, 
                     "%s: error on clear_files: %s -- %d: %s", 
@@ -1614,11 +3606,12 @@ finish:
 
 void filecache_pdata_move(filecache_t *cache, const char *old_path, const char *new_path, GError **gerr) {
     struct filecache_pdata *pdata = NULL;
+    size_t pdata_len = 0;
     GError *tmpgerr = NULL;
 
     BUMP(filecache_pdata_move);
 
-    pdata = filecache_pdata_get(cache, old_path, &tmpgerr);
+    pdata = filecache_pdata_get_len(cache, old_path, &pdata_len, &tmpgerr);
     if (tmpgerr) {
         g_propagate_prefixed_error(gerr, tmpgerr, "filecache_pdata_move: ");
         return;
@@ -1631,12 +3624,33 @@ void filecache_pdata_move(filecache_t *cache, const char *old_path, const char *
 
     log_print(LOG_INFO, SECTION_FILECACHE_FILE, "filecache_pdata_move: Update last_server_update on %s: timestamp: %lu", pdata->filename, pdata->last_server_update);
 
-    filecache_pdata_set(cache, new_path, pdata, &tmpgerr);
+    // Carry any inline body along with the entry
+    filecache_pdata_put(cache, new_path, pdata, pdata_len, &tmpgerr);
     if (tmpgerr) {
         g_propagate_prefixed_error(gerr, tmpgerr, "filecache_pdata_move: Moving entry from path %s to %s failed: ", old_path, new_path);
         goto finish;
     }
 
+    // Later opens of the new path share what's open under the old one. This goes first,
+    // since filecache_delete forgets what's open under the path it's given.
+    pthread_mutex_lock(&open_files_mutex);
+    {
+        struct filecache_sdata *sdata = g_hash_table_lookup(open_files, old_path);
+        char *key = sdata ? strdup(new_path) : NULL;
+        char *new_open_path = sdata ? strdup(new_path) : NULL;
+        if (key && new_open_path) {
+            g_hash_table_remove(open_files, old_path);
+            free(sdata->open_path);
+            sdata->open_path = new_open_path;
+            g_hash_table_replace(open_files, key, sdata);
+        }
+        else {
+            free(key);
+            free(new_open_path);
+        }
+    }
+    pthread_mutex_unlock(&open_files_mutex);
+
     // We don't want to unlink the cachefile for 'old' since we use it for 'new'
     filecache_delete(cache, old_path, false, &tmpgerr);
     if (tmpgerr) {
@@ -1646,6 +3660,20 @@ void filecache_pdata_move(filecache_t *cache, const char *old_path, const char *
 
     log_print(LOG_DEBUG, SECTION_FILECACHE_FILE, "filecache_pdata_move: new cachefile is %s", pdata->filename);
 
+    // A handle still writing to the file now answers getattr for the new path
+    pthread_mutex_lock(&deferred_mutex);
+    {
+        struct filecache_sdata *sdata = g_hash_table_lookup(deferred_stats, old_path);
+        char *new_deferred_path = sdata ? strdup(new_path) : NULL;
+        if (new_deferred_path) {
+            g_hash_table_remove(deferred_stats, old_path);
+            free(sdata->deferred_path);
+            sdata->deferred_path = new_deferred_path;
+            g_hash_table_replace(deferred_stats, sdata->deferred_path, sdata);
+        }
+    }
+    pthread_mutex_unlock(&deferred_mutex);
+
 finish:
 
     free(pdata);
@@ -1667,6 +3695,138 @@ static const char *key2path(const char *key) {
     return NULL;
 }
 
+// Move a cache file from the old flat layout into its hashed subdirectory, and point the
+// entry at the new relative name. The file is linked under the new name before the entry
+// changes, so an open racing with us finds it under either. Only the name changes, and only
+// if the entry is still as old has it; a PUT or fetch which finished meanwhile wins, and the
+// file is left for the next cleanup. On success fname gets the new name.
+static void migrate_cache_file(filecache_t *cache, const char *cache_path, const char *path,
+        const struct filecache_pdata *old, char *fname) {
+    struct filecache_pdata *pdata;
+    GError *tmpgerr = NULL;
+    char newpath[PATH_MAX];
+    const char *bname;
+
+    pdata = malloc(sizeof(struct filecache_pdata));
+    if (pdata == NULL) return;
+    memcpy(pdata, old, sizeof(struct filecache_pdata));
+
+    bname = strrchr(old->filename, '/') + 1;
+    snprintf(pdata->filename, PATH_MAX, "files/%02x/%s", g_str_hash(bname) % CACHE_FILE_FANOUT, bname);
+    snprintf(newpath, PATH_MAX, "%s/%s", cache_path, pdata->filename);
+
+    if (link(old->filename, newpath) && errno != EEXIST) {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "migrate_cache_file: failed to link %s to %s: %d %s",
+            old->filename, newpath, errno, strerror(errno));
+        goto finish;
+    }
+
+    if (!filecache_pdata_replace(cache, path, old, pdata, &tmpgerr)) {
+        if (tmpgerr) {
+            log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "migrate_cache_file: %s", tmpgerr->message);
+            g_clear_error(&tmpgerr);
+        }
+        else {
+            log_print(LOG_INFO, SECTION_FILECACHE_CLEAN, "migrate_cache_file: %s changed; leaving it for now", path);
+        }
+        unlink(newpath);
+        goto finish;
+    }
+
+    fdpool_invalidate(old->filename);
+    unlink(old->filename);
+    strncpy(fname, pdata->filename, PATH_MAX);
+    BUMP(filecache_migrated);
+
+finish:
+    free(pdata);
+}
+
+struct compaction_snapshot {
+    filecache_t *cache;
+    leveldb_readoptions_t *options;
+    leveldb_iterator_t *iter;
+};
+
+// Called by slabstore_compaction_begin once the victims are marked
+static void snapshot_for_compaction(void *userdata) {
+    struct compaction_snapshot *snapshot = userdata;
+
+    snapshot->iter = leveldb_create_iterator(snapshot->cache, snapshot->options);
+}
+
+// Move the live bodies out of the slabs which filecache_cleanup found to be mostly dead,
+// then retire those slabs. Entries which can't be moved are dropped, to be refetched.
+static void compact_slabs(filecache_t *cache) {
+    struct compaction_snapshot snapshot = {cache, NULL, NULL};
+    leveldb_iterator_t *iter;
+    leveldb_readoptions_t *options;
+    size_t klen;
+    int moved = 0;
+    int dropped = 0;
+
+    options = leveldb_readoptions_create();
+    leveldb_readoptions_set_fill_cache(options, false);
+    snapshot.options = options;
+
+    if (slabstore_compaction_begin(snapshot_for_compaction, &snapshot) == 0) {
+        leveldb_readoptions_destroy(options);
+        return;
+    }
+    iter = snapshot.iter;
+
+    leveldb_iter_seek(iter, filecache_prefix, strlen(filecache_prefix));
+
+    while (leveldb_iter_valid(iter)) {
+        const struct filecache_pdata *old;
+        struct filecache_pdata pdata;
+        struct slab_ref ref;
+        struct slab_ref newref;
+        GError *tmpgerr = NULL;
+        const char *path;
+        fd_t fd;
+
+        path = key2path(leveldb_iter_key(iter, &klen));
+        if (path == NULL) break;
+        old = (const struct filecache_pdata *)leveldb_iter_value(iter, &klen);
+        if (old == NULL || !pdata_is_slab(old) || !pdata_slab_ref(old, &ref) || !slabstore_compacting(ref.id)) {
+            leveldb_iter_next(iter);
+            continue;
+        }
+
+        fd = slabstore_open(&ref, &tmpgerr);
+        if (!tmpgerr) {
+            slabstore_append(fd, ref.offset, ref.length, &newref, &tmpgerr);
+            close(fd);
+        }
+        // The entry may have changed since the iterator's snapshot, e.g. an open spilled the body
+        // to a cache file; only repoint it if it hasn't
+        if (!tmpgerr) {
+            memcpy(&pdata, old, sizeof(struct filecache_pdata));
+            pdata_set_slab_ref(&pdata, &newref);
+            if (filecache_pdata_replace(cache, path, old, &pdata, &tmpgerr)) {
+                ++moved;
+                BUMP(filecache_slab_moved);
+            }
+            slabstore_append_done(&newref);
+        }
+        if (tmpgerr) {
+            log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "compact_slabs: dropping %s: %s", path, tmpgerr->message);
+            g_clear_error(&tmpgerr);
+            filecache_delete(cache, path, false, NULL);
+            ++dropped;
+        }
+        leveldb_iter_next(iter);
+    }
+
+    leveldb_iter_destroy(iter);
+    leveldb_readoptions_destroy(options);
+
+    slabstore_compaction_end();
+
+    log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "compact_slabs: moved %d bodies; dropped %d", moved, dropped);
+}
+
 void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, GError **gerr) {
     leveldb_iterator_t *iter = NULL;
     leveldb_readoptions_t *options;
@@ -1675,6 +3835,7 @@ void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, G
     char *newpath = NULL;
     size_t klen;
     char fname[PATH_MAX];
+    char abs_path[PATH_MAX];
     time_t starttime;
     int ret;
     // Statistics
@@ -1695,8 +3856,11 @@ void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, G
 
     starttime = time(NULL);
 
+    if (use_slab_store) slabstore_usage_reset();
+
     while (leveldb_iter_valid(iter)) {
         const struct filecache_pdata *pdata;
+        struct slab_ref ref;
         const char *iterkey;
         const char *path;
         // We need the key to get the path in case we need to remove the entry from the filecache
@@ -1712,8 +3876,11 @@ void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, G
             // so store it in fname
             strncpy(fname, pdata->filename, PATH_MAX);
 
-            // If the cache file doesn't exist, delete the entry from the level_db cache
-            ret = access(fname, F_OK);
+            // If the cache file doesn't exist, delete the entry from the level_db cache.
+            // Inline entries have no cache file, so only ever age out; slab entries need their slab.
+            if (pdata_is_inline(pdata)) ret = 0;
+            else if (pdata_is_slab(pdata)) ret = (pdata_slab_ref(pdata, &ref) && slabstore_exists(ref.id)) ? 0 : -1;
+            else ret = access(cache_file_abs(fname, abs_path), F_OK);
             if (ret) {
                 filecache_delete(cache, path, true, &tmpgerr);
                 if (tmpgerr) {
@@ -1725,7 +3892,8 @@ void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, G
                     ++pruned_files;
                 }
             }
-            else if ((first && pdata->last_server_update == 0) ||
+            // Local copies waiting in the write queue are the only copy of those writes; keep them
+            else if ((first && pdata->last_server_update == 0 && !writequeue_contains(path)) ||
                      ((pdata->last_server_update != 0) && (starttime - pdata->last_server_update > AGE_OUT_THRESHOLD))) {
                 log_print(LOG_DEBUG, SECTION_FILECACHE_CLEAN, "filecache_cleanup: Unlinking %s", fname);
                 filecache_delete(cache, path, true, &tmpgerr);
@@ -1740,9 +3908,16 @@ void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, G
                     ++unlinked_files;
                 }
             }
-            else {
+            else if (pdata_is_slab(pdata)) {
+                // Still live; count it so compaction knows what it has to keep
+                slabstore_usage_add(&ref);
+            }
+            else if (!pdata_is_inline(pdata)) {
+                if (fname[0] == '/') {
+                    migrate_cache_file(cache, cache_path, path, pdata, fname);
+                }
                 // put a timestamp on the file
-                ret = utime(fname, NULL);
+                ret = utime(cache_file_abs(fname, abs_path), NULL);
                 if (ret) {
                     log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "filecache_cleanup: failed to update timestamp on \"%s\" for \"%s\" from ldb cache: %d - %s", fname, path, errno, strerror(errno));
                 }
@@ -1757,11 +3932,13 @@ void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, G
     leveldb_iter_destroy(iter);
     leveldb_readoptions_destroy(options);
 
+    if (use_slab_store) compact_slabs(cache);
+
     // check filestamps on each file in directory. Set back a second to avoid unlikely but
     // possible race where we are updating a file inside the window where we are starting the cache cleanup
     // Ignore return value, which is files still left in the directory
     asprintf(&newpath, "%s/files", cache_path);
-    clear_files(newpath, (starttime - 1), &tmpgerr);
+    clear_files(newpath, (starttime - 1), true, &tmpgerr);
     free(newpath);
     if (tmpgerr) {
         g_propagate_prefixed_error(gerr, tmpgerr, "filecache_cleanup: ");
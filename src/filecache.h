@@ -31,25 +31,36 @@
  * match. The closest approximation to PDATANULL is ENOENT; it means whenever we're trying
  * to do an operation, we don't have the file in the cache, so we can't update, etc.
  * Calling file too large EFBIG is pretty obvious.
+ * A conditional upload refused because the server's copy changed under us is ESTALE.
  */
 #define E_FC_PDATANULL ENOENT
 #define E_FC_SDATANULL EIO
 #define E_FC_LDBERR EIO
 #define E_FC_CURLERR ENETDOWN
 #define E_FC_FILETOOLARGE EFBIG
+#define E_FC_CONFLICT ESTALE
 
 typedef leveldb_t filecache_t;
 
+struct fusedav_config;
+
 void filecache_print_stats(void);
-void filecache_init(char *cache_path, GError **gerr);
+void filecache_init(struct fusedav_config *config, GError **gerr);
 void filecache_delete(filecache_t *cache, const char *path, bool unlink, GError **gerr);
 void filecache_open(char *cache_path, filecache_t *cache, const char *path, struct fuse_file_info *info, bool grace, GError **gerr);
 ssize_t filecache_read(struct fuse_file_info *info, char *buf, size_t size, off_t offset, GError **gerr);
 ssize_t filecache_write(struct fuse_file_info *info, const char *buf, size_t size, off_t offset, GError **gerr);
 void filecache_close(struct fuse_file_info *info, GError **gerr);
+bool filecache_release(struct fuse_file_info *info);
+bool filecache_shared(struct fuse_file_info *info);
 bool filecache_sync(filecache_t *cache, const char *path, struct fuse_file_info *info, bool do_put, GError **gerr);
+int filecache_replay_writes(filecache_t *cache);
 void filecache_truncate(struct fuse_file_info *info, off_t s, GError **gerr);
 int filecache_fd(struct fuse_file_info *info);
+void filecache_defer_stat(const char *path, struct fuse_file_info *info);
+bool filecache_deferred_stat(const char *path, struct stat *st);
+void filecache_stat_published(struct fuse_file_info *info);
+off_t filecache_packed_size(struct fuse_file_info *info);
 void filecache_set_error(struct fuse_file_info *info, int error_code);
 void filecache_forensic_haven(const char *cache_path, filecache_t *cache, const char *path, off_t fsize, GError **gerr);
 void filecache_pdata_move(filecache_t *cache, const char *old_path, const char *new_path, GError **gerr);
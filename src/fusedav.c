@@ -32,6 +32,7 @@
 #include <glib.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include "log.h"
 #include "log_sections.h"
@@ -45,6 +46,10 @@
 #include "fusedav-statsd.h"
 #include "signal_handling.h"
 #include "stats.h"
+#include "warmup.h"
+#include "writequeue.h"
+#include "slabstore.h"
+#include "httpengine.h"
 
 mode_t mask = 0;
 struct fuse* fuse = NULL;
@@ -54,6 +59,14 @@ struct fuse* fuse = NULL;
 // Run cache cleanup once a day.
 #define CACHE_CLEANUP_INTERVAL 86400
 
+// Save the record of hot paths every ten minutes.
+#define WARMUP_SAVE_INTERVAL 600
+// Pause between warm-up requests so they stay in the background of real traffic.
+#define WARMUP_PAUSE_USEC 20000
+
+// Look for writes queued in saint mode to upload this often.
+#define WRITE_QUEUE_INTERVAL 5
+
 // 'Soft" limit for core dump to ensure we get them
 #define NEW_RLIM_CUR (512 * 1024*1024)
 
@@ -190,6 +203,12 @@ static void getdir_propfind_callback(__unused void *userdata, const char *path,
 
     log_print(LOG_INFO, SECTION_FUSEDAV_PROP, "%s: %s (%lu)", funcname, path, status_code);
 
+    // Until its queued upload goes, the server doesn't know about the local copy; keep ours (see update_directory)
+    if (writequeue_contains(path)) {
+        log_print(LOG_INFO, SECTION_FUSEDAV_PROP, "%s: %s has a queued upload; keeping the local entry", funcname, path);
+        return;
+    }
+
     if (status_code == 410) {
         struct stat_cache_value *existing;
 
@@ -308,6 +327,23 @@ static void getdir_cache_callback(__unused const char *path_prefix, const char *
     }
 }
 
+// Refreshes the stat cache entry of a queued upload in directory dir, so it outlives
+// the PROPFIND which didn't mention it
+static void keep_queued_entry(const char *path, const void *dir) {
+    struct fusedav_config *config = fuse_get_context()->private_data;
+    struct stat_cache_value *value;
+    const char *slash = strrchr(path, '/');
+    size_t parent_len = slash - path;
+
+    if (parent_len == 0 ? strcmp(dir, "/") != 0 : (strlen(dir) != parent_len || strncmp(path, dir, parent_len) != 0)) return;
+
+    value = stat_cache_value_get(config->cache, path, true, NULL);
+    if (value) {
+        stat_cache_value_set(config->cache, path, value, NULL);
+        free(value);
+    }
+}
+
 static void update_directory(const char *path, bool attempt_progressive_update, GError **gerr) {
     struct fusedav_config *config = fuse_get_context()->private_data;
     GError *tmpgerr = NULL;
@@ -371,6 +407,9 @@ static void update_directory(const char *path, bool attempt_progressive_update,
             return;
         }
 
+        // Nor will files with a queued upload, which the server may not have yet
+        writequeue_foreach(keep_queued_entry, path);
+
         // All files in propfind list will have local_generation > min_generation and will not be subject to deletion
         stat_cache_delete_older(config->cache, path, min_generation, &tmpgerr);
         if (tmpgerr) {
@@ -422,6 +461,8 @@ static int dav_readdir(
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
 
+    warmup_record(path, true);
+
     if (config->grace && use_saint_mode()) {
         log_print(LOG_INFO, SECTION_FUSEDAV_STAT, "dav_readdir: Using saint mode on %s", path);
         ignore_freshness = true;
@@ -495,6 +536,11 @@ static void getattr_propfind_callback(__unused void *userdata, const char *path,
     memset(&value, 0, sizeof(struct stat_cache_value));
     value.st = st;
 
+    if (writequeue_contains(path)) {
+        log_print(LOG_INFO, SECTION_FUSEDAV_PROP, "getattr_propfind_callback: %s has a queued upload; keeping the local entry", path);
+        return;
+    }
+
     if (status_code == 410) {
         log_print(LOG_NOTICE, SECTION_FUSEDAV_PROP, "getattr_propfind_callback: Deleting from stat cache: %s", path);
         stat_cache_delete(config->cache, path, &subgerr1);
@@ -613,6 +659,20 @@ static void get_stat(const char *path, struct stat *stbuf, GError **gerr) {
         log_print(LOG_INFO, SECTION_FUSEDAV_STAT, "get_stat: Using saint mode on %s", path);
         skip_freshness_check = SAINT_MODE;
     }
+    else {
+        struct stat pending;
+        // Writes no longer refresh the stat cache entry as they go, but while a handle
+        // has writes the stat cache hasn't seen, the local entry trumps the server's
+        if (filecache_deferred_stat(path, &pending)) {
+            log_print(LOG_DEBUG, SECTION_FUSEDAV_STAT, "get_stat: %s has unpublished writes; using the cache", path);
+            skip_freshness_check = ALREADY_FRESH;
+        }
+        // Likewise for a local copy whose upload is queued from saint mode
+        else if (writequeue_contains(path)) {
+            log_print(LOG_DEBUG, SECTION_FUSEDAV_STAT, "get_stat: %s has a queued upload; using the cache", path);
+            skip_freshness_check = ALREADY_FRESH;
+        }
+    }
 
     // Check if we can directly hit this entry in the stat cache.
     ret = get_stat_from_cache(path, stbuf, skip_freshness_check, &tmpgerr);
@@ -770,6 +830,11 @@ static void common_getattr(const char *path, struct stat *stbuf, struct fuse_fil
             }
             break;
         }
+        // A file being written to may be ahead of the stat cache
+        if (S_ISREG(stbuf->st_mode) && filecache_deferred_stat(path, stbuf)) {
+            log_print(LOG_DEBUG, SECTION_FUSEDAV_STAT, "common_getattr: size %lu from open handle on %s", stbuf->st_size, path);
+        }
+
         // These are taken care of by fill_stat_generic below if path is NULL
         if (S_ISDIR(stbuf->st_mode))
             stbuf->st_mode |= S_IFDIR;
@@ -787,6 +852,14 @@ static void common_getattr(const char *path, struct stat *stbuf, struct fuse_fil
             g_propagate_prefixed_error(gerr, tmpgerr, "common_getattr: ");
             return;
         }
+        // Files served inline or from a slab don't have an fd of their own to get the size from
+        {
+            off_t size = filecache_packed_size(info);
+            if (size >= 0) {
+                stbuf->st_size = size;
+                stbuf->st_blocks = (size + 511) / 512;
+            }
+        }
     }
 
     // Zero-out unused nanosecond fields.
@@ -1256,7 +1329,9 @@ static int dav_release(const char *path, __unused struct fuse_file_info *info) {
     // We still need to close the file.
 
     if (path != NULL) {
-        bool wrote_data = filecache_sync(config->cache, path, info, true, &gerr);
+        // Handles on the same path share one upload, which goes with the last of them
+        bool last = filecache_release(info);
+        bool wrote_data = filecache_sync(config->cache, path, info, last, &gerr);
 
         // If we didn't write data, we either got an error, which we handle below, or there is no error,
         // so just fall through (not writable, not modified are examples)
@@ -1387,6 +1462,7 @@ static int dav_fsync(const char *path, __unused int isdatasync, struct fuse_file
         if (gerr) {
             return processed_gerror("dav_fsync: ", path, &gerr);
         }
+        filecache_stat_published(info);
     }
 
     return 0;
@@ -1407,7 +1483,8 @@ static int dav_flush(const char *path, struct fuse_file_info *info) {
         struct stat_cache_value value;
         memset(&value, 0, sizeof(struct stat_cache_value));
 
-        wrote_data = filecache_sync(config->cache, path, info, true, &gerr);
+        // While other handles share the file, leave the PUT to the last of them
+        wrote_data = filecache_sync(config->cache, path, info, !filecache_shared(info), &gerr);
         if (gerr) {
             return processed_gerror("dav_flush: ", path, &gerr);
         }
@@ -1423,6 +1500,7 @@ static int dav_flush(const char *path, struct fuse_file_info *info) {
             if (gerr) {
                 return processed_gerror("dav_flush: ", path, &gerr);
             }
+            filecache_stat_published(info);
         }
     }
 
@@ -1498,6 +1576,10 @@ static int dav_open(const char *path, struct fuse_file_info *info) {
         return ret;
     }
 
+    if (!(info->flags & O_TRUNC)) {
+        warmup_record(path, false);
+    }
+
     // Update stat cache value to reset the file size to 0 on trunc.
     if (info->flags & O_TRUNC) {
         struct stat_cache_value value;
@@ -1572,7 +1654,6 @@ static int dav_write(const char *path, const char *buf, size_t size, off_t offse
     struct fusedav_config *config = fuse_get_context()->private_data;
     GError *gerr = NULL;
     ssize_t bytes_written;
-    struct stat_cache_value value;
 
     BUMP(dav_write);
 
@@ -1593,33 +1674,21 @@ static int dav_write(const char *path, const char *buf, size_t size, off_t offse
     }
 
     if (path != NULL) {
-        int fd;
         filecache_sync(config->cache, path, info, false, &gerr);
         if (gerr) {
             return processed_gerror("dav_write: ", path, &gerr);
         }
 
-        // Zero-out structure; some fields we don't populate but want to be 0, e.g. st_atim.tv_nsec
-        memset(&value, 0, sizeof(struct stat_cache_value));
-
-        fd = filecache_fd(info);
-        // mode = 0 (unspecified), is_dir = false; fd to get size
-        fill_stat_generic(&(value.st), 0, false, fd, &gerr);
-        if (gerr) {
-            return processed_gerror("dav_write: ", path, &gerr);
-        }
-        else {
-            if (file_too_big(value.st.st_size, config->max_file_size, path)) {
-                // The file will now carry along with it the fact that there has been an error.
-                // Eventually, this will send the file to forensic haven
-                filecache_set_error(info, EFBIG);
-                return (-EFBIG);
-            }
-            stat_cache_value_set(config->cache, path, &value, &gerr);
-            if (gerr) {
-                return processed_gerror("dav_write: ", path, &gerr);
-            }
+        // A write can only make the file too big by extending it
+        if (file_too_big(offset + bytes_written, config->max_file_size, path)) {
+            // The file will now carry along with it the fact that there has been an error.
+            // Eventually, this will send the file to forensic haven
+            filecache_set_error(info, EFBIG);
+            return (-EFBIG);
         }
+
+        // The stat cache catches up at flush or release; until then getattr asks the handle
+        filecache_defer_stat(path, info);
     }
 
    return bytes_written;
@@ -1877,16 +1946,134 @@ static void *cache_cleanup(void *ptr) {
     return NULL;
 }
 
+static void warmup_noop_callback(__unused const char *path_prefix, __unused const char *filename, __unused void *user) {
+}
+
+// Refreshes the stat and file cache entries for one path from the warm-up record
+static void warmup_path(const char *path, bool is_dir, void *userdata) {
+    struct fusedav_config *config = userdata;
+    GError *gerr = NULL;
+
+    // Don't add to the load on a cluster we already think is in trouble
+    if (config->grace && use_saint_mode()) {
+        log_print(LOG_INFO, SECTION_FUSEDAV_DEFAULT, "warmup_path: in saint mode; skipping %s", path);
+        return;
+    }
+
+    usleep(WARMUP_PAUSE_USEC);
+
+    if (is_dir) {
+        int ret;
+
+        // Real traffic may have got here first
+        ret = stat_cache_enumerate(config->cache, path, warmup_noop_callback, NULL, false);
+        if (ret == 0) return;
+
+        update_directory(path, (ret == -STAT_CACHE_OLD_DATA), &gerr);
+        if (gerr) {
+            processed_gerror("warmup_path: ", path, &gerr);
+            return;
+        }
+        BUMP(warmup_dir);
+    }
+    else {
+        struct fuse_file_info info;
+        struct stat st;
+
+        get_stat(path, &st, &gerr);
+        if (gerr) {
+            // Most likely the file has gone away since the record was saved
+            processed_gerror("warmup_path: ", path, &gerr);
+            return;
+        }
+        if (!S_ISREG(st.st_mode)) return;
+
+        // A read-only open fetches the body if we don't have it, or revalidates it if we do
+        memset(&info, 0, sizeof(struct fuse_file_info));
+        info.flags = O_RDONLY;
+        filecache_open(config->cache_path, config->cache, path, &info, config->grace, &gerr);
+        if (gerr) {
+            processed_gerror("warmup_path: ", path, &gerr);
+            return;
+        }
+        filecache_close(&info, &gerr);
+        if (gerr) {
+            processed_gerror("warmup_path: ", path, &gerr);
+            return;
+        }
+        BUMP(warmup_file);
+    }
+}
+
+/* Replays the paths which were hot before the last restart, then keeps the record
+ * up to date. The fuse operations we borrow find the config through the fuse
+ * context; this thread isn't one of fuse's, so it gets a context of its own
+ * with only private_data filled in.
+ */
+static void *cache_warmup(void *ptr) {
+    struct fusedav_config *config = (struct fusedav_config *)ptr;
+    GError *gerr = NULL;
+
+    log_print(LOG_DEBUG, SECTION_FUSEDAV_DEFAULT, "enter cache_warmup");
+
+    fuse_get_context()->private_data = config;
+
+    // Leave the cpu to the threads serving requests
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19)) {
+        log_print(LOG_NOTICE, SECTION_FUSEDAV_DEFAULT, "cache_warmup: can't lower priority: %d %s", errno, strerror(errno));
+    }
+
+    warmup_replay(warmup_path, config);
+    log_print(LOG_NOTICE, SECTION_FUSEDAV_DEFAULT, "cache_warmup: warmed %u directories and %u files",
+        FETCH(warmup_dir), FETCH(warmup_file));
+
+    while (true) {
+        if ((sleep(WARMUP_SAVE_INTERVAL)) != 0) {
+            log_print(LOG_CRIT, SECTION_FUSEDAV_DEFAULT, "cache_warmup: sleep interrupted; exiting ...");
+            return NULL;
+        }
+        warmup_save(&gerr);
+        if (gerr) {
+            processed_gerror("cache_warmup: ", config->cache_path, &gerr);
+        }
+    }
+    return NULL;
+}
+
+static void *write_queue_replay(void *ptr) {
+    struct fusedav_config *config = (struct fusedav_config *)ptr;
+    int uploaded;
+
+    log_print(LOG_DEBUG, SECTION_FUSEDAV_DEFAULT, "enter write_queue_replay");
+
+    while (true) {
+        if ((sleep(WRITE_QUEUE_INTERVAL)) != 0) {
+            log_print(LOG_CRIT, SECTION_FUSEDAV_DEFAULT, "write_queue_replay: sleep interrupted; exiting ...");
+            return NULL;
+        }
+        // Stops at the first failure, or if the cluster is (still) in saint mode
+        uploaded = filecache_replay_writes(config->cache);
+        if (uploaded > 0) {
+            log_print(LOG_NOTICE, SECTION_FUSEDAV_DEFAULT, "write_queue_replay: uploaded %d writes queued in saint mode", uploaded);
+        }
+    }
+    return NULL;
+}
+
 int main(int argc, char *argv[]) {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     struct fusedav_config config;
     struct fuse_chan *ch = NULL;
     char *mountpoint = NULL;
     GError *gerr = NULL;
+    GError *savegerr = NULL; // warmup_save's, kept apart from whatever sent us to finish
     pthread_t cache_cleanup_thread;
+    pthread_t cache_warmup_thread;
+    pthread_t write_queue_thread;
     pthread_t error_injection_thread;
     int ret = -1;
     int limres;
+    int refresh_ret;
     struct rlimit lim;
 
     limres = getrlimit(RLIMIT_CORE, &lim);
@@ -1966,8 +2153,22 @@ int main(int argc, char *argv[]) {
         sleep(10);
     }
 
+    // Like the other threads, the engine's has to be started after daemonizing
+    if (config.async_engine) {
+        int engine_ret = httpengine_init();
+        if (engine_ret < 0) {
+            log_print(LOG_ERR, SECTION_FUSEDAV_MAIN, "Failed to start the async request engine: %s. Not fatal.", strerror(-engine_ret));
+        }
+    }
+
+    // Looks up the nodes and warms connections to them before the first request needs them
+    refresh_ret = session_refresh_init();
+    if (refresh_ret < 0) {
+        log_print(LOG_ERR, SECTION_FUSEDAV_MAIN, "Failed to start the node refresh thread: %s. Not fatal.", strerror(-refresh_ret));
+    }
+
     // Ensure directory exists for file content cache.
-    filecache_init(config.cache_path, &gerr);
+    filecache_init(&config, &gerr);
     if (gerr) {
         log_print(LOG_CRIT, SECTION_FUSEDAV_MAIN, "main: %s.", gerr->message);
         goto finish;
@@ -1992,6 +2193,20 @@ int main(int argc, char *argv[]) {
         goto finish;
     }
 
+    if (config.saint_write_queue) {
+        if (pthread_create(&write_queue_thread, NULL, write_queue_replay, &config)) {
+            log_print(LOG_CRIT, SECTION_FUSEDAV_MAIN, "Failed to create write queue thread.");
+            goto finish;
+        }
+    }
+
+    if (config.warmup_paths > 0) {
+        warmup_init(config.cache_path, config.warmup_paths);
+        if (pthread_create(&cache_warmup_thread, NULL, cache_warmup, &config)) {
+            log_print(LOG_CRIT, SECTION_FUSEDAV_MAIN, "Failed to create cache warmup thread. Not fatal.");
+        }
+    }
+
     log_print(LOG_NOTICE, SECTION_FUSEDAV_MAIN, "Startup complete. Entering main FUSE loop.");
 
     if (config.singlethread) {
@@ -2020,6 +2235,12 @@ finish:
 
     dump_stats(false, config.cache_path); // false means output to file, not to log
 
+    warmup_save(&savegerr);
+    if (savegerr) {
+        log_print(LOG_WARNING, SECTION_FUSEDAV_MAIN, "main: warmup_save failed on %s: %s", config.cache_path, savegerr->message);
+        g_clear_error(&savegerr);
+    }
+
     if (ch != NULL) {
         log_print(LOG_DEBUG, SECTION_FUSEDAV_MAIN, "Unmounting: %s", mountpoint);
         fuse_unmount(mountpoint, ch);
@@ -2042,6 +2263,10 @@ finish:
     session_config_free();
     log_print(LOG_DEBUG, SECTION_FUSEDAV_MAIN, "Cleaned up session system.");
 
+    // The slab still being filled is only kept for the next run if it's sealed
+    slabstore_close();
+    log_print(LOG_DEBUG, SECTION_FUSEDAV_MAIN, "Sealed the slab store.");
+
     // We don't capture any errors from stat_cache_close
     stat_cache_close(config.cache, config.cache_supplemental);
 
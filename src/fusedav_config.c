@@ -131,6 +131,21 @@ static void print_config(struct fusedav_config *config) {
     log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "log_level_by_section %s", config->log_level_by_section);
     log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "log_prefix %s", config->log_prefix);
     log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "max_file_size %d", config->max_file_size);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "inline_file_size %d", config->inline_file_size);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "slab_store %d", config->slab_store);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "passthrough_file_size %d", config->passthrough_file_size);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "fd_pool_size %d", config->fd_pool_size);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "chunked_upload_size %d", config->chunked_upload_size);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "append_uploads %d", config->append_uploads);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "warmup_paths %d", config->warmup_paths);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "max_staleness %d", config->max_staleness);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "write_buffer_size %d", config->write_buffer_size);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "io_uring %d", config->io_uring);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "saint_write_queue %d", config->saint_write_queue);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "connection_pool %d", config->connection_pool);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "async_engine %d", config->async_engine);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "hedge_requests %d", config->hedge_requests);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "adaptive_timeouts %d", config->adaptive_timeouts);
     log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "statsd_host %s", config->statsd_host);
     log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "statsd_port %s", config->statsd_port);
 
@@ -157,6 +172,21 @@ log_level=5
 log_level_by_section=0
 log_prefix=6f7a106722f74cc7bd96d4d06785ed78
 max_file_size=256
+inline_file_size=4096
+slab_store=false
+passthrough_file_size=64
+fd_pool_size=256
+chunked_upload_size=32
+append_uploads=false
+warmup_paths=2000
+max_staleness=60
+write_buffer_size=256
+io_uring=false
+saint_write_queue=true
+connection_pool=true
+async_engine=false
+hedge_requests=false
+adaptive_timeouts=false
 statsd_host=127.0.0.1
 statsd_port=8126
 */
@@ -198,6 +228,21 @@ static void parse_configs(struct fusedav_config *config, GError **gerr) {
         keytuple(fusedav, log_level_by_section, STRING),
         keytuple(fusedav, log_prefix, STRING),
         keytuple(fusedav, max_file_size, INT),
+        keytuple(fusedav, inline_file_size, INT),
+        keytuple(fusedav, slab_store, BOOL),
+        keytuple(fusedav, passthrough_file_size, INT),
+        keytuple(fusedav, fd_pool_size, INT),
+        keytuple(fusedav, chunked_upload_size, INT),
+        keytuple(fusedav, append_uploads, BOOL),
+        keytuple(fusedav, warmup_paths, INT),
+        keytuple(fusedav, max_staleness, INT),
+        keytuple(fusedav, write_buffer_size, INT),
+        keytuple(fusedav, io_uring, BOOL),
+        keytuple(fusedav, saint_write_queue, BOOL),
+        keytuple(fusedav, connection_pool, BOOL),
+        keytuple(fusedav, async_engine, BOOL),
+        keytuple(fusedav, hedge_requests, BOOL),
+        keytuple(fusedav, adaptive_timeouts, BOOL),
         keytuple(fusedav, statsd_host, STRING),
         keytuple(fusedav, statsd_port, STRING),
         {NULL, NULL, 0, 0}
@@ -304,7 +349,8 @@ void configure_fusedav(struct fusedav_config *config, struct fuse_args *args, ch
         return;
     }
 
-    if (session_config_init(config->uri, config->ca_certificate, config->client_certificate, config->grace) < 0 || inject_error(config_error_sessioninit)) {
+    if (session_config_init(config->uri, config->ca_certificate, config->client_certificate, config->grace, config->connection_pool, config->hedge_requests,
+            config->adaptive_timeouts) < 0 || inject_error(config_error_sessioninit)) {
         g_set_error(gerr, fusedav_config_quark(), ENETDOWN, "configure_fusedav: Failed to initialize session system.");
         return;
     }
@@ -53,6 +53,21 @@ struct fusedav_config {
     char *log_level_by_section;
     char *log_prefix;
     int  max_file_size;
+    int  inline_file_size;
+    bool slab_store;
+    int  passthrough_file_size; // MB; 0 is off
+    int  fd_pool_size;
+    int  chunked_upload_size; // MB; 0 is off
+    bool append_uploads;
+    int  warmup_paths; // 0 is off
+    int  max_staleness; // seconds; 0 is off
+    int  write_buffer_size; // KB; 0 is off
+    bool io_uring;
+    bool saint_write_queue;
+    bool connection_pool; // one connection cache, DNS cache and TLS session cache for all threads, HTTP/2 where the nodes offer it
+    bool async_engine; // run requests on one curl multi handle with its own thread
+    bool hedge_requests; // send GETs and PROPFINDs which are slow to answer to a second node too
+    bool adaptive_timeouts; // time requests out by how long each node has been taking, not fixed limits
     char *statsd_host;
     char *statsd_port;
     char *conf;
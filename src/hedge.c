@@ -0,0 +1,269 @@
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <time.h>
+
+#include "hedge.h"
+#include "nodescore.h"
+
+/* This file has no dependencies on the rest of fusedav, so that
+ * tests/hedge-bench.c can build it on its own. Callers do the logging and stats.
+ */
+
+// Hedges saved up for bursts; the budget is kept in hundredths of a hedge
+#define HEDGE_BURST 10
+#define BUDGET_MAX (HEDGE_BURST * 100)
+
+static int budget = BUDGET_MAX;
+
+struct hedge_state;
+
+struct attempt {
+    struct hedge_state *state;
+    CURL *session;
+    int node;
+    struct timespec start;
+    bool done;
+    bool cut_off; // lost to the other attempt
+    CURLcode res;
+};
+
+struct hedge_state {
+    struct hedge_request *request;
+    // The attempt which started answering first; only it gets to write
+    struct attempt *winner;
+};
+
+static long elapsed_ms(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((now.tv_sec - start->tv_sec) * 1000) + ((now.tv_nsec - start->tv_nsec) / (1000 * 1000));
+}
+
+// Each hedgeable request earns HEDGE_BUDGET_PERCENT hundredths of a hedge
+static void budget_add(int amount) {
+    int old;
+    int new;
+
+    do {
+        old = budget;
+        new = old + amount;
+        if (new > BUDGET_MAX) new = BUDGET_MAX;
+    } while (old != new && !__sync_bool_compare_and_swap(&budget, old, new));
+}
+
+static void budget_earn(void) {
+    budget_add(HEDGE_BUDGET_PERCENT);
+}
+
+static bool budget_spend(void) {
+    int old;
+
+    do {
+        old = budget;
+        if (old < 100) return false;
+    } while (!__sync_bool_compare_and_swap(&budget, old, old - 100));
+    return true;
+}
+
+// The first attempt to get any of the response wins; the other is cut off
+static bool claim(struct attempt *attempt) {
+    if (attempt->state->winner == NULL) attempt->state->winner = attempt;
+    if (attempt->state->winner == attempt) return true;
+    attempt->cut_off = true;
+    return false;
+}
+
+static size_t hedge_write(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    struct attempt *attempt = userdata;
+    struct hedge_request *request = attempt->state->request;
+
+    if (!claim(attempt)) return 0;
+    return request->write_fn(ptr, size, nmemb, request->write_data);
+}
+
+static size_t hedge_header(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    struct attempt *attempt = userdata;
+    struct hedge_request *request = attempt->state->request;
+
+    if (!claim(attempt)) return 0;
+    if (request->header_fn == NULL) return size * nmemb;
+    return request->header_fn(ptr, size, nmemb, request->header_data);
+}
+
+static void start_attempt(struct attempt *attempt, struct hedge_state *state, CURL *session, int node) {
+    memset(attempt, 0, sizeof(struct attempt));
+    attempt->state = state;
+    attempt->session = session;
+    attempt->node = node;
+    curl_easy_setopt(session, CURLOPT_WRITEFUNCTION, hedge_write);
+    curl_easy_setopt(session, CURLOPT_WRITEDATA, attempt);
+    curl_easy_setopt(session, CURLOPT_HEADERFUNCTION, hedge_header);
+    curl_easy_setopt(session, CURLOPT_HEADERDATA, attempt);
+    nodescore_start(node);
+    clock_gettime(CLOCK_MONOTONIC, &attempt->start);
+}
+
+/* An attempt which was cut off, or never got to finish, was slow but didn't fail.
+ * Notes in request if this opened the node's breaker.
+ */
+static void score_attempt(struct attempt *attempt, struct hedge_request *request) {
+    long elapsed = elapsed_ms(&attempt->start);
+    long response_code = 0;
+    bool ok = true;
+
+    if (!attempt->cut_off && attempt->done) {
+        if (attempt->res == CURLE_OK) curl_easy_getinfo(attempt->session, CURLINFO_RESPONSE_CODE, &response_code);
+        ok = (attempt->res == CURLE_OK && response_code < 500 && elapsed <= request->slow_ms);
+    }
+    if (nodescore_done(attempt->node, ok, elapsed)) {
+        request->breaker_opened = true;
+        request->breaker_node = attempt->node;
+    }
+}
+
+/* How long to wait for an answer before hedging: the percentile of recent latencies,
+ * between floor_ms and ceiling_ms; the ceiling until there are enough requests to go on.
+ */
+long hedge_delay(struct latency_hist *hist, int percentile, long floor_ms, long ceiling_ms) {
+    long delay = latency_percentile(hist, percentile, 100);
+
+    if (delay < 0 || delay > ceiling_ms) return ceiling_ms;
+    if (delay < floor_ms) return floor_ms;
+    return delay;
+}
+
+/* Does the request on session, set up for request->node, hedging it if it's slow to answer.
+ * The response goes to request's callbacks; the caller mustn't set write or header callbacks.
+ * Scores both attempts on the scoreboard, noting in request if that opened a breaker.
+ * Returns the result of the attempt which answered, or if neither did, of the first.
+ */
+CURLcode hedge_perform(CURL *session, struct hedge_request *request) {
+    struct hedge_state state;
+    struct attempt attempts[2];
+    struct attempt *answered;
+    int num_attempts = 1;
+    bool hedge_considered = false;
+    CURLM *multi;
+    CURLcode res;
+
+    memset(&state, 0, sizeof(struct hedge_state));
+    state.request = request;
+    request->answered = session;
+    request->hedged = false;
+    request->over_budget = false;
+    request->breaker_opened = false;
+    request->breaker_node = -1;
+    budget_earn();
+
+    start_attempt(&attempts[0], &state, session, request->node);
+
+    multi = curl_multi_init();
+    if (multi == NULL) {
+        attempts[0].res = curl_easy_perform(session);
+        attempts[0].done = true;
+        score_attempt(&attempts[0], request);
+        return attempts[0].res;
+    }
+    curl_multi_add_handle(multi, session);
+
+    while (true) {
+        struct CURLMsg *msg;
+        bool all_done = true;
+        int timeout_ms = 1000;
+        int running;
+        int left;
+
+        curl_multi_perform(multi, &running);
+        while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+            CURL *done_session;
+
+            if (msg->msg != CURLMSG_DONE) continue;
+            // msg goes away with the handle
+            done_session = msg->easy_handle;
+            for (int idx = 0; idx < num_attempts; idx++) {
+                if (attempts[idx].session == done_session) {
+                    attempts[idx].done = true;
+                    attempts[idx].res = msg->data.result;
+                }
+            }
+            curl_multi_remove_handle(multi, done_session);
+        }
+
+        if (state.winner && state.winner->done) break;
+        for (int idx = 0; idx < num_attempts; idx++) {
+            if (!attempts[idx].done) all_done = false;
+        }
+        if (all_done) break;
+
+        if (!hedge_considered && state.winner == NULL) {
+            long waited = elapsed_ms(&attempts[0].start);
+
+            if (waited < request->delay_ms) {
+                timeout_ms = request->delay_ms - waited;
+            }
+            else {
+                int node = -1;
+                CURL *copy = NULL;
+
+                /* Picking a node may claim its breaker's probe, which then has to go out, so
+                 * pick only once the hedge is paid for and its handle is ready; a hedge which
+                 * doesn't go out after all gets its budget back.
+                 */
+                hedge_considered = true;
+                if (!budget_spend()) {
+                    request->over_budget = true;
+                }
+                else if ((copy = curl_easy_duphandle(session)) == NULL || (node = nodescore_pick_other(request->node)) < 0) {
+                    if (copy) curl_easy_cleanup(copy);
+                    budget_add(100);
+                }
+                else {
+                    curl_easy_setopt(copy, CURLOPT_CONNECT_TO, nodescore_connect_to(node));
+                    start_attempt(&attempts[1], &state, copy, node);
+                    curl_multi_add_handle(multi, copy);
+                    num_attempts = 2;
+                    request->hedged = true;
+                    continue;
+                }
+            }
+        }
+
+        curl_multi_wait(multi, NULL, 0, timeout_ms, NULL);
+    }
+
+    for (int idx = 0; idx < num_attempts; idx++) {
+        if (!attempts[idx].done) curl_multi_remove_handle(multi, attempts[idx].session);
+        score_attempt(&attempts[idx], request);
+    }
+    curl_multi_cleanup(multi);
+
+    answered = state.winner ? state.winner : &attempts[0];
+    res = answered->res;
+    request->answered = answered->session;
+    if (num_attempts == 2 && answered != &attempts[1]) {
+        curl_easy_cleanup(attempts[1].session);
+    }
+
+    return res;
+}
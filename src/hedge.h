@@ -0,0 +1,66 @@
+#ifndef foohedgehfoo
+#define foohedgehfoo
+
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#include <stdbool.h>
+#include <curl/curl.h>
+
+#include "latency.h"
+
+/* Hedged requests, for requests which are safe to send twice (GET, PROPFIND).
+ * If the node a request went to hasn't started answering by the time most requests of
+ * its kind have finished (a percentile of recent latencies), a copy of the request goes
+ * to another node, and whichever starts answering first gets to write the response;
+ * the other is dropped. One stalled node then costs a request the hedge delay, not
+ * a timeout and a retry.
+ * Hedges are limited to HEDGE_BUDGET_PERCENT of hedgeable requests, so a cluster which
+ * is slow all over doesn't get twice the load.
+ * Both attempts run on a multi handle of their own, on the caller's thread, so the
+ * response callbacks run there too.
+ */
+
+// At most this many hedges per hundred hedgeable requests, with a few saved up for bursts
+#define HEDGE_BUDGET_PERCENT 5
+
+// Same as curl's write and header callbacks, but taking void * like fusedav's own
+typedef size_t (*hedge_write_fn)(void *ptr, size_t size, size_t nmemb, void *userdata);
+
+struct hedge_request {
+    // Where the response goes. curl has no way to read these back off the handle, so
+    // the caller gives them to us instead of setting them; header_fn may be NULL
+    hedge_write_fn write_fn;
+    void *write_data;
+    hedge_write_fn header_fn;
+    void *header_data;
+    int node;          // the scoreboard node the request is set up for, with CURLOPT_CONNECT_TO
+    long delay_ms;     // how long to wait for an answer before sending the hedge
+    long slow_ms;      // an answer slower than this counts against its node
+    // Filled in by hedge_perform
+    CURL *answered;    // the handle which answered: the caller's, or a copy the caller must clean up
+    bool hedged;       // a hedge went out
+    bool over_budget;  // a hedge was due, but the budget was spent
+    bool breaker_opened; // scoring an attempt opened its node's circuit breaker
+    int breaker_node;    // whose, if so; the hedge's if both did
+};
+
+long hedge_delay(struct latency_hist *hist, int percentile, long floor_ms, long ceiling_ms);
+CURLcode hedge_perform(CURL *session, struct hedge_request *request);
+
+#endif
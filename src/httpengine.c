@@ -0,0 +1,238 @@
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "httpengine.h"
+
+/* This file has no dependencies on the rest of fusedav, so that
+ * tests/httpengine-bench.c can build it on its own. Callers do the logging.
+ */
+
+// curl_multi_poll and curl_multi_wakeup came in 7.66 and 7.68
+#if LIBCURL_VERSION_NUM >= 0x074400
+
+// Longest the engine thread sleeps when nothing happens; new requests wake it at once
+#define ENGINE_POLL_MS 1000
+
+struct engine_request {
+    CURL *session;
+    httpengine_done_fn done; // NULL if the submitter waits in httpengine_perform
+    void *userdata;
+    // Only for waiters, whose request lives on their stack
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool finished;
+    CURLcode res;
+    struct engine_request *next;
+};
+
+// Only the engine thread touches the multi handle, except for curl_multi_wakeup
+static CURLM *multi = NULL;
+static bool engine_running = false;
+static unsigned in_flight = 0;
+
+// Requests handed in, but not yet added to the multi handle
+static pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct engine_request *pending_head = NULL;
+static struct engine_request *pending_tail = NULL;
+
+static void finish_request(struct engine_request *req, CURLcode res) {
+    __sync_fetch_and_sub(&in_flight, 1);
+
+    if (req->done) {
+        req->done(req->session, res, req->userdata);
+        free(req);
+        return;
+    }
+
+    // The waiter frees req as soon as it sees finished, so don't touch it after the unlock
+    pthread_mutex_lock(&req->lock);
+    req->res = res;
+    req->finished = true;
+    pthread_cond_signal(&req->cond);
+    pthread_mutex_unlock(&req->lock);
+}
+
+static void *run_engine(__attribute__((unused)) void *ptr) {
+    while (true) {
+        struct engine_request *req;
+        struct CURLMsg *msg;
+        int running;
+        int left;
+
+        pthread_mutex_lock(&pending_mutex);
+        req = pending_head;
+        pending_head = NULL;
+        pending_tail = NULL;
+        pthread_mutex_unlock(&pending_mutex);
+
+        while (req) {
+            struct engine_request *next = req->next;
+            curl_easy_setopt(req->session, CURLOPT_PRIVATE, req);
+            if (curl_multi_add_handle(multi, req->session) != CURLM_OK) {
+                finish_request(req, CURLE_FAILED_INIT);
+            }
+            req = next;
+        }
+
+        curl_multi_perform(multi, &running);
+
+        while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+            CURL *session;
+            CURLcode res;
+            char *priv = NULL;
+
+            if (msg->msg != CURLMSG_DONE) continue;
+            // msg goes away with the handle
+            session = msg->easy_handle;
+            res = msg->data.result;
+            curl_easy_getinfo(session, CURLINFO_PRIVATE, &priv);
+            curl_multi_remove_handle(multi, session);
+            finish_request((struct engine_request *) priv, res);
+        }
+
+        curl_multi_poll(multi, NULL, 0, ENGINE_POLL_MS, NULL);
+    }
+    return NULL;
+}
+
+static void enqueue_request(struct engine_request *req) {
+    req->next = NULL;
+    __sync_fetch_and_add(&in_flight, 1);
+
+    pthread_mutex_lock(&pending_mutex);
+    if (pending_tail) {
+        pending_tail->next = req;
+    }
+    else {
+        pending_head = req;
+    }
+    pending_tail = req;
+    pthread_mutex_unlock(&pending_mutex);
+
+    curl_multi_wakeup(multi);
+}
+
+// Returns 0, or -errno if the engine can't be started; requests are then done on the caller's thread
+int httpengine_init(void) {
+    pthread_t thread;
+    int ret;
+
+    if (engine_running) return 0;
+
+    multi = curl_multi_init();
+    if (multi == NULL) return -ENOMEM;
+    // Requests for the same node share its HTTP/2 connections
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+    ret = pthread_create(&thread, NULL, run_engine, NULL);
+    if (ret) {
+        curl_multi_cleanup(multi);
+        multi = NULL;
+        return -ret;
+    }
+    pthread_detach(thread);
+    engine_running = true;
+
+    return 0;
+}
+
+bool httpengine_running(void) {
+    return engine_running;
+}
+
+CURLcode httpengine_perform(CURL *session) {
+    struct engine_request req;
+
+    if (!engine_running) return curl_easy_perform(session);
+
+    memset(&req, 0, sizeof(struct engine_request));
+    req.session = session;
+    pthread_mutex_init(&req.lock, NULL);
+    pthread_cond_init(&req.cond, NULL);
+
+    enqueue_request(&req);
+
+    pthread_mutex_lock(&req.lock);
+    while (!req.finished) {
+        pthread_cond_wait(&req.cond, &req.lock);
+    }
+    pthread_mutex_unlock(&req.lock);
+
+    pthread_cond_destroy(&req.cond);
+    pthread_mutex_destroy(&req.lock);
+
+    return req.res;
+}
+
+// Returns 0, or -errno if the request couldn't be handed over, in which case done isn't called
+int httpengine_submit(CURL *session, httpengine_done_fn done, void *userdata) {
+    struct engine_request *req;
+
+    if (!engine_running) {
+        done(session, curl_easy_perform(session), userdata);
+        return 0;
+    }
+
+    req = calloc(1, sizeof(struct engine_request));
+    if (req == NULL) return -ENOMEM;
+    req->session = session;
+    req->done = done;
+    req->userdata = userdata;
+
+    enqueue_request(req);
+
+    return 0;
+}
+
+unsigned httpengine_in_flight(void) {
+    return in_flight;
+}
+
+#else // libcurl too old for the engine
+
+int httpengine_init(void) {
+    return -ENOSYS;
+}
+
+bool httpengine_running(void) {
+    return false;
+}
+
+CURLcode httpengine_perform(CURL *session) {
+    return curl_easy_perform(session);
+}
+
+int httpengine_submit(CURL *session, httpengine_done_fn done, void *userdata) {
+    done(session, curl_easy_perform(session), userdata);
+    return 0;
+}
+
+unsigned httpengine_in_flight(void) {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef foohttpenginehfoo
+#define foohttpenginehfoo
+
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#include <stdbool.h>
+#include <curl/curl.h>
+
+/* Once started, the engine runs every request on one curl multi handle, driven by
+ * its own thread, so that many requests can be in flight at once however few threads
+ * asked for them, and HTTP/2 connections are multiplexed between them.
+ * httpengine_perform stands in for curl_easy_perform: the caller waits for its
+ * request to finish. httpengine_submit doesn't wait; done is called on the engine
+ * thread when the request finishes, and the handle is the submitter's again then.
+ * If the engine isn't running, both do the request on the caller's thread.
+ * Otherwise, the handle's callbacks (read, write, debug...) run on the engine thread,
+ * so they mustn't rely on the caller's thread-local state, nor block for long.
+ */
+
+typedef void (*httpengine_done_fn)(CURL *session, CURLcode res, void *userdata);
+
+int httpengine_init(void);
+bool httpengine_running(void);
+CURLcode httpengine_perform(CURL *session);
+int httpengine_submit(CURL *session, httpengine_done_fn done, void *userdata);
+unsigned httpengine_in_flight(void);
+
+#endif
@@ -0,0 +1,316 @@
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "ioengine.h"
+
+/* This file has no dependencies on the rest of fusedav, so that
+ * tests/ioengine-bench.c can build it on its own. Callers do the logging.
+ */
+
+#ifdef HAVE_LIBURING
+
+#define IOENGINE_QUEUE_DEPTH 256
+// How many times to retry a submit the kernel refuses for now (EINTR, EAGAIN, EBUSY), 1ms apart
+#define IOENGINE_SUBMIT_RETRIES 100
+
+enum ioreq_op {IOREQ_READ, IOREQ_WRITE};
+
+/* One per request, on the caller's stack; the caller waits on it until the completion thread
+ * fills in res, or until the submitter gives up on the ring and sets fallback.
+ */
+struct ioreq {
+    enum ioreq_op op;
+    int fd;
+    void *buf;
+    size_t count;
+    off_t offset;
+    struct ioreq *next; // in staged
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    bool fallback; // never submitted; the caller does the I/O with a plain syscall
+    int res;
+};
+
+static struct io_uring ring;
+static bool uring_active = false;
+
+/* Callers don't touch the ring. They add their request to staged, and the first one to find
+ * nobody submitting becomes the submitter: it takes everything staged, fills in entries for it
+ * and submits them with one syscall, and goes round again for whatever was staged meanwhile.
+ * So under load, one io_uring_enter carries the requests of every thread which arrived during
+ * the last one. Only the completion thread reaps.
+ * stage_mutex protects the variables below; the ring's submission side, and pending, belong
+ * to whoever set submitting.
+ */
+static pthread_mutex_t stage_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ioreq *staged_head = NULL;
+static struct ioreq *staged_tail = NULL;
+static bool submitting = false;
+// The kernel refused to take entries for good; nothing is submitted after this
+static bool uring_failed = false;
+
+// Filled in, not yet taken by the kernel, oldest first
+static struct ioreq *pending[IOENGINE_QUEUE_DEPTH];
+static unsigned num_pending = 0;
+
+static void complete_req(struct ioreq *req, int res, bool fallback) {
+    pthread_mutex_lock(&req->lock);
+    req->res = res;
+    req->fallback = fallback;
+    req->done = true;
+    pthread_cond_signal(&req->cond);
+    pthread_mutex_unlock(&req->lock);
+}
+
+static void *reap_completions(__attribute__((unused)) void *ptr) {
+    while (true) {
+        struct io_uring_cqe *cqe;
+        struct ioreq *req;
+        int ret;
+
+        ret = io_uring_wait_cqe(&ring, &cqe);
+        if (ret < 0) {
+            // EINTR, or nothing to wait for yet
+            continue;
+        }
+        req = io_uring_cqe_get_data(cqe);
+        ret = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+
+        complete_req(req, ret, false);
+    }
+    return NULL;
+}
+
+/* Submits everything pending. Returns 0, or the error from the kernel once it has refused
+ * IOENGINE_SUBMIT_RETRIES times running, or for good.
+ */
+static int submit_pending(void) {
+    int tries = 0;
+
+    while (num_pending > 0) {
+        int ret = io_uring_submit(&ring);
+
+        // The kernel takes entries in order, so the first ret of pending are in
+        if (ret > 0) {
+            num_pending -= ret;
+            memmove(pending, pending + ret, num_pending * sizeof(pending[0]));
+            tries = 0;
+            continue;
+        }
+        if (ret == 0) ret = -EAGAIN;
+        if ((ret == -EINTR || ret == -EAGAIN || ret == -EBUSY) && ++tries < IOENGINE_SUBMIT_RETRIES) {
+            usleep(1000);
+            continue;
+        }
+        return ret;
+    }
+    return 0;
+}
+
+/* Gives up on the ring. Entries can't be taken back out of it, but nothing is submitted from
+ * here on, so the kernel never sees what's pending or staged; those callers do the I/O themselves.
+ * Call with stage_mutex held.
+ */
+static void fail_uring(int err) {
+    uring_failed = true;
+    for (unsigned idx = 0; idx < num_pending; idx++) {
+        complete_req(pending[idx], err, true);
+    }
+    num_pending = 0;
+    while (staged_head) {
+        struct ioreq *req = staged_head;
+        staged_head = req->next;
+        complete_req(req, err, true);
+    }
+    staged_tail = NULL;
+}
+
+// As the submitter, submits what's staged until nothing is
+static void submit_staged(void) {
+    int ret = 0;
+
+    pthread_mutex_lock(&stage_mutex);
+    while (staged_head && !uring_failed) {
+        struct ioreq *req = staged_head;
+
+        staged_head = staged_tail = NULL;
+        pthread_mutex_unlock(&stage_mutex);
+
+        while (req && ret == 0) {
+            struct ioreq *next = req->next;
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+
+            // The queue is full of this batch; send it to make room
+            if (sqe == NULL) {
+                ret = submit_pending();
+                if (ret == 0) sqe = io_uring_get_sqe(&ring);
+                if (sqe == NULL) break;
+            }
+            if (req->op == IOREQ_READ) {
+                io_uring_prep_read(sqe, req->fd, req->buf, req->count, req->offset);
+            }
+            else {
+                io_uring_prep_write(sqe, req->fd, req->buf, req->count, req->offset);
+            }
+            io_uring_sqe_set_data(sqe, req);
+            pending[num_pending++] = req;
+            req = next;
+        }
+        if (ret == 0) ret = submit_pending();
+
+        pthread_mutex_lock(&stage_mutex);
+        // Whatever of this batch didn't get an entry goes back on the front of staged
+        if (req) {
+            struct ioreq *last = req;
+            while (last->next) last = last->next;
+            last->next = staged_head;
+            if (staged_head == NULL) staged_tail = last;
+            staged_head = req;
+        }
+        if (ret != 0) fail_uring(ret);
+    }
+    submitting = false;
+    pthread_mutex_unlock(&stage_mutex);
+}
+
+static ssize_t plain_rw(enum ioreq_op op, int fd, void *buf, size_t count, off_t offset) {
+    return (op == IOREQ_READ) ? pread(fd, buf, count, offset) : pwrite(fd, buf, count, offset);
+}
+
+static ssize_t uring_rw(enum ioreq_op op, int fd, void *buf, size_t count, off_t offset) {
+    struct ioreq req;
+    bool submitter = false;
+
+    req.op = op;
+    req.fd = fd;
+    req.buf = buf;
+    req.count = count;
+    req.offset = offset;
+    req.next = NULL;
+    req.done = false;
+    req.fallback = false;
+    req.res = 0;
+
+    pthread_mutex_lock(&stage_mutex);
+    if (uring_failed) {
+        pthread_mutex_unlock(&stage_mutex);
+        return plain_rw(op, fd, buf, count, offset);
+    }
+    pthread_mutex_init(&req.lock, NULL);
+    pthread_cond_init(&req.cond, NULL);
+    if (staged_tail) staged_tail->next = &req;
+    else staged_head = &req;
+    staged_tail = &req;
+    if (!submitting) {
+        submitting = true;
+        submitter = true;
+    }
+    pthread_mutex_unlock(&stage_mutex);
+
+    if (submitter) submit_staged();
+
+    pthread_mutex_lock(&req.lock);
+    while (!req.done) {
+        pthread_cond_wait(&req.cond, &req.lock);
+    }
+    pthread_mutex_unlock(&req.lock);
+
+    pthread_cond_destroy(&req.cond);
+    pthread_mutex_destroy(&req.lock);
+
+    if (req.fallback) return plain_rw(op, fd, buf, count, offset);
+    if (req.res < 0) {
+        errno = -req.res;
+        return -1;
+    }
+    return req.res;
+}
+
+// Returns 0, or -errno if io_uring was asked for but can't be had; plain syscalls are used then
+int ioengine_init(bool use_uring) {
+    pthread_t thread;
+    int ret;
+
+    if (!use_uring || uring_active) return 0;
+
+    ret = io_uring_queue_init(IOENGINE_QUEUE_DEPTH, &ring, 0);
+    if (ret < 0) return ret;
+
+    if (pthread_create(&thread, NULL, reap_completions, NULL)) {
+        ret = -errno;
+        io_uring_queue_exit(&ring);
+        return ret;
+    }
+    pthread_detach(thread);
+    uring_active = true;
+
+    return 0;
+}
+
+// False once the ring has failed, too. This is for counting, so it doesn't take the lock.
+bool ioengine_uring(void) {
+    return uring_active && !uring_failed;
+}
+
+ssize_t ioengine_pread(int fd, void *buf, size_t count, off_t offset) {
+    if (uring_active) return uring_rw(IOREQ_READ, fd, buf, count, offset);
+    return pread(fd, buf, count, offset);
+}
+
+ssize_t ioengine_pwrite(int fd, const void *buf, size_t count, off_t offset) {
+    // io_uring_prep_write takes a const buffer, but uring_rw's signature is shared with reads
+    if (uring_active) return uring_rw(IOREQ_WRITE, fd, (void *) (uintptr_t) buf, count, offset);
+    return pwrite(fd, buf, count, offset);
+}
+
+#else // no liburing at build time
+
+int ioengine_init(bool use_uring) {
+    return use_uring ? -ENOSYS : 0;
+}
+
+bool ioengine_uring(void) {
+    return false;
+}
+
+ssize_t ioengine_pread(int fd, void *buf, size_t count, off_t offset) {
+    return pread(fd, buf, count, offset);
+}
+
+ssize_t ioengine_pwrite(int fd, const void *buf, size_t count, off_t offset) {
+    return pwrite(fd, buf, count, offset);
+}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef fooioenginehfoo
+#define fooioenginehfoo
+
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Reads and writes on cache files go through here. By default they are plain
+ * pread/pwrite calls. With the io_uring engine, they are queued on one shared
+ * ring instead, and a completion thread hands the results back to the callers,
+ * who wait for them. The engine falls back to plain syscalls if the kernel (or
+ * the build) has no io_uring. The calls return what pread/pwrite would, with
+ * errno set on failure.
+ */
+
+int ioengine_init(bool use_uring);
+bool ioengine_uring(void);
+ssize_t ioengine_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t ioengine_pwrite(int fd, const void *buf, size_t count, off_t offset);
+
+#endif
@@ -0,0 +1,88 @@
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+
+#include "latency.h"
+
+/* This file has no dependencies on the rest of fusedav, so that
+ * the benches in tests/ can build it on their own.
+ */
+
+/* Bucket 0 holds anything under 1ms. After that, each power of two, 2^n ms, gets two buckets:
+ * 1 + 2n for [2^n, 2^n * sqrt(2)), and 2 + 2n for [2^n * sqrt(2), 2^(n+1)).
+ * The last bucket takes everything too big for the others.
+ */
+static int bucket(long ms) {
+    int log2 = 0;
+    int idx;
+
+    if (ms < 1) return 0;
+    while ((ms >> (log2 + 1)) > 0) ++log2;
+    idx = 1 + 2 * log2;
+    // 1414/1000 for sqrt(2)
+    if ((uint64_t) ms * 1000 >= ((uint64_t) 1 << log2) * 1414) ++idx;
+    return idx < LATENCY_BUCKETS ? idx : LATENCY_BUCKETS - 1;
+}
+
+// The most a bucket's latencies can be, in ms
+static long bucket_limit(int idx) {
+    int log2;
+
+    if (idx == 0) return 1;
+    log2 = (idx - 1) / 2;
+    if ((idx - 1) % 2 == 0) return (long) (((uint64_t) 1 << log2) * 1414 / 1000);
+    return 1L << (log2 + 1);
+}
+
+void latency_record(struct latency_hist *hist, long ms) {
+    __sync_fetch_and_add(&hist->counts[bucket(ms)], 1);
+
+    // Whoever fills the window halves it; a sample or two landing meanwhile doesn't matter
+    if (__sync_add_and_fetch(&hist->samples, 1) == LATENCY_WINDOW) {
+        for (int idx = 0; idx < LATENCY_BUCKETS; idx++) {
+            hist->counts[idx] /= 2;
+        }
+        hist->samples = 0;
+    }
+}
+
+// Returns the percentile in ms, or -1 if there have been fewer than min_samples requests to go on
+long latency_percentile(struct latency_hist *hist, int percentile, unsigned min_samples) {
+    unsigned counts[LATENCY_BUCKETS];
+    uint64_t total = 0;
+    uint64_t target;
+    uint64_t seen = 0;
+
+    for (int idx = 0; idx < LATENCY_BUCKETS; idx++) {
+        counts[idx] = hist->counts[idx];
+        total += counts[idx];
+    }
+    if (total == 0 || total < min_samples) return -1;
+
+    target = (total * percentile + 99) / 100;
+    for (int idx = 0; idx < LATENCY_BUCKETS; idx++) {
+        seen += counts[idx];
+        if (seen >= target) return bucket_limit(idx);
+    }
+    return bucket_limit(LATENCY_BUCKETS - 1);
+}
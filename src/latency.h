@@ -0,0 +1,40 @@
+#ifndef foolatencyhfoo
+#define foolatencyhfoo
+
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+/* A histogram of recent request latencies, for estimating percentiles.
+ * Buckets are half a power of two wide, so a percentile is good to about 40%,
+ * which is plenty for deciding how long to wait for something. Counts are halved
+ * every LATENCY_WINDOW samples, so old requests fade out.
+ * Recording doesn't take a lock; a histogram which starts zeroed needs no init.
+ */
+
+#define LATENCY_BUCKETS 50
+#define LATENCY_WINDOW 1024
+
+struct latency_hist {
+    unsigned counts[LATENCY_BUCKETS];
+    unsigned samples; // since counts were last halved
+};
+
+void latency_record(struct latency_hist *hist, long ms);
+long latency_percentile(struct latency_hist *hist, int percentile, unsigned min_samples);
+
+#endif
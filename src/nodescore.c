@@ -0,0 +1,435 @@
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "nodescore.h"
+
+/* This file has no dependencies on the rest of fusedav, so that
+ * tests/nodescore-bench.c can build it on its own. Callers do the logging.
+ */
+
+// Node addresses as session.c logs them, e.g. 10_0_0_1
+#define NODESCORE_KEY_SZ 80
+// Moving averages move 1/2^shift of the way to each new sample: latency over about
+// the last 8 requests, failures over the last 4
+#define LATENCY_SHIFT 3
+#define ERROR_SHIFT 2
+// errors runs from 0, never fails, to ERROR_SCALE, always fails
+#define ERROR_SCALE 1024
+// One failure on a node which hasn't been failing makes it unhealthy; a success or two makes it healthy again
+#define UNHEALTHY_ERRORS (ERROR_SCALE >> ERROR_SHIFT)
+/* A node nobody has used for this long has its averages halved, and halved again each time
+ * this long passes, so a node which was slow or failing gets tried again now and then.
+ * The first request it gets after that starts its averages over.
+ */
+#define DECAY_SECS 60
+// A removed node's slot is only reused once no request can still be using its connect_to
+#define RECLAIM_SECS 3600
+
+/* Each node has a circuit breaker, shared by all threads. A failure opens it; picking already
+ * stops sending a node requests after one failure, and the breaker decides when it gets them
+ * back. No requests go to the node while it's open, other than when every node is. Once the
+ * backoff is up the breaker is half open: the next request to pick a node goes to it, as a
+ * probe, and only that one until it's done. If the probe gets through, the breaker closes and
+ * the node's averages start over, so it gets its share of requests again; if not, the breaker
+ * opens again with twice the backoff, up to BACKOFF_MAX_MS, with jitter so processes which saw
+ * the same outage don't all probe at once.
+ * The state, the number of trips in a row and the time the backoff or the probe is up share
+ * one word, which changes with compare-and-swap.
+ */
+#define BACKOFF_BASE_MS 1000
+#define BACKOFF_MAX_MS (60 * 1000)
+// A probe which hasn't reported back by then was lost; let another go
+#define PROBE_DEADLINE_MS (60 * 1000)
+#define BREAKER_CLOSED 0
+#define BREAKER_OPEN 1
+#define BREAKER_HALF_OPEN 2
+#define BREAKER_STATE_BITS 2
+#define BREAKER_TRIPS_BITS 6
+#define BREAKER_TIME_SHIFT (BREAKER_STATE_BITS + BREAKER_TRIPS_BITS)
+
+struct node_score {
+    char key[NODESCORE_KEY_SZ];
+    // CURLOPT_CONNECT_TO for requests to this node; only freed when the slot is reclaimed
+    struct curl_slist *connect_to;
+    bool current;
+    time_t removed;
+    // Updated by every request, without a lock
+    unsigned latency_us;
+    unsigned errors;
+    unsigned pending;
+    time_t updated;
+    uint64_t breaker;
+};
+
+static struct node_score nodes[NODESCORE_MAX_NODES];
+// Slots in use, current or not; only grows, and only once the new slot is filled in
+static int num_slots = 0;
+// Taken to change the set of nodes, never to pick or record
+static pthread_mutex_t nodes_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread unsigned int seed = 0;
+
+static unsigned int next_random(void) {
+    if (seed == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        seed = (ts.tv_nsec ^ (uintptr_t) &seed) | 1;
+    }
+    return rand_r(&seed);
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / (1000 * 1000);
+}
+
+static unsigned breaker_state(uint64_t breaker) {
+    return breaker & ((1 << BREAKER_STATE_BITS) - 1);
+}
+
+static unsigned breaker_trips(uint64_t breaker) {
+    return (breaker >> BREAKER_STATE_BITS) & ((1 << BREAKER_TRIPS_BITS) - 1);
+}
+
+// When the backoff, or the probe, is up
+static uint64_t breaker_until(uint64_t breaker) {
+    return breaker >> BREAKER_TIME_SHIFT;
+}
+
+static uint64_t breaker_word(unsigned state, unsigned trips, uint64_t until) {
+    if (trips >= (1 << BREAKER_TRIPS_BITS)) trips = (1 << BREAKER_TRIPS_BITS) - 1;
+    return (until << BREAKER_TIME_SHIFT) | (trips << BREAKER_STATE_BITS) | state;
+}
+
+// Between half and all of the backoff for this many trips in a row
+static uint64_t backoff_ms(unsigned trips) {
+    uint64_t backoff = BACKOFF_BASE_MS;
+
+    while (--trips > 0 && backoff < BACKOFF_MAX_MS) backoff *= 2;
+    if (backoff > BACKOFF_MAX_MS) backoff = BACKOFF_MAX_MS;
+    return backoff / 2 + next_random() % (backoff / 2 + 1);
+}
+
+// A breaker which is open or half open, and due a probe
+static bool probe_due(uint64_t breaker, uint64_t now) {
+    return breaker_state(breaker) != BREAKER_CLOSED && now >= breaker_until(breaker);
+}
+
+// Makes this request the node's probe; false if someone else got there first
+static bool claim_probe(struct node_score *node, uint64_t breaker, uint64_t now) {
+    uint64_t probe = breaker_word(BREAKER_HALF_OPEN, breaker_trips(breaker), now + PROBE_DEADLINE_MS);
+    return __sync_bool_compare_and_swap(&node->breaker, breaker, probe);
+}
+
+// Returns the state this put the breaker in, or -1 if it left it alone
+static int breaker_done(struct node_score *node, bool ok) {
+    uint64_t old;
+    uint64_t new;
+
+    do {
+        old = node->breaker;
+        switch (breaker_state(old)) {
+            case BREAKER_CLOSED:
+                if (ok) return -1;
+                new = breaker_word(BREAKER_OPEN, 1, now_ms() + backoff_ms(1));
+                break;
+            case BREAKER_HALF_OPEN:
+                if (ok) {
+                    new = breaker_word(BREAKER_CLOSED, 0, 0);
+                }
+                else {
+                    unsigned trips = breaker_trips(old) + 1;
+                    new = breaker_word(BREAKER_OPEN, trips, now_ms() + backoff_ms(trips));
+                }
+                break;
+            default:
+                // Requests which went out before it opened don't count
+                return -1;
+        }
+    } while (!__sync_bool_compare_and_swap(&node->breaker, old, new));
+    return breaker_state(new);
+}
+
+static unsigned decayed(unsigned value, time_t updated, time_t now) {
+    time_t halvings = (now - updated) / DECAY_SECS;
+
+    if (halvings <= 0) return value;
+    if (halvings >= 32) return 0;
+    return value >> halvings;
+}
+
+static void ewma_update(unsigned *avg, unsigned sample, int shift, bool restart) {
+    unsigned old;
+    unsigned new;
+
+    do {
+        old = *avg;
+        new = restart ? sample : old - (old >> shift) + (sample >> shift);
+    } while (!__sync_bool_compare_and_swap(avg, old, new));
+}
+
+static bool healthy(struct node_score *node, time_t now) {
+    return decayed(node->errors, node->updated, now) < UNHEALTHY_ERRORS;
+}
+
+// What a request to this node should expect to cost; a node nobody has tried yet costs least
+static uint64_t cost(struct node_score *node, time_t now) {
+    uint64_t latency = decayed(node->latency_us, node->updated, now);
+    uint64_t errors = decayed(node->errors, node->updated, now);
+
+    return (latency + 1) * (node->pending + 1) * (ERROR_SCALE + 4 * errors);
+}
+
+static void fill_slot(struct node_score *node, const char *key, const char *connect_to) {
+    if (node->connect_to) curl_slist_free_all(node->connect_to);
+    memset(node, 0, sizeof(struct node_score));
+    strncpy(node->key, key, NODESCORE_KEY_SZ);
+    node->key[NODESCORE_KEY_SZ - 1] = '\0';
+    node->connect_to = curl_slist_append(NULL, connect_to);
+    node->current = true;
+}
+
+/* Makes keys the current nodes; connect_to[idx] is what CURLOPT_CONNECT_TO needs to send a
+ * request to keys[idx]. A node which comes back keeps its scores. Returns the number of
+ * current nodes, which is less than count if the scoreboard is full.
+ */
+int nodescore_set_nodes(char *const keys[], char *const connect_to[], int count) {
+    time_t now = time(NULL);
+    int current = 0;
+
+    pthread_mutex_lock(&nodes_mutex);
+
+    for (int idx = 0; idx < num_slots; idx++) {
+        bool listed = false;
+        for (int kdx = 0; kdx < count && !listed; kdx++) {
+            listed = (strcmp(nodes[idx].key, keys[kdx]) == 0);
+        }
+        if (nodes[idx].current && !listed) {
+            nodes[idx].current = false;
+            nodes[idx].removed = now;
+        }
+        else if (listed) {
+            nodes[idx].current = true;
+        }
+    }
+
+    for (int kdx = 0; kdx < count; kdx++) {
+        int slot = nodescore_find(keys[kdx]);
+
+        if (slot >= 0) {
+            ++current;
+            continue;
+        }
+        if (num_slots < NODESCORE_MAX_NODES) {
+            fill_slot(&nodes[num_slots], keys[kdx], connect_to[kdx]);
+            __sync_synchronize();
+            ++num_slots;
+            ++current;
+            continue;
+        }
+        for (int idx = 0; idx < num_slots; idx++) {
+            if (!nodes[idx].current && now - nodes[idx].removed > RECLAIM_SECS) {
+                // Readers skip slots which aren't current, so this one is ours until we say otherwise
+                nodes[idx].key[0] = '\0';
+                __sync_synchronize();
+                fill_slot(&nodes[idx], keys[kdx], connect_to[kdx]);
+                ++current;
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&nodes_mutex);
+
+    return current;
+}
+
+static int pick(int exclude) {
+    int candidates[NODESCORE_MAX_NODES];
+    int count = 0;
+    int slots = num_slots;
+    uint64_t ms = now_ms();
+    time_t now;
+    int first;
+    int second;
+    bool first_healthy;
+    bool second_healthy;
+
+    // A node due a probe gets this request, if no one else has got there first
+    for (int idx = 0; idx < slots; idx++) {
+        uint64_t breaker = nodes[idx].breaker;
+
+        if (!nodes[idx].current || idx == exclude) continue;
+        if (breaker_state(breaker) == BREAKER_CLOSED) {
+            candidates[count++] = idx;
+        }
+        else if (probe_due(breaker, ms) && claim_probe(&nodes[idx], breaker, ms)) {
+            return idx;
+        }
+    }
+    // With every breaker open, requests go where they would without breakers
+    if (count == 0) {
+        for (int idx = 0; idx < slots; idx++) {
+            if (nodes[idx].current && idx != exclude) candidates[count++] = idx;
+        }
+    }
+    if (count == 0) return -1;
+    if (count == 1) return candidates[0];
+
+    first = next_random() % count;
+    second = next_random() % (count - 1);
+    if (second >= first) ++second;
+    first = candidates[first];
+    second = candidates[second];
+
+    now = time(NULL);
+    first_healthy = healthy(&nodes[first], now);
+    second_healthy = healthy(&nodes[second], now);
+    if (first_healthy != second_healthy) {
+        return first_healthy ? first : second;
+    }
+    return cost(&nodes[first], now) <= cost(&nodes[second], now) ? first : second;
+}
+
+// Returns the index of the node the next request should go to, or -1 if there are no nodes
+int nodescore_pick(void) {
+    return pick(-1);
+}
+
+// Like nodescore_pick, but never picks exclude; -1 if there's no other node
+int nodescore_pick_other(int exclude) {
+    return pick(exclude);
+}
+
+// Returns the index of the node with this key, or -1
+int nodescore_find(const char *key) {
+    int slots = num_slots;
+
+    for (int idx = 0; idx < slots; idx++) {
+        if (strcmp(nodes[idx].key, key) == 0) return idx;
+    }
+    return -1;
+}
+
+const char *nodescore_key(int idx) {
+    if (idx < 0 || idx >= num_slots) return NULL;
+    return nodes[idx].key;
+}
+
+struct curl_slist *nodescore_connect_to(int idx) {
+    if (idx < 0 || idx >= num_slots) return NULL;
+    return nodes[idx].connect_to;
+}
+
+// A request is going out to the node; pair with nodescore_done
+void nodescore_start(int idx) {
+    if (idx < 0 || idx >= num_slots) return;
+    __sync_fetch_and_add(&nodes[idx].pending, 1);
+}
+
+/* A request to the node finished; ok is false if it failed, got a 5xx, or was too slow.
+ * Returns true if that opened the node's breaker.
+ */
+bool nodescore_done(int idx, bool ok, long elapsed_ms) {
+    struct node_score *node;
+    time_t now = time(NULL);
+    bool restart;
+    int breaker;
+    unsigned latency_us;
+
+    if (idx < 0 || idx >= num_slots) return false;
+    node = &nodes[idx];
+
+    __sync_fetch_and_sub(&node->pending, 1);
+    breaker = breaker_done(node, ok);
+    if (elapsed_ms < 0) elapsed_ms = 0;
+    latency_us = elapsed_ms > 1000 * 1000 ? 1000 * 1000 * 1000 : elapsed_ms * 1000;
+    restart = (now - node->updated >= DECAY_SECS || breaker == BREAKER_CLOSED);
+    ewma_update(&node->latency_us, latency_us, LATENCY_SHIFT, restart);
+    ewma_update(&node->errors, ok ? 0 : ERROR_SCALE, ERROR_SHIFT, restart);
+    node->updated = now;
+    return breaker == BREAKER_OPEN;
+}
+
+// For logging: "closed", "open" or "half-open"
+const char *nodescore_breaker(int idx) {
+    static const char *names[] = {"closed", "open", "half-open"};
+
+    if (idx < 0 || idx >= num_slots) return "closed";
+    return names[breaker_state(nodes[idx].breaker)];
+}
+
+// True if the node is current, healthy, and its breaker is closed
+bool nodescore_healthy(int idx) {
+    if (idx < 0 || idx >= num_slots || !nodes[idx].current) return false;
+    return breaker_state(nodes[idx].breaker) == BREAKER_CLOSED && healthy(&nodes[idx], time(NULL));
+}
+
+// True if there are nodes and all of them are unhealthy
+bool nodescore_all_unhealthy(void) {
+    int slots = num_slots;
+    time_t now = time(NULL);
+    bool any = false;
+
+    for (int idx = 0; idx < slots; idx++) {
+        if (!nodes[idx].current) continue;
+        if (healthy(&nodes[idx], now)) return false;
+        any = true;
+    }
+    return any;
+}
+
+/* How long until a request can go to a node with its breaker closed, or as a probe: 0 if
+ * one can now, or if there are no nodes.
+ */
+long nodescore_wait_ms(void) {
+    int slots = num_slots;
+    uint64_t ms = now_ms();
+    uint64_t soonest = 0;
+
+    for (int idx = 0; idx < slots; idx++) {
+        uint64_t breaker = nodes[idx].breaker;
+        uint64_t until = breaker_until(breaker);
+
+        if (!nodes[idx].current) continue;
+        if (breaker_state(breaker) == BREAKER_CLOSED || until <= ms) return 0;
+        if (soonest == 0 || until < soonest) soonest = until;
+    }
+    return soonest ? (long) (soonest - ms) : 0;
+}
+
+int nodescore_count(void) {
+    int slots = num_slots;
+    int count = 0;
+
+    for (int idx = 0; idx < slots; idx++) {
+        if (nodes[idx].current) ++count;
+    }
+    return count;
+}
@@ -0,0 +1,56 @@
+#ifndef foonodescorehfoo
+#define foonodescorehfoo
+
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#include <stdbool.h>
+#include <curl/curl.h>
+
+/* One scoreboard of the filesystem nodes for the whole process. Every request's
+ * latency and outcome go into a moving average for the node it went to, so all
+ * threads learn from each other's requests, and a node which is slow but answers
+ * gets less traffic, not just one which fails.
+ * Each request picks two nodes at random and goes to the better of them
+ * (power of two choices): healthy beats unhealthy, then the lower of latency
+ * times requests outstanding. That sends most traffic to the fast nodes without
+ * all threads piling onto the single best one.
+ * Each node also has a circuit breaker: a node which fails gets no requests
+ * for a backoff, then one probe at a time until one gets through.
+ * Nodes are identified by an index, good for the life of the process. Picking and
+ * recording don't take a lock; only changing the set of nodes does.
+ */
+
+// Most nodes, current and recently removed, the scoreboard holds
+#define NODESCORE_MAX_NODES 64
+
+int nodescore_set_nodes(char *const keys[], char *const connect_to[], int count);
+int nodescore_pick(void);
+int nodescore_pick_other(int exclude);
+int nodescore_find(const char *key);
+const char *nodescore_key(int idx);
+struct curl_slist *nodescore_connect_to(int idx);
+void nodescore_start(int idx);
+bool nodescore_done(int idx, bool ok, long elapsed_ms);
+const char *nodescore_breaker(int idx);
+bool nodescore_healthy(int idx);
+bool nodescore_all_unhealthy(void);
+long nodescore_wait_ms(void);
+int nodescore_count(void);
+
+#endif
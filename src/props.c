@@ -389,8 +389,9 @@ int simple_propfind(const char *path, size_t depth, time_t last_updated, props_r
         chunk.memory = malloc(1024*1024);  /* will be grown as needed by the realloc above */ 
         chunk.size = 0;    /* no data at this point */ 
         chunk.cap = 1024*1024;
-        curl_easy_setopt(session, CURLOPT_WRITEDATA, (void *) &chunk);
-        curl_easy_setopt(session, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+        // PROPFIND only reads, so a slow one can be hedged; there's no telling how big the answer is
+        session_request_type(session, REQUEST_PROPFIND, -1);
+        session_hedgeable(session, WriteMemoryCallback, (void *) &chunk, NULL, NULL);
 
         // Configure the parser.
         parser = XML_ParserCreateNS(NULL, '\0');
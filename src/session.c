@@ -32,9 +32,12 @@
 #include <arpa/nameser.h>
 #include <resolv.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 #include <ctype.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include <arpa/inet.h>
 #include <uriparser/Uri.h>
 
@@ -42,90 +45,92 @@
 #include "log_sections.h"
 #include "util.h"
 #include "session.h"
+#include "httpengine.h"
+#include "nodescore.h"
+#include "hedge.h"
+#include "timeouts.h"
 #include "fusedav-statsd.h"
 
 static pthread_once_t session_once = PTHREAD_ONCE_INIT;
 static pthread_key_t session_tsd_key;
 
-pthread_mutex_t saint_state_mutex = PTHREAD_MUTEX_INITIALIZER;
-static state_t saint_state = STATE_HEALTHY;
-
 pthread_mutex_t request_outstanding = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 static int request_outstanding_lock_count = 0;
 
 const int time_limit = 30 * 1000; // 30 seconds
 
-void (*const state_table [NUM_STATES][NUM_EVENTS]) (void) = {
+bool (*const state_table [NUM_STATES][NUM_EVENTS]) (saint_word_t word) = {
     { action_s1_e1, action_s1_e2, action_s1_e3 }, /* procedures for state 1 */
     { action_s2_e1, action_s2_e2, action_s2_e3 }, /* procedures for state 2 */
     { action_s3_e1, action_s3_e2, action_s3_e3 }  /* procedures for state 3 */
 };
 
-// The string we pass to curl is domain:port:ip:address, so leave room
+// The string we pass to curl is domain:port:ip-address:port, so leave room
 #define IPSTR_SZ 128
 // Maximum number of A records (bzw IP addresses) our domain can resolve to
 #define MAX_NODES 32
 
-// Grab the node address out of the curl message and keep track for later logging
+// The address of the node the last request on this thread went to, for later logging and stats
 #define LOGSTRSZ 80
 static __thread char nodeaddr[LOGSTRSZ];
-
-// status of a node in a cluster
-static const unsigned int HEALTHY = 0;
-static const unsigned int RECOVERING = 1;
-static const unsigned int UNHEALTHY = 2;
-
-// We track connection health thread-by-thread. Ultimately all threads 
-// should have a similar view of the health of the system. We optimize 
-// for short outages, reducing the opportunities for fusedav to think 
-// a healthy node is unhealthy. We don't want to take a node out of 
-// rotation for long periods of time, so we enter them back into
-// rotation frequently. If a node stays degraded for long periods of time, 
-// it will get accessed, and if it fails will fall out of rotation again. 
-// Since we have a retry mechanism, the operation should succeed on following 
-// iterations, so there should be only slight degradation of customer 
-// experience. The amount of traffic sent to a degraded node remains small.
-
-// -- We set a node's score to 2 when it fails. All other nodes in a degraded 
-// state will have their score decremented. This helps ensure that the node 
-// that failed most recently won't find itself at the top of the list for 
-// the next iteration.
-// -- The resolve slist is updated every 2 minutes. When we do, we mark 
-// degraded nodes as ready for rotation.
-// -- When we detect a bad connection, we create a new resolve slist and 
-// bounce the handle. We sort the list so that healthy connections are at the top
-struct health_status_s {
-    char curladdr[IPSTR_SZ]; // Keep track of complete string we pass to curl
-    unsigned int score;
-    time_t timestamp;
-    // Did we see this entry on this call to getaddrinfo (or have we deleted a node?)
-    bool current; 
-};
-
-// This will be the list of randomized addresses we pass to curl 
-// (resolve_slist) and the hashtable of health status. Make it thread-local 
-// so each session gets its own.
-
-// Assuming that session==thread, but that's what we assume for 
-// session_tsd_key above
-// Using __thread in preference to pthread_once mechanism; seems simpler and less error-prone
-struct node_status_s {
-    struct curl_slist *resolve_slist;
-    // hashtable containing a health_status_s for each node
-    GHashTable *node_hash_table;
-};
-
-static __thread struct node_status_s node_status;
-
-struct addr_score_s {
-    char addr[IPSTR_SZ];
-    unsigned int score;
-};
-
-// It needs some value to start, but will be adjusted in call to getaddrinfo
-// If one node is unresponsive, we will rescramble the resolve list and
-// expect a different node to try the second time. This will clear the thread
-// of continuing to target a bad node.
+// The node the current request on this thread last tried to connect to; curl doesn't say if it failed to
+static __thread char tried_addr[INET6_ADDRSTRLEN];
+
+/* Which node each request goes to is up to the process-wide scoreboard in nodescore.c.
+ * The node list comes from getaddrinfo, and is no more than NODES_REFRESH_SECS old. Each
+ * request is sent to the node picked for it with CURLOPT_CONNECT_TO, which also keeps pooled
+ * connections apart by node.
+ * Once session_refresh_init has started the refresh thread, it does the lookups, at half
+ * NODES_REFRESH_SECS so the list never gets old, and every REFRESH_TICK_SECS after one fails;
+ * requests don't wait on DNS. Until then, or if the thread is gone, whichever request
+ * notices the list is old does the lookup.
+ * With the connection pool, the thread also sends each healthy node a HEAD every WARM_SECS,
+ * which opens a connection to a node which has none and keeps one which does from going
+ * idle long enough for curl or the node to close it. Requests then find a connection with
+ * its handshake done instead of making one.
+ */
+#define NODES_REFRESH_SECS 600
+#define REFRESH_TICK_SECS 10
+#define WARM_SECS 30
+// A node which hasn't answered its warming HEAD by then is left for the next pass
+#define WARM_TIMEOUT_MS 5000
+static time_t nodes_refreshed = 0;
+static pthread_mutex_t nodes_refresh_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool refresh_running = false;
+// The node picked for the request this thread is setting up, or -1 to let curl resolve the name
+static __thread int picked_node = -1;
+
+/* With hedge_requests set, GETs and PROPFINDs which are slow to start answering are sent to a
+ * second node as well; see hedge.h. Callers say a request can be hedged by giving its response
+ * callbacks to session_hedgeable, after session_request_init and session_request_type, instead
+ * of setting them. The hedge delay is a percentile of recent times to first byte, for each
+ * type of request.
+ */
+#define HEDGE_PERCENTILE 95
+#define HEDGE_FLOOR_MS 10
+#define HEDGE_CEILING_MS 2000
+static bool config_hedge = false;
+static struct latency_hist hedge_latency[NUM_REQUEST_TYPES];
+// The request this thread is setting up, if it can be hedged
+static __thread bool hedgeable = false;
+static __thread struct hedge_request hedge;
+
+/* With adaptive_timeouts set, a request's connect and total timeouts come from how long its node
+ * has recently been taking over that type of request; see timeouts.h. Otherwise every request
+ * gets the ceilings, CONNECT_TIMEOUT_MS and REQUEST_TIMEOUT_SECS. Callers give the type and the
+ * size of the body with session_request_type; a request they don't is REQUEST_OTHER, with no body.
+ */
+#define CONNECT_TIMEOUT_MS 1200
+#define REQUEST_TIMEOUT_SECS 60
+static bool config_adaptive_timeouts = false;
+// The request this thread is setting up
+static __thread request_type_t request_type = REQUEST_OTHER;
+static __thread curl_off_t request_bytes = 0;
+
+// How many times requests are tried.
+// If one node is unresponsive, the scoreboard marks it unhealthy, and we
+// expect a different node to be picked the second time. This will clear the
+// process of continuing to target a bad node.
 int num_filesystem_server_nodes = 3;
 // Keep track of the config parameter grace so we can better manage saint mode
 static bool config_grace;
@@ -139,6 +144,25 @@ static char *filesystem_domain = NULL;
 static char *filesystem_port = NULL;
 static char *filesystem_cluster = NULL;
 
+/* With connection_pool set, every handle, the per-thread ones and the temporary ones,
+ * keeps its connections in one process-wide cache instead of its own. An idle connection
+ * opened by one thread then serves the next request on any thread, and bouncing a handle
+ * or refreshing the resolve slist doesn't cost a new TCP and TLS handshake.
+ * Requests ask for HTTP/2 over TLS; nodes which don't offer it in ALPN get HTTP/1.1.
+ * The handles also share their DNS cache and TLS sessions, so a connection which does
+ * have to be made, on a new handle or after a failure, resumes a session some other
+ * thread negotiated instead of doing a full handshake.
+ */
+static CURLSH *connection_pool = NULL;
+// One per kind of shared data; curl asks for shared access where it only reads
+static pthread_rwlock_t pool_locks[CURL_LOCK_DATA_LAST];
+// Most connections, to all nodes together, the pool keeps open
+#define POOL_MAX_CONNECTIONS 32
+// Sockets open on all handles, pooled or not; each is a connection
+static int open_connections = 0;
+// The last request on this thread failed, so the next one shouldn't get a pooled connection to the same node
+static __thread bool fresh_connect = false;
+
 const char *get_base_url(void) {
     return base_url;
 }
@@ -151,7 +175,52 @@ const char *get_nodeaddr(void) {
     return nodeaddr;
 }
 
-int session_config_init(char *base, char *ca_cert, char *client_cert, bool grace) {
+static void pool_lock(__unused CURL *handle, curl_lock_data data, curl_lock_access access, __unused void *userptr) {
+    if (access == CURL_LOCK_ACCESS_SHARED) {
+        pthread_rwlock_rdlock(&pool_locks[data]);
+    }
+    else {
+        pthread_rwlock_wrlock(&pool_locks[data]);
+    }
+}
+
+static void pool_unlock(__unused CURL *handle, curl_lock_data data, __unused void *userptr) {
+    pthread_rwlock_unlock(&pool_locks[data]);
+}
+
+static void connection_pool_init(void) {
+    connection_pool = curl_share_init();
+    if (connection_pool == NULL) {
+        log_print(LOG_ERR, SECTION_SESSION_DEFAULT, "connection_pool_init: curl_share_init failed; each thread keeps its own connections");
+        return;
+    }
+    for (int idx = 0; idx < CURL_LOCK_DATA_LAST; idx++) {
+        pthread_rwlock_init(&pool_locks[idx], NULL);
+    }
+    curl_share_setopt(connection_pool, CURLSHOPT_LOCKFUNC, pool_lock);
+    curl_share_setopt(connection_pool, CURLSHOPT_UNLOCKFUNC, pool_unlock);
+    /* Requests go to their node with CURLOPT_CONNECT_TO, so the DNS cache only matters
+     * when we have no nodes, e.g. when getaddrinfo failed. curl keys TLS sessions by
+     * CONNECT_TO as well as by name, so a session is only offered to the node which issued it.
+     */
+    if (curl_share_setopt(connection_pool, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) != CURLSHE_OK) {
+        log_print(LOG_ERR, SECTION_SESSION_DEFAULT, "connection_pool_init: libcurl can't share the DNS cache; each handle keeps its own");
+    }
+    if (curl_share_setopt(connection_pool, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION) != CURLSHE_OK) {
+        log_print(LOG_ERR, SECTION_SESSION_DEFAULT, "connection_pool_init: libcurl can't share TLS sessions; each handle keeps its own");
+    }
+    // Older libcurls can't share the connection cache
+    if (curl_share_setopt(connection_pool, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT) != CURLSHE_OK) {
+        log_print(LOG_ERR, SECTION_SESSION_DEFAULT, "connection_pool_init: libcurl can't share connections; each thread keeps its own");
+        curl_share_cleanup(connection_pool);
+        connection_pool = NULL;
+        return;
+    }
+    log_print(LOG_INFO, SECTION_SESSION_DEFAULT, "connection_pool_init: sharing up to %d connections", POOL_MAX_CONNECTIONS);
+}
+
+int session_config_init(char *base, char *ca_cert, char *client_cert, bool grace, bool pool, bool hedge_requests,
+        bool adaptive_timeouts) {
     size_t base_len;
     UriParserStateA state;
     UriUriA uri;
@@ -164,6 +233,11 @@ int session_config_init(char *base, char *ca_cert, char *client_cert, bool grace
         return -1;
     }
     config_grace = grace;
+    config_hedge = hedge_requests;
+    config_adaptive_timeouts = adaptive_timeouts;
+    if (pool) {
+        connection_pool_init();
+    }
 
     // Ensure the base URL has no trailing slash.
     base_len = strlen(base);
@@ -217,6 +291,8 @@ void session_config_free(void) {
     free(base_url);
     free(ca_certificate);
     free(client_certificate);
+    // Threads which still have handles keep it alive (CURLSHE_IN_USE); we're exiting anyway
+    if (connection_pool) curl_share_cleanup(connection_pool);
 }
 
 // Keep a session count for stats gauge
@@ -269,72 +345,6 @@ static void print_errors(const int iter, const char *type_str, const char *fcn_n
     free(error_str);
 }
 
-static struct health_status_s *get_health_status(char *addr) {
-    return g_hash_table_lookup(node_status.node_hash_table, addr);
-}
-
-/*  return can be:
- *  0 = all healthy
- *  2 = all unhealthy
- *  1 = mismatch, some healthy, some unhealthy
- */
-static unsigned int health_status_all_nodes(void) {
-    static const char *funcname = "health_status_all_nodes";
-    GHashTableIter iter;
-    gpointer key, value;
-    int idx = 0;
-    unsigned int score = HEALTHY;
-
-    g_hash_table_iter_init (&iter, node_status.node_hash_table);
-    while (g_hash_table_iter_next (&iter, &key, &value)) {
-        struct health_status_s *healthstatus = (struct health_status_s *)value;
-        log_print(LOG_DEBUG, SECTION_SESSION_DEFAULT, "%s: hash_table [%p], iter [%p], score [%d]",
-            funcname, node_status.node_hash_table, iter, healthstatus->score);
-        // If this is the first iteration, seed score
-        if (idx == 0) {
-            score = healthstatus->score;
-            ++idx;
-        }
-        // If we see nodes in different states, return RECOVERING as a marker
-        else if (healthstatus->score != score) {
-            return RECOVERING;
-        }
-    }
-    return score;
-}
-
-static void update_health_status_all_nodes(void) {
-    static const char *funcname = "update_health_status_all_nodes";
-    GHashTableIter iter;
-    gpointer key, value;
-
-    g_hash_table_iter_init (&iter, node_status.node_hash_table);
-    while (g_hash_table_iter_next (&iter, &key, &value)) {
-        struct health_status_s *healthstatus = (struct health_status_s *)value;
-        log_print(LOG_DEBUG, SECTION_SESSION_DEFAULT, "%s: hash_table [%p], score [%d]",
-            funcname, node_status.node_hash_table, healthstatus->score);
-        if (healthstatus->score != HEALTHY) {
-            --healthstatus->score;
-            log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, "%s: addr [%s], score [%d]",
-                funcname, healthstatus->curladdr, healthstatus->score);
-        }
-    }
-}
-
-static void increment_node_success(char *addr) {
-    struct health_status_s *healthstatus = get_health_status(addr);
-    if (!healthstatus) {
-        log_print(LOG_CRIT, SECTION_SESSION_DEFAULT, "increment_node_success: healthstatus null for %s", addr);
-        return;
-    }
-    if (healthstatus->score > HEALTHY) {
-        --healthstatus->score;
-        healthstatus->timestamp = time(NULL); // Reset since we just used it
-        log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, "increment_node_success: %s addr score set to %u",
-            addr, healthstatus->score);
-    }
-}
-
 // Call session_cleanup when reinitializing a handle, or called from session_destroy when thread exits
 static void session_cleanup(void *s) {
     CURL *session = s;
@@ -348,23 +358,12 @@ static void session_cleanup(void *s) {
     session = NULL;
     pthread_setspecific(session_tsd_key, session);
     update_session_count(false);
-
-    // REVIEW: clear list before or after?
-    // Free the resolve_slist before exiting the session
-    if (node_status.resolve_slist) {
-        curl_slist_free_all(node_status.resolve_slist);
-        node_status.resolve_slist = NULL;
-    }
 }
 
-// When a thread exits, we also want to free its hashtable. We don't want to free the hashtable if we are just
-// reinitializing the thread, since we want to keep the health status that causes those reinitializations
 static void session_destroy(void *s) {
-    pthread_mutex_lock(&saint_state_mutex);
+    // request_outstanding is recursive, and only its owner touches the count, so this needs no other lock
     try_release_request_outstanding();
-    pthread_mutex_unlock(&saint_state_mutex);
     session_cleanup(s);
-    g_hash_table_destroy(node_status.node_hash_table);
 }
 
 static void session_tsd_key_init(void) {
@@ -388,58 +387,47 @@ static char * logstr(char *addr) {
  * will help us know that we are accessing the nodes in a balanced way.
  * (We access the filesystem nodes via a domain which resolves to many
  * A records or IP addrs; our mechanism chooses one of those A records (IP addr).
- * We know the address used because we capture the libcurl message
- * "Trying <ip addr>...". Kind of clunky since the message can change. Do
- * we have a better way?
+ * curl tells us the address of the connection the request went over, new or
+ * reused. If it couldn't connect, it doesn't, and open_connection has kept the
+ * address of the last one it tried, so the failure goes against the right node.
+ * We run on the requesting thread, after the request, so nodeaddr is ours,
+ * even when the async engine did the request.
  */
-static void print_ipaddr_pair(char *msg) {
-    // nodeaddr is global so it can be reused in later logging
-    char *end;
-    // msg+9 takes us past "  Trying ". We assume the ip addr starts there.
-    strncpy(nodeaddr, msg + 9, LOGSTRSZ);
+static void update_nodeaddr(CURL *session) {
+    char *addr = NULL;
+
+    curl_easy_getinfo(session, CURLINFO_PRIMARY_IP, &addr);
+    if (addr == NULL || addr[0] == '\0') addr = tried_addr;
+    // Failed before trying any node, e.g. on name resolution; keep the last one for logging
+    if (addr[0] == '\0') return;
+
+    strncpy(nodeaddr, addr, LOGSTRSZ);
     nodeaddr[LOGSTRSZ - 1] = '\0'; // Just make sure it's null terminated
-    // end finds the first two dots after the ip addr. We put a zero there
-    // to turn the original string into just the IP addr.
-    end = strstr(nodeaddr, "..");
-    end[0] = '\0';
     // Change dots in addr to underscore for logging
     logstr(nodeaddr);
     // We print the key=value pair.
     log_print(LOG_INFO, SECTION_SESSION_DEFAULT, "Using filesystem_host=%s", nodeaddr);
 }
 
-static int session_debug(__unused CURL *handle, curl_infotype type, char *data, size_t size, __unused void *userp) {
-    if (type == CURLINFO_TEXT) {
-        char *msg = malloc(size + 1);
-        if (msg != NULL) {
-            strncpy(msg, data, size);
-            msg[size] = '\0';
-            if (msg[size - 1] == '\n') msg[size - 1] = '\0';
-            // We want to see the "Trying <ip addr> message, but the others only when in some
-            // level of debug
-            if (strstr(msg, "Trying")) {
-                log_print(LOG_INFO, SECTION_SESSION_DEFAULT, "cURL: %s", msg);
-                print_ipaddr_pair(msg);
-            }
-            else {
-                log_print(LOG_INFO, SECTION_SESSION_DEFAULT, "cURL: %s", msg);
-            }
-            free(msg);
-        }
-    }
-    return 0;
-}
-
 /* cluster saint mode means:
- * 1. If in cluster saint mode, back off accessing the cluster for a given period of time
+ * 1. If in cluster saint mode, back off accessing the cluster for a given period of time, and
+ *    then until some node's circuit breaker (see nodescore.h) lets a probe through
  * 2. If in cluster saint mode, where possible, assume local state is correct.
  * Regarding (2), propfinds should succeed, as should GETs (as if 304).
  *
  * We implement a simple state machine to keep track of saint_state. See the diagram at:
  *     documentation/saint_mode_machine_state.png
  */
-// cluster_failure_timestamp is the most recent time we detected that all connections to the cluster were in some failed mode
-static time_t failure_timestamp = 0;
+/* The state and the most recent time we detected that all connections to the cluster were in
+ * some failed mode (failure timestamp) share one word, so that every request can read them
+ * without a lock, and a transition can change both with one compare-and-swap. Each action
+ * makes its transition only if the word is still the one it was called with, and returns
+ * false if it isn't, so the caller can look again; whichever thread makes a transition
+ * does its logging and stats.
+ */
+#define SAINT_STATE_BITS 2
+#define SAINT_STATE_MASK ((1 << SAINT_STATE_BITS) - 1)
+static saint_word_t saint_word = STATE_HEALTHY;
 // record the the first failure_timestamp in this saint_mode experience
 static time_t unhealthy_since_timestamp = 0;
 // Backoff time; avoid accessing the cluster for this many seconds
@@ -448,6 +436,25 @@ const int saint_mode_duration = 10;
 const int saint_mode_warning_threshold = 60*15;
 
 
+static state_t word_state(saint_word_t word) {
+    return word & SAINT_STATE_MASK;
+}
+
+static time_t word_failure_timestamp(saint_word_t word) {
+    return word >> SAINT_STATE_BITS;
+}
+
+static bool transition(saint_word_t word, state_t state, time_t failure_timestamp) {
+    saint_word_t new_word = ((saint_word_t) failure_timestamp << SAINT_STATE_BITS) | state;
+    return __sync_bool_compare_and_swap(&saint_word, word, new_word);
+}
+
+static time_t monotonic_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
 void try_release_request_outstanding(void) {
     if (pthread_mutex_trylock(&request_outstanding) == 0) {
         log_print(LOG_DEBUG, SECTION_SESSION_DEFAULT, "Release lock for request_outstanding, lock_count: %d", request_outstanding_lock_count);
@@ -459,79 +466,83 @@ void try_release_request_outstanding(void) {
     }
 }
 
-void action_s1_e1(void) {
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    failure_timestamp = now.tv_sec;
-    unhealthy_since_timestamp = now.tv_sec;
-    saint_state = STATE_SAINT_MODE;
+bool action_s1_e1(saint_word_t word) {
+    time_t now = monotonic_now();
+    if (!transition(word, STATE_SAINT_MODE, now)) return false;
+    unhealthy_since_timestamp = now;
     log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, "Event CLUSTER_FAILURE; transitioned to STATE_SAINT_MODE from STATE_HEALTHY.");
+    return true;
 }
-void action_s1_e2 (void) {}
-void action_s1_e3 (void) {}
-void action_s2_e1 (void) {}
-void action_s2_e2 (void) {
-    saint_state = STATE_ATTEMPTING_TO_EXIT_SAINT_MODE;
+bool action_s1_e2 (__unused saint_word_t word) { return true; }
+bool action_s1_e3 (__unused saint_word_t word) { return true; }
+bool action_s2_e1 (__unused saint_word_t word) { return true; }
+bool action_s2_e2 (saint_word_t word) {
+    if (!transition(word, STATE_ATTEMPTING_TO_EXIT_SAINT_MODE, word_failure_timestamp(word))) return false;
     log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, "Event SAINT_MODE_DURATION_EXPIRED; transitioned to STATE_ATTEMPTING_TO_EXIT_SAINT_MODE from STATE_SAINT_MODE.");
+    return true;
 }
-void action_s2_e3 (void) {}
-void action_s3_e1 (void) {
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    failure_timestamp = now.tv_sec;
+bool action_s2_e3 (__unused saint_word_t word) { return true; }
+bool action_s3_e1 (saint_word_t word) {
+    if (!transition(word, STATE_SAINT_MODE, monotonic_now())) return false;
     try_release_request_outstanding();
-    saint_state = STATE_SAINT_MODE;
     stats_counter_cluster("saint_mode", 1);
     log_print(LOG_NOTICE, SECTION_ENHANCED, "Setting cluster saint mode for %lu seconds.", saint_mode_duration);
     log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, "Event CLUSTER_FAILURE; transitioned to STATE_SAINT_MODE from STATE_ATTEMPTING_TO_EXIT_SAINT_MODE.");
+    return true;
 }
-void action_s3_e2 (void) {}
-void action_s3_e3 (void) {
+bool action_s3_e2 (__unused saint_word_t word) { return true; }
+bool action_s3_e3 (saint_word_t word) {
+    if (!transition(word, STATE_HEALTHY, word_failure_timestamp(word))) return false;
     try_release_request_outstanding();
-    saint_state = STATE_HEALTHY;
     log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, "Event CLUSTER_SUCCESS; transitioned to STATE_HEALTHY from STATE_ATTEMPTING_TO_EXIT_SAINT_MODE.");
+    return true;
 }
 
 void trigger_saint_mode_expired_if_needed(void) {
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    if (saint_state == STATE_SAINT_MODE && now.tv_sec >= failure_timestamp + saint_mode_duration) {
-        state_table[saint_state][SAINT_MODE_DURATION_EXPIRED]();
-        // If we've been in saintmode for longer than saint_mode_warning_threshold, emit a stat saying so.
-        if (now.tv_sec >= unhealthy_since_timestamp + saint_mode_warning_threshold) {
-            stats_counter_cluster("long_running_saint_mode", 1);
-            log_print(LOG_INFO, SECTION_ENHANCED, "saint_mode active for %d seconds", now.tv_sec-unhealthy_since_timestamp);
-        }
+    saint_word_t word = saint_word;
+    time_t now;
+
+    if (word_state(word) != STATE_SAINT_MODE) return;
+    now = monotonic_now();
+    if (now < word_failure_timestamp(word) + saint_mode_duration) return;
+    // Nor before a node's breaker lets a probe through; there's no point trying any sooner
+    if (nodescore_wait_ms() > 0) return;
+    // Someone else got there first
+    if (!state_table[STATE_SAINT_MODE][SAINT_MODE_DURATION_EXPIRED](word)) return;
+    // If we've been in saintmode for longer than saint_mode_warning_threshold, emit a stat saying so.
+    if (now >= unhealthy_since_timestamp + saint_mode_warning_threshold) {
+        stats_counter_cluster("long_running_saint_mode", 1);
+        log_print(LOG_INFO, SECTION_ENHANCED, "saint_mode active for %d seconds", now - unhealthy_since_timestamp);
     }
 }
 
 void trigger_saint_event(event_t event) {
+    saint_word_t word;
+
     if (!config_grace) return;
-    pthread_mutex_lock(&saint_state_mutex);
-    trigger_saint_mode_expired_if_needed(); // trigger SAINT_MODE_DURATION_EXPIRED if duration has expired.
-    state_table[saint_state][event]();
-    pthread_mutex_unlock(&saint_state_mutex);
+    do {
+        trigger_saint_mode_expired_if_needed(); // trigger SAINT_MODE_DURATION_EXPIRED if duration has expired.
+        word = saint_word;
+    } while (!state_table[word_state(word)][event](word));
 }
 
 state_t get_saint_state(void) {
-    pthread_mutex_lock(&saint_state_mutex);
     trigger_saint_mode_expired_if_needed();
-    pthread_mutex_unlock(&saint_state_mutex);
-    return saint_state;
+    return word_state(saint_word);
 }
 
 bool use_saint_mode(void) {
+    state_t state = get_saint_state();
     bool sm = false;
-    pthread_mutex_lock(&saint_state_mutex);
-    trigger_saint_mode_expired_if_needed();
 
-    if (saint_state == STATE_HEALTHY) {
+    if (state == STATE_HEALTHY) {
         sm = false;
         log_print(LOG_DEBUG, SECTION_SESSION_DEFAULT, "State healthy, not using saint_mode");
-    } else if (saint_state == STATE_SAINT_MODE) {
+    } else if (state == STATE_SAINT_MODE) {
         sm = true;
         log_print(LOG_DEBUG, SECTION_SESSION_SAINTMODE, "State saint mode, using saint_mode");
-    } else if (saint_state == STATE_ATTEMPTING_TO_EXIT_SAINT_MODE) {
+    } else if (state == STATE_ATTEMPTING_TO_EXIT_SAINT_MODE) {
+        // Only one thread's requests go out to see if the cluster is back
         if (pthread_mutex_trylock(&request_outstanding) == 0) {
             request_outstanding_lock_count++;
             log_print(LOG_DEBUG, SECTION_SESSION_SAINTMODE, "Aquire lock for request_outstanding, lock_count: %d", request_outstanding_lock_count);
@@ -543,25 +554,267 @@ bool use_saint_mode(void) {
         }
     }
 
-    pthread_mutex_unlock(&saint_state_mutex);
     return sm;
 }
 
+// clientp is the requesting thread's tried_addr; with the async engine, we run on the engine's thread
+static curl_socket_t open_connection(void *clientp, __unused curlsocktype purpose, struct curl_sockaddr *address) {
+    curl_socket_t fd = socket(address->family, address->socktype, address->protocol);
+    if (fd != CURL_SOCKET_BAD) __sync_fetch_and_add(&open_connections, 1);
+    if (address->family == AF_INET) {
+        inet_ntop(AF_INET, &((struct sockaddr_in *) &address->addr)->sin_addr, clientp, INET6_ADDRSTRLEN);
+    }
+    else if (address->family == AF_INET6) {
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *) &address->addr)->sin6_addr, clientp, INET6_ADDRSTRLEN);
+    }
+    return fd;
+}
+
+static int close_connection(__unused void *clientp, curl_socket_t fd) {
+    __sync_fetch_and_sub(&open_connections, 1);
+    return close(fd);
+}
+
+/* What a handle needs to open connections the way requests do, or to be given one from
+ * the pool which another handle opened; curl only reuses a connection for a handle with
+ * the same TLS and HTTP version options. addr gets the address of the node it connects to.
+ */
+static void set_connection_options(CURL *session, char *addr) {
+    curl_easy_setopt(session, CURLOPT_OPENSOCKETFUNCTION, open_connection);
+    curl_easy_setopt(session, CURLOPT_OPENSOCKETDATA, addr);
+    curl_easy_setopt(session, CURLOPT_CLOSESOCKETFUNCTION, close_connection);
+    if (connection_pool) {
+        curl_easy_setopt(session, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(session, CURLOPT_MAXCONNECTS, POOL_MAX_CONNECTIONS);
+    }
+    if (ca_certificate != NULL)
+        curl_easy_setopt(session, CURLOPT_CAINFO, ca_certificate);
+    if (client_certificate != NULL) {
+        curl_easy_setopt(session, CURLOPT_SSLCERT, client_certificate);
+        curl_easy_setopt(session, CURLOPT_SSLKEY, client_certificate);
+    }
+    curl_easy_setopt(session, CURLOPT_SSL_VERIFYHOST, 0);
+    curl_easy_setopt(session, CURLOPT_SSL_VERIFYPEER, 1);
+}
+
+/* Connections, handshakes and latency; what the connection pool is meant to improve.
+ * The timers go out under the node the request went to, so a slow phase shows which node
+ * is slow and at what: name lookup, tcp connect, tls handshake, or the node itself
+ * (first byte, from the request going out on a ready connection to the answer coming back).
+ * curl's times are cumulative from the start of the request.
+ */
+static void connection_stats(CURL *session, CURLcode res, long elapsed_time) {
+    long new_connects = 0;
+    long http_version = 0;
+    double pretransfer_time = 0;
+    double starttransfer_time = 0;
+    double total_time = 0;
+
+    stats_timer("request-latency", elapsed_time);
+    if (httpengine_running()) {
+        stats_gauge_local("engine-in-flight", httpengine_in_flight());
+    }
+
+    curl_easy_getinfo(session, CURLINFO_NUM_CONNECTS, &new_connects);
+    if (new_connects > 0) {
+        double namelookup_time = 0;
+        double connect_time = 0;
+        double appconnect_time = 0;
+
+        stats_counter("new-connections", new_connects);
+        curl_easy_getinfo(session, CURLINFO_NAMELOOKUP_TIME, &namelookup_time);
+        curl_easy_getinfo(session, CURLINFO_CONNECT_TIME, &connect_time);
+        // Only a TLS connection has an appconnect phase; it ends when the handshake is done
+        curl_easy_getinfo(session, CURLINFO_APPCONNECT_TIME, &appconnect_time);
+        stats_timer("dns-time", namelookup_time * 1000);
+        // Zero if it never connected
+        if (connect_time > 0) {
+            stats_timer("connect-time", (connect_time - namelookup_time) * 1000);
+        }
+        if (appconnect_time > 0) {
+            stats_counter("tls-handshakes", new_connects);
+            stats_timer("tls-handshake-time", (appconnect_time - connect_time) * 1000);
+        }
+        stats_gauge_cluster("open-connections", open_connections);
+        log_print(LOG_INFO, SECTION_SESSION_DEFAULT, "connection_stats: %ld new connections; %d open", new_connects, open_connections);
+    }
+
+    curl_easy_getinfo(session, CURLINFO_HTTP_VERSION, &http_version);
+    stats_counter(http_version == CURL_HTTP_VERSION_2_0 ? "http2-requests" : "http1-requests", 1);
+
+    if (res != CURLE_OK) return;
+
+    curl_easy_getinfo(session, CURLINFO_PRETRANSFER_TIME, &pretransfer_time);
+    curl_easy_getinfo(session, CURLINFO_STARTTRANSFER_TIME, &starttransfer_time);
+    curl_easy_getinfo(session, CURLINFO_TOTAL_TIME, &total_time);
+    stats_timer("first-byte-time", (starttransfer_time - pretransfer_time) * 1000);
+    // Unlike request-latency, leaves out any wait for the engine to pick the request up
+    stats_timer("total-time", total_time * 1000);
+}
+
+// bytes is the size of the body, up or down, or -1 if it isn't known
+void session_request_type(__unused CURL *session, request_type_t type, curl_off_t bytes) {
+    request_type = type;
+    request_bytes = bytes;
+}
+
+void session_hedgeable(CURL *session, hedge_write_fn write_fn, void *write_data,
+        hedge_write_fn header_fn, void *header_data) {
+    curl_easy_setopt(session, CURLOPT_WRITEFUNCTION, write_fn);
+    curl_easy_setopt(session, CURLOPT_WRITEDATA, write_data);
+    if (header_fn) {
+        curl_easy_setopt(session, CURLOPT_HEADERFUNCTION, header_fn);
+        curl_easy_setopt(session, CURLOPT_HEADERDATA, header_data);
+    }
+    if (!config_hedge) return;
+
+    memset(&hedge, 0, sizeof(struct hedge_request));
+    hedge.write_fn = write_fn;
+    hedge.write_data = write_data;
+    hedge.header_fn = header_fn;
+    hedge.header_data = header_data;
+    hedgeable = true;
+}
+
+// answered is the handle which got the response; with a hedge, maybe not the caller's
+static void hedge_stats(CURL *session, CURL *answered, CURLcode res) {
+    double first_byte = 0;
+
+    // What the delay is a percentile of: how long until a request starts getting its answer
+    if (res == CURLE_OK) {
+        curl_easy_getinfo(answered, CURLINFO_STARTTRANSFER_TIME, &first_byte);
+        latency_record(&hedge_latency[request_type], first_byte * 1000 + (answered != session ? hedge.delay_ms : 0));
+    }
+    if (hedge.over_budget) {
+        stats_counter("hedges-over-budget", 1);
+    }
+    if (hedge.hedged) {
+        stats_counter("hedges", 1);
+        log_print(LOG_INFO, SECTION_SESSION_DEFAULT, "hedge_stats: no answer after %ldms; hedge %s",
+            hedge.delay_ms, answered != session ? "answered first" : "lost");
+    }
+    if (answered != session) {
+        stats_counter("hedge-wins", 1);
+    }
+    // As for requests which aren't hedged, in timed_curl_easy_perform
+    if (hedge.breaker_opened) {
+        stats_counter("breaker-opens", 1);
+        log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, "hedge_stats: breaker opened on %s", nodescore_key(hedge.breaker_node));
+    }
+}
+
+/* A body of unknown size might be huge, so its request gets the ceiling, but gives up if
+ * nothing at all moves for as long as the same request with no body would get.
+ */
+static void set_timeouts(CURL *session) {
+    long connect_ms;
+    long request_ms;
+
+    if (!config_adaptive_timeouts) return;
+
+    connect_ms = timeouts_connect_ms(picked_node);
+    request_ms = timeouts_request_ms(picked_node, request_type, request_bytes);
+    curl_easy_setopt(session, CURLOPT_CONNECTTIMEOUT_MS, connect_ms);
+    curl_easy_setopt(session, CURLOPT_TIMEOUT_MS, request_ms);
+    if (request_bytes < 0) {
+        long idle_secs = (timeouts_request_ms(picked_node, request_type, 0) + 999) / 1000;
+        curl_easy_setopt(session, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(session, CURLOPT_LOW_SPEED_TIME, idle_secs);
+    }
+    log_print(LOG_DEBUG, SECTION_SESSION_DEFAULT, "set_timeouts: connect %ldms; request %ldms", connect_ms, request_ms);
+}
+
+/* What the timeouts go by, and the timeouts themselves, which go out under the node they
+ * happened on.
+ */
+static void timeout_stats(CURL *session, CURLcode res, long elapsed_time) {
+    char *primary_ip = NULL;
+    bool connecting;
+    unsigned count;
+
+    if (res == CURLE_OK) {
+        long new_connects = 0;
+        long connect_ms = -1;
+        curl_off_t uploaded = 0;
+        curl_off_t downloaded = 0;
+
+        curl_easy_getinfo(session, CURLINFO_NUM_CONNECTS, &new_connects);
+        if (new_connects > 0) {
+            double namelookup_time = 0;
+            double connect_time = 0;
+
+            curl_easy_getinfo(session, CURLINFO_NAMELOOKUP_TIME, &namelookup_time);
+            curl_easy_getinfo(session, CURLINFO_CONNECT_TIME, &connect_time);
+            if (connect_time > 0) connect_ms = (connect_time - namelookup_time) * 1000;
+        }
+        curl_easy_getinfo(session, CURLINFO_SIZE_UPLOAD_T, &uploaded);
+        curl_easy_getinfo(session, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+        timeouts_record(picked_node, request_type, connect_ms, elapsed_time, uploaded + downloaded);
+        return;
+    }
+    if (res != CURLE_OPERATION_TIMEDOUT) return;
+
+    // curl only has the address once it's connected
+    curl_easy_getinfo(session, CURLINFO_PRIMARY_IP, &primary_ip);
+    connecting = (primary_ip == NULL || primary_ip[0] == '\0');
+    count = timeouts_timed_out(picked_node);
+    stats_counter(connecting ? "connect-timeouts" : "request-timeouts", 1);
+    log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, "timeout_stats: %s after %ldms; %u timeouts on %s",
+        connecting ? "connect timed out" : "timed out", elapsed_time, count, get_nodeaddr());
+}
+
 void timed_curl_easy_perform(CURL *session, CURLcode *res, long *response_code, long *elapsed_time) {
     static const char *funcname = "timed_curl_easy_perform";
     struct timespec start_time;
     struct timespec now;
+    // Only worth it if there's another node to send the hedge to
+    bool hedging = hedgeable && picked_node >= 0 && nodescore_count() > 1;
+    bool breaker_opened = false;
+    CURL *answered = session;
 
+    hedgeable = false;
+    set_timeouts(session);
     log_print(LOG_DEBUG, SECTION_SESSION_DEFAULT, 
             "%s: calling curl_easy_perform; session: %p", funcname, session);
     clock_gettime(CLOCK_MONOTONIC, &start_time);
-    *res = curl_easy_perform(session);
+    if (hedging) {
+        // hedge_perform keeps the scoreboard for its attempts
+        hedge.node = picked_node;
+        hedge.delay_ms = hedge_delay(&hedge_latency[request_type], HEDGE_PERCENTILE, HEDGE_FLOOR_MS, HEDGE_CEILING_MS);
+        hedge.slow_ms = time_limit;
+        *res = hedge_perform(session, &hedge);
+        answered = hedge.answered;
+    }
+    else {
+        nodescore_start(picked_node);
+        *res = httpengine_perform(session);
+    }
     clock_gettime(CLOCK_MONOTONIC, &now);
     if(*res == CURLE_OK) {
-        curl_easy_getinfo(session, CURLINFO_RESPONSE_CODE, response_code);
+        curl_easy_getinfo(answered, CURLINFO_RESPONSE_CODE, response_code);
     }
     *elapsed_time = ((now.tv_sec - start_time.tv_sec) * 1000) + 
         ((now.tv_nsec - start_time.tv_nsec) / (1000 * 1000));
+    if (!hedging) {
+        // The same tests process_status makes for a failure
+        breaker_opened = nodescore_done(picked_node, *res == CURLE_OK && *response_code < 500 && *elapsed_time <= time_limit,
+            *elapsed_time);
+    }
+    update_nodeaddr(answered);
+    connection_stats(answered, *res, *elapsed_time);
+    if (breaker_opened) {
+        stats_counter("breaker-opens", 1);
+        log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, "%s: breaker opened on %s", funcname, nodescore_key(picked_node));
+    }
+    // A hedge which answered went to some other node
+    if (answered == session) {
+        timeout_stats(session, *res, *elapsed_time);
+    }
+    picked_node = -1;
+    if (hedging) {
+        hedge_stats(session, answered, *res);
+        if (answered != session) curl_easy_cleanup(answered);
+    }
     if (*res != CURLE_OK) {
         log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, 
                 "%s: curl failed: %s : *elapsed_time: %ld\n", 
@@ -627,146 +880,6 @@ finish:
    Only effective if N is much smaller than RAND_MAX;
    if this may not be the case, use a better random
    number generator. */
-static void randomize(void *array[], int n) {
-    struct timespec ts;
-    // Randomize!
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    srand(ts.tv_nsec * ts.tv_sec);
-
-    if (n > 1) {
-        for (int idx = 0; idx < n - 1; idx++) {
-          int jdx = idx + rand() / (RAND_MAX / (n - idx) + 1);
-          void *t = array[jdx];
-          array[jdx] = array[idx];
-          array[idx] = t;
-        }
-    }
-}
-
-static int compare_node_score(const void *x, const void *y) {
-    const struct addr_score_s *a = (const struct addr_score_s *)*(const struct addr_score_s * const *)x;
-    const struct addr_score_s *b = (const struct addr_score_s *)*(const struct addr_score_s * const *)y;
-
-    if (a->score > b->score) return 1;
-    else if (a->score < b->score) return -1;
-    else return 0;
-}
-
-static bool set_health_status(char *addr, char *curladdr) {
-    static const char *funcname = "set_health_status";
-    bool added_entry = false;
-    struct health_status_s *healthstatus = NULL;
-    healthstatus = g_hash_table_lookup(node_status.node_hash_table, addr);
-    if (healthstatus) {
-        if (curladdr && healthstatus->curladdr[0] == '\0') {
-            strncpy(healthstatus->curladdr, curladdr, LOGSTRSZ);
-            log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, 
-                    "%s: existing entry didn't have curladdr %s", funcname, addr);
-        }
-        log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, "%s: reusing entry for %s", funcname, addr);
-        healthstatus->current = true;
-    }
-    else {
-        healthstatus = g_new(struct health_status_s, 1);
-        healthstatus->score = HEALTHY;
-        healthstatus->timestamp = 0;
-        healthstatus->current = true;
-        if (curladdr) {
-            strncpy(healthstatus->curladdr, curladdr, LOGSTRSZ);
-        }
-        else {
-            log_print(LOG_CRIT, SECTION_SESSION_DEFAULT, 
-                    "%s: new entry doesn't have curladdr %s", funcname, addr);
-        }
-        g_hash_table_replace(node_status.node_hash_table, g_strdup(addr), healthstatus);
-        log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, 
-                "%s: creating new entry for %s // %s", funcname, addr, curladdr);
-        added_entry = true;
-    }
-    return added_entry;
-}
-
-static void construct_resolve_slist(GHashTable *addr_table) {
-    static const char *funcname = "construct_resolve_slist";
-    int addr_score_idx = 0;
-    GHashTableIter iter;
-    gpointer key, value;
-    // Did we change the list? Used to decide to print new list
-    // We get a new list if we get a new session, or we add or delete a node 
-    // from the cluster; or if we update a health score
-    struct addr_score_s *addr_score[MAX_NODES + 1] = {NULL};
-
-    // Is there anything in node_hash_table not in addr table,
-    // e.g. a deleted addr
-    g_hash_table_iter_init (&iter, node_status.node_hash_table);
-    log_print(LOG_DEBUG, SECTION_SESSION_DEFAULT, "%s: hash_table [%p], iter [%p]",
-        funcname, node_status.node_hash_table, iter);
-    while (g_hash_table_iter_next (&iter, &key, &value)) {
-        // Is this address in addr_table?
-        bool exists = g_hash_table_lookup(addr_table, key);
-        if (!exists) {
-            // delete the node
-            g_hash_table_iter_remove(&iter);
-            log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, "%s: removed from hash table: %s", 
-                    funcname, key);
-        }
-    }
-    // Is there anything in addr_table not in node_hash_table
-    // e.g. an added addr
-    g_hash_table_iter_init (&iter, addr_table);
-    while (g_hash_table_iter_next (&iter, &key, &value)) {
-        // Is this address in addr_table?
-        bool exists = g_hash_table_lookup(node_status.node_hash_table, key);
-        if (!exists) {
-            // Add to node_hash_table
-            set_health_status(key, value);
-            log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, "%s: added to hash table %s :: %s",
-                    funcname, key, value);
-        }
-    }
-
-    // Prepare a sortable array
-    g_hash_table_iter_init (&iter, node_status.node_hash_table);
-
-    addr_score_idx = 0;
-    while (g_hash_table_iter_next (&iter, &key, &value)) {
-        struct health_status_s *healthstatus = (struct health_status_s *)value;
-
-        log_print(LOG_DEBUG, SECTION_SESSION_DEFAULT, "%s: healthstatus->curladdr: %s", funcname, healthstatus->curladdr);
-
-        // We need to sort on health score, but use the addr name.
-        addr_score[addr_score_idx] = g_new(struct addr_score_s, 1);
-
-        // Save values into sortable array
-        strncpy(addr_score[addr_score_idx]->addr, healthstatus->curladdr, IPSTR_SZ);
-        addr_score[addr_score_idx]->score = healthstatus->score;
-        log_print(LOG_INFO, SECTION_SESSION_DEFAULT, "%s: addr_score_idx [%d], addr [%s], score [%d]",
-            funcname, addr_score_idx, addr_score[addr_score_idx]->addr, addr_score[addr_score_idx]->score);
-        ++addr_score_idx;
-    }
-
-    // Randomize first; then sort and expect that the order of items with the same score (think '0') stays randomized
-    randomize((void *)addr_score, addr_score_idx);
-
-    // sort the array
-    qsort(addr_score, addr_score_idx, sizeof(struct addr_score_s *), compare_node_score);
-
-    if (addr_score[0]->score != 0) {
-        // All connections are in some state of bad
-        log_print(LOG_ERR, SECTION_SESSION_DEFAULT, "%s: top entry is non-zero: %s -- %d",
-            funcname, addr_score[0]->addr, addr_score[0]->score);
-    }
-
-    // addr_score_idx is the number of addresses we processed above
-    for (int idx = 0; idx < addr_score_idx; idx++) {
-        log_print(LOG_DYNAMIC, SECTION_SESSION_DEFAULT, 
-                "%s: inserting into resolve_slist (%p): %s, score %d",
-                funcname, node_status.resolve_slist, addr_score[idx]->addr, addr_score[idx]->score);
-        node_status.resolve_slist = curl_slist_append(node_status.resolve_slist, addr_score[idx]->addr);
-        g_free(addr_score[idx]);
-    }
-}
-
 /* For reference, keep the different sockaddr structs available for inspection
  *
  * struct addrinfo {
@@ -819,22 +932,20 @@ static void construct_resolve_slist(GHashTable *addr_table) {
  *
  */
 
-/* Construct an slist for curl to use with opt CURLOPT_RESOLVE.
+/* Find the nodes for the scoreboard.
  * If our file system has several nodes, and a domain name which resolves
- * to those nodes, we need to present those nodes to distinct invocations
- * of fusedav in a random fashion to ensure load balance.
+ * to those nodes, we need to spread requests over those nodes to ensure
+ * load balance, both within and between invocations of fusedav.
  * Following its normal path, libcurl calls getaddrinfo, which will sort
  * the IP addresses according to the RFC which governs it. This breaks
  * load balance, since each invocation of fusedav will see the list of
  * IP addresses in the same order, and all will prefer the same one.
- * So we use CURLOPT_RESOLVE to let us pass in the list, which libcurl
- * will then use instead of calling getaddrinfo.
- * We do this by calling getaddrinfo ourselves, then randomizing the list.
+ * So we call getaddrinfo ourselves, and send each request to the node the
+ * scoreboard picks for it with CURLOPT_CONNECT_TO.
  */
 
-/*  create_new_addr creates the table with the current nodes;
- *  construct_resolve_slist uses that information when constructing
- *  its slist 
+/*  create_new_addr_table creates the table with the current nodes, keyed
+ *  by address as we log it, with the CURLOPT_CONNECT_TO string for each
  */
 static GHashTable *create_new_addr_table(void) {
     static const char *funcname = "create_new_addr_table";
@@ -850,11 +961,6 @@ static GHashTable *create_new_addr_table(void) {
 
     GHashTable *addr_table;
 
-    log_print(LOG_DEBUG, SECTION_SESSION_DEFAULT, "%s: node_status = %p", funcname, &node_status);
-    if (node_status.node_hash_table == NULL) {
-        node_status.node_hash_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
-    }
-
     // Turn hints off
     memset(&hints, 0, sizeof(struct addrinfo));
     // By setting ai_family to 0, we allow both IPv4 and IPv6
@@ -871,8 +977,8 @@ static GHashTable *create_new_addr_table(void) {
         log_print(LOG_CRIT, SECTION_SESSION_DEFAULT, "%s: getaddrinfo returns error: %d (%s)",
             funcname, res, gai_strerror(res));
 
-        // This is an error. We do not set CURLOPT_RESOLVE, so libcurl will
-        // do its default thing. If its call to getaddrinfo succeeds, the
+        // This is an error. If we have no nodes from before, we do not set CURLOPT_CONNECT_TO,
+        // so libcurl will do its default thing. If its call to getaddrinfo succeeds, the
         // first IP will be used (breaks load balancing).  If it fails as it does here,
         // it will do its own error processing.
         return NULL;
@@ -886,12 +992,11 @@ static GHashTable *create_new_addr_table(void) {
      * by the addrlen which gets returned (16 for IPv4, 26 (28?) for IPv6.
      * The components of the address we need are in an array of chars or ints, so
      * we pull them out one by one and append them to the string we are building.
-     * Ultimately, this string, per libcurl's CURLOPT_RESOLVE requirements,
-     * will be DOMAIN:PORT:IP-ADDRESS.
+     * Ultimately, this string, per libcurl's CURLOPT_CONNECT_TO requirements,
+     * will be DOMAIN:PORT:IP-ADDRESS:PORT.
      *
-     * If timeout has passed, we recreate the list and pass it in again to libcurl.
-     * However, if the previous connection is still good, libcurl will continue
-     * to use it in spite of the new order of addresses in the list. (This is good.)
+     * curl only reuses a connection for a request with the same CONNECT_TO,
+     * so a request gets a connection to the node picked for it, or a new one.
      */
     for (ai = aihead; ai != NULL && count < MAX_NODES; ai = ai->ai_next) {
         // Holds the string we are constructing
@@ -934,7 +1039,17 @@ static GHashTable *create_new_addr_table(void) {
             continue;
         }
 
-        strcat(ipstr, ipaddr);
+        // An IPv6 address needs brackets, so its colons don't look like separators
+        if (ai->ai_family == AF_INET6) {
+            strcat(ipstr, "[");
+            strcat(ipstr, ipaddr);
+            strcat(ipstr, "]");
+        }
+        else {
+            strcat(ipstr, ipaddr);
+        }
+        strcat(ipstr, ":");
+        strcat(ipstr, filesystem_port);
 
         log_print(LOG_DEBUG, SECTION_SESSION_DEFAULT, 
                 "%s: ipaddr/ipstr is %s // %s", funcname, ipaddr, ipstr);
@@ -959,6 +1074,8 @@ void delete_tmp_session(CURL *session) {
 
 static void delete_session(CURL *session, bool tmp_session) {
     log_print(LOG_INFO, SECTION_SESSION_DEFAULT, "delete_session: destroying old handle and creating a new one");
+    // Bouncing the handle no longer closes its connection, which stays in the pool
+    if (connection_pool) fresh_connect = true;
     if (tmp_session) {
         delete_tmp_session(session);
     }
@@ -967,32 +1084,6 @@ static void delete_session(CURL *session, bool tmp_session) {
     }
 }
 
-static void increment_node_failure(char *addr, const CURLcode res, const long response_code, const long elapsed_time) {
-    const char * funcname = "increment_node_failure";
-    struct health_status_s *healthstatus = get_health_status(addr);
-    if (!healthstatus) {
-        log_print(LOG_CRIT, SECTION_SESSION_DEFAULT, "%s: healthstatus null for %s", funcname, addr);
-        return;
-    }
-    // Currently treat !CURLE_OK and response_code > 500 the same, but leave in structure if we want to treat them differently.
-    if (res != CURLE_OK) {
-        healthstatus->score = UNHEALTHY;
-        log_print(LOG_ERR, SECTION_SESSION_DEFAULT, "%s: !CURLE_OK: %s addr score set to %d",
-            funcname, addr, healthstatus->score);
-    }
-    else if (response_code >= 500) {
-        healthstatus->score = UNHEALTHY;
-        log_print(LOG_ERR, SECTION_SESSION_DEFAULT, "%s: response_code %lu: %s addr score set to %d",
-            funcname, response_code, addr, healthstatus->score);
-    }
-    else if (elapsed_time > time_limit) {
-        healthstatus->score = UNHEALTHY;
-        log_print(LOG_ERR, SECTION_SESSION_DEFAULT, "%s: slow_request %lu: %s addr score set to %d",
-            funcname, elapsed_time, addr, healthstatus->score);
-    }
-    healthstatus->timestamp = time(NULL); // Most recent failure. We don't currently use this value, but it might be interesting
-}
-
 void process_status(const char *fcn_name, CURL *session, const CURLcode res, 
         const long response_code, const long elapsed_time, const int iter, 
         const char *path, bool tmp_session) {
@@ -1001,22 +1092,19 @@ void process_status(const char *fcn_name, CURL *session, const CURLcode res,
 
     if (res != CURLE_OK) {
         print_errors(iter, "curl_failures", fcn_name, res, response_code, elapsed_time, path);
-        increment_node_failure(nodeaddr, res, response_code, elapsed_time);
         delete_session(session, tmp_session);
         return;
     }
 
     if (response_code >= 500) {
         print_errors(iter, "status500_failures", fcn_name, res, response_code, elapsed_time, path);
-        increment_node_failure(nodeaddr, res, response_code, elapsed_time);
         delete_session(session, tmp_session);
         return;
     }
 
     if (elapsed_time > time_limit) {
         print_errors(iter, "slow_requests", fcn_name, res, response_code, elapsed_time, path);
-        increment_node_failure(nodeaddr, res, response_code, elapsed_time);
-        if (health_status_all_nodes() == UNHEALTHY) {
+        if (nodescore_all_unhealthy()) {
             trigger_saint_event(CLUSTER_FAILURE);
             set_dynamic_logging();
         }
@@ -1029,52 +1117,193 @@ void process_status(const char *fcn_name, CURL *session, const CURLcode res,
         stats_counter("recoveries", 1);
         log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT,
             "%s: curl iter %d on path %s -- fusedav.%s.server-%s.recoveries", fcn_name, iter, path, filesystem_cluster, nodeaddr);
-        increment_node_success(nodeaddr);
     }
 }
 
-static bool valid_slist(void) {
-    if (node_status.resolve_slist) {
-        return true;
+/* Hand the nodes the filesystem domain resolves to now over to the scoreboard, if the ones
+ * it has are max_age secs old. Returns true if it did.
+ */
+static bool refresh_nodes(time_t max_age) {
+    static const char *funcname = "refresh_nodes";
+    char *keys[MAX_NODES];
+    char *connect_to[MAX_NODES];
+    GHashTable *addr_table;
+    GHashTableIter iter;
+    gpointer key, value;
+    time_t now = time(NULL);
+    int count = 0;
+    bool refreshed = false;
+
+    if (now - nodes_refreshed < max_age) return false;
+
+    // Only one thread needs to do it; the others go on with the nodes we have, unless there are none yet
+    if (nodescore_count() > 0) {
+        if (pthread_mutex_trylock(&nodes_refresh_mutex) != 0) return false;
     }
+    else {
+        pthread_mutex_lock(&nodes_refresh_mutex);
+    }
+    if (now - nodes_refreshed < max_age) goto finish;
+
+    addr_table = create_new_addr_table();
+    // On getaddrinfo failure, keep the nodes we have and try again next time
+    if (addr_table == NULL) goto finish;
 
-    return false;
+    g_hash_table_iter_init(&iter, addr_table);
+    while (g_hash_table_iter_next(&iter, &key, &value) && count < MAX_NODES) {
+        keys[count] = key;
+        connect_to[count] = value;
+        ++count;
+    }
+    log_print(LOG_INFO, SECTION_SESSION_DEFAULT, "%s: %d nodes, %d in the scoreboard",
+        funcname, count, nodescore_set_nodes(keys, connect_to, count));
+    g_hash_table_destroy(addr_table);
+    nodes_refreshed = now;
+    refreshed = true;
+
+finish:
+    pthread_mutex_unlock(&nodes_refresh_mutex);
+    return refreshed;
 }
 
-static bool slist_timed_out(void) {
-    // timeout interval in seconds
-    // If this interval has passed, we recreate the list. Within this interval,
-    // we reuse the current list.
-    static const time_t resolve_slist_timeout = 600;
-    static const time_t health_update_timeout = 120;
-    // Keep a timer; at periodic intervals we reset the resolve_slist.
-    // static so it persists between calls
-    static __thread time_t prev_slist_time = 0;
-    static __thread time_t prev_health_time = 0;
-    time_t curtime;
-
-    // If the list is still young, just return. The current list is still valid
-    curtime = time(NULL);
-
-    // We want to update the health status on all nodes currently unhealthy. We
-    // do this on a different interval than the slist_timeout
-    if (curtime - prev_health_time > health_update_timeout) {
-        log_print(LOG_INFO, SECTION_SESSION_DEFAULT,
-            "slist_timed_out: updating health status all nodes");
-        update_health_status_all_nodes();
-        // Ready for the next invocation.
-        prev_health_time = curtime;
-    }
-    if (curtime - prev_slist_time < resolve_slist_timeout) {
-        log_print(LOG_DEBUG, SECTION_SESSION_DEFAULT,
-            "slist_timed_out: timeout has not elapsed; return with current slist (%p)", node_status.resolve_slist);
-        return false;
-    }
-
-    // Ready for the next invocation.
-    prev_slist_time = curtime;
-    log_print(LOG_INFO, SECTION_SESSION_DEFAULT, "slist_timed_out: timeout has elapsed on %s", nodeaddr);
-    return true;
+// A HEAD of the base URL on the node, so the pool has a connection to it ready
+static CURL *warm_session(int idx) {
+    CURL *session;
+    // Only the connection is wanted, not where it went
+    static __thread char addr[INET6_ADDRSTRLEN];
+
+    session = curl_easy_init();
+    if (!session) return NULL;
+    curl_easy_setopt(session, CURLOPT_SHARE, connection_pool);
+    curl_easy_setopt(session, CURLOPT_URL, get_base_url());
+    curl_easy_setopt(session, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(session, CURLOPT_CONNECT_TO, nodescore_connect_to(idx));
+    set_connection_options(session, addr);
+    curl_easy_setopt(session, CURLOPT_CONNECTTIMEOUT_MS, CONNECT_TIMEOUT_MS);
+    curl_easy_setopt(session, CURLOPT_TIMEOUT_MS, WARM_TIMEOUT_MS);
+    curl_easy_setopt(session, CURLOPT_PRIVATE, (char *) (intptr_t) idx);
+    return session;
+}
+
+/* Warms every healthy node at once, so one node which doesn't answer holds up the pass
+ * for WARM_TIMEOUT_MS at most, not the others. Outcomes go on the scoreboard like any
+ * request's, so a node which fails its HEAD has its breaker opened before requests find out.
+ */
+static void warm_nodes(void) {
+    static const char *funcname = "warm_nodes";
+    struct timespec start;
+    CURLM *multi;
+    int warmed = 0;
+    int failed = 0;
+    int running = 0;
+
+    // The scoreboard and saint mode decide when sick nodes get traffic again, not us
+    if (get_saint_state() != STATE_HEALTHY) return;
+
+    multi = curl_multi_init();
+    if (multi == NULL) return;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int idx = 0; idx < NODESCORE_MAX_NODES; idx++) {
+        CURL *session;
+
+        if (!nodescore_healthy(idx)) continue;
+        session = warm_session(idx);
+        if (session == NULL) continue;
+        nodescore_start(idx);
+        curl_multi_add_handle(multi, session);
+        ++running;
+    }
+
+    while (running > 0) {
+        struct CURLMsg *msg;
+        int left;
+
+        curl_multi_perform(multi, &running);
+        while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+            CURL *session = msg->easy_handle;
+            CURLcode res = msg->data.result;
+            long response_code = 0;
+            char *private = NULL;
+            struct timespec now;
+            long elapsed;
+            bool ok;
+            int idx;
+
+            if (msg->msg != CURLMSG_DONE) continue;
+            curl_easy_getinfo(session, CURLINFO_PRIVATE, &private);
+            idx = (int) (intptr_t) private;
+            if (res == CURLE_OK) curl_easy_getinfo(session, CURLINFO_RESPONSE_CODE, &response_code);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed = ((now.tv_sec - start.tv_sec) * 1000) + ((now.tv_nsec - start.tv_nsec) / (1000 * 1000));
+
+            // Whatever the node makes of a HEAD, the connection is in the pool now
+            ok = (res == CURLE_OK && response_code < 500);
+            if (ok) {
+                ++warmed;
+            }
+            else {
+                ++failed;
+                log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, "%s: %s: %s (%ld)",
+                    funcname, nodescore_key(idx), curl_easy_strerror(res), response_code);
+            }
+            if (nodescore_done(idx, ok, elapsed)) {
+                stats_counter("breaker-opens", 1);
+                log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, "%s: breaker opened on %s", funcname, nodescore_key(idx));
+            }
+            // msg goes away with the handle
+            curl_multi_remove_handle(multi, session);
+            curl_easy_cleanup(session);
+        }
+        if (running > 0) curl_multi_wait(multi, NULL, 0, 1000, NULL);
+    }
+    curl_multi_cleanup(multi);
+
+    if (warmed) stats_counter("warmed-nodes", warmed);
+    if (failed) stats_counter("warm-failures", failed);
+    log_print(LOG_DEBUG, SECTION_SESSION_DEFAULT, "%s: %d warm, %d failed", funcname, warmed, failed);
+}
+
+static void *refresh_and_warm(__unused void *ptr) {
+    time_t warmed = 0;
+
+    log_print(LOG_DEBUG, SECTION_SESSION_DEFAULT, "enter refresh_and_warm");
+
+    while (true) {
+        bool refreshed = refresh_nodes(NODES_REFRESH_SECS / 2);
+
+        // Nodes which just showed up get their connection now
+        if (connection_pool && (refreshed || time(NULL) - warmed >= WARM_SECS)) {
+            warm_nodes();
+            warmed = time(NULL);
+        }
+        if ((sleep(REFRESH_TICK_SECS)) != 0) {
+            log_print(LOG_CRIT, SECTION_SESSION_DEFAULT, "refresh_and_warm: sleep interrupted; exiting ...");
+            // Requests go back to doing the lookups
+            refresh_running = false;
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/* Looks up the nodes, so the first requests don't have to, and starts the refresh thread,
+ * which warms them straight away; the mount doesn't wait for that.
+ * Returns 0, or -errno if the thread can't be started; requests then do the lookups.
+ */
+int session_refresh_init(void) {
+    pthread_t thread;
+    int ret;
+
+    if (refresh_running) return 0;
+
+    refresh_nodes(0);
+
+    ret = pthread_create(&thread, NULL, refresh_and_warm, NULL);
+    if (ret) return -ret;
+    pthread_detach(thread);
+    refresh_running = true;
+
+    return 0;
 }
 
 static bool needs_new_session(bool tmp_session) {
@@ -1099,18 +1328,6 @@ static bool needs_new_session(bool tmp_session) {
         new_session = true;
     }
 
-    // no slist
-    else if (!valid_slist()) {
-        log_print(LOG_NOTICE, SECTION_SESSION_DEFAULT, "%s: !valid_slist", funcname);
-        new_session = true;
-    }
-
-    // timeout
-    else if (slist_timed_out()) {
-        log_print(LOG_INFO, SECTION_SESSION_DEFAULT, "%s: slist_timed_out", funcname);
-        new_session = true;
-    }
-
     // We're going to create a new session, so get rid of the old
     if (new_session) {
         session_cleanup(session);
@@ -1123,17 +1340,6 @@ static CURL *update_session(bool tmp_session) {
     static const char *funcname = "update_session";
     CURL *session = NULL;
 
-    // We only need a new addr_table if we need a new session, and if we call update_session,
-    // we need a new session
-    GHashTable *addr_table;
-    addr_table = create_new_addr_table();
-    // On getaddrinfo failure, NULL gets returned; pass it through
-    if (addr_table == NULL) return NULL;
-
-    // create the hash table of node addresses for which we will keep health status
-    // We do this when the thread is initialized. We want the hashtable to survive reinitialization of the handle,
-    // since the hashtable keeps track of the health status of connections causing the reinitialization
-
     log_print(LOG_INFO, SECTION_SESSION_DEFAULT, "Opening cURL session");
 
     // if tmp_session, we need to get a new session for this request; otherwise see if we already have a session
@@ -1150,6 +1356,10 @@ static CURL *update_session(bool tmp_session) {
         log_print(LOG_CRIT, SECTION_SESSION_DEFAULT, "%s: curl_easy_init returns NULL", funcname);
         return NULL;
     }
+    // curl_easy_reset leaves this alone, so it's only needed once per handle
+    if (connection_pool) {
+        curl_easy_setopt(session, CURLOPT_SHARE, connection_pool);
+    }
     // We don't want a tmp session to muck with start time and resetting the main session
     if (!tmp_session) {
         // Keep track of start time so we can track how long sessions stay open
@@ -1159,10 +1369,6 @@ static CURL *update_session(bool tmp_session) {
         update_session_count(true);
     }
 
-    log_print(LOG_DEBUG, SECTION_SESSION_DEFAULT, "%s: construct_resolve_slist: addr_table (%p)", funcname, addr_table);
-    construct_resolve_slist(addr_table);
-    g_hash_table_destroy(addr_table);
-
     return session;
 }
 
@@ -1204,15 +1410,29 @@ CURL *session_request_init(const char *path, const char *query_string, bool tmp_
 
     curl_easy_reset(session);
 
-    // Whether we created a new resolve_slist or not, we still need to
-    // make the setopt call for CURLOPT_RESOLVE.
-    // Otherwise, libcurl will revert to its default, call getaddrinfo
-    // on its own, and return the unsorted, unbalanced, first entry.
-    log_print(LOG_INFO, SECTION_SESSION_DEFAULT, "%s: Sending resolve_slist (%p) to curl",
-        funcname, node_status.resolve_slist);
-    curl_easy_setopt(session, CURLOPT_RESOLVE, node_status.resolve_slist);
-    curl_easy_setopt(session, CURLOPT_DEBUGFUNCTION, session_debug);
-    curl_easy_setopt(session, CURLOPT_VERBOSE, 1L);
+    // Without CURLOPT_CONNECT_TO, libcurl will revert to its default, call getaddrinfo
+    // on its own, and use the unsorted, unbalanced, first entry.
+    hedgeable = false;
+    request_type = REQUEST_OTHER;
+    request_bytes = 0;
+    if (!refresh_running) refresh_nodes(NODES_REFRESH_SECS);
+    picked_node = nodescore_pick();
+    if (picked_node >= 0) {
+        log_print(LOG_INFO, SECTION_SESSION_DEFAULT, "%s: picked node %s (breaker %s)", funcname,
+            nodescore_key(picked_node), nodescore_breaker(picked_node));
+        curl_easy_setopt(session, CURLOPT_CONNECT_TO, nodescore_connect_to(picked_node));
+    }
+    tried_addr[0] = '\0';
+    set_connection_options(session, tried_addr);
+    if (connection_pool && fresh_connect) {
+        curl_easy_setopt(session, CURLOPT_FRESH_CONNECT, 1L);
+        fresh_connect = false;
+    }
+    // All requests share the engine's multi handle, so one can wait to be multiplexed
+    // onto a connection still being set up rather than open another
+    if (httpengine_running()) {
+        curl_easy_setopt(session, CURLOPT_PIPEWAIT, 1L);
+    }
 
     escaped_path = escape_except_slashes(session, path);
     if (escaped_path == NULL) {
@@ -1235,17 +1455,9 @@ CURL *session_request_init(const char *path, const char *query_string, bool tmp_
     log_print(LOG_INFO, SECTION_SESSION_DEFAULT, "%s: Initialized request to URL: %s", funcname, full_url);
     free(full_url);
 
-    if (ca_certificate != NULL)
-        curl_easy_setopt(session, CURLOPT_CAINFO, ca_certificate);
-    if (client_certificate != NULL) {
-        curl_easy_setopt(session, CURLOPT_SSLCERT, client_certificate);
-        curl_easy_setopt(session, CURLOPT_SSLKEY, client_certificate);
-    }
-    curl_easy_setopt(session, CURLOPT_SSL_VERIFYHOST, 0);
-    curl_easy_setopt(session, CURLOPT_SSL_VERIFYPEER, 1);
     curl_easy_setopt(session, CURLOPT_FOLLOWLOCATION, 1);
-    curl_easy_setopt(session, CURLOPT_CONNECTTIMEOUT_MS, 1200);
-    curl_easy_setopt(session, CURLOPT_TIMEOUT, 60);
+    curl_easy_setopt(session, CURLOPT_CONNECTTIMEOUT_MS, CONNECT_TIMEOUT_MS);
+    curl_easy_setopt(session, CURLOPT_TIMEOUT, REQUEST_TIMEOUT_SECS);
     curl_easy_setopt(session, CURLOPT_PROTOCOLS, CURLPROTO_HTTP | CURLPROTO_HTTPS);
     curl_easy_setopt(session, CURLOPT_REDIR_PROTOCOLS, CURLPROTO_HTTP | CURLPROTO_HTTPS);
 
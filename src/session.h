@@ -20,11 +20,17 @@
 ***/
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <curl/curl.h>
 
+#include "hedge.h"
+#include "timeouts.h"
+
 extern int num_filesystem_server_nodes;
 
-int session_config_init(char *base, char *ca_cert, char *client_cert, bool grace);
+int session_config_init(char *base, char *ca_cert, char *client_cert, bool grace, bool pool, bool hedge_requests,
+        bool adaptive_timeouts);
+int session_refresh_init(void);
 CURL *session_request_init(const char *path, const char *query_string, bool temporary_handle);
 void session_config_free(void);
 void process_status(const char *fcn_name, CURL *session, const CURLcode res, 
@@ -42,16 +48,18 @@ void aggregate_log_print_local(unsigned int log_level, unsigned int section, con
 
 typedef enum { STATE_HEALTHY, STATE_SAINT_MODE, STATE_ATTEMPTING_TO_EXIT_SAINT_MODE, NUM_STATES } state_t;
 typedef enum { CLUSTER_FAILURE, SAINT_MODE_DURATION_EXPIRED, CLUSTER_SUCCESS, NUM_EVENTS } event_t;
+// The saint state and the time of the last cluster failure, packed so they change together
+typedef uint64_t saint_word_t;
 
-void action_s1_e1 (void);
-void action_s1_e2 (void);
-void action_s1_e3 (void);
-void action_s2_e1 (void);
-void action_s2_e2 (void);
-void action_s2_e3 (void);
-void action_s3_e1 (void);
-void action_s3_e2 (void);
-void action_s3_e3 (void);
+bool action_s1_e1 (saint_word_t word);
+bool action_s1_e2 (saint_word_t word);
+bool action_s1_e3 (saint_word_t word);
+bool action_s2_e1 (saint_word_t word);
+bool action_s2_e2 (saint_word_t word);
+bool action_s2_e3 (saint_word_t word);
+bool action_s3_e1 (saint_word_t word);
+bool action_s3_e2 (saint_word_t word);
+bool action_s3_e3 (saint_word_t word);
 
 void try_release_request_outstanding(void);
 void trigger_saint_mode_expired_if_needed(void);
@@ -59,6 +67,9 @@ void trigger_saint_event(event_t);
 state_t get_saint_state(void);
 bool use_saint_mode(void);
 void timed_curl_easy_perform(CURL *session, CURLcode *res, long *response_code, long *elapsed_time);
+void session_request_type(CURL *session, request_type_t type, curl_off_t bytes);
+void session_hedgeable(CURL *session, hedge_write_fn write_fn, void *write_data,
+        hedge_write_fn header_fn, void *header_data);
 const char *get_filesystem_cluster(void);
 const char *get_nodeaddr(void);
 
@@ -0,0 +1,386 @@
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "slabstore.h"
+#include "log.h"
+#include "log_sections.h"
+#include "util.h"
+
+// Start a new slab once the current one reaches this size
+#define SLAB_FILE_SIZE (256 * 1024 * 1024)
+// Slab ids are indexes into slabs[]; this caps the store at 256G
+#define SLAB_MAX_COUNT 1024
+#define SLAB_COPY_SIZE (64 * 1024)
+
+struct slab {
+    int fd; // -1 if there's no slab with this id
+    off_t tail; // Everything below this has been handed out
+    off_t live; // Bytes still referenced by the filecache, as of the last usage count
+    unsigned pending; // Appends handed out whose entries may not be written yet; see slabstore_append_done
+    bool sealed; // On disk in full, and named so that the next run trusts it; see seal_slab
+    bool compacting;
+};
+
+// slab_mutex protects everything below, but not the contents of the slab files.
+// Appends reserve their range under the lock and copy outside it.
+static pthread_mutex_t slab_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct slab slabs[SLAB_MAX_COUNT];
+// The slab we append to; never a compaction victim
+static int active = -1;
+static char slab_dir[PATH_MAX];
+
+static G_DEFINE_QUARK(SLAB, slab)
+
+// Slabs are named slab-<id> once sealed, and slab-<id>.new until then
+static void slab_path(unsigned id, bool sealed, char *path) {
+    snprintf(path, PATH_MAX, "%s/slab-%u%s", slab_dir, id, sealed ? "" : ".new");
+}
+
+// Called with slab_mutex held. A slab can be sealed once nothing will be appended to it.
+static bool seal_due(int id) {
+    return id >= 0 && id < SLAB_MAX_COUNT && id != active && slabs[id].fd >= 0 && !slabs[id].sealed && slabs[id].pending == 0;
+}
+
+/* Syncs a slab which is no longer appended to, then renames it so slabstore_init will pick
+ * it up. Only the thread which found seal_due calls it, without slab_mutex held. If it
+ * fails, the slab stays unsealed: it's served until the restart, but never compacted.
+ */
+static void seal_slab(unsigned id) {
+    char from[PATH_MAX];
+    char to[PATH_MAX];
+    int fd;
+
+    pthread_mutex_lock(&slab_mutex);
+    fd = dup(slabs[id].fd);
+    pthread_mutex_unlock(&slab_mutex);
+
+    if (fd < 0 || fdatasync(fd)) {
+        log_print(LOG_WARNING, SECTION_FILECACHE_CACHE, "seal_slab: can't sync slab %u: %d %s", id, errno, strerror(errno));
+        if (fd >= 0) close(fd);
+        return;
+    }
+    close(fd);
+
+    slab_path(id, false, from);
+    slab_path(id, true, to);
+    pthread_mutex_lock(&slab_mutex);
+    if (rename(from, to)) {
+        log_print(LOG_WARNING, SECTION_FILECACHE_CACHE, "seal_slab: can't rename %s: %d %s", from, errno, strerror(errno));
+    }
+    else {
+        slabs[id].sealed = true;
+        log_print(LOG_INFO, SECTION_FILECACHE_CACHE, "seal_slab: sealed %s (%lu bytes)", to, slabs[id].tail);
+    }
+    pthread_mutex_unlock(&slab_mutex);
+}
+
+// Called with slab_mutex held
+static void new_slab(GError **gerr) {
+    char path[PATH_MAX];
+
+    for (unsigned id = 0; id < SLAB_MAX_COUNT; id++) {
+        if (slabs[id].fd >= 0 || slabs[id].compacting) continue;
+
+        slab_path(id, false, path);
+        slabs[id].fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (slabs[id].fd < 0) {
+            g_set_error(gerr, slab_quark(), errno, "new_slab: failed to create %s", path);
+            return;
+        }
+        slabs[id].tail = 0;
+        slabs[id].live = 0;
+        slabs[id].pending = 0;
+        slabs[id].sealed = false;
+        active = id;
+        log_print(LOG_INFO, SECTION_FILECACHE_CACHE, "new_slab: appending to %s", path);
+        return;
+    }
+
+    g_set_error(gerr, slab_quark(), E_SLAB_NOSPACE, "new_slab: all %d slabs in use", SLAB_MAX_COUNT);
+}
+
+void slabstore_init(const char *cache_path, GError **gerr) {
+    struct dirent *diriter;
+    DIR *dir;
+
+    snprintf(slab_dir, PATH_MAX, "%s/slabs", cache_path);
+    if (mkdir(slab_dir, 0770) == -1 && errno != EEXIST) {
+        g_set_error(gerr, slab_quark(), errno, "slabstore_init: Path %s could not be created.", slab_dir);
+        return;
+    }
+
+    for (unsigned id = 0; id < SLAB_MAX_COUNT; id++) {
+        slabs[id].fd = -1;
+    }
+
+    dir = opendir(slab_dir);
+    if (dir == NULL) {
+        g_set_error(gerr, slab_quark(), errno, "slabstore_init: Can't open %s", slab_dir);
+        return;
+    }
+
+    /* Pick up the sealed slabs from the last run; new bodies go to a fresh slab. Appends aren't
+     * synced one by one, so a slab which wasn't sealed, because the last run crashed while it
+     * was being filled, may have lost any part of what was written to it. It goes, and the
+     * entries which point into it miss, and are fetched again.
+     */
+    while ((diriter = readdir(dir)) != NULL) {
+        char path[PATH_MAX];
+        struct stat st;
+        unsigned id;
+        int len = 0;
+
+        if (sscanf(diriter->d_name, "slab-%u%n", &id, &len) != 1 || id >= SLAB_MAX_COUNT) continue;
+
+        if (diriter->d_name[len] != '\0') {
+            snprintf(path, PATH_MAX, "%s/%s", slab_dir, diriter->d_name);
+            log_print(LOG_NOTICE, SECTION_FILECACHE_CACHE, "slabstore_init: discarding %s, which wasn't sealed", path);
+            unlink(path);
+            continue;
+        }
+
+        slab_path(id, true, path);
+        slabs[id].fd = open(path, O_RDWR);
+        if (slabs[id].fd < 0 || fstat(slabs[id].fd, &st)) {
+            log_print(LOG_WARNING, SECTION_FILECACHE_CACHE, "slabstore_init: can't open %s: %d %s", path, errno, strerror(errno));
+            if (slabs[id].fd >= 0) close(slabs[id].fd);
+            slabs[id].fd = -1;
+            continue;
+        }
+        slabs[id].tail = st.st_size;
+        slabs[id].sealed = true;
+        log_print(LOG_DEBUG, SECTION_FILECACHE_CACHE, "slabstore_init: found %s (%lu bytes)", path, st.st_size);
+    }
+    closedir(dir);
+}
+
+/* Copies length bytes at src_offset in src_fd to the end of the active slab, and sets ref to where they went.
+ * Unless it fails, the caller calls slabstore_append_done once the entry recording ref is written, or
+ * it has given up on writing it; until then the slab isn't sealed or compacted. Nothing is synced here:
+ * the slab is, as a whole, when it's sealed after filling up.
+ */
+void slabstore_append(int src_fd, off_t src_offset, off_t length, struct slab_ref *ref, GError **gerr) {
+    GError *tmpgerr = NULL;
+    char *buf = NULL;
+    off_t done = 0;
+    int previous;
+    bool seal = false;
+    int fd;
+
+    pthread_mutex_lock(&slab_mutex);
+    previous = active;
+    if (active < 0 || slabs[active].tail + length > SLAB_FILE_SIZE) {
+        new_slab(&tmpgerr);
+        if (tmpgerr) {
+            pthread_mutex_unlock(&slab_mutex);
+            g_propagate_prefixed_error(gerr, tmpgerr, "slabstore_append: ");
+            return;
+        }
+        // Appends still copying into the old slab seal it when they're done
+        seal = seal_due(previous);
+    }
+    ref->id = active;
+    ref->offset = slabs[active].tail;
+    ref->length = length;
+    slabs[active].tail += length;
+    // The slab might be retired by a compaction before we are done, so copy through our own fd
+    fd = dup(slabs[active].fd);
+    if (fd >= 0) ++slabs[active].pending;
+    pthread_mutex_unlock(&slab_mutex);
+
+    if (seal) seal_slab(previous);
+
+    if (fd < 0) {
+        g_set_error(gerr, slab_quark(), errno, "slabstore_append: dup failed");
+        return;
+    }
+
+    // A failure leaves a hole in the slab, which compaction will reclaim
+    buf = malloc(SLAB_COPY_SIZE);
+    if (buf == NULL) {
+        g_set_error(gerr, slab_quark(), ENOMEM, "slabstore_append: malloc failed");
+        goto finish;
+    }
+
+    while (done < length) {
+        size_t chunk = (length - done) < SLAB_COPY_SIZE ? (size_t) (length - done) : SLAB_COPY_SIZE;
+        ssize_t bytes = pread(src_fd, buf, chunk, src_offset + done);
+
+        if (bytes <= 0) {
+            g_set_error(gerr, slab_quark(), bytes < 0 ? errno : EIO, "slabstore_append: short read at %lu", src_offset + done);
+            goto finish;
+        }
+        if (pwrite(fd, buf, bytes, ref->offset + done) != bytes) {
+            g_set_error(gerr, slab_quark(), errno, "slabstore_append: write to slab %u failed", ref->id);
+            goto finish;
+        }
+        done += bytes;
+    }
+
+    log_print(LOG_DEBUG, SECTION_FILECACHE_CACHE, "slabstore_append: %lu bytes to slab %u at %lu", length, ref->id, ref->offset);
+
+finish:
+    free(buf);
+    close(fd);
+    // A failure leaves nothing for the caller to record
+    if (done < length) slabstore_append_done(ref);
+}
+
+// The entry for an append has been written, or won't be
+void slabstore_append_done(const struct slab_ref *ref) {
+    bool seal;
+
+    pthread_mutex_lock(&slab_mutex);
+    if (ref->id < SLAB_MAX_COUNT && slabs[ref->id].pending > 0) --slabs[ref->id].pending;
+    seal = seal_due(ref->id);
+    pthread_mutex_unlock(&slab_mutex);
+
+    if (seal) seal_slab(ref->id);
+}
+
+// Seals the active slab, so that the next run keeps what's in it
+void slabstore_close(void) {
+    int id;
+    bool seal;
+
+    pthread_mutex_lock(&slab_mutex);
+    id = active;
+    active = -1;
+    seal = seal_due(id);
+    pthread_mutex_unlock(&slab_mutex);
+
+    if (seal) seal_slab(id);
+}
+
+// Returns a new fd on the slab holding ref's body; reads need to add ref->offset
+int slabstore_open(const struct slab_ref *ref, GError **gerr) {
+    int fd = -1;
+
+    pthread_mutex_lock(&slab_mutex);
+    if (ref->id < SLAB_MAX_COUNT && slabs[ref->id].fd >= 0 && ref->offset + ref->length <= slabs[ref->id].tail) {
+        fd = dup(slabs[ref->id].fd);
+        if (fd < 0) {
+            g_set_error(gerr, slab_quark(), errno, "slabstore_open: dup failed on slab %u", ref->id);
+        }
+    }
+    else {
+        g_set_error(gerr, slab_quark(), E_SLAB_NOSLAB, "slabstore_open: no slab %u holding %lu at %lu", ref->id, ref->length, ref->offset);
+    }
+    pthread_mutex_unlock(&slab_mutex);
+
+    return fd;
+}
+
+bool slabstore_exists(unsigned id) {
+    bool exists;
+
+    pthread_mutex_lock(&slab_mutex);
+    exists = (id < SLAB_MAX_COUNT && slabs[id].fd >= 0);
+    pthread_mutex_unlock(&slab_mutex);
+
+    return exists;
+}
+
+void slabstore_usage_reset(void) {
+    pthread_mutex_lock(&slab_mutex);
+    for (unsigned id = 0; id < SLAB_MAX_COUNT; id++) {
+        slabs[id].live = 0;
+    }
+    pthread_mutex_unlock(&slab_mutex);
+}
+
+void slabstore_usage_add(const struct slab_ref *ref) {
+    pthread_mutex_lock(&slab_mutex);
+    if (ref->id < SLAB_MAX_COUNT) {
+        slabs[ref->id].live += ref->length;
+    }
+    pthread_mutex_unlock(&slab_mutex);
+}
+
+/* Marks slabs which are less than half live for compaction; returns how many there are.
+ * Only sealed slabs qualify, so none has appends whose entries are still to be written.
+ * snapshot is called before slab_mutex is released, so a snapshot of the filecache taken
+ * there has every entry which points into the marked slabs.
+ */
+int slabstore_compaction_begin(void (*snapshot)(void *userdata), void *userdata) {
+    int victims = 0;
+
+    pthread_mutex_lock(&slab_mutex);
+    for (unsigned id = 0; id < SLAB_MAX_COUNT; id++) {
+        if (slabs[id].fd < 0 || (int) id == active || !slabs[id].sealed || slabs[id].pending > 0) continue;
+        if (slabs[id].tail == 0 || slabs[id].live * 2 < slabs[id].tail) {
+            slabs[id].compacting = true;
+            ++victims;
+            log_print(LOG_INFO, SECTION_FILECACHE_CLEAN, "slabstore_compaction_begin: slab %u has %lu of %lu bytes live",
+                id, slabs[id].live, slabs[id].tail);
+        }
+    }
+    if (victims > 0) snapshot(userdata);
+    pthread_mutex_unlock(&slab_mutex);
+
+    return victims;
+}
+
+bool slabstore_compacting(unsigned id) {
+    bool compacting;
+
+    pthread_mutex_lock(&slab_mutex);
+    compacting = (id < SLAB_MAX_COUNT && slabs[id].compacting);
+    pthread_mutex_unlock(&slab_mutex);
+
+    return compacting;
+}
+
+// Removes the slabs whose live bodies have been moved. Handles still reading
+// from them have their own fds, so they keep working until they close.
+void slabstore_compaction_end(void) {
+    char path[PATH_MAX];
+
+    pthread_mutex_lock(&slab_mutex);
+    for (unsigned id = 0; id < SLAB_MAX_COUNT; id++) {
+        if (!slabs[id].compacting) continue;
+
+        slab_path(id, true, path);
+        close(slabs[id].fd);
+        if (unlink(path)) {
+            log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "slabstore_compaction_end: failed to unlink %s: %d %s", path, errno, strerror(errno));
+        }
+        log_print(LOG_INFO, SECTION_FILECACHE_CLEAN, "slabstore_compaction_end: reclaimed %lu bytes from %s",
+            slabs[id].tail - slabs[id].live, path);
+        slabs[id].fd = -1;
+        slabs[id].tail = 0;
+        slabs[id].live = 0;
+        slabs[id].compacting = false;
+    }
+    pthread_mutex_unlock(&slab_mutex);
+}
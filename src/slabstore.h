@@ -0,0 +1,62 @@
+#ifndef fooslabstorehfoo
+#define fooslabstorehfoo
+
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <glib.h>
+
+/* Slabs are large append-only files in cache_path/slabs which hold the bodies
+ * of cached files that are only ever read. The filecache entry for such a file
+ * records where its body lives (slab_ref); that is the offset index.
+ * Space held by replaced or deleted bodies is reclaimed by compaction, which
+ * copies the live bodies out of sparse slabs and then removes them.
+ * A slab is synced once, when it's sealed after it fills up (or on slabstore_close);
+ * only sealed slabs survive a restart.
+ */
+
+#define E_SLAB_NOSPACE ENOSPC
+#define E_SLAB_NOSLAB ENOENT
+
+// Bodies bigger than this keep their own cache file
+#define SLAB_BODY_MAX (1024 * 1024)
+
+struct slab_ref {
+    unsigned id;
+    off_t offset;
+    off_t length;
+};
+
+void slabstore_init(const char *cache_path, GError **gerr);
+void slabstore_append(int src_fd, off_t src_offset, off_t length, struct slab_ref *ref, GError **gerr);
+void slabstore_append_done(const struct slab_ref *ref);
+void slabstore_close(void);
+int slabstore_open(const struct slab_ref *ref, GError **gerr);
+bool slabstore_exists(unsigned id);
+
+// Compaction: account for every live body, pick the sparse slabs, move their
+// live bodies elsewhere, then retire them.
+void slabstore_usage_reset(void);
+void slabstore_usage_add(const struct slab_ref *ref);
+int slabstore_compaction_begin(void (*snapshot)(void *userdata), void *userdata);
+bool slabstore_compacting(unsigned id);
+void slabstore_compaction_end(void);
+
+#endif
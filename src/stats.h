@@ -46,6 +46,9 @@ struct statistics {
     unsigned propfind_progressive_cache;
     unsigned propfind_complete_cache;
 
+    unsigned warmup_dir;
+    unsigned warmup_file;
+
     unsigned filecache_cache_file;
     unsigned filecache_pdata_set;
     unsigned filecache_create_file;
@@ -93,6 +96,34 @@ struct statistics {
     unsigned filecache_put_lg_count;
     unsigned filecache_put_xlg_timing;
     unsigned filecache_put_xlg_count;
+    unsigned filecache_put_lock_timing;
+    unsigned filecache_put_lock_count;
+    unsigned filecache_put_cpu_timing;
+    unsigned filecache_inline_store;
+    unsigned filecache_inline_open;
+    unsigned filecache_inline_spill;
+    unsigned filecache_slab_store;
+    unsigned filecache_slab_open;
+    unsigned filecache_slab_spill;
+    unsigned filecache_slab_moved;
+    unsigned filecache_slab_miss;
+    unsigned filecache_migrated;
+    unsigned filecache_passthrough_open;
+    unsigned filecache_passthrough_get;
+    unsigned filecache_passthrough_fallback;
+    unsigned filecache_fdpool_hit;
+    unsigned filecache_chunked_chunk;
+    unsigned filecache_chunked_resume;
+    unsigned filecache_append_put;
+    unsigned filecache_append_fallback;
+    unsigned filecache_stale_open;
+    unsigned filecache_revalidate;
+    unsigned filecache_wbuf_combine;
+    unsigned filecache_wbuf_flush;
+    unsigned filecache_uring_io;
+    unsigned filecache_wqueue_add;
+    unsigned filecache_wqueue_replay;
+    unsigned filecache_open_shared;
 
     unsigned statcache_local_gen;
     unsigned statcache_path2key;
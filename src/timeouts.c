@@ -0,0 +1,108 @@
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+
+#include "timeouts.h"
+#include "latency.h"
+#include "nodescore.h"
+
+/* This file has no dependencies on the rest of fusedav, so that
+ * tests/timeouts-bench.c can build it on its own. Callers do the logging and stats.
+ */
+
+// Timeouts are this multiple of this percentile of recent times
+#define TIMEOUT_PERCENTILE 99
+#define TIMEOUT_MULTIPLE 4
+// Fewer requests than this to go on, and the timeout is the ceiling
+#define MIN_SAMPLES 50
+/* One lost SYN costs a second before it's resent, so a connect timeout under that
+ * gives up on a node which dropped one packet; the floor only has to be past what
+ * a healthy node takes. The ceiling is what every connect used to get.
+ */
+#define CONNECT_FLOOR_MS 200
+#define CONNECT_CEILING_MS 1200
+#define REQUEST_FLOOR_MS 1000
+#define REQUEST_CEILING_MS (60 * 1000)
+/* A request which timed out doesn't say how long it would have taken, so it isn't a sample.
+ * Instead each timeout in a row on a node doubles its timeouts, up to the ceiling, until a
+ * request gets through; so if a node, or all of them, really has got slower, requests get
+ * the time they need again and the percentiles catch up.
+ */
+#define MAX_DOUBLINGS 6
+
+struct node_timeouts {
+    struct latency_hist connect;
+    struct latency_hist requests[NUM_REQUEST_TYPES];
+    unsigned timed_out;
+    unsigned in_a_row;
+};
+
+static struct node_timeouts nodes[NODESCORE_MAX_NODES];
+
+static long timeout_from(struct node_timeouts *node, struct latency_hist *hist, long floor_ms, long ceiling_ms) {
+    long percentile = latency_percentile(hist, TIMEOUT_PERCENTILE, MIN_SAMPLES);
+    unsigned in_a_row = node->in_a_row;
+    long timeout;
+
+    if (percentile < 0) return ceiling_ms;
+    timeout = percentile * TIMEOUT_MULTIPLE;
+    if (timeout < floor_ms) timeout = floor_ms;
+    timeout <<= (in_a_row < MAX_DOUBLINGS ? in_a_row : MAX_DOUBLINGS);
+    if (timeout > ceiling_ms) return ceiling_ms;
+    return timeout;
+}
+
+/* A request to node got its answer. connect_ms is how long it took to connect, or -1 if it
+ * didn't make a new connection; bytes is how much it sent and received.
+ */
+void timeouts_record(int node, request_type_t type, long connect_ms, long elapsed_ms, curl_off_t bytes) {
+    if (node < 0 || node >= NODESCORE_MAX_NODES || type >= NUM_REQUEST_TYPES) return;
+    if (connect_ms >= 0) latency_record(&nodes[node].connect, connect_ms);
+    if (bytes < TIMEOUTS_SMALL_BYTES) latency_record(&nodes[node].requests[type], elapsed_ms);
+    if (nodes[node].in_a_row) nodes[node].in_a_row = 0;
+}
+
+long timeouts_connect_ms(int node) {
+    if (node < 0 || node >= NODESCORE_MAX_NODES) return CONNECT_CEILING_MS;
+    return timeout_from(&nodes[node], &nodes[node].connect, CONNECT_FLOOR_MS, CONNECT_CEILING_MS);
+}
+
+/* The whole request, connect included, with time for bytes of body on top. bytes is -1 if the
+ * caller doesn't know how big the body is; it might be huge, so that gets the ceiling.
+ */
+long timeouts_request_ms(int node, request_type_t type, curl_off_t bytes) {
+    long timeout;
+
+    if (node < 0 || node >= NODESCORE_MAX_NODES || type >= NUM_REQUEST_TYPES || bytes < 0) {
+        return REQUEST_CEILING_MS;
+    }
+    timeout = timeout_from(&nodes[node], &nodes[node].requests[type], REQUEST_FLOOR_MS, REQUEST_CEILING_MS);
+    return timeout + (long) ((bytes * 1000) / TIMEOUTS_MIN_RATE);
+}
+
+// A request to node timed out; returns how many have
+unsigned timeouts_timed_out(int node) {
+    if (node < 0 || node >= NODESCORE_MAX_NODES) return 0;
+    __sync_fetch_and_add(&nodes[node].in_a_row, 1);
+    return __sync_add_and_fetch(&nodes[node].timed_out, 1);
+}
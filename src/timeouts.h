@@ -0,0 +1,50 @@
+#ifndef footimeoutshfoo
+#define footimeoutshfoo
+
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+
+#include <stdbool.h>
+#include <curl/curl.h>
+
+/* Timeouts for each node and kind of request, from how long that node has recently taken
+ * to answer that kind of request, instead of one fixed limit for everything. A small
+ * PROPFIND to a node which has stopped answering then fails over in a second or two, not
+ * a minute, and a big GET or PUT gets time in proportion to its body.
+ * Connect timeouts come from the node's recent connect times. Request timeouts come from
+ * the recent times of requests of the kind which moved less than TIMEOUTS_SMALL_BYTES,
+ * plus time for the body at TIMEOUTS_MIN_RATE. Both are a multiple of a high percentile,
+ * between a floor and a ceiling; the ceiling until there are enough requests to go on.
+ * Timeouts in a row on a node back its timeouts off toward the ceiling.
+ * Nodes are scoreboard indexes, see nodescore.h. Recording doesn't take a lock.
+ */
+
+typedef enum { REQUEST_GET, REQUEST_PROPFIND, REQUEST_PUT, REQUEST_OTHER, NUM_REQUEST_TYPES } request_type_t;
+
+// Requests which move less than this count toward the node's latency; bigger ones are mostly transfer
+#define TIMEOUTS_SMALL_BYTES (1024 * 1024)
+// The slowest transfer we allow for, in bytes per second
+#define TIMEOUTS_MIN_RATE (1024 * 1024)
+
+void timeouts_record(int node, request_type_t type, long connect_ms, long elapsed_ms, curl_off_t bytes);
+long timeouts_connect_ms(int node);
+long timeouts_request_ms(int node, request_type_t type, curl_off_t bytes);
+unsigned timeouts_timed_out(int node);
+
+#endif
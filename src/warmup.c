@@ -0,0 +1,260 @@
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "warmup.h"
+#include "log.h"
+#include "log_sections.h"
+
+// The in-memory table may grow to this many times max_paths before it is trimmed
+#define WARMUP_SLACK 4
+
+struct warmup_entry {
+    char *path;
+    unsigned hits;
+    bool is_dir;
+};
+
+// warmup_mutex protects everything below
+static pthread_mutex_t warmup_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *entries = NULL;
+static unsigned capacity = 0;
+static char warmup_file[PATH_MAX];
+
+static G_DEFINE_QUARK(WARMUP, warmup)
+
+static void entry_free(gpointer data) {
+    struct warmup_entry *entry = data;
+    free(entry->path);
+    free(entry);
+}
+
+static int hottest_first(const void *a, const void *b) {
+    const struct warmup_entry *ea = *(const struct warmup_entry * const *)a;
+    const struct warmup_entry *eb = *(const struct warmup_entry * const *)b;
+
+    if (ea->hits != eb->hits) return ea->hits < eb->hits ? 1 : -1;
+    // Directories first, so their children's stats are fresh before the files are opened
+    if (ea->is_dir != eb->is_dir) return ea->is_dir ? -1 : 1;
+    return strcmp(ea->path, eb->path);
+}
+
+// Called with warmup_mutex held. Returns the entries, hottest first; the caller frees the array but not the entries.
+static struct warmup_entry **sorted_entries(unsigned *count) {
+    struct warmup_entry **sorted;
+    GHashTableIter iter;
+    gpointer value;
+    unsigned idx = 0;
+
+    *count = g_hash_table_size(entries);
+    sorted = malloc((*count + 1) * sizeof(struct warmup_entry *));
+    if (sorted == NULL) {
+        *count = 0;
+        return NULL;
+    }
+
+    g_hash_table_iter_init(&iter, entries);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        sorted[idx++] = value;
+    }
+    qsort(sorted, *count, sizeof(struct warmup_entry *), hottest_first);
+
+    return sorted;
+}
+
+static void add_entry(const char *path, bool is_dir, unsigned hits) {
+    struct warmup_entry *entry;
+
+    entry = g_hash_table_lookup(entries, path);
+    if (entry) {
+        entry->hits += hits;
+        entry->is_dir = is_dir;
+        return;
+    }
+
+    entry = calloc(1, sizeof(struct warmup_entry));
+    if (entry == NULL) return;
+    entry->path = strdup(path);
+    if (entry->path == NULL) {
+        free(entry);
+        return;
+    }
+    entry->hits = hits;
+    entry->is_dir = is_dir;
+    g_hash_table_insert(entries, entry->path, entry);
+}
+
+/* Called with warmup_mutex held. Keeps the hottest max_paths entries and halves their
+ * hits, so paths which were hot long ago gradually give way to ones which are hot now.
+ */
+static void trim_entries(void) {
+    struct warmup_entry **sorted;
+    unsigned count;
+
+    sorted = sorted_entries(&count);
+    if (sorted == NULL) return;
+
+    for (unsigned idx = 0; idx < count; idx++) {
+        if (idx >= capacity || sorted[idx]->hits < 2) {
+            g_hash_table_remove(entries, sorted[idx]->path);
+        }
+        else {
+            sorted[idx]->hits /= 2;
+        }
+    }
+    free(sorted);
+
+    log_print(LOG_DEBUG, SECTION_FUSEDAV_DEFAULT, "trim_entries: kept %u paths", g_hash_table_size(entries));
+}
+
+// Reads the paths saved by the last run. Lines look like "<hits> <d|f> <path>".
+void warmup_init(const char *cache_path, unsigned max_paths) {
+    char line[PATH_MAX + 32];
+    unsigned loaded = 0;
+    FILE *fp;
+
+    capacity = max_paths;
+    entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, entry_free);
+    snprintf(warmup_file, PATH_MAX, "%s/warmup_paths", cache_path);
+
+    fp = fopen(warmup_file, "r");
+    if (fp == NULL) {
+        log_print(LOG_INFO, SECTION_FUSEDAV_DEFAULT, "warmup_init: no saved paths in %s: %d %s", warmup_file, errno, strerror(errno));
+        return;
+    }
+
+    while (loaded < capacity && fgets(line, sizeof(line), fp) != NULL) {
+        unsigned hits;
+        char kind;
+        int start = 0;
+        size_t len;
+
+        len = strlen(line);
+        if (len == 0 || line[len - 1] != '\n') continue;
+        line[len - 1] = '\0';
+        if (sscanf(line, "%u %c %n", &hits, &kind, &start) != 2 || start == 0 || line[start] != '/') {
+            log_print(LOG_NOTICE, SECTION_FUSEDAV_DEFAULT, "warmup_init: skipping bad line in %s: %s", warmup_file, line);
+            continue;
+        }
+        add_entry(line + start, kind == 'd', hits);
+        ++loaded;
+    }
+    fclose(fp);
+
+    log_print(LOG_NOTICE, SECTION_FUSEDAV_DEFAULT, "warmup_init: loaded %u paths from %s", loaded, warmup_file);
+}
+
+void warmup_record(const char *path, bool is_dir) {
+    if (capacity == 0 || path == NULL || strchr(path, '\n')) return;
+
+    pthread_mutex_lock(&warmup_mutex);
+    add_entry(path, is_dir, 1);
+    if (g_hash_table_size(entries) > capacity * WARMUP_SLACK) {
+        trim_entries();
+    }
+    pthread_mutex_unlock(&warmup_mutex);
+}
+
+// Writes the hottest paths to cache_path/warmup_paths, replacing the old record in one go
+void warmup_save(GError **gerr) {
+    struct warmup_entry **sorted;
+    char tmp_file[PATH_MAX];
+    unsigned count;
+    unsigned saved = 0;
+    FILE *fp;
+
+    if (capacity == 0) return;
+
+    snprintf(tmp_file, PATH_MAX, "%s.tmp", warmup_file);
+    fp = fopen(tmp_file, "w");
+    if (fp == NULL) {
+        g_set_error(gerr, warmup_quark(), errno, "warmup_save: can't open %s", tmp_file);
+        return;
+    }
+
+    pthread_mutex_lock(&warmup_mutex);
+    sorted = sorted_entries(&count);
+    for (unsigned idx = 0; sorted && idx < count && idx < capacity; idx++) {
+        fprintf(fp, "%u %c %s\n", sorted[idx]->hits, sorted[idx]->is_dir ? 'd' : 'f', sorted[idx]->path);
+        ++saved;
+    }
+    pthread_mutex_unlock(&warmup_mutex);
+    free(sorted);
+
+    if (fclose(fp) != 0) {
+        g_set_error(gerr, warmup_quark(), errno, "warmup_save: failed to write %s", tmp_file);
+        unlink(tmp_file);
+        return;
+    }
+    if (rename(tmp_file, warmup_file)) {
+        g_set_error(gerr, warmup_quark(), errno, "warmup_save: failed to rename %s", tmp_file);
+        unlink(tmp_file);
+        return;
+    }
+
+    log_print(LOG_INFO, SECTION_FUSEDAV_DEFAULT, "warmup_save: saved %u paths to %s", saved, warmup_file);
+}
+
+// Calls fn on each recorded path, hottest first, without holding the lock
+void warmup_replay(void (*fn)(const char *path, bool is_dir, void *userdata), void *userdata) {
+    struct warmup_entry **sorted;
+    char **paths = NULL;
+    bool *dirs = NULL;
+    unsigned count;
+
+    if (capacity == 0) return;
+
+    pthread_mutex_lock(&warmup_mutex);
+    sorted = sorted_entries(&count);
+    if (sorted) {
+        paths = calloc(count + 1, sizeof(char *));
+        dirs = calloc(count + 1, sizeof(bool));
+    }
+    for (unsigned idx = 0; paths && dirs && idx < count; idx++) {
+        paths[idx] = strdup(sorted[idx]->path);
+        dirs[idx] = sorted[idx]->is_dir;
+    }
+    pthread_mutex_unlock(&warmup_mutex);
+    free(sorted);
+
+    if (paths == NULL || dirs == NULL) {
+        log_print(LOG_WARNING, SECTION_FUSEDAV_DEFAULT, "warmup_replay: out of memory for %u paths", count);
+        count = 0;
+    }
+
+    log_print(LOG_NOTICE, SECTION_FUSEDAV_DEFAULT, "warmup_replay: warming %u paths", count);
+    for (unsigned idx = 0; idx < count; idx++) {
+        if (paths[idx]) {
+            fn(paths[idx], dirs[idx], userdata);
+            free(paths[idx]);
+        }
+    }
+    free(paths);
+    free(dirs);
+}
@@ -0,0 +1,37 @@
+#ifndef foowarmuphfoo
+#define foowarmuphfoo
+
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#include <stdbool.h>
+#include <glib.h>
+
+/* A compact record of the paths which see the most opens and readdirs, kept
+ * in cache_path/warmup_paths. Hits are counted in memory and the hottest paths
+ * are saved from time to time. After a restart, or when the cache has been
+ * wiped, the saved paths are replayed hottest first so their stat and file
+ * cache entries can be refreshed before the first real request for them.
+ */
+
+void warmup_init(const char *cache_path, unsigned max_paths);
+void warmup_record(const char *path, bool is_dir);
+void warmup_save(GError **gerr);
+void warmup_replay(void (*fn)(const char *path, bool is_dir, void *userdata), void *userdata);
+
+#endif
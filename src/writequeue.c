@@ -0,0 +1,318 @@
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "writequeue.h"
+#include "log.h"
+#include "log_sections.h"
+
+// Entry files are named by their sequence number, in fixed-width hex so they sort
+#define SEQ_NAME_LEN 16
+// Longest ETag an entry keeps
+#define ENTRY_ETAG_MAX 256
+
+struct queue_entry {
+    unsigned long seq;
+    char *path;
+    char *etag; // the server's ETag the queued write started from; empty if not known
+};
+
+// queue_mutex protects everything below, and the files in queue_dir
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Oldest first
+static GQueue *queue = NULL;
+// path -> entry in queue
+static GHashTable *queued = NULL;
+static unsigned long next_seq = 1;
+static char queue_dir[PATH_MAX];
+
+static G_DEFINE_QUARK(WRITEQUEUE, writequeue)
+
+static void entry_path(unsigned long seq, const char *suffix, char *path) {
+    snprintf(path, PATH_MAX, "%s/%016lx%s", queue_dir, seq, suffix);
+}
+
+static void entry_free(struct queue_entry *entry) {
+    free(entry->path);
+    free(entry->etag);
+    free(entry);
+}
+
+static gint oldest_first(gconstpointer a, gconstpointer b, __attribute__((unused)) gpointer data) {
+    const struct queue_entry *ea = a;
+    const struct queue_entry *eb = b;
+
+    if (ea->seq == eb->seq) return 0;
+    return ea->seq < eb->seq ? -1 : 1;
+}
+
+// Called with queue_mutex held
+static void drop_entry(struct queue_entry *entry) {
+    char path[PATH_MAX];
+
+    entry_path(entry->seq, "", path);
+    if (unlink(path) && errno != ENOENT) {
+        log_print(LOG_WARNING, SECTION_FILECACHE_COMM, "writequeue: failed to unlink %s: %d %s", path, errno, strerror(errno));
+    }
+    g_hash_table_remove(queued, entry->path);
+    g_queue_remove(queue, entry);
+    entry_free(entry);
+}
+
+/* Reads back the path recorded in an entry file, and the ETag after it, if there is one;
+ * entries from before ETags were recorded have just the path. Returns false if it's unreadable.
+ */
+static bool read_entry(const char *name, struct queue_entry *entry) {
+    char path[PATH_MAX];
+    char buf[PATH_MAX + ENTRY_ETAG_MAX + 2];
+    size_t path_len;
+    ssize_t bytes;
+    int fd;
+
+    snprintf(path, PATH_MAX, "%s/%s", queue_dir, name);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    bytes = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (bytes <= 0 || buf[0] != '/') return false;
+    buf[bytes] = '\0';
+    path_len = strlen(buf);
+    entry->path = strdup(buf);
+    entry->etag = strdup((ssize_t) path_len < bytes ? buf + path_len + 1 : "");
+    if (entry->path == NULL || entry->etag == NULL) {
+        free(entry->path);
+        free(entry->etag);
+        return false;
+    }
+    return true;
+}
+
+void writequeue_init(const char *cache_path, GError **gerr) {
+    struct dirent *diriter;
+    DIR *dir;
+
+    snprintf(queue_dir, PATH_MAX, "%s/write-queue", cache_path);
+    if (mkdir(queue_dir, 0770) == -1 && errno != EEXIST) {
+        g_set_error(gerr, writequeue_quark(), errno, "writequeue_init: Path %s could not be created.", queue_dir);
+        return;
+    }
+
+    dir = opendir(queue_dir);
+    if (dir == NULL) {
+        g_set_error(gerr, writequeue_quark(), errno, "writequeue_init: Can't open %s", queue_dir);
+        return;
+    }
+
+    pthread_mutex_lock(&queue_mutex);
+    queue = g_queue_new();
+    queued = g_hash_table_new(g_str_hash, g_str_equal);
+
+    // Pick up what the last run couldn't upload
+    while ((diriter = readdir(dir)) != NULL) {
+        struct queue_entry *entry;
+        struct queue_entry *existing;
+        unsigned long seq;
+        char *endptr;
+
+        if (diriter->d_name[0] == '.') continue;
+
+        seq = strtoul(diriter->d_name, &endptr, 16);
+        if (strlen(diriter->d_name) != SEQ_NAME_LEN || *endptr != '\0') {
+            // Left over from an add which didn't finish
+            char path[PATH_MAX];
+            snprintf(path, PATH_MAX, "%s/%s", queue_dir, diriter->d_name);
+            unlink(path);
+            continue;
+        }
+
+        entry = malloc(sizeof(struct queue_entry));
+        if (entry == NULL) continue;
+        entry->seq = seq;
+        if (!read_entry(diriter->d_name, entry)) {
+            log_print(LOG_WARNING, SECTION_FILECACHE_COMM, "writequeue_init: ignoring unreadable entry %s", diriter->d_name);
+            free(entry);
+            continue;
+        }
+        if (seq >= next_seq) next_seq = seq + 1;
+
+        // A restart between queueing a path again and removing its old entry leaves both; keep the later one
+        existing = g_hash_table_lookup(queued, entry->path);
+        if (existing && existing->seq > seq) {
+            char stale[PATH_MAX];
+            entry_path(seq, "", stale);
+            unlink(stale);
+            entry_free(entry);
+            continue;
+        }
+        if (existing) drop_entry(existing);
+        g_hash_table_insert(queued, entry->path, entry);
+        g_queue_push_tail(queue, entry);
+    }
+    closedir(dir);
+
+    g_queue_sort(queue, oldest_first, NULL);
+    log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "writequeue_init: %u writes waiting for upload in %s",
+        g_queue_get_length(queue), queue_dir);
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+/* Records path at the back of the queue, with etag, the server's ETag for the version the write
+ * started from. The entry is on disk before this returns.
+ */
+void writequeue_add(const char *path, const char *etag, GError **gerr) {
+    struct queue_entry *entry = NULL;
+    struct queue_entry *existing;
+    char tmp_path[PATH_MAX];
+    char entry_file[PATH_MAX];
+    size_t len = strlen(path);
+    size_t etag_len;
+    int fd = -1;
+
+    pthread_mutex_lock(&queue_mutex);
+
+    if (queue == NULL) {
+        g_set_error(gerr, writequeue_quark(), EINVAL, "writequeue_add: queue not initialized");
+        goto finish;
+    }
+
+    // A path queued again was written again while it waited; it still started from what the server
+    // had before the first write, unless the server has told us something newer since
+    existing = g_hash_table_lookup(queued, path);
+    if ((etag == NULL || etag[0] == '\0') && existing) etag = existing->etag;
+    if (etag == NULL) etag = "";
+    etag_len = strnlen(etag, ENTRY_ETAG_MAX);
+
+    entry = calloc(1, sizeof(struct queue_entry));
+    if (entry == NULL || (entry->path = strdup(path)) == NULL || (entry->etag = strndup(etag, etag_len)) == NULL) {
+        g_set_error(gerr, writequeue_quark(), ENOMEM, "writequeue_add: malloc failed");
+        if (entry) entry_free(entry);
+        entry = NULL;
+        goto finish;
+    }
+    entry->seq = next_seq++;
+
+    // Write under a temporary name and rename, so a crash never leaves a partial entry
+    entry_path(entry->seq, ".tmp", tmp_path);
+    entry_path(entry->seq, "", entry_file);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        g_set_error(gerr, writequeue_quark(), errno, "writequeue_add: can't create %s", tmp_path);
+        goto finish;
+    }
+    errno = 0;
+    // The path, then the ETag after a NUL
+    if (write(fd, path, len + 1) != (ssize_t) len + 1 || write(fd, entry->etag, etag_len) != (ssize_t) etag_len ||
+            fsync(fd)) {
+        g_set_error(gerr, writequeue_quark(), errno ? errno : EIO, "writequeue_add: can't write %s", tmp_path);
+        unlink(tmp_path);
+        goto finish;
+    }
+    if (rename(tmp_path, entry_file)) {
+        g_set_error(gerr, writequeue_quark(), errno, "writequeue_add: can't rename %s", tmp_path);
+        unlink(tmp_path);
+        goto finish;
+    }
+
+    // Only the last write to a path needs uploading, after everything written before it
+    if (existing) drop_entry(existing);
+    g_hash_table_insert(queued, entry->path, entry);
+    g_queue_push_tail(queue, entry);
+
+    log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "writequeue_add: queued %s as %016lx; %u waiting",
+        path, entry->seq, g_queue_get_length(queue));
+    entry = NULL;
+
+finish:
+    if (fd >= 0) close(fd);
+    if (entry) entry_free(entry);
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+bool writequeue_contains(const char *path) {
+    bool contains;
+
+    pthread_mutex_lock(&queue_mutex);
+    contains = (queued != NULL && g_hash_table_lookup(queued, path) != NULL);
+    pthread_mutex_unlock(&queue_mutex);
+
+    return contains;
+}
+
+/* Copies the oldest path queued after sequence number after (0 for the oldest of all) into
+ * path (PATH_MAX bytes), and the ETag it was queued with into etag (etag_size bytes).
+ * Returns false if there is none.
+ */
+bool writequeue_peek(unsigned long after, char *path, char *etag, size_t etag_size, unsigned long *seq) {
+    struct queue_entry *entry = NULL;
+
+    pthread_mutex_lock(&queue_mutex);
+    if (queue != NULL) {
+        // The queue is in sequence order
+        for (GList *iter = queue->head; iter && entry == NULL; iter = iter->next) {
+            if (((struct queue_entry *) iter->data)->seq > after) entry = iter->data;
+        }
+    }
+    if (entry) {
+        strncpy(path, entry->path, PATH_MAX - 1);
+        path[PATH_MAX - 1] = '\0';
+        strncpy(etag, entry->etag, etag_size - 1);
+        etag[etag_size - 1] = '\0';
+        *seq = entry->seq;
+    }
+    pthread_mutex_unlock(&queue_mutex);
+
+    return entry != NULL;
+}
+
+// Removes path from the queue, unless it has been queued again since seq was handed out; seq 0 removes it regardless
+void writequeue_remove(const char *path, unsigned long seq) {
+    struct queue_entry *entry;
+
+    pthread_mutex_lock(&queue_mutex);
+    entry = queued ? g_hash_table_lookup(queued, path) : NULL;
+    if (entry && (seq == 0 || entry->seq == seq)) {
+        drop_entry(entry);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+// Calls fn on each queued path, oldest first. fn must not call back into the queue.
+void writequeue_foreach(void (*fn)(const char *path, const void *userdata), const void *userdata) {
+    pthread_mutex_lock(&queue_mutex);
+    if (queue != NULL) {
+        for (GList *iter = queue->head; iter; iter = iter->next) {
+            struct queue_entry *entry = iter->data;
+            fn(entry->path, userdata);
+        }
+    }
+    pthread_mutex_unlock(&queue_mutex);
+}
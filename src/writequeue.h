@@ -0,0 +1,48 @@
+#ifndef foowritequeuehfoo
+#define foowritequeuehfoo
+
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#include <stdbool.h>
+#include <glib.h>
+
+/* Paths whose upload failed while the cluster was in saint mode, in the order
+ * they were written. Each entry is a small file in cache_path/write-queue,
+ * named by its sequence number, which survives a restart. The bodies stay in
+ * their filecache entries (marked as local copies), so reads see them until
+ * the queue is replayed. A path is only queued once; queueing it again moves
+ * it to the back.
+ * Each entry also keeps the server's ETag for the version the queued write
+ * started from. The replay only replaces the file if the server still has that
+ * version (If-Match), so a change another client made during the outage isn't
+ * overwritten; the local copy goes to the forensic haven instead. Writes to new
+ * files, and entries queued before ETags were kept, have none, and the last
+ * writer wins.
+ * writequeue_peek walks the queue: pass 0 for the oldest entry, then the seq it
+ * returned for the next. Entries stay queued until writequeue_remove.
+ */
+
+void writequeue_init(const char *cache_path, GError **gerr);
+void writequeue_add(const char *path, const char *etag, GError **gerr);
+bool writequeue_contains(const char *path);
+bool writequeue_peek(unsigned long after, char *path, char *etag, size_t etag_size, unsigned long *seq);
+void writequeue_remove(const char *path, unsigned long seq);
+void writequeue_foreach(void (*fn)(const char *path, const void *userdata), const void *userdata);
+
+#endif
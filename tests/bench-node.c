@@ -0,0 +1,159 @@
+/* The nodes the scoreboard benches run against, and the bits of setup they share; see bench-node.h */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include "bench-node.h"
+
+bool verbose = false;
+
+struct connection {
+    int fd;
+    int node;
+    bench_reply_fn reply;
+};
+
+struct listener {
+    int fd;
+    int node;
+    bench_reply_fn reply;
+};
+
+// Prints the bench's options, then the ones they all have, and exits
+void usage(const char *const options[]) {
+    for (int idx = 0; options[idx]; idx++) {
+        printf("%s\n", options[idx]);
+    }
+    printf("-v for verbose\n");
+    printf("-h for help\n");
+    exit(0);
+}
+
+void v_printf(const char *fmt, ...) {
+    if (verbose) {
+        va_list ap;
+        va_start(ap, fmt);
+        vfprintf(stdout, fmt, ap);
+        va_end(ap);
+    }
+}
+
+// Seconds since start
+double elapsed(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+size_t discard(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    (void) ptr; (void) userdata;
+    return size * nmemb;
+}
+
+int compare_long(const void *x, const void *y) {
+    long a = *(const long *)x;
+    long b = *(const long *)y;
+    return (a > b) - (a < b);
+}
+
+// Answers each request on a keep-alive connection with a 2 byte body, or not, as the bench decides
+static void *serve_connection(void *ptr) {
+    struct connection *conn = ptr;
+    static const char response[] = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+    static unsigned int connections = 0;
+    unsigned int seed = __sync_add_and_fetch(&connections, 1) * 2654435761u;
+    char buf[4096];
+    size_t len = 0;
+
+    while (true) {
+        ssize_t bytes = read(conn->fd, buf + len, sizeof(buf) - len - 1);
+        char *end;
+        if (bytes <= 0) break;
+        len += bytes;
+        buf[len] = '\0';
+        while ((end = strstr(buf, "\r\n\r\n")) != NULL) {
+            size_t used = end + 4 - buf;
+            int delay_ms = 0;
+            enum bench_reply reply = conn->reply(conn->node, &seed, &delay_ms);
+
+            if (reply == BENCH_HANG_UP) goto finish;
+            if (delay_ms > 0) usleep(delay_ms * 1000);
+            if (reply == BENCH_ANSWER && write(conn->fd, response, sizeof(response) - 1) < 0) goto finish;
+            memmove(buf, buf + used, len - used + 1);
+            len -= used;
+        }
+        if (len == sizeof(buf) - 1) break;
+    }
+
+finish:
+    close(conn->fd);
+    free(conn);
+    return NULL;
+}
+
+static void *serve_node(void *ptr) {
+    struct listener *listener = ptr;
+
+    while (true) {
+        struct connection *conn;
+        pthread_t thread;
+        int fd = accept(listener->fd, NULL, NULL);
+        if (fd < 0) continue;
+        conn = malloc(sizeof(struct connection));
+        conn->fd = fd;
+        conn->node = listener->node;
+        conn->reply = listener->reply;
+        pthread_create(&thread, NULL, serve_connection, conn);
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+// Starts a node on an unused port on 127.0.0.1; returns the port, or -1
+int start_node(int node, bench_reply_fn reply) {
+    struct listener *listener = malloc(sizeof(struct listener));
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    pthread_t thread;
+
+    listener->fd = socket(AF_INET, SOCK_STREAM, 0);
+    listener->node = node;
+    listener->reply = reply;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listener->fd < 0 || bind(listener->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(listener->fd, 128) < 0 || getsockname(listener->fd, (struct sockaddr *) &addr, &addrlen) < 0) {
+        printf("ERROR: can't start a node: %d %s\n", errno, strerror(errno));
+        return -1;
+    }
+    pthread_create(&thread, NULL, serve_node, listener);
+    pthread_detach(thread);
+    return ntohs(addr.sin_port);
+}
+
+/* Starts nodes first to first + count - 1, named node<index> in keys, with their
+ * CURLOPT_CONNECT_TO strings in connect_to_str; returns -1 if one didn't start.
+ */
+int start_nodes(int first, int count, bench_reply_fn reply, char *keys[], char *connect_to_str[]) {
+    for (int idx = first; idx < first + count; idx++) {
+        int port = start_node(idx, reply);
+        if (port < 0) return -1;
+        if (asprintf(&keys[idx], "node%d", idx) < 0 ||
+            asprintf(&connect_to_str[idx], BENCH_HOST "::127.0.0.1:%d", port) < 0) {
+            printf("ERROR: out of memory\n");
+            return -1;
+        }
+        v_printf("%s on port %d\n", keys[idx], port);
+    }
+    return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef foobenchnodehfoo
+#define foobenchnodehfoo
+
+/* Shared by the benches which run their own filesystem nodes (nodescore-bench,
+ * timeouts-bench, breaker-bench, hedge-bench): small HTTP servers on 127.0.0.1,
+ * each on its own port, which answer every request on a keep-alive connection
+ * with a 2 byte body. What a node does with each request is up to the bench.
+ * Requests reach them the way src/session.c sends them, with CURLOPT_CONNECT_TO
+ * from BENCH_HOST to the node's port.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#define MAX_THREADS 256
+#define MAX_BENCH_NODES 16
+#define BENCH_HOST "fusedav-bench.invalid"
+
+enum bench_reply {
+    BENCH_ANSWER, // after *delay_ms
+    BENCH_SILENT, // read the request, but never answer it
+    BENCH_HANG_UP, // close the connection
+};
+
+// Decides what node does with a request; seed is the connection's, for rand_r
+typedef enum bench_reply (*bench_reply_fn)(int node, unsigned int *seed, int *delay_ms);
+
+extern bool verbose;
+
+void usage(const char *const options[]);
+void v_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+double elapsed(const struct timespec *start);
+size_t discard(void *ptr, size_t size, size_t nmemb, void *userdata);
+int compare_long(const void *x, const void *y);
+
+int start_node(int node, bench_reply_fn reply);
+int start_nodes(int first, int count, bench_reply_fn reply, char *keys[], char *connect_to_str[]);
+
+#endif
@@ -0,0 +1,233 @@
+/* Take a node down and bring it back, and watch the circuit breakers in src/nodescore.c.
+ * The bench runs its own nodes: -N small HTTP servers on 127.0.0.1, each on its own port,
+ * answering after -f ms. Threads send requests to them for -d seconds the way src/session.c
+ * does, picking nodes with the scoreboard and trying another node when a request fails, as
+ * the callers do. From -a until -b seconds in, the first node drops every connection as soon
+ * as a request comes in, as a node which has crashed and is being restarted would, e.g.
+ *   breaker-bench -N 3 -f 2 -t 8 -d 10 -a 2 -b 6
+ * We print, for each half second, the tries which went to the node and how many failed, and
+ * check that no request failed on every try and that the node got traffic again once it was back:
+ * over the last second, at least half the share an even spread would give it. Leave it a couple
+ * of seconds between -b and -d to get there.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <curl/curl.h>
+
+#include "nodescore.h"
+#include "bench-node.h"
+
+// Tries per request, as num_filesystem_server_nodes in src/session.c
+#define TRIES 3
+#define MAX_SLICES 1024
+#define SLICE_MS 500
+
+static int num_nodes = 3;
+static int fast_ms = 2;
+static int duration_secs = 10;
+static int down_at_secs = 2;
+static int back_at_secs = 6;
+static char *keys[MAX_BENCH_NODES];
+static char *connect_to_str[MAX_BENCH_NODES];
+static bool node0_down = false;
+static struct timespec bench_start;
+// For each half second: tries which went to node 0, how many of them failed, and all tries
+static long slice_tries[MAX_SLICES];
+static long slice_failures[MAX_SLICES];
+static long slice_all_tries[MAX_SLICES];
+// When node 0 first answered after it came back, in ms from the start
+static long recovered_ms = -1;
+
+struct worker {
+    pthread_t thread;
+    long requests;
+    int failed;
+};
+
+static const char *const options[] = {
+    "-N <nodes> number of nodes, 3 by default",
+    "-f <ms> how long the nodes take to answer, 2 by default",
+    "-t <threads> number of threads, 8 by default",
+    "-d <secs> how long to run, 10 by default",
+    "-a <secs> when the first node goes down, 2 by default",
+    "-b <secs> when it comes back, 6 by default",
+    NULL
+};
+
+// Nodes answer after -f ms; node 0 hangs up instead while it's down
+static enum bench_reply reply(int node, unsigned int *seed, int *delay_ms) {
+    (void) seed;
+    if (node == 0 && node0_down) return BENCH_HANG_UP;
+    *delay_ms = fast_ms;
+    return BENCH_ANSWER;
+}
+
+// One try, set up and scored the way session_request_init and timed_curl_easy_perform do
+static bool try_node(CURL *session, int node) {
+    struct timespec start;
+    long response_code = 0;
+    long elapsed_ms;
+    long now_ms = elapsed(&bench_start) * 1000;
+    int slice = now_ms / SLICE_MS;
+    const char *breaker = nodescore_breaker(node);
+    bool ok;
+    CURLcode res;
+
+    if (slice >= MAX_SLICES) slice = MAX_SLICES - 1;
+    curl_easy_reset(session);
+    curl_easy_setopt(session, CURLOPT_URL, "http://" BENCH_HOST "/");
+    curl_easy_setopt(session, CURLOPT_CONNECT_TO, nodescore_connect_to(node));
+    curl_easy_setopt(session, CURLOPT_WRITEFUNCTION, discard);
+    curl_easy_setopt(session, CURLOPT_CONNECTTIMEOUT_MS, 1200L);
+    curl_easy_setopt(session, CURLOPT_TIMEOUT, 60L);
+
+    nodescore_start(node);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    res = curl_easy_perform(session);
+    elapsed_ms = elapsed(&start) * 1000;
+    if (res == CURLE_OK) curl_easy_getinfo(session, CURLINFO_RESPONSE_CODE, &response_code);
+    ok = (res == CURLE_OK && response_code < 500);
+    if (nodescore_done(node, ok, elapsed_ms)) {
+        v_printf("%.2fs: breaker opened on %s\n", now_ms / 1000.0, keys[node]);
+    }
+
+    __sync_fetch_and_add(&slice_all_tries[slice], 1);
+    if (node == 0) {
+        __sync_fetch_and_add(&slice_tries[slice], 1);
+        if (!ok) __sync_fetch_and_add(&slice_failures[slice], 1);
+        if (ok && now_ms >= back_at_secs * 1000 && recovered_ms < 0) {
+            __sync_bool_compare_and_swap(&recovered_ms, -1, now_ms);
+        }
+        if (strcmp(breaker, "closed") != 0) {
+            v_printf("%.2fs: probe to %s (%s): %s\n", now_ms / 1000.0, keys[node], breaker, ok ? "ok" : "failed");
+        }
+    }
+    return ok;
+}
+
+static void *work(void *ptr) {
+    struct worker *worker = ptr;
+    CURL *session = curl_easy_init();
+
+    while (session && elapsed(&bench_start) < duration_secs) {
+        bool ok = false;
+
+        for (int tries = 0; tries < TRIES && !ok; tries++) {
+            ok = try_node(session, nodescore_pick());
+        }
+        ++worker->requests;
+        if (!ok) ++worker->failed;
+    }
+
+    if (session) curl_easy_cleanup(session);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    struct worker workers[MAX_THREADS];
+    int num_threads = 8;
+    long requests = 0;
+    long down_tries = 0;
+    long down_failures = 0;
+    long last_tries = 0;
+    long last_all_tries = 0;
+    bool traffic_back;
+    int failed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "N:f:t:d:a:b:vh")) != -1) {
+        switch (opt) {
+            case 'N':
+                num_nodes = atoi(optarg);
+                if (num_nodes < 2) num_nodes = 2;
+                if (num_nodes > MAX_BENCH_NODES) num_nodes = MAX_BENCH_NODES;
+                break;
+            case 'f':
+                fast_ms = atoi(optarg);
+                break;
+            case 't':
+                num_threads = atoi(optarg);
+                if (num_threads < 1) num_threads = 1;
+                if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+                break;
+            case 'd':
+                duration_secs = atoi(optarg);
+                break;
+            case 'a':
+                down_at_secs = atoi(optarg);
+                break;
+            case 'b':
+                back_at_secs = atoi(optarg);
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'h':
+            default:
+                usage(options);
+        }
+    }
+    if (duration_secs * 1000 / SLICE_MS > MAX_SLICES) duration_secs = MAX_SLICES * SLICE_MS / 1000;
+    if (back_at_secs >= duration_secs || down_at_secs >= back_at_secs) {
+        printf("ERROR: need -a < -b < -d\n");
+        return 1;
+    }
+
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    if (start_nodes(0, num_nodes, reply, keys, connect_to_str) < 0) return 1;
+    nodescore_set_nodes(keys, connect_to_str, num_nodes);
+
+    clock_gettime(CLOCK_MONOTONIC, &bench_start);
+    for (int idx = 0; idx < num_threads; idx++) {
+        memset(&workers[idx], 0, sizeof(struct worker));
+        pthread_create(&workers[idx].thread, NULL, work, &workers[idx]);
+    }
+    sleep(down_at_secs);
+    node0_down = true;
+    v_printf("%.2fs: %s is down\n", elapsed(&bench_start), keys[0]);
+    sleep(back_at_secs - down_at_secs);
+    node0_down = false;
+    v_printf("%.2fs: %s is back\n", elapsed(&bench_start), keys[0]);
+    for (int idx = 0; idx < num_threads; idx++) {
+        pthread_join(workers[idx].thread, NULL);
+        requests += workers[idx].requests;
+        failed += workers[idx].failed;
+    }
+
+    printf("time   all tries  %s tries  failed\n", keys[0]);
+    for (int slice = 0; slice < duration_secs * 1000 / SLICE_MS; slice++) {
+        bool down = slice * SLICE_MS >= down_at_secs * 1000 && slice * SLICE_MS < back_at_secs * 1000;
+        printf("%5.1fs %9ld %11ld %7ld%s\n", slice * SLICE_MS / 1000.0, slice_all_tries[slice], slice_tries[slice],
+            slice_failures[slice], down ? "  (down)" : "");
+        if (down) {
+            down_tries += slice_tries[slice];
+            down_failures += slice_failures[slice];
+        }
+        if ((slice + 1) * SLICE_MS > (duration_secs - 1) * 1000) {
+            last_tries += slice_tries[slice];
+            last_all_tries += slice_all_tries[slice];
+        }
+    }
+    printf("%ld requests; while %s was down for %ds, %ld tries went to it and %ld failed; "
+        "it answered again %ldms after it was back\n", requests, keys[0], back_at_secs - down_at_secs,
+        down_tries, down_failures, recovered_ms < 0 ? -1 : recovered_ms - back_at_secs * 1000);
+
+    traffic_back = recovered_ms >= 0 && last_tries * num_nodes * 2 >= last_all_tries;
+    if (failed || !traffic_back) {
+        printf("FAIL: %d requests failed on every try%s\n", failed,
+            traffic_back ? "" : "; the node didn't get its share of traffic back");
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,152 @@
+/* Compare create and unlink rates for cache files in one flat directory against
+ * the same files spread over hashed subdirectories, as fusedav lays out cache_path/files.
+ * Run it on the filesystem which holds the cache, e.g.
+ *   cachedir-bench -d /srv/bindings/<bid>/cache -n 1000000
+ * It creates and removes its own directory under -d.
+ */
+#define _XOPEN_SOURCE 700
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <getopt.h>
+
+#define PATH_MAX 4096
+// Keep in step with CACHE_FILE_FANOUT in src/filecache.c
+#define FANOUT 256
+// Names are kept relative to the run directory, so 1M of them fit in memory
+#define NAME_LEN 32
+
+static bool verbose = false;
+
+static void usage() {
+    printf("-d <dir> directory to run in, . by default\n");
+    printf("-n <files> number of files, 1000000 by default\n");
+    printf("-v for verbose\n");
+    printf("-h for help\n");
+    exit(0);
+}
+
+static void v_printf(const char *fmt, ...) {
+    if (verbose) {
+        va_list ap;
+        va_start(ap, fmt);
+        vfprintf(stdout, fmt, ap);
+        va_end(ap);
+    }
+}
+
+static double elapsed(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Creates num_files files under top, flat or hashed, then unlinks them; prints the rates
+static int run(const char *top, int num_files, bool hashed) {
+    char (*names)[NAME_LEN] = calloc(num_files, NAME_LEN);
+    char path[PATH_MAX];
+    struct timespec start;
+    double secs;
+    int failed = 0;
+
+    if (names == NULL) {
+        printf("ERROR: can't allocate names for %d files\n", num_files);
+        return -1;
+    }
+
+    mkdir(top, 0770);
+    if (hashed) {
+        for (int bucket = 0; bucket < FANOUT; bucket++) {
+            snprintf(path, PATH_MAX, "%s/%02x", top, bucket);
+            mkdir(path, 0770);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int idx = 0; idx < num_files; idx++) {
+        int fd;
+        if (hashed) {
+            snprintf(path, PATH_MAX, "%s/%02x/fusedav-cache-XXXXXX", top, rand() % FANOUT);
+        }
+        else {
+            snprintf(path, PATH_MAX, "%s/fusedav-cache-XXXXXX", top);
+        }
+        fd = mkstemp(path);
+        if (fd < 0) {
+            v_printf("mkstemp failed on %s: %d %s\n", path, errno, strerror(errno));
+            ++failed;
+            continue;
+        }
+        close(fd);
+        strncpy(names[idx], path + strlen(top) + 1, NAME_LEN - 1);
+    }
+    secs = elapsed(&start);
+    printf("%s: created %d files in %.2fs (%.0f/s)\n", hashed ? "hashed" : "flat", num_files, secs, num_files / secs);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int idx = 0; idx < num_files; idx++) {
+        if (names[idx][0] == '\0') continue;
+        snprintf(path, PATH_MAX, "%s/%s", top, names[idx]);
+        if (unlink(path)) {
+            v_printf("unlink failed on %s: %d %s\n", path, errno, strerror(errno));
+            ++failed;
+        }
+    }
+    secs = elapsed(&start);
+    printf("%s: unlinked %d files in %.2fs (%.0f/s)\n", hashed ? "hashed" : "flat", num_files, secs, num_files / secs);
+
+    if (hashed) {
+        for (int bucket = 0; bucket < FANOUT; bucket++) {
+            snprintf(path, PATH_MAX, "%s/%02x", top, bucket);
+            rmdir(path);
+        }
+    }
+    rmdir(top);
+    free(names);
+
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    const char *dir = ".";
+    char top[PATH_MAX];
+    int num_files = 1000000;
+    int failed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:n:vh")) != -1) {
+        switch (opt) {
+            case 'd':
+                dir = optarg;
+                break;
+            case 'n':
+                num_files = atoi(optarg);
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'h':
+            default:
+                usage();
+        }
+    }
+
+    snprintf(top, PATH_MAX, "%s/cachedir-bench-%d", dir, getpid());
+    failed += run(top, num_files, false);
+    failed += run(top, num_files, true);
+
+    if (failed) {
+        printf("FAIL: %d errors\n", failed);
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,307 @@
+# This file is part of fusedav.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+# A stand-in for the server side of chunked uploads (see put_chunked in src/filecache.c):
+#   HEAD <path>?chunked-upload=<id>               Upload-Offset: bytes received so far (404: none)
+#   PUT  <path>?chunked-upload=<id>&offset=<n>    the chunk at n; must start at the Upload-Offset
+#   POST <path>?chunked-upload=<id>&commit=<size> replace <path> with the staged bytes; returns the ETag
+#                                                 (412 if it has If-Match and <path> has another ETag)
+#
+# With -u, it sits in front of a real file server: it answers the chunked-upload requests itself,
+# commits with a plain PUT to the server, and passes every other request through. Point fusedav's
+# base url at it, with chunked_upload_size set, and large files go up in chunks.
+# Without -u, it keeps files under -d itself, which is enough for --selftest.
+# -x# drops the connection halfway through every #th chunk, keeping what arrived, so fusedav
+# (or the self-test) has to resume.
+#
+# --selftest uploads the way put_chunked does, with small chunks, and checks that:
+#   an upload cut off by a dropped connection resumes and commits the right body;
+#   a second version of the same size, under its own upload id, doesn't pick up the first's chunks;
+#   a commit whose If-Match is no longer the file's ETag is refused, as a replayed write's is.
+#
+# e.g.
+#   python3 chunked-upload-server.py -p 8080 -u http://localhost:8448 -x 3
+#   python3 chunked-upload-server.py --selftest
+
+import argparse
+import hashlib
+import http.client
+import http.server
+import os
+import shutil
+import sys
+import tempfile
+import threading
+import urllib.parse
+
+class ChunkedUploadHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+    # Set by main
+    root = None
+    upstream = None
+    drop_every = 0
+    chunks = 0
+    lock = threading.Lock()
+
+    def log_message(self, format, *args):
+        if self.server.verbose:
+            http.server.BaseHTTPRequestHandler.log_message(self, format, *args)
+
+    def split(self):
+        url = urllib.parse.urlsplit(self.path)
+        return url.path, dict(urllib.parse.parse_qsl(url.query))
+
+    def staged(self, upload_id):
+        # Ids come from fusedav; don't let one name a file outside the staging area
+        name = hashlib.sha1(upload_id.encode()).hexdigest()
+        return os.path.join(self.root, '.chunked-upload', name)
+
+    def reply(self, code, headers=None, body=b''):
+        self.send_response(code)
+        for key, value in (headers or {}).items():
+            self.send_header(key, value)
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        if self.command != 'HEAD':
+            self.wfile.write(body)
+
+    def body(self):
+        return self.rfile.read(int(self.headers.get('Content-Length', 0)))
+
+    def do_HEAD(self):
+        path, query = self.split()
+        if 'chunked-upload' not in query:
+            return self.other()
+        staged = self.staged(query['chunked-upload'])
+        if not os.path.exists(staged):
+            return self.reply(404)
+        self.reply(200, {'Upload-Offset': str(os.path.getsize(staged))})
+
+    def do_PUT(self):
+        path, query = self.split()
+        if 'chunked-upload' not in query:
+            return self.other()
+        staged = self.staged(query['chunked-upload'])
+        have = os.path.getsize(staged) if os.path.exists(staged) else 0
+        length = int(self.headers.get('Content-Length', 0))
+        if int(query.get('offset', -1)) != have:
+            self.body()
+            return self.reply(409)
+        with self.lock:
+            ChunkedUploadHandler.chunks += 1
+            drop = self.drop_every and ChunkedUploadHandler.chunks % self.drop_every == 0
+        os.makedirs(os.path.dirname(staged), exist_ok=True)
+        with open(staged, 'ab') as f:
+            if drop:
+                # Keep half the chunk and hang up, as a dying node or a dropped connection would
+                f.write(self.rfile.read(length // 2))
+                self.close_connection = True
+                self.connection.shutdown(2)
+                return
+            f.write(self.rfile.read(length))
+        self.reply(204)
+
+    def do_POST(self):
+        path, query = self.split()
+        if 'chunked-upload' not in query:
+            return self.other()
+        staged = self.staged(query['chunked-upload'])
+        if not os.path.exists(staged) or os.path.getsize(staged) != int(query.get('commit', -1)):
+            return self.reply(409)
+        with open(staged, 'rb') as f:
+            data = f.read()
+        if_match = self.headers.get('If-Match')
+        if self.upstream:
+            headers = {'Content-Type': 'application/octet-stream'}
+            if if_match:
+                headers['If-Match'] = if_match
+            code, headers, body = self.forward('PUT', path, headers, data)
+            if code >= 300:
+                return self.reply(code, body=body)
+            etag = headers.get('ETag', '')
+        else:
+            local = os.path.join(self.root, path.lstrip('/'))
+            if if_match and self.local_etag(local) != if_match:
+                return self.reply(412)
+            os.makedirs(os.path.dirname(local), exist_ok=True)
+            with open(local, 'wb') as f:
+                f.write(data)
+            etag = '"%s"' % hashlib.sha1(data).hexdigest()
+        os.unlink(staged)
+        self.reply(201, {'ETag': etag})
+
+    def local_etag(self, local):
+        if not os.path.isfile(local):
+            return None
+        with open(local, 'rb') as f:
+            return '"%s"' % hashlib.sha1(f.read()).hexdigest()
+
+    def do_GET(self):
+        self.other()
+
+    def do_DELETE(self):
+        self.other()
+
+    def do_PROPFIND(self):
+        self.other()
+
+    def do_PATCH(self):
+        self.other()
+
+    def do_MKCOL(self):
+        self.other()
+
+    def do_MOVE(self):
+        self.other()
+
+    def forward(self, method, path, headers, body):
+        url = urllib.parse.urlsplit(self.upstream)
+        conn = http.client.HTTPConnection(url.hostname, url.port)
+        conn.request(method, path, body=body, headers=headers)
+        response = conn.getresponse()
+        data = response.read()
+        conn.close()
+        return response.status, dict(response.getheaders()), data
+
+    # Everything which isn't a chunked upload
+    def other(self):
+        body = self.body()
+        if self.upstream:
+            headers = {k: v for k, v in self.headers.items() if k.lower() not in ('host', 'connection')}
+            code, response_headers, data = self.forward(self.command, self.path, headers, body)
+            response_headers = {k: v for k, v in response_headers.items()
+                                if k.lower() not in ('content-length', 'connection', 'transfer-encoding')}
+            return self.reply(code, response_headers, data)
+        local = os.path.join(self.root, self.split()[0].lstrip('/'))
+        if self.command == 'PUT':
+            os.makedirs(os.path.dirname(local), exist_ok=True)
+            with open(local, 'wb') as f:
+                f.write(body)
+            return self.reply(201, {'ETag': '"%s"' % hashlib.sha1(body).hexdigest()})
+        if self.command in ('GET', 'HEAD') and os.path.isfile(local):
+            with open(local, 'rb') as f:
+                data = f.read()
+            return self.reply(200, {'ETag': '"%s"' % hashlib.sha1(data).hexdigest()}, data)
+        self.reply(404 if self.command in ('GET', 'HEAD') else 501)
+
+def serve(port, root, upstream, drop_every, verbose):
+    ChunkedUploadHandler.root = root
+    ChunkedUploadHandler.upstream = upstream
+    ChunkedUploadHandler.drop_every = drop_every
+    server = http.server.ThreadingHTTPServer(('127.0.0.1', port), ChunkedUploadHandler)
+    server.verbose = verbose
+    return server
+
+# The client side, as put_chunked does it: ask how much the server has, send the rest, commit
+def upload(port, path, upload_id, data, chunk, if_match=None):
+    resumed = False
+    for attempt in range(8):
+        try:
+            conn = http.client.HTTPConnection('127.0.0.1', port)
+            query = 'chunked-upload=%s' % upload_id
+            conn.request('HEAD', '%s?%s' % (path, query))
+            response = conn.getresponse()
+            response.read()
+            offset = int(response.getheader('Upload-Offset', 0)) if response.status == 200 else 0
+            resumed = resumed or offset > 0
+            while offset < len(data):
+                end = min(offset + chunk, len(data))
+                conn.request('PUT', '%s?%s&offset=%d' % (path, query, offset), body=data[offset:end])
+                response = conn.getresponse()
+                response.read()
+                if response.status >= 300:
+                    raise IOError('chunk at %d: %d' % (offset, response.status))
+                offset = end
+            conn.request('POST', '%s?%s&commit=%d' % (path, query, len(data)),
+                         headers={'If-Match': if_match} if if_match else {})
+            response = conn.getresponse()
+            response.read()
+            return response.status, resumed
+        except (http.client.HTTPException, ConnectionError):
+            # Go round again, as put_chunked does on a curl error
+            continue
+        finally:
+            conn.close()
+    return 0, resumed
+
+def selftest(verbose):
+    root = tempfile.mkdtemp()
+    server = serve(0, root, None, 3, verbose)
+    port = server.server_address[1]
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    chunk = 64 * 1024
+    first = os.urandom(10 * chunk + 100)
+    second = os.urandom(len(first))
+    failures = []
+
+    # Version 1 is cut off after two chunks (every third chunk is dropped), and resumes
+    ChunkedUploadHandler.drop_every = 3
+    code, resumed = upload(port, '/f', 'v1', first, chunk)
+    with open(os.path.join(root, 'f'), 'rb') as f:
+        body = f.read()
+    if code != 201 or body != first:
+        failures.append('resumed upload committed the wrong body (%d)' % code)
+    if not resumed:
+        failures.append('upload was never resumed')
+
+    # Version 2 is staged halfway and dropped; version 3, same size, has its own id and must not resume on it
+    ChunkedUploadHandler.chunks = 0
+    ChunkedUploadHandler.drop_every = 1
+    code, resumed = upload(port, '/g', 'v2', first, chunk)
+    ChunkedUploadHandler.drop_every = 0
+    code, resumed = upload(port, '/g', 'v3', second, chunk)
+    with open(os.path.join(root, 'g'), 'rb') as f:
+        body = f.read()
+    if code != 201 or body != second or resumed:
+        failures.append('a new version picked up chunks staged for an old one')
+
+    # Written from version 1 of /f, which is gone; the commit must leave version 2 alone
+    old_etag = '"%s"' % hashlib.sha1(first).hexdigest()
+    with open(os.path.join(root, 'f'), 'wb') as f:
+        f.write(second)
+    code, resumed = upload(port, '/f', 'v5', first, chunk, old_etag)
+    with open(os.path.join(root, 'f'), 'rb') as f:
+        body = f.read()
+    if code != 412 or body != second:
+        failures.append('a commit with a stale If-Match replaced the file (%d)' % code)
+
+    server.shutdown()
+    shutil.rmtree(root)
+    for failure in failures:
+        print('FAIL: %s' % failure)
+    if failures:
+        return 1
+    print('PASS')
+    return 0
+
+def main():
+    parser = argparse.ArgumentParser(description='Stand-in server for fusedav chunked uploads')
+    parser.add_argument('-p', '--port', type=int, default=8080)
+    parser.add_argument('-d', '--dir', help='where files and staged uploads go (default: a temporary directory)')
+    parser.add_argument('-u', '--upstream', help='file server to pass other requests through to, e.g. http://localhost:8448')
+    parser.add_argument('-x', '--drop-every', type=int, default=0, help='drop the connection halfway through every #th chunk')
+    parser.add_argument('-v', '--verbose', action='store_true')
+    parser.add_argument('--selftest', action='store_true')
+    args = parser.parse_args()
+
+    if args.selftest:
+        return selftest(args.verbose)
+    server = serve(args.port, args.dir or tempfile.mkdtemp(), args.upstream, args.drop_every, args.verbose)
+    server.serve_forever()
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
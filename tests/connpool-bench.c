@@ -0,0 +1,329 @@
+/* Compare per-thread curl handles, each with its own connections, DNS cache and TLS sessions,
+ * against handles sharing only the DNS cache and TLS sessions, and against handles sharing
+ * those and one connection cache over HTTP/2, the way src/session.c does with connection_pool.
+ * Threads GET the url over and over; every -r requests a thread throws its handle away
+ * and makes a new one, like fusedav does on errors and slist refreshes. A new handle on its
+ * own has no TLS session to resume, so each of its connections costs a full handshake.
+ * Point it at a local TLS server, e.g.
+ *   openssl req -x509 -newkey rsa:2048 -nodes -keyout key.pem -out cert.pem -subj /CN=localhost
+ *   openssl s_server -accept 8443 -cert cert.pem -key key.pem -WWW &
+ *   connpool-bench -u https://localhost:8443/cert.pem -k -t 16 -n 500
+ * s_server only talks HTTP/1.1, so that shows the fallback; use nginx with http2 on to see
+ * multiplexing.
+ */
+#define _XOPEN_SOURCE 700
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <curl/curl.h>
+
+#define MAX_THREADS 256
+
+static bool verbose = false;
+static bool insecure = false;
+static const char *url = NULL;
+static int num_requests = 500;
+static int reset_interval = 50;
+static CURLSH *pool = NULL;
+static bool share_connections = false;
+static pthread_rwlock_t pool_locks[CURL_LOCK_DATA_LAST];
+static int open_sockets = 0;
+static int max_open_sockets = 0;
+
+struct worker {
+    pthread_t thread;
+    long connects;
+    long handshakes;
+    long http2;
+    double dns_ms; // name lookup, over all new connections
+    double connect_ms; // tcp connect, over all new connections
+    double handshake_ms; // tls handshake, over all new connections
+    long *latencies; // ms
+    int failed;
+};
+
+static void usage() {
+    printf("-u <url> to GET, required\n");
+    printf("-t <threads> number of threads, 8 by default\n");
+    printf("-n <requests> requests per thread, 500 by default\n");
+    printf("-r <requests> new handle after this many requests, 50 by default; 0 is never\n");
+    printf("-k don't verify the server certificate\n");
+    printf("-v for verbose\n");
+    printf("-h for help\n");
+    exit(0);
+}
+
+static void v_printf(const char *fmt, ...) {
+    if (verbose) {
+        va_list ap;
+        va_start(ap, fmt);
+        vfprintf(stdout, fmt, ap);
+        va_end(ap);
+    }
+}
+
+static double elapsed(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void pool_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+    (void) handle; (void) userptr;
+    if (access == CURL_LOCK_ACCESS_SHARED) pthread_rwlock_rdlock(&pool_locks[data]);
+    else pthread_rwlock_wrlock(&pool_locks[data]);
+}
+
+static void pool_unlock(CURL *handle, curl_lock_data data, void *userptr) {
+    (void) handle; (void) userptr;
+    pthread_rwlock_unlock(&pool_locks[data]);
+}
+
+static curl_socket_t open_socket(void *clientp, curlsocktype purpose, struct curl_sockaddr *address) {
+    curl_socket_t fd = socket(address->family, address->socktype, address->protocol);
+    (void) clientp; (void) purpose;
+    if (fd != CURL_SOCKET_BAD) {
+        int now = __sync_add_and_fetch(&open_sockets, 1);
+        int max = max_open_sockets;
+        while (now > max && !__sync_bool_compare_and_swap(&max_open_sockets, max, now)) {
+            max = max_open_sockets;
+        }
+    }
+    return fd;
+}
+
+static int close_socket(void *clientp, curl_socket_t fd) {
+    (void) clientp;
+    __sync_fetch_and_sub(&open_sockets, 1);
+    return close(fd);
+}
+
+static size_t discard(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    (void) ptr; (void) userdata;
+    return size * nmemb;
+}
+
+static CURL *new_handle(void) {
+    CURL *session = curl_easy_init();
+    if (session && pool) curl_easy_setopt(session, CURLOPT_SHARE, pool);
+    return session;
+}
+
+static void *work(void *ptr) {
+    struct worker *worker = ptr;
+    CURL *session = new_handle();
+
+    for (int idx = 0; idx < num_requests && session; idx++) {
+        struct timespec start;
+        long new_connects = 0;
+        long http_version = 0;
+        long response_code = 0;
+        double namelookup_time = 0;
+        double connect_time = 0;
+        double appconnect_time = 0;
+        CURLcode res;
+
+        if (reset_interval > 0 && idx > 0 && idx % reset_interval == 0) {
+            curl_easy_cleanup(session);
+            session = new_handle();
+            if (session == NULL) break;
+        }
+
+        // Set up the way session_request_init does
+        curl_easy_reset(session);
+        curl_easy_setopt(session, CURLOPT_URL, url);
+        curl_easy_setopt(session, CURLOPT_WRITEFUNCTION, discard);
+        curl_easy_setopt(session, CURLOPT_OPENSOCKETFUNCTION, open_socket);
+        curl_easy_setopt(session, CURLOPT_CLOSESOCKETFUNCTION, close_socket);
+        curl_easy_setopt(session, CURLOPT_CONNECTTIMEOUT_MS, 1200);
+        curl_easy_setopt(session, CURLOPT_TIMEOUT, 60);
+        if (insecure) {
+            curl_easy_setopt(session, CURLOPT_SSL_VERIFYPEER, 0L);
+            curl_easy_setopt(session, CURLOPT_SSL_VERIFYHOST, 0L);
+        }
+        if (share_connections) {
+            curl_easy_setopt(session, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+            curl_easy_setopt(session, CURLOPT_MAXCONNECTS, 32L);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        res = curl_easy_perform(session);
+        worker->latencies[idx] = elapsed(&start) * 1000;
+        if (res != CURLE_OK) {
+            v_printf("request %d failed: %s\n", idx, curl_easy_strerror(res));
+            ++worker->failed;
+            continue;
+        }
+        curl_easy_getinfo(session, CURLINFO_RESPONSE_CODE, &response_code);
+        if (response_code != 200) {
+            v_printf("request %d got %ld\n", idx, response_code);
+            ++worker->failed;
+        }
+        curl_easy_getinfo(session, CURLINFO_NUM_CONNECTS, &new_connects);
+        curl_easy_getinfo(session, CURLINFO_NAMELOOKUP_TIME, &namelookup_time);
+        curl_easy_getinfo(session, CURLINFO_CONNECT_TIME, &connect_time);
+        curl_easy_getinfo(session, CURLINFO_APPCONNECT_TIME, &appconnect_time);
+        curl_easy_getinfo(session, CURLINFO_HTTP_VERSION, &http_version);
+        worker->connects += new_connects;
+        if (new_connects > 0) {
+            worker->dns_ms += namelookup_time * 1000;
+            worker->connect_ms += (connect_time - namelookup_time) * 1000;
+        }
+        if (new_connects > 0 && appconnect_time > 0) {
+            worker->handshakes += new_connects;
+            worker->handshake_ms += (appconnect_time - connect_time) * 1000;
+        }
+        if (http_version == CURL_HTTP_VERSION_2_0) ++worker->http2;
+    }
+
+    if (session) curl_easy_cleanup(session);
+    return NULL;
+}
+
+static int compare_long(const void *x, const void *y) {
+    long a = *(const long *)x;
+    long b = *(const long *)y;
+    return (a > b) - (a < b);
+}
+
+// Runs the workers, with whatever pool shares; prints what it cost
+static int run(const char *name, int num_threads) {
+    struct worker workers[MAX_THREADS];
+    struct timespec start;
+    long *latencies;
+    long connects = 0;
+    long handshakes = 0;
+    long http2 = 0;
+    long total_latency = 0;
+    double dns_ms = 0;
+    double connect_ms = 0;
+    double handshake_ms = 0;
+    int total = num_threads * num_requests;
+    double secs;
+    int failed = 0;
+
+    latencies = calloc(total, sizeof(long));
+    if (latencies == NULL) {
+        printf("ERROR: can't allocate latencies for %d requests\n", total);
+        return 1;
+    }
+    open_sockets = 0;
+    max_open_sockets = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int idx = 0; idx < num_threads; idx++) {
+        memset(&workers[idx], 0, sizeof(struct worker));
+        workers[idx].latencies = latencies + idx * num_requests;
+        pthread_create(&workers[idx].thread, NULL, work, &workers[idx]);
+    }
+    for (int idx = 0; idx < num_threads; idx++) {
+        pthread_join(workers[idx].thread, NULL);
+        connects += workers[idx].connects;
+        handshakes += workers[idx].handshakes;
+        http2 += workers[idx].http2;
+        dns_ms += workers[idx].dns_ms;
+        connect_ms += workers[idx].connect_ms;
+        handshake_ms += workers[idx].handshake_ms;
+        failed += workers[idx].failed;
+    }
+    secs = elapsed(&start);
+
+    qsort(latencies, total, sizeof(long), compare_long);
+    for (int idx = 0; idx < total; idx++) total_latency += latencies[idx];
+
+    printf("%s: %d requests in %.2fs (%.0f/s); %ld connections (at most %d open), %ld handshakes (%.1f/s), %ld over HTTP/2\n",
+        name, total, secs, total / secs, connects, max_open_sockets, handshakes, handshakes / secs, http2);
+    printf("%s: dns avg %.2fms, connect avg %.2fms, handshake avg %.2fms; %.0fms setting up connections in all\n",
+        name, connects ? dns_ms / connects : 0, connects ? connect_ms / connects : 0,
+        handshakes ? handshake_ms / handshakes : 0, dns_ms + connect_ms + handshake_ms);
+    printf("%s: latency avg %.1fms p50 %ldms p99 %ldms max %ldms\n",
+        name, (double) total_latency / total, latencies[total / 2], latencies[(total * 99) / 100], latencies[total - 1]);
+
+    free(latencies);
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    int num_threads = 8;
+    int failed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "u:t:n:r:kvh")) != -1) {
+        switch (opt) {
+            case 'u':
+                url = optarg;
+                break;
+            case 't':
+                num_threads = atoi(optarg);
+                if (num_threads < 1) num_threads = 1;
+                if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+                break;
+            case 'n':
+                num_requests = atoi(optarg);
+                if (num_requests < 1) num_requests = 1;
+                break;
+            case 'r':
+                reset_interval = atoi(optarg);
+                break;
+            case 'k':
+                insecure = true;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'h':
+            default:
+                usage();
+        }
+    }
+    if (url == NULL) usage();
+
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    failed += run("per-thread", num_threads);
+
+    for (int idx = 0; idx < CURL_LOCK_DATA_LAST; idx++) {
+        pthread_rwlock_init(&pool_locks[idx], NULL);
+    }
+
+    // A handle can't change shares, and every run makes new handles, so each run gets its own share
+    pool = curl_share_init();
+    curl_share_setopt(pool, CURLSHOPT_LOCKFUNC, pool_lock);
+    curl_share_setopt(pool, CURLSHOPT_UNLOCKFUNC, pool_unlock);
+    curl_share_setopt(pool, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(pool, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    failed += run("shared-sessions", num_threads);
+    curl_share_cleanup(pool);
+
+    pool = curl_share_init();
+    curl_share_setopt(pool, CURLSHOPT_LOCKFUNC, pool_lock);
+    curl_share_setopt(pool, CURLSHOPT_UNLOCKFUNC, pool_unlock);
+    curl_share_setopt(pool, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(pool, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    if (curl_share_setopt(pool, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT) != CURLSHE_OK) {
+        printf("pooled: libcurl can't share connections, skipped\n");
+    }
+    else {
+        share_connections = true;
+        failed += run("pooled", num_threads);
+    }
+    curl_share_cleanup(pool);
+    curl_global_cleanup();
+
+    if (failed) {
+        printf("FAIL: %d errors\n", failed);
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
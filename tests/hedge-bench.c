@@ -0,0 +1,247 @@
+/* Compare requests with and without hedging (src/hedge.c) when nodes stall now and then.
+ * The bench runs its own nodes: -N small HTTP servers on 127.0.0.1, each on its own port,
+ * answering after -f ms, except that -p percent of requests stall for -s ms first.
+ * Threads pick nodes with the scoreboard and send requests to them the way src/session.c
+ * does, and we compare latencies and count the hedges, e.g.
+ *   hedge-bench -N 3 -f 2 -s 200 -p 3 -t 8 -n 500
+ * It fails unless the hedged p99 is lower than the unhedged one.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <curl/curl.h>
+
+#include "nodescore.h"
+#include "latency.h"
+#include "hedge.h"
+#include "bench-node.h"
+
+static int num_nodes = 3;
+static int fast_ms = 2;
+static int stall_ms = 200;
+static int stall_percent = 3;
+static int num_requests = 500;
+static bool use_hedging = false;
+static char *keys[MAX_BENCH_NODES];
+static char *connect_to_str[MAX_BENCH_NODES];
+// Times to first byte, for the hedge delay, as session.c keeps them
+static struct latency_hist first_byte;
+static long hedges;
+static long hedge_wins;
+static long over_budget;
+
+struct worker {
+    pthread_t thread;
+    long *latencies; // us
+    int failed;
+};
+
+// Where a response goes; the bench checks that exactly one response's worth arrives
+struct body {
+    char buf[16];
+    size_t len;
+};
+
+static const char *const options[] = {
+    "-N <nodes> number of nodes, 3 by default",
+    "-f <ms> how long the nodes take to answer, 2 by default",
+    "-s <ms> how long a stalled request takes, 200 by default",
+    "-p <percent> of requests which stall, 3 by default",
+    "-t <threads> number of threads, 8 by default",
+    "-n <requests> requests per thread, 500 by default",
+    NULL
+};
+
+// Nodes answer after a delay, or now and then a stall
+static enum bench_reply reply(int node, unsigned int *seed, int *delay_ms) {
+    (void) node;
+    *delay_ms = (int) (rand_r(seed) % 100) < stall_percent ? stall_ms : fast_ms;
+    return BENCH_ANSWER;
+}
+
+static size_t keep_body(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    struct body *body = userdata;
+    size_t bytes = size * nmemb;
+
+    if (body->len + bytes >= sizeof(body->buf)) return 0;
+    memcpy(body->buf + body->len, ptr, bytes);
+    body->len += bytes;
+    body->buf[body->len] = '\0';
+    return bytes;
+}
+
+static void *work(void *ptr) {
+    struct worker *worker = ptr;
+    CURL *session = curl_easy_init();
+
+    for (int idx = 0; idx < num_requests && session; idx++) {
+        struct hedge_request hedge;
+        struct body body;
+        struct timespec start;
+        CURL *answered = session;
+        long response_code = 0;
+        long elapsed_us;
+        double first_byte_secs = 0;
+        int node = nodescore_pick();
+        CURLcode res;
+
+        // Set up the way session_request_init does
+        curl_easy_reset(session);
+        curl_easy_setopt(session, CURLOPT_URL, "http://" BENCH_HOST "/");
+        curl_easy_setopt(session, CURLOPT_CONNECT_TO, nodescore_connect_to(node));
+        curl_easy_setopt(session, CURLOPT_TIMEOUT, 60);
+        memset(&body, 0, sizeof(struct body));
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (use_hedging) {
+            memset(&hedge, 0, sizeof(struct hedge_request));
+            hedge.write_fn = keep_body;
+            hedge.write_data = &body;
+            hedge.node = node;
+            hedge.delay_ms = hedge_delay(&first_byte, 95, 10, 2000);
+            hedge.slow_ms = 1000;
+            res = hedge_perform(session, &hedge);
+            answered = hedge.answered;
+            if (hedge.hedged) __sync_fetch_and_add(&hedges, 1);
+            if (answered != session) __sync_fetch_and_add(&hedge_wins, 1);
+            if (hedge.over_budget) __sync_fetch_and_add(&over_budget, 1);
+        }
+        else {
+            curl_easy_setopt(session, CURLOPT_WRITEFUNCTION, keep_body);
+            curl_easy_setopt(session, CURLOPT_WRITEDATA, &body);
+            nodescore_start(node);
+            res = curl_easy_perform(session);
+        }
+        elapsed_us = elapsed(&start) * 1000 * 1000;
+        worker->latencies[idx] = elapsed_us;
+        if (res == CURLE_OK) {
+            curl_easy_getinfo(answered, CURLINFO_RESPONSE_CODE, &response_code);
+            curl_easy_getinfo(answered, CURLINFO_STARTTRANSFER_TIME, &first_byte_secs);
+            latency_record(&first_byte, first_byte_secs * 1000 + (answered != session ? hedge.delay_ms : 0));
+        }
+        if (!use_hedging) nodescore_done(node, res == CURLE_OK && response_code < 500, elapsed_us / 1000);
+        if (answered != session) curl_easy_cleanup(answered);
+
+        if (res != CURLE_OK || response_code != 200 || strcmp(body.buf, "ok") != 0) {
+            v_printf("request %d to %s failed: %s %ld '%s'\n", idx, keys[node], curl_easy_strerror(res),
+                response_code, body.buf);
+            ++worker->failed;
+        }
+    }
+
+    if (session) curl_easy_cleanup(session);
+    return NULL;
+}
+
+// Returns how many requests failed; *p99 is the 99th percentile latency, in us
+static int run(const char *name, int num_threads, long *p99) {
+    struct worker workers[MAX_THREADS];
+    struct timespec start;
+    long *latencies;
+    long total_latency = 0;
+    int total = num_threads * num_requests;
+    double secs;
+    int failed = 0;
+
+    latencies = calloc(total, sizeof(long));
+    if (latencies == NULL) {
+        printf("ERROR: can't allocate latencies for %d requests\n", total);
+        return 1;
+    }
+    hedges = hedge_wins = over_budget = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int idx = 0; idx < num_threads; idx++) {
+        memset(&workers[idx], 0, sizeof(struct worker));
+        workers[idx].latencies = latencies + idx * num_requests;
+        pthread_create(&workers[idx].thread, NULL, work, &workers[idx]);
+    }
+    for (int idx = 0; idx < num_threads; idx++) {
+        pthread_join(workers[idx].thread, NULL);
+        failed += workers[idx].failed;
+    }
+    secs = elapsed(&start);
+
+    qsort(latencies, total, sizeof(long), compare_long);
+    for (int idx = 0; idx < total; idx++) total_latency += latencies[idx];
+    *p99 = latencies[(total * 99) / 100];
+
+    printf("%s: %d requests in %.2fs (%.0f/s); latency avg %.1fms p50 %.1fms p90 %.1fms p99 %.1fms max %.1fms\n",
+        name, total, secs, total / secs, total_latency / 1000.0 / total, latencies[total / 2] / 1000.0,
+        latencies[(total * 90) / 100] / 1000.0, latencies[(total * 99) / 100] / 1000.0, latencies[total - 1] / 1000.0);
+    if (use_hedging) {
+        printf("%s: %ld hedges (%.1f%%), %ld answered first; %ld more were over budget\n",
+            name, hedges, hedges * 100.0 / total, hedge_wins, over_budget);
+    }
+
+    free(latencies);
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    int num_threads = 8;
+    long unhedged_p99;
+    long hedged_p99;
+    int failed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "N:f:s:p:t:n:vh")) != -1) {
+        switch (opt) {
+            case 'N':
+                num_nodes = atoi(optarg);
+                if (num_nodes < 2) num_nodes = 2;
+                if (num_nodes > MAX_BENCH_NODES) num_nodes = MAX_BENCH_NODES;
+                break;
+            case 'f':
+                fast_ms = atoi(optarg);
+                break;
+            case 's':
+                stall_ms = atoi(optarg);
+                break;
+            case 'p':
+                stall_percent = atoi(optarg);
+                break;
+            case 't':
+                num_threads = atoi(optarg);
+                if (num_threads < 1) num_threads = 1;
+                if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+                break;
+            case 'n':
+                num_requests = atoi(optarg);
+                if (num_requests < 1) num_requests = 1;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'h':
+            default:
+                usage(options);
+        }
+    }
+
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    if (start_nodes(0, num_nodes, reply, keys, connect_to_str) < 0) return 1;
+    nodescore_set_nodes(keys, connect_to_str, num_nodes);
+
+    failed += run("unhedged", num_threads, &unhedged_p99);
+
+    use_hedging = true;
+    failed += run("hedged", num_threads, &hedged_p99);
+
+    // Hedging is there to cut the tail
+    if (failed || hedged_p99 >= unhedged_p99) {
+        printf("FAIL: %d errors%s\n", failed, hedged_p99 >= unhedged_p99 ? "; hedging didn't bring p99 down" : "");
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
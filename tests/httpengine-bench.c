@@ -0,0 +1,237 @@
+/* Compare threads each blocking in curl_easy_perform, as fuse worker threads do,
+ * against one thread keeping many requests in flight on the engine in src/httpengine.c.
+ * Both runs make -n requests to the url; the blocking run has -t threads, the engine run
+ * keeps -c requests outstanding from a single thread. Point it at a local server which
+ * takes a while to answer, so that concurrency is what counts, e.g. nginx with a location
+ * doing 'echo_sleep 0.05', and
+ *   httpengine-bench -u https://localhost:8443/slow -k -t 4 -c 64 -n 2000
+ */
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <curl/curl.h>
+
+#include "httpengine.h"
+
+#define MAX_THREADS 256
+#define MAX_CONCURRENCY 1024
+
+static bool verbose = false;
+static bool insecure = false;
+static const char *url = NULL;
+static int num_requests = 2000;
+static int started = 0;
+static int failed = 0;
+
+// The engine run's requests finish on the engine thread; main waits for all of them here
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static int finished = 0;
+
+static void usage() {
+    printf("-u <url> to GET, required\n");
+    printf("-n <requests> total requests per run, 2000 by default\n");
+    printf("-t <threads> threads for the blocking run, 4 by default\n");
+    printf("-c <requests> requests in flight for the engine run, 64 by default\n");
+    printf("-k don't verify the server certificate\n");
+    printf("-v for verbose\n");
+    printf("-h for help\n");
+    exit(0);
+}
+
+static void v_printf(const char *fmt, ...) {
+    if (verbose) {
+        va_list ap;
+        va_start(ap, fmt);
+        vfprintf(stdout, fmt, ap);
+        va_end(ap);
+    }
+}
+
+static double elapsed(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static size_t discard(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    (void) ptr; (void) userdata;
+    return size * nmemb;
+}
+
+static void setup(CURL *session) {
+    curl_easy_reset(session);
+    curl_easy_setopt(session, CURLOPT_URL, url);
+    curl_easy_setopt(session, CURLOPT_WRITEFUNCTION, discard);
+    curl_easy_setopt(session, CURLOPT_TIMEOUT, 60);
+    if (insecure) {
+        curl_easy_setopt(session, CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt(session, CURLOPT_SSL_VERIFYHOST, 0L);
+    }
+}
+
+static bool check(CURL *session, CURLcode res) {
+    long response_code = 0;
+
+    if (res != CURLE_OK) {
+        v_printf("request failed: %s\n", curl_easy_strerror(res));
+        return false;
+    }
+    curl_easy_getinfo(session, CURLINFO_RESPONSE_CODE, &response_code);
+    if (response_code != 200) {
+        v_printf("request got %ld\n", response_code);
+        return false;
+    }
+    return true;
+}
+
+// Claims the next request; false once all have been started
+static bool next_request(void) {
+    return __sync_fetch_and_add(&started, 1) < num_requests;
+}
+
+static void *blocking_worker(void *ptr) {
+    CURL *session = curl_easy_init();
+    (void) ptr;
+
+    while (session && next_request()) {
+        setup(session);
+        if (!check(session, curl_easy_perform(session))) __sync_fetch_and_add(&failed, 1);
+    }
+    if (session) curl_easy_cleanup(session);
+    return NULL;
+}
+
+static void request_finished(bool ok) {
+    if (!ok) __sync_fetch_and_add(&failed, 1);
+    pthread_mutex_lock(&done_mutex);
+    ++finished;
+    pthread_cond_signal(&done_cond);
+    pthread_mutex_unlock(&done_mutex);
+}
+
+// Runs on the engine thread; reuses the handle for the next request, if there is one
+static void request_done(CURL *session, CURLcode res, void *userdata) {
+    (void) userdata;
+    request_finished(check(session, res));
+
+    if (next_request()) {
+        setup(session);
+        if (httpengine_submit(session, request_done, NULL) == 0) return;
+        request_finished(false);
+    }
+    curl_easy_cleanup(session);
+}
+
+static void run_blocking(int num_threads) {
+    pthread_t threads[MAX_THREADS];
+    struct timespec start;
+    double secs;
+
+    started = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int idx = 0; idx < num_threads; idx++) {
+        pthread_create(&threads[idx], NULL, blocking_worker, NULL);
+    }
+    for (int idx = 0; idx < num_threads; idx++) {
+        pthread_join(threads[idx], NULL);
+    }
+    secs = elapsed(&start);
+    printf("blocking: %d threads did %d requests in %.2fs (%.0f/s)\n", num_threads, num_requests, secs, num_requests / secs);
+}
+
+static void run_engine(int concurrency) {
+    struct timespec start;
+    double secs;
+
+    started = 0;
+    finished = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int idx = 0; idx < concurrency && next_request(); idx++) {
+        CURL *session = curl_easy_init();
+        if (session == NULL) {
+            request_finished(false);
+            continue;
+        }
+        setup(session);
+        if (httpengine_submit(session, request_done, NULL) < 0) {
+            request_finished(false);
+            curl_easy_cleanup(session);
+        }
+    }
+
+    pthread_mutex_lock(&done_mutex);
+    while (finished < num_requests) {
+        pthread_cond_wait(&done_cond, &done_mutex);
+    }
+    pthread_mutex_unlock(&done_mutex);
+    secs = elapsed(&start);
+    printf("engine: 1 thread with %d in flight did %d requests in %.2fs (%.0f/s)\n", concurrency, num_requests, secs, num_requests / secs);
+}
+
+int main(int argc, char *argv[]) {
+    int num_threads = 4;
+    int concurrency = 64;
+    int ret;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "u:n:t:c:kvh")) != -1) {
+        switch (opt) {
+            case 'u':
+                url = optarg;
+                break;
+            case 'n':
+                num_requests = atoi(optarg);
+                if (num_requests < 1) num_requests = 1;
+                break;
+            case 't':
+                num_threads = atoi(optarg);
+                if (num_threads < 1) num_threads = 1;
+                if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+                break;
+            case 'c':
+                concurrency = atoi(optarg);
+                if (concurrency < 1) concurrency = 1;
+                if (concurrency > MAX_CONCURRENCY) concurrency = MAX_CONCURRENCY;
+                break;
+            case 'k':
+                insecure = true;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'h':
+            default:
+                usage();
+        }
+    }
+    if (url == NULL) usage();
+
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    run_blocking(num_threads);
+
+    ret = httpengine_init();
+    if (ret < 0) {
+        printf("engine: unavailable (%d %s), skipped\n", -ret, strerror(-ret));
+    }
+    else {
+        run_engine(concurrency);
+    }
+
+    if (failed) {
+        printf("FAIL: %d errors\n", failed);
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
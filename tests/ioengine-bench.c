@@ -0,0 +1,191 @@
+/* Compare cache file I/O through plain pread/pwrite against the io_uring engine in src/ioengine.c.
+ * Threads do random block-sized reads and writes (70/30) on one file, like fuse worker threads
+ * on a cache file. Run it on the filesystem which holds the cache, e.g.
+ *   ioengine-bench -d /srv/bindings/<bid>/cache -t 16 -n 100000
+ * It creates and removes its own file under -d. Build with -DHAVE_LIBURING -luring to get
+ * the io_uring run; without it only the pread/pwrite numbers are real.
+ */
+#define _XOPEN_SOURCE 700
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "ioengine.h"
+
+#define PATH_MAX 4096
+#define MAX_THREADS 256
+// Percentage of operations which are reads
+#define READ_PERCENT 70
+
+static bool verbose = false;
+static int fd = -1;
+static int num_ops = 100000;
+static size_t block_size = 4096;
+static off_t file_blocks = 16384;
+
+struct worker {
+    pthread_t thread;
+    unsigned seed;
+    int failed;
+};
+
+static void usage() {
+    printf("-d <dir> directory to run in, . by default\n");
+    printf("-t <threads> number of threads, 8 by default\n");
+    printf("-n <ops> operations per thread, 100000 by default\n");
+    printf("-s <bytes> block size, 4096 by default\n");
+    printf("-b <blocks> file size in blocks, 16384 by default\n");
+    printf("-v for verbose\n");
+    printf("-h for help\n");
+    exit(0);
+}
+
+static void v_printf(const char *fmt, ...) {
+    if (verbose) {
+        va_list ap;
+        va_start(ap, fmt);
+        vfprintf(stdout, fmt, ap);
+        va_end(ap);
+    }
+}
+
+static double elapsed(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *work(void *ptr) {
+    struct worker *worker = ptr;
+    char *buf = malloc(block_size);
+
+    if (buf == NULL) {
+        ++worker->failed;
+        return NULL;
+    }
+    memset(buf, 'x', block_size);
+
+    for (int idx = 0; idx < num_ops; idx++) {
+        off_t offset = (rand_r(&worker->seed) % file_blocks) * block_size;
+        ssize_t bytes;
+        bool reading = (rand_r(&worker->seed) % 100) < READ_PERCENT;
+
+        if (reading) {
+            bytes = ioengine_pread(fd, buf, block_size, offset);
+        }
+        else {
+            bytes = ioengine_pwrite(fd, buf, block_size, offset);
+        }
+        if (bytes != (ssize_t) block_size) {
+            v_printf("%s failed at %ld: %ld %d %s\n", reading ? "pread" : "pwrite", offset, bytes, errno, strerror(errno));
+            ++worker->failed;
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+// Runs the workers against the current engine; prints the rate
+static int run(const char *name, int num_threads) {
+    struct worker workers[MAX_THREADS];
+    struct timespec start;
+    double secs;
+    int failed = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int idx = 0; idx < num_threads; idx++) {
+        workers[idx].seed = idx + 1;
+        workers[idx].failed = 0;
+        pthread_create(&workers[idx].thread, NULL, work, &workers[idx]);
+    }
+    for (int idx = 0; idx < num_threads; idx++) {
+        pthread_join(workers[idx].thread, NULL);
+        failed += workers[idx].failed;
+    }
+    secs = elapsed(&start);
+    printf("%s: %d threads did %d ops of %lu bytes in %.2fs (%.0f ops/s)\n",
+        name, num_threads, num_threads * num_ops, block_size, secs, num_threads * num_ops / secs);
+
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    const char *dir = ".";
+    char path[PATH_MAX];
+    int num_threads = 8;
+    int failed = 0;
+    int ret;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:t:n:s:b:vh")) != -1) {
+        switch (opt) {
+            case 'd':
+                dir = optarg;
+                break;
+            case 't':
+                num_threads = atoi(optarg);
+                if (num_threads < 1) num_threads = 1;
+                if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+                break;
+            case 'n':
+                num_ops = atoi(optarg);
+                break;
+            case 's':
+                block_size = atol(optarg);
+                break;
+            case 'b':
+                file_blocks = atol(optarg);
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'h':
+            default:
+                usage();
+        }
+    }
+
+    snprintf(path, PATH_MAX, "%s/ioengine-bench-%d", dir, getpid());
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        printf("ERROR: can't create %s: %d %s\n", path, errno, strerror(errno));
+        return 1;
+    }
+    if (ftruncate(fd, file_blocks * block_size)) {
+        printf("ERROR: can't size %s: %d %s\n", path, errno, strerror(errno));
+        close(fd);
+        unlink(path);
+        return 1;
+    }
+
+    failed += run("pread/pwrite", num_threads);
+
+    ret = ioengine_init(true);
+    if (ret < 0) {
+        printf("io_uring: unavailable (%d %s), skipped\n", -ret, strerror(-ret));
+    }
+    else {
+        failed += run("io_uring", num_threads);
+    }
+
+    close(fd);
+    unlink(path);
+
+    if (failed) {
+        printf("FAIL: %d errors\n", failed);
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
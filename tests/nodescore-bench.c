@@ -0,0 +1,213 @@
+/* Compare spreading requests over the nodes at random, as the shuffled resolve list did,
+ * against picking them with the scoreboard in src/nodescore.c, when one node is slow.
+ * The bench runs its own nodes: -N small HTTP servers on 127.0.0.1, each on its own port,
+ * answering after -f ms, except the last, which takes -s ms. Threads send requests to
+ * them the way src/session.c does, with CURLOPT_CONNECT_TO, and we compare latencies, e.g.
+ *   nodescore-bench -N 3 -f 2 -s 50 -t 8 -n 500
+ * It fails unless the scoreboard sends the slow node less traffic than chance does, and
+ * less than any of the fast ones.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <curl/curl.h>
+
+#include "nodescore.h"
+#include "bench-node.h"
+
+static int num_nodes = 3;
+static int fast_ms = 2;
+static int slow_ms = 50;
+static int num_requests = 500;
+static bool use_scoreboard = false;
+static struct curl_slist *connect_to[MAX_BENCH_NODES];
+static char *keys[MAX_BENCH_NODES];
+static char *connect_to_str[MAX_BENCH_NODES];
+static int node_delay_ms[MAX_BENCH_NODES];
+static long node_requests[MAX_BENCH_NODES];
+
+struct worker {
+    pthread_t thread;
+    long *latencies; // us
+    int failed;
+};
+
+static const char *const options[] = {
+    "-N <nodes> number of nodes, 3 by default",
+    "-f <ms> how long the fast nodes take to answer, 2 by default",
+    "-s <ms> how long the slow node, the last one, takes, 50 by default",
+    "-t <threads> number of threads, 8 by default",
+    "-n <requests> requests per thread, 500 by default",
+    NULL
+};
+
+// Each node answers after its delay
+static enum bench_reply reply(int node, unsigned int *seed, int *delay_ms) {
+    (void) seed;
+    *delay_ms = node_delay_ms[node];
+    return BENCH_ANSWER;
+}
+
+static void *work(void *ptr) {
+    struct worker *worker = ptr;
+    CURL *session = curl_easy_init();
+    unsigned int seed = (unsigned int) (uintptr_t) worker;
+
+    for (int idx = 0; idx < num_requests && session; idx++) {
+        struct timespec start;
+        long response_code = 0;
+        long elapsed_us;
+        int node;
+        CURLcode res;
+
+        node = use_scoreboard ? nodescore_pick() : (int) (rand_r(&seed) % num_nodes);
+        __sync_fetch_and_add(&node_requests[node], 1);
+
+        // Set up the way session_request_init does
+        curl_easy_reset(session);
+        curl_easy_setopt(session, CURLOPT_URL, "http://" BENCH_HOST "/");
+        curl_easy_setopt(session, CURLOPT_CONNECT_TO, connect_to[node]);
+        curl_easy_setopt(session, CURLOPT_WRITEFUNCTION, discard);
+        curl_easy_setopt(session, CURLOPT_TIMEOUT, 60);
+
+        if (use_scoreboard) nodescore_start(node);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        res = curl_easy_perform(session);
+        elapsed_us = elapsed(&start) * 1000 * 1000;
+        worker->latencies[idx] = elapsed_us;
+        if (res == CURLE_OK) curl_easy_getinfo(session, CURLINFO_RESPONSE_CODE, &response_code);
+        if (use_scoreboard) nodescore_done(node, res == CURLE_OK && response_code < 500, elapsed_us / 1000);
+
+        if (res != CURLE_OK || response_code != 200) {
+            v_printf("request %d to %s failed: %s %ld\n", idx, keys[node], curl_easy_strerror(res), response_code);
+            ++worker->failed;
+        }
+    }
+
+    if (session) curl_easy_cleanup(session);
+    return NULL;
+}
+
+static int run(const char *name, int num_threads) {
+    struct worker workers[MAX_THREADS];
+    struct timespec start;
+    long *latencies;
+    long total_latency = 0;
+    int total = num_threads * num_requests;
+    double secs;
+    int failed = 0;
+
+    latencies = calloc(total, sizeof(long));
+    if (latencies == NULL) {
+        printf("ERROR: can't allocate latencies for %d requests\n", total);
+        return 1;
+    }
+    memset(node_requests, 0, sizeof(node_requests));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int idx = 0; idx < num_threads; idx++) {
+        memset(&workers[idx], 0, sizeof(struct worker));
+        workers[idx].latencies = latencies + idx * num_requests;
+        pthread_create(&workers[idx].thread, NULL, work, &workers[idx]);
+    }
+    for (int idx = 0; idx < num_threads; idx++) {
+        pthread_join(workers[idx].thread, NULL);
+        failed += workers[idx].failed;
+    }
+    secs = elapsed(&start);
+
+    qsort(latencies, total, sizeof(long), compare_long);
+    for (int idx = 0; idx < total; idx++) total_latency += latencies[idx];
+
+    printf("%s: %d requests in %.2fs (%.0f/s); latency avg %.1fms p50 %.1fms p90 %.1fms p99 %.1fms max %.1fms\n",
+        name, total, secs, total / secs, total_latency / 1000.0 / total, latencies[total / 2] / 1000.0,
+        latencies[(total * 90) / 100] / 1000.0, latencies[(total * 99) / 100] / 1000.0, latencies[total - 1] / 1000.0);
+    printf("%s: requests per node:", name);
+    for (int idx = 0; idx < num_nodes; idx++) {
+        printf(" %s (%dms) %ld", keys[idx], node_delay_ms[idx], node_requests[idx]);
+    }
+    printf("\n");
+
+    free(latencies);
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    int num_threads = 8;
+    int slow;
+    long random_slow;
+    long least_fast = 0; // Fewest requests any fast node got
+    bool slow_avoided;
+    int failed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "N:f:s:t:n:vh")) != -1) {
+        switch (opt) {
+            case 'N':
+                num_nodes = atoi(optarg);
+                if (num_nodes < 2) num_nodes = 2;
+                if (num_nodes > MAX_BENCH_NODES) num_nodes = MAX_BENCH_NODES;
+                break;
+            case 'f':
+                fast_ms = atoi(optarg);
+                break;
+            case 's':
+                slow_ms = atoi(optarg);
+                break;
+            case 't':
+                num_threads = atoi(optarg);
+                if (num_threads < 1) num_threads = 1;
+                if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+                break;
+            case 'n':
+                num_requests = atoi(optarg);
+                if (num_requests < 1) num_requests = 1;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'h':
+            default:
+                usage(options);
+        }
+    }
+
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    for (int idx = 0; idx < num_nodes; idx++) {
+        node_delay_ms[idx] = (idx == num_nodes - 1) ? slow_ms : fast_ms;
+    }
+    if (start_nodes(0, num_nodes, reply, keys, connect_to_str) < 0) return 1;
+    for (int idx = 0; idx < num_nodes; idx++) {
+        connect_to[idx] = curl_slist_append(NULL, connect_to_str[idx]);
+    }
+    slow = num_nodes - 1;
+
+    failed += run("random", num_threads);
+    random_slow = node_requests[slow];
+
+    use_scoreboard = true;
+    nodescore_set_nodes(keys, connect_to_str, num_nodes);
+    failed += run("scoreboard", num_threads);
+
+    // The scoreboard has to send the slow node less than chance does, and less than any fast node gets
+    for (int idx = 0; idx < slow; idx++) {
+        if (idx == 0 || node_requests[idx] < least_fast) least_fast = node_requests[idx];
+    }
+    slow_avoided = node_requests[slow] < random_slow && node_requests[slow] < least_fast;
+
+    if (failed || !slow_avoided) {
+        printf("FAIL: %d errors%s\n", failed, slow_avoided ? "" : "; the scoreboard didn't send the slow node less traffic");
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,176 @@
+/* Throughput of small sequential writes, which the per-handle write buffer (write_buffer_size)
+ * combines before they reach the cache file. Run it in a fusedav mount, once with the buffer
+ * and once without, e.g.
+ *   perfanalysis-smallwrites -f 4 -n 4096 -s 512
+ * Each file is written with -n writes of -s bytes, then read back and checked. Only the
+ * time spent in write() counts, not the opens, or the closes, which do the PUTs.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <getopt.h>
+
+#define PATH_MAX 4096
+
+static bool verbose = false;
+
+static void usage() {
+    printf("-f <files> number of files, 4 by default\n");
+    printf("-n <writes> writes per file, 4096 by default\n");
+    printf("-s <size> bytes per write, 512 by default\n");
+    printf("-v for verbose\n");
+    printf("-h for help\n");
+    exit(0);
+}
+
+static void v_printf(const char *fmt, ...) {
+    if (verbose) {
+        va_list ap;
+        va_start(ap, fmt);
+        vfprintf(stdout, fmt, ap);
+        va_end(ap);
+    }
+}
+
+static double elapsed(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Writes the file; returns the seconds spent in write(), or -1 on error
+static double write_file(const char *filename, const char *wbuf, int num_writes, int write_size) {
+    struct timespec start;
+    struct timespec end;
+    double write_secs = 0;
+    int fd;
+
+    unlink(filename);
+    fd = open(filename, O_RDWR | O_CREAT, 0640);
+    if (fd < 0) {
+        printf("OPEN ERROR: open failed on %s : %d %s\n", filename, errno, strerror(errno));
+        return -1;
+    }
+    for (int idx = 0; idx < num_writes; idx++) {
+        ssize_t bytes_written;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bytes_written = write(fd, wbuf + (off_t) idx * write_size, write_size);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        write_secs += elapsed(&start, &end);
+        if (bytes_written != write_size) {
+            printf("WRITE ERROR: %s: bytes_written = %zd at write %d : %d %s\n", filename, bytes_written, idx, errno, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    if (close(fd)) {
+        printf("CLOSE ERROR: %s : %d %s\n", filename, errno, strerror(errno));
+        return -1;
+    }
+    return write_secs;
+}
+
+// What was written must read back the same
+static bool check_file(const char *filename, const char *wbuf, size_t file_size) {
+    char *rbuf;
+    size_t total = 0;
+    bool same;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("OPEN ERROR: reopen failed on %s : %d %s\n", filename, errno, strerror(errno));
+        return false;
+    }
+    rbuf = malloc(file_size + 1);
+    while (total <= file_size) {
+        ssize_t bytes_read = read(fd, rbuf + total, file_size + 1 - total);
+        if (bytes_read <= 0) break;
+        total += bytes_read;
+    }
+    close(fd);
+    same = (total == file_size && memcmp(rbuf, wbuf, file_size) == 0);
+    if (!same) printf("READ ERROR: %s: read back %zu bytes of %zu, or different ones\n", filename, total, file_size);
+    free(rbuf);
+    return same;
+}
+
+int main(int argc, char *argv[]) {
+    char filename[PATH_MAX];
+    char *wbuf;
+    size_t file_size;
+    double write_secs = 0;
+    int num_files = 4;
+    int num_writes = 4096;
+    int write_size = 512;
+    int errors = 0;
+    int opt;
+
+    while ((opt = getopt (argc, argv, "vhf:n:s:")) != -1) {
+        switch (opt)
+        {
+            case 'v':
+                verbose = true;
+                break;
+            case 'f':
+                num_files = strtol(optarg, NULL, 10);
+                break;
+            case 'n':
+                num_writes = strtol(optarg, NULL, 10);
+                break;
+            case 's':
+                write_size = strtol(optarg, NULL, 10);
+                break;
+            case 'h':
+            case '?':
+            default:
+                usage ();
+        }
+    }
+    if (num_files < 1 || num_writes < 1 || write_size < 1) usage();
+
+    file_size = (size_t) num_writes * write_size;
+    wbuf = malloc(file_size);
+    if (wbuf == NULL) {
+        printf("FAIL: can't allocate %zu bytes\n", file_size);
+        return 1;
+    }
+    for (size_t idx = 0; idx < file_size; idx++) {
+        wbuf[idx] = 'A' + rand() % 52;
+    }
+
+    for (int idx = 0; idx < num_files; idx++) {
+        double secs;
+
+        snprintf(filename, sizeof(filename), "perfanalysis-smallwrites-%d", idx);
+        secs = write_file(filename, wbuf, num_writes, write_size);
+        if (secs < 0 || !check_file(filename, wbuf, file_size)) {
+            ++errors;
+        }
+        else {
+            write_secs += secs;
+            v_printf("%s: %d writes of %d bytes in %.3fs\n", filename, num_writes, write_size, secs);
+        }
+        unlink(filename);
+    }
+
+    if (write_secs > 0) {
+        long bytes_total = (long) (num_files - errors) * file_size;
+        printf("write throughput: %ld bytes in %d-byte writes in %.3fs (%.0f KB/s)\n",
+            bytes_total, write_size, write_secs, bytes_total / write_secs / 1024);
+    }
+    free(wbuf);
+    if (errors > 0) {
+        printf("FAIL: %d of %d files\n", errors, num_files);
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,174 @@
+#! /bin/bash
+
+set +e
+
+usage()
+{
+cat << EOF
+usage: $0 options
+
+This script tests the saint mode write queue by taking valhalla nginx down,
+writing files, and checking that the writes reach the server once it is back.
+It needs saint_write_queue=true in fusedav.conf.
+
+OPTIONS:
+   -h      Show this message
+   -i      Number of iterations
+   -v      Verbose
+EOF
+}
+
+verbose=0
+iters=0
+
+while getopts "hi:v" OPTION
+do
+     case $OPTION in
+         h)
+             usage
+             exit 1
+             ;;
+         i)
+             iters=$OPTARG
+             ;;
+         v)
+             verbose=1
+             ;;
+         ?)
+             usage
+             exit
+             ;;
+     esac
+done
+
+if [ $iters -eq 0 ]; then
+	iters=1
+fi
+
+pass=0
+fail=0
+
+if [ $verbose -eq 1 ]; then
+    starttime=$(date +%s)
+fi
+
+# If run on a onebox, it will take nginx_valhalla up and down.
+# If run outside of a onebox, it would be run on an endpoint,
+# and there is no facility there to take valhalla(yolo)
+# services up and down, so for those tests, other measures
+# need to be taken (e.g. script on each valhallayolo node
+# to stop/restart the nginx service)
+if [ -f /etc/systemd/system/haproxy_valhalla21_onebox.service ]; then
+	echo "Running on a onebox."
+	onebox=1
+else
+	onebox=0
+fi
+
+
+# Most tests need to be in the files directory, but this one needs to be
+# one up.
+
+# If we have a fusedav.conf, that likely means we're in the right place
+if [ -f ../fusedav.conf ]; then
+	cd ..
+fi
+
+if [ ! -f ./fusedav.conf ]; then
+	echo "ERROR: Need to cd to /srv/binding/<bid> directory"
+	exit
+fi
+
+uri=$(grep Description /etc/systemd/system/php_fpm_$(pwd | sed s#/srv/bindings/## | sed s#/files##).service | sed s#.*uri=##)
+
+# Set up some files for the test
+if [ $onebox -eq 1 ]; then
+	systemctl restart nginx_valhalla.service
+	systemctl status nginx_valhalla.service
+fi
+for idx in {1..12}; do
+	# create a random file
+	filelist[$idx]=`mktemp files/myfile.XXX`
+	# make it not empty
+	echo "abc" > ${filelist[$idx]}
+done
+
+for iter in $(seq 1 $iters); do
+	# Need to stop the service for the following
+	if [ $onebox -eq 1 ]; then
+		systemctl stop nginx_valhalla.service
+		sleep 2
+	fi
+
+	# overwrite each of the files above; should succeed, since the uploads are queued.
+	# dd reports errors from fsync, which uploads the file, where a shell redirect would ignore them.
+	for file in ${filelist[@]}; do
+		res=$(echo "def$iter" | dd of=$file conv=fsync 2>&1)
+		if [ $? -ne 0 ]; then
+			printf "ERROR: write file: %s: %s: %s\n" "$0" "$file" "$res"
+			fail=$((fail + 1))
+		else
+			pass=$((pass + 1))
+		fi
+	done
+
+	# cat each of the files; should get the new contents from the local copy
+	for file in ${filelist[@]}; do
+		res=$(cat $file)
+		if [[ ! "$res" =~ "def$iter" ]]; then
+			printf "ERROR: cat file in saint mode: %s: %s: %s\n" "$0" "$file" "$res"
+			fail=$((fail + 1))
+		else
+			pass=$((pass + 1))
+		fi
+	done
+
+	if [ $onebox -eq 1 ]; then
+		systemctl restart nginx_valhalla.service
+	fi
+
+	# Wait for saint mode to expire and the queue to be replayed
+	for wait in {1..60}; do
+		if [ -z "$(ls -A cache/write-queue 2>/dev/null)" ]; then
+			break
+		fi
+		sleep 1
+	done
+	if [ -n "$(ls -A cache/write-queue 2>/dev/null)" ]; then
+		printf "ERROR: write queue not empty after 60s: %s\n" "$(ls cache/write-queue | wc -l)"
+		fail=$((fail + 1))
+	else
+		pass=$((pass + 1))
+	fi
+
+	# The server should now have the new contents, not the ones from before the outage
+	for file in ${filelist[@]}; do
+		res=$(curl -s -H "Cache-Control: no-cache" -H "X-Bypass-Cache: 1" http://$uri/sites/default/$file)
+		if [[ ! "$res" =~ "def$iter" ]]; then
+			printf "ERROR: server copy after replay: %s: %s : %s :: %s\n" "$0" "$uri" "$file" "$res"
+			fail=$((fail + 1))
+		else
+			pass=$((pass + 1))
+			if [ $verbose -eq 1 ]; then
+				printf "SUCCEED: %s: %s : %s :: %s\n" "$0" "$uri" "$file" "$res"
+			fi
+		fi
+	done
+done
+
+for file in ${filelist[@]}; do
+	rm -f $file
+done
+
+cd files
+
+if [ $verbose -eq 1 ]; then
+	endtime=$(date +%s)
+	echo "Elapsed time: $((endtime - starttime))s"
+fi
+
+if [ $fail -ne 0 ]; then
+	echo "FAIL: write queue checks failed: $fail; checks passed $pass"
+else
+	echo "PASS: write queue checks passed $pass"
+fi
@@ -0,0 +1,268 @@
+/* Compare fixed timeouts, as src/session.c had them, against the adaptive ones in src/timeouts.c,
+ * when a node stops answering. The bench runs its own nodes: -N small HTTP servers on 127.0.0.1,
+ * each on its own port, answering after -f ms. Threads send requests to them the way src/session.c
+ * does, picking nodes with the scoreboard and trying another node when a request fails, as the
+ * callers do. After -w warm-up requests per thread, one node goes on accepting connections and
+ * requests but never answers, and we compare latencies over the next -n requests per thread. Each
+ * run has nodes of its own, so the scoreboard doesn't carry over from one to the other, e.g.
+ *   timeouts-bench -N 3 -f 2 -t 8 -w 200 -n 200
+ * The fixed run waits out its 60s timeout at least once, so the bench takes a minute or so.
+ * It fails unless every request in the adaptive run, failing over from the dead node
+ * included, takes less than the fixed timeout.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <curl/curl.h>
+
+#include "nodescore.h"
+#include "timeouts.h"
+#include "bench-node.h"
+
+// Tries per request, as num_filesystem_server_nodes in src/session.c
+#define TRIES 3
+
+static int num_nodes = 3;
+static int fast_ms = 2;
+static int fixed_timeout_secs = 60;
+static int num_warmup = 200;
+static int num_requests = 200;
+static bool use_adaptive = false;
+// Both runs' nodes; their indexes are the same as on the scoreboard
+static char *keys[2 * MAX_BENCH_NODES];
+static char *connect_to_str[2 * MAX_BENCH_NODES];
+static bool node_dead[2 * MAX_BENCH_NODES];
+static long node_timeouts[2 * MAX_BENCH_NODES];
+
+struct worker {
+    pthread_t thread;
+    int count;
+    long *latencies; // us
+    int failed;
+};
+
+static const char *const options[] = {
+    "-N <nodes> number of nodes, 3 by default",
+    "-f <ms> how long the nodes take to answer, 2 by default",
+    "-T <secs> the fixed request timeout, 60 by default",
+    "-t <threads> number of threads, 8 by default",
+    "-w <requests> warm-up requests per thread, before a node stops answering, 200 by default",
+    "-n <requests> requests per thread after that, 200 by default",
+    NULL
+};
+
+// Nodes answer after -f ms, unless they're dead
+static enum bench_reply reply(int node, unsigned int *seed, int *delay_ms) {
+    (void) seed;
+    *delay_ms = fast_ms;
+    return node_dead[node] ? BENCH_SILENT : BENCH_ANSWER;
+}
+
+// One try, set up and recorded the way session_request_init and timed_curl_easy_perform do
+static bool try_node(CURL *session, int node) {
+    struct timespec start;
+    long response_code = 0;
+    long elapsed_ms;
+    CURLcode res;
+
+    curl_easy_reset(session);
+    curl_easy_setopt(session, CURLOPT_URL, "http://" BENCH_HOST "/");
+    curl_easy_setopt(session, CURLOPT_CONNECT_TO, nodescore_connect_to(node));
+    curl_easy_setopt(session, CURLOPT_WRITEFUNCTION, discard);
+    if (use_adaptive) {
+        curl_easy_setopt(session, CURLOPT_CONNECTTIMEOUT_MS, timeouts_connect_ms(node));
+        curl_easy_setopt(session, CURLOPT_TIMEOUT_MS, timeouts_request_ms(node, REQUEST_GET, 2));
+    }
+    else {
+        curl_easy_setopt(session, CURLOPT_CONNECTTIMEOUT_MS, 1200L);
+        curl_easy_setopt(session, CURLOPT_TIMEOUT, (long) fixed_timeout_secs);
+    }
+
+    nodescore_start(node);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    res = curl_easy_perform(session);
+    elapsed_ms = elapsed(&start) * 1000;
+    if (res == CURLE_OK) curl_easy_getinfo(session, CURLINFO_RESPONSE_CODE, &response_code);
+    nodescore_done(node, res == CURLE_OK && response_code < 500, elapsed_ms);
+
+    if (res == CURLE_OK) {
+        double namelookup_time = 0;
+        double connect_time = 0;
+        long new_connects = 0;
+        long connect_ms = -1;
+
+        curl_easy_getinfo(session, CURLINFO_NUM_CONNECTS, &new_connects);
+        curl_easy_getinfo(session, CURLINFO_NAMELOOKUP_TIME, &namelookup_time);
+        curl_easy_getinfo(session, CURLINFO_CONNECT_TIME, &connect_time);
+        if (new_connects > 0 && connect_time > 0) connect_ms = (connect_time - namelookup_time) * 1000;
+        timeouts_record(node, REQUEST_GET, connect_ms, elapsed_ms, 2);
+    }
+    if (res == CURLE_OPERATION_TIMEDOUT) {
+        timeouts_timed_out(node);
+        __sync_fetch_and_add(&node_timeouts[node], 1);
+    }
+    if (res != CURLE_OK || response_code != 200) {
+        v_printf("request to %s failed after %ldms: %s %ld\n", keys[node], elapsed_ms, curl_easy_strerror(res), response_code);
+        return false;
+    }
+    return true;
+}
+
+static void *work(void *ptr) {
+    struct worker *worker = ptr;
+    CURL *session = curl_easy_init();
+
+    for (int idx = 0; idx < worker->count && session; idx++) {
+        struct timespec start;
+        bool ok = false;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int tries = 0; tries < TRIES && !ok; tries++) {
+            ok = try_node(session, nodescore_pick());
+        }
+        if (worker->latencies) worker->latencies[idx] = elapsed(&start) * 1000 * 1000;
+        if (!ok) ++worker->failed;
+    }
+
+    if (session) curl_easy_cleanup(session);
+    return NULL;
+}
+
+// Runs count requests on each thread; keeps their latencies if latencies isn't NULL
+static int run_threads(int num_threads, int count, long *latencies) {
+    struct worker workers[MAX_THREADS];
+    int failed = 0;
+
+    for (int idx = 0; idx < num_threads; idx++) {
+        memset(&workers[idx], 0, sizeof(struct worker));
+        workers[idx].count = count;
+        workers[idx].latencies = latencies ? latencies + idx * count : NULL;
+        pthread_create(&workers[idx].thread, NULL, work, &workers[idx]);
+    }
+    for (int idx = 0; idx < num_threads; idx++) {
+        pthread_join(workers[idx].thread, NULL);
+        failed += workers[idx].failed;
+    }
+    return failed;
+}
+
+/* Runs on nodes [first, first + num_nodes); the first of them stops answering after the warm-up.
+ * Returns how many requests failed on every try; *slowest is the longest any request took, in us.
+ */
+static int run(const char *name, int num_threads, int first, long *slowest) {
+    struct timespec start;
+    long *latencies;
+    long total_latency = 0;
+    int total = num_threads * num_requests;
+    double secs;
+    int failed;
+
+    latencies = calloc(total, sizeof(long));
+    if (latencies == NULL) {
+        printf("ERROR: can't allocate latencies for %d requests\n", total);
+        return 1;
+    }
+    if (nodescore_set_nodes(keys + first, connect_to_str + first, num_nodes) != num_nodes ||
+        nodescore_find(keys[first]) != first) {
+        printf("ERROR: the scoreboard didn't take the nodes\n");
+        return 1;
+    }
+
+    failed = run_threads(num_threads, num_warmup, NULL);
+    node_dead[first] = true;
+    v_printf("%s: %s stops answering\n", name, keys[first]);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    failed += run_threads(num_threads, num_requests, latencies);
+    secs = elapsed(&start);
+
+    qsort(latencies, total, sizeof(long), compare_long);
+    for (int idx = 0; idx < total; idx++) total_latency += latencies[idx];
+    *slowest = latencies[total - 1];
+
+    printf("%s: %d requests in %.2fs (%.0f/s); latency avg %.1fms p50 %.1fms p99 %.1fms p99.9 %.1fms max %.1fms\n",
+        name, total, secs, total / secs, total_latency / 1000.0 / total, latencies[total / 2] / 1000.0,
+        latencies[(total * 99) / 100] / 1000.0, latencies[(total * 999) / 1000] / 1000.0, latencies[total - 1] / 1000.0);
+    printf("%s: timeouts per node:", name);
+    for (int idx = first; idx < first + num_nodes; idx++) {
+        printf(" %s%s %ld", keys[idx], idx == first ? " (dead)" : "", node_timeouts[idx]);
+    }
+    printf("; timeouts now %ldms for %s, %ldms for %s\n",
+        use_adaptive ? timeouts_request_ms(first, REQUEST_GET, 2) : fixed_timeout_secs * 1000L, keys[first],
+        use_adaptive ? timeouts_request_ms(first + 1, REQUEST_GET, 2) : fixed_timeout_secs * 1000L, keys[first + 1]);
+
+    free(latencies);
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    int num_threads = 8;
+    long fixed_slowest;
+    long adaptive_slowest;
+    bool failed_over;
+    int failed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "N:f:T:t:w:n:vh")) != -1) {
+        switch (opt) {
+            case 'N':
+                num_nodes = atoi(optarg);
+                if (num_nodes < 3) num_nodes = 3;
+                if (num_nodes > MAX_BENCH_NODES) num_nodes = MAX_BENCH_NODES;
+                break;
+            case 'f':
+                fast_ms = atoi(optarg);
+                break;
+            case 'T':
+                fixed_timeout_secs = atoi(optarg);
+                if (fixed_timeout_secs < 1) fixed_timeout_secs = 1;
+                break;
+            case 't':
+                num_threads = atoi(optarg);
+                if (num_threads < 1) num_threads = 1;
+                if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+                break;
+            case 'w':
+                num_warmup = atoi(optarg);
+                if (num_warmup < 0) num_warmup = 0;
+                break;
+            case 'n':
+                num_requests = atoi(optarg);
+                if (num_requests < 1) num_requests = 1;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'h':
+            default:
+                usage(options);
+        }
+    }
+
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    if (start_nodes(0, 2 * num_nodes, reply, keys, connect_to_str) < 0) return 1;
+
+    failed += run("fixed", num_threads, 0, &fixed_slowest);
+
+    use_adaptive = true;
+    failed += run("adaptive", num_threads, num_nodes, &adaptive_slowest);
+
+    // With adaptive timeouts, no request waits out the fixed timeout on the dead node before failing over
+    failed_over = adaptive_slowest < fixed_timeout_secs * 1000L * 1000;
+    if (failed || !failed_over) {
+        printf("FAIL: %d requests failed on every try%s\n", failed,
+            failed_over ? "" : "; the adaptive run took as long as the fixed timeout to fail over");
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}